@@ -69,6 +69,8 @@ static void acct_radius_vhost_init(void **_vctx, void *pool, void *additional)
 		fprintf(stderr, "error reading the radius dictionary\n");
 		exit(1);
 	}
+
+	radius_transport_init(vctx, "acctserver");
 	*_vctx = vctx;
 
 	return;
@@ -81,6 +83,7 @@ static void acct_radius_vhost_deinit(void *_vctx)
 {
 	struct radius_vhost_ctx *vctx = _vctx;
 
+	radius_transport_deinit(vctx);
 	if (vctx->rh != NULL)
 		rc_destroy(vctx->rh);
 }
@@ -167,11 +170,12 @@ static void append_acct_standard(struct radius_vhost_ctx *vctx, rc_handle *rh, c
 	return;
 }
 
+/* The interim updates and the session stops are not waited for; their
+ * replies would only be logged. */
 static void radius_acct_session_stats(void *_vctx, unsigned auth_method, const common_acct_info_st *ai, stats_st *stats)
 {
-	int ret;
 	uint32_t status_type;
-	VALUE_PAIR *send = NULL, *recvd = NULL;
+	VALUE_PAIR *send = NULL;
 	struct radius_vhost_ctx *vctx = _vctx;
 
 	status_type = PW_STATUS_ALIVE;
@@ -185,15 +189,7 @@ static void radius_acct_session_stats(void *_vctx, unsigned auth_method, const c
 	append_acct_standard(vctx, vctx->rh, ai, &send);
 	append_stats(vctx->rh, &send, stats);
 
-	ret = rc_aaa(vctx->rh, 0, send, &recvd, NULL, 0, PW_ACCOUNTING_REQUEST);
-
-	if (recvd != NULL)
-		rc_avpair_free(recvd);
-
-	if (ret != OK_RC) {
-		syslog(LOG_AUTH, "radius-auth: radius_open_session: %d", ret);
-		goto cleanup;
-	}
+	radius_aaa_async(vctx, send, PW_ACCOUNTING_REQUEST, "radius_session_stats");
 
  cleanup:
 	rc_avpair_free(send);
@@ -227,7 +223,7 @@ static int radius_acct_open_session(void *_vctx, unsigned auth_method, const com
 
 	append_acct_standard(vctx, vctx->rh, ai, &send);
 
-	ret = rc_aaa(vctx->rh, 0, send, &recvd, NULL, 0, PW_ACCOUNTING_REQUEST);
+	ret = radius_aaa(vctx, send, &recvd, NULL, PW_ACCOUNTING_REQUEST);
 
 	if (recvd != NULL)
 		rc_avpair_free(recvd);
@@ -248,7 +244,7 @@ static void radius_acct_close_session(void *_vctx, unsigned auth_method, const c
 {
 	int ret;
 	uint32_t status_type;
-	VALUE_PAIR *send = NULL, *recvd = NULL;
+	VALUE_PAIR *send = NULL;
 	struct radius_vhost_ctx *vctx = _vctx;
 
 	status_type = PW_STATUS_STOP;
@@ -276,16 +272,8 @@ static void radius_acct_close_session(void *_vctx, unsigned auth_method, const c
 	append_acct_standard(vctx, vctx->rh, ai, &send);
 	append_stats(vctx->rh, &send, stats);
 
-	ret = rc_aaa(vctx->rh, 0, send, &recvd, NULL, 0, PW_ACCOUNTING_REQUEST);
-	if (recvd != NULL)
-		rc_avpair_free(recvd);
+	radius_aaa_async(vctx, send, PW_ACCOUNTING_REQUEST, "radius_close_session");
 
-	if (ret != OK_RC) {
-		syslog(LOG_INFO, "radius-auth: radius_close_session: %d", ret);
-		goto cleanup;
-	}
-
- cleanup:
  	rc_avpair_free(send);
 	return;
 }
@@ -383,6 +383,7 @@ static void gssapi_group_list(void *pool, void *_additional, char ***groupname,
 
 const struct auth_mod_st gssapi_auth_funcs = {
 	.type = AUTH_TYPE_GSSAPI,
+	.threads = AUTH_THREADS_SERIAL,
 	.auth_init = gssapi_auth_init,
 	.auth_deinit = gssapi_auth_deinit,
 	.auth_msg = gssapi_auth_msg,
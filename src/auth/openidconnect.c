@@ -25,33 +25,87 @@
 #include <unistd.h>
 #include <vpn.h>
 #include <c-ctype.h>
+#include <c-strcase.h>
 #include "plain.h"
 #include "common-config.h"
 #include "auth/common.h"
+#include <ccan/htable/htable.h>
+#include <ccan/hash/hash.h>
 
 #ifdef SUPPORT_OIDC_AUTH
 #include <curl/curl.h>
 #include <jansson.h>
 #include <cjose/cjose.h>
 #include <time.h>
+#include <signal.h>
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
 
 #define MINIMUM_KEY_REFRESH_INTERVAL (900)
 
+/* The key set is refreshed once its lifetime, as set by Cache-Control
+ * in the JWKS reply, has passed; these apply when it is not set, or when
+ * a refresh failed. */
+#define DEFAULT_KEYS_LIFETIME (3600)
+#define MINIMUM_KEYS_LIFETIME (60)
+#define KEYS_RETRY_INTERVAL (60)
+#define FETCH_TIMEOUT (30)
+
+/* The keys are imported once when fetched, and indexed by kid. A key set
+ * is replaced as a whole on refresh; the tokens being verified keep a
+ * reference to the set they use.
+ */
+typedef struct oidc_key_st {
+	char *kid;
+	cjose_jwk_t *jwk;
+} oidc_key_st;
+
+typedef struct oidc_keys_st {
+	struct htable keys;
+	unsigned size;
+	unsigned refs;
+} oidc_keys_st;
+
+/* The keys are fetched by a thread of the module, periodically or when
+ * a token with an unknown kid is seen; authentication does not wait for
+ * the network. */
 typedef struct oidc_vctx_st {
 	json_t *config;
-	json_t *jwks;
+	oidc_keys_st *keys;
 	void * pool;
 	int minimum_jwk_refresh_time;
-	time_t last_jwks_load_time;
+	time_t last_jwks_load_time; /* last fetch attempt */
+	time_t next_refresh;
+	unsigned refresh_requested;
+#ifdef HAVE_PTHREAD_H
+	unsigned stop;
+	unsigned thread_started;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+#endif
 } oidc_vctx_st;
 
+#ifdef HAVE_PTHREAD_H
+# define oidc_lock(vctx) pthread_mutex_lock(&(vctx)->lock)
+# define oidc_unlock(vctx) pthread_mutex_unlock(&(vctx)->lock)
+#else
+# define oidc_lock(vctx)
+# define oidc_unlock(vctx)
+#endif
+
 typedef struct oidc_ctx_st {
 	oidc_vctx_st *vctx_st;
 	char username[MAX_USERNAME_SIZE];
 	int token_verified;
 } oidc_ctx_st;
 
-static bool oidc_fetch_oidc_keys(oidc_vctx_st * vctx);
+static bool oidc_refresh_keys(oidc_vctx_st * vctx);
+static void oidc_keys_put(oidc_vctx_st * vctx, oidc_keys_st * keys);
+#ifdef HAVE_PTHREAD_H
+static void *oidc_refresh_thread(void *arg);
+#endif
 static bool oidc_verify_token(oidc_vctx_st * vctx, const char *token,
 				size_t token_length,
 				char user_name[MAX_USERNAME_SIZE]);
@@ -62,13 +116,13 @@ static void oidc_vhost_init(void **vctx, void *pool, void *additional)
 	json_error_t err;
 	struct oidc_vctx_st *vc;
 
-	vc = talloc(pool, struct oidc_vctx_st);
+	vc = talloc_zero(pool, struct oidc_vctx_st);
 	if (vc == NULL) {
 		syslog(LOG_ERR, "ocserv-oidc allocation failure!\n");
 		exit(1);
 	}
 	vc->config = NULL;
-	vc->jwks = NULL;
+	vc->keys = NULL;
 	vc->pool = pool;
 
 	if (config == NULL) {
@@ -106,11 +160,44 @@ static void oidc_vhost_init(void **vctx, void *pool, void *additional)
 		vc->minimum_jwk_refresh_time = MINIMUM_KEY_REFRESH_INTERVAL;
 	}
 
-	if (!oidc_fetch_oidc_keys(vc)) {
+	/* before any thread uses curl */
+	if (curl_global_init(CURL_GLOBAL_DEFAULT) != CURLE_OK) {
+		syslog(LOG_ERR, "ocserv-oidc: failed to initialize curl\n");
+		exit(1);
+	}
+
+#ifdef HAVE_PTHREAD_H
+	if (pthread_mutex_init(&vc->lock, NULL) != 0 ||
+	    pthread_cond_init(&vc->cond, NULL) != 0) {
+		syslog(LOG_ERR, "ocserv-oidc allocation failure!\n");
+		exit(1);
+	}
+#endif
+
+	if (!oidc_refresh_keys(vc)) {
 		syslog(LOG_ERR, "ocserv-oidc: failed to load jwks\n");
 		exit(1);
 	}
 
+#ifdef HAVE_PTHREAD_H
+	{
+		sigset_t set, oldset;
+		int ret;
+
+		/* signals are only handled by the main loop */
+		sigfillset(&set);
+		pthread_sigmask(SIG_SETMASK, &set, &oldset);
+		ret = pthread_create(&vc->thread, NULL, oidc_refresh_thread, vc);
+		pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+
+		if (ret != 0)
+			syslog(LOG_ERR, "ocserv-oidc: could not start refresh thread: %s\n",
+			       strerror(ret));
+		else
+			vc->thread_started = 1;
+	}
+#endif
+
 	*vctx = (void *)vc;
 
 	return;
@@ -124,9 +211,21 @@ static void oidc_vhost_deinit(void *ctx)
 		return;
 	}
 
-	if (vctx->jwks) {
-		json_decref(vctx->jwks);
-		vctx->jwks = NULL;
+#ifdef HAVE_PTHREAD_H
+	if (vctx->thread_started) {
+		oidc_lock(vctx);
+		vctx->stop = 1;
+		pthread_cond_signal(&vctx->cond);
+		oidc_unlock(vctx);
+
+		pthread_join(vctx->thread, NULL);
+		vctx->thread_started = 0;
+	}
+#endif
+
+	if (vctx->keys) {
+		oidc_keys_put(vctx, vctx->keys);
+		vctx->keys = NULL;
 	}
 
 	if (vctx->config) {
@@ -187,6 +286,7 @@ static void oidc_auth_deinit(void *ctx)
 const struct auth_mod_st oidc_auth_funcs = {
 	.type = AUTH_TYPE_OIDC,
 	.allows_retries = 1,
+	.threads = AUTH_THREADS_SAFE,
 	.vhost_init = oidc_vhost_init,
 	.vhost_deinit = oidc_vhost_deinit,
 	.auth_init = oidc_auth_init,
@@ -204,6 +304,7 @@ typedef struct oidc_json_parser_context {
 	char *buffer;
 	size_t length;
 	size_t offset;
+	long max_age; /* from Cache-Control, or -1 */
 } oidc_json_parser_context;
 
 // Callback from CURL for each block as it is downloaded
@@ -236,10 +337,47 @@ static size_t oidc_json_parser_context_callback(char *ptr, size_t size,
 	return nmemb;
 }
 
-// Download a JSON file from the provided URI and return it in a jansson object
-static json_t *oidc_fetch_json_from_uri(void * pool, const char *uri)
+// Callback from CURL for each header line; reads the max-age of
+// Cache-Control. A no-cache or no-store directive is taken as zero.
+static size_t oidc_json_parser_header_callback(char *ptr, size_t size,
+					       size_t nmemb, void *userdata)
 {
-	oidc_json_parser_context context = { pool, NULL, 0, 0 };
+	oidc_json_parser_context *context =
+	    (oidc_json_parser_context *) userdata;
+	static const char name[] = "cache-control:";
+	char value[256];
+	char *p;
+	size_t len = nmemb * size;
+
+	if (len <= sizeof(name) - 1 || len - (sizeof(name) - 1) >= sizeof(value) ||
+	    c_strncasecmp(ptr, name, sizeof(name) - 1) != 0) {
+		return len;
+	}
+
+	memcpy(value, ptr + sizeof(name) - 1, len - (sizeof(name) - 1));
+	value[len - (sizeof(name) - 1)] = 0;
+
+	for (p = value; *p != 0; p++) {
+		*p = c_tolower(*p);
+	}
+
+	if (strstr(value, "no-cache") || strstr(value, "no-store")) {
+		context->max_age = 0;
+	} else if ((p = strstr(value, "max-age=")) != NULL) {
+		context->max_age = strtol(p + sizeof("max-age=") - 1, NULL, 10);
+		if (context->max_age < 0) {
+			context->max_age = 0;
+		}
+	}
+
+	return len;
+}
+
+// Download a JSON file from the provided URI and return it in a jansson
+// object. The max-age of the reply is set in max_age if not NULL.
+static json_t *oidc_fetch_json_from_uri(void * pool, const char *uri, long *max_age)
+{
+	oidc_json_parser_context context = { pool, NULL, 0, 0, -1 };
 	json_t *json = NULL;
 	json_error_t err;
 	CURL *curl = NULL;
@@ -286,6 +424,22 @@ static json_t *oidc_fetch_json_from_uri(void * pool, const char *uri)
 		goto cleanup;
 	}
 
+	res = curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION,
+			       oidc_json_parser_header_callback);
+	if (res == CURLE_OK)
+		res = curl_easy_setopt(curl, CURLOPT_HEADERDATA, &context);
+	// called from a thread; no signals for the timeouts
+	if (res == CURLE_OK)
+		res = curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+	if (res == CURLE_OK)
+		res = curl_easy_setopt(curl, CURLOPT_TIMEOUT, (long)FETCH_TIMEOUT);
+	if (res != CURLE_OK) {
+		syslog(LOG_AUTH,
+		       "ocserv-oidc: failed to download JSON document: URI %s, CURLcode %d\n",
+		       uri, res);
+		goto cleanup;
+	}
+
 	res = curl_easy_perform(curl);
 	if (res != CURLE_OK) {
 		syslog(LOG_AUTH,
@@ -302,6 +456,10 @@ static json_t *oidc_fetch_json_from_uri(void * pool, const char *uri)
 		goto cleanup;
 	}
 
+	if (max_age) {
+		*max_age = context.max_age;
+	}
+
  cleanup:
 	if (context.buffer) {
 		talloc_free(context.buffer);
@@ -314,28 +472,157 @@ static json_t *oidc_fetch_json_from_uri(void * pool, const char *uri)
 	return json;
 }
 
-// Download and parse the JWT keys for this virtual server context
-static bool oidc_fetch_oidc_keys(oidc_vctx_st * vctx)
+static size_t oidc_key_rehash(const void *_e, void *unused)
 {
-	bool result = false;
-	json_t *jwks = NULL;
-	json_t *openid_configuration_url =
-	    json_object_get(vctx->config, "openid_configuration_url");
+	const oidc_key_st *e = _e;
+	return hash_any(e->kid, strlen(e->kid), 0);
+}
+
+static bool oidc_key_cmp(const void *_e, void *kid)
+{
+	const oidc_key_st *e = _e;
+
+	if (strcmp(e->kid, kid) == 0)
+		return 1;
+	return 0;
+}
+
+static void oidc_keys_free(oidc_keys_st * keys)
+{
+	struct htable_iter iter;
+	oidc_key_st *key;
+
+	key = htable_first(&keys->keys, &iter);
+	while (key != NULL) {
+		cjose_jwk_release(key->jwk);
+		key = htable_next(&keys->keys, &iter);
+	}
+	htable_clear(&keys->keys);
+	talloc_free(keys);
+}
+
+// Returns the current key set, with a reference which is released with
+// oidc_keys_put().
+static oidc_keys_st *oidc_keys_get(oidc_vctx_st * vctx)
+{
+	oidc_keys_st *keys;
 
+	oidc_lock(vctx);
+	keys = vctx->keys;
+	if (keys) {
+		keys->refs++;
+	}
+	oidc_unlock(vctx);
+
+	return keys;
+}
+
+static void oidc_keys_put(oidc_vctx_st * vctx, oidc_keys_st * keys)
+{
+	unsigned refs;
+
+	oidc_lock(vctx);
+	refs = --keys->refs;
+	oidc_unlock(vctx);
+
+	if (refs == 0) {
+		oidc_keys_free(keys);
+	}
+}
+
+// Imports the keys of a JWKS document, indexed by kid
+static oidc_keys_st *oidc_import_keys(json_t * jwks)
+{
+	oidc_keys_st *keys;
+	oidc_key_st *key;
+	cjose_err err;
 	json_t *array;
 	size_t index;
 	json_t *value;
+	const char *kid;
+	size_t hval;
+
+	array = json_object_get(jwks, "keys");
+	if (array == NULL || !json_is_array(array)) {
+		syslog(LOG_AUTH, "ocserv-oidc: JWK keys malformed\n");
+		return NULL;
+	}
+
+	// not in the vhost's pool; it may be allocated by the refresh thread
+	keys = talloc_zero(NULL, oidc_keys_st);
+	if (keys == NULL) {
+		return NULL;
+	}
+	htable_init(&keys->keys, oidc_key_rehash, NULL);
+	keys->refs = 1;
+
+	json_array_foreach(array, index, value) {
+		kid = json_string_value(json_object_get(value, "kid"));
+		if (kid == NULL) {
+			syslog(LOG_AUTH, "ocserv-oidc: ignoring JWK without kid\n");
+			continue;
+		}
+
+		hval = hash_any(kid, strlen(kid), 0);
+		if (htable_get(&keys->keys, hval, oidc_key_cmp, (void *)kid) != NULL) {
+			syslog(LOG_AUTH, "ocserv-oidc: ignoring duplicate JWK %s\n", kid);
+			continue;
+		}
+
+		key = talloc_zero(keys, oidc_key_st);
+		if (key == NULL) {
+			goto fail;
+		}
+
+		key->kid = talloc_strdup(key, kid);
+		key->jwk = cjose_jwk_import_json(value, &err);
+		if (key->kid == NULL || key->jwk == NULL) {
+			syslog(LOG_AUTH, "ocserv-oidc: failed to import JWK %s\n", kid);
+			if (key->jwk) {
+				cjose_jwk_release(key->jwk);
+			}
+			talloc_free(key);
+			continue;
+		}
+
+		if (!htable_add(&keys->keys, hval, key)) {
+			cjose_jwk_release(key->jwk);
+			talloc_free(key);
+			goto fail;
+		}
+		keys->size++;
+
+		syslog(LOG_INFO, "ocserv-oidc: fetched new JWK %s\n", kid);
+	}
+
+	return keys;
+ fail:
+	oidc_keys_free(keys);
+	return NULL;
+}
+
+// Download and parse the JWT keys for this virtual server context. The
+// lifetime of the keys is set from the Cache-Control of the reply.
+static oidc_keys_st *oidc_fetch_oidc_keys(oidc_vctx_st * vctx, time_t * lifetime)
+{
+	oidc_keys_st *keys = NULL;
+	json_t *oidc_config = NULL;
+	json_t *jwks = NULL;
+	json_t *jwks_uri;
+	long max_age = -1;
+	json_t *openid_configuration_url =
+	    json_object_get(vctx->config, "openid_configuration_url");
 
 	if (!openid_configuration_url) {
 		syslog(LOG_AUTH,
 		       "ocserv-oidc: openid_configuration_url missing from config\n");
 		goto cleanup;
 	}
-	
-	json_t *oidc_config =
-	    oidc_fetch_json_from_uri(vctx->pool, 
-					   json_string_value
-				       (openid_configuration_url));
+
+	oidc_config =
+	    oidc_fetch_json_from_uri(NULL,
+				     json_string_value
+				     (openid_configuration_url), NULL);
 
 	if (!oidc_config) {
 		syslog(LOG_AUTH,
@@ -343,14 +630,14 @@ static bool oidc_fetch_oidc_keys(oidc_vctx_st * vctx)
 		goto cleanup;
 	}
 
-	json_t *jwks_uri = json_object_get(oidc_config, "jwks_uri");
+	jwks_uri = json_object_get(oidc_config, "jwks_uri");
 	if (!jwks_uri || !json_string_value(jwks_uri)) {
 		syslog(LOG_AUTH,
 		       "ocserv-oidc: jwks_uri missing from config doc\n");
 		goto cleanup;
 	}
 
-	jwks = oidc_fetch_json_from_uri(vctx->pool, json_string_value(jwks_uri));
+	jwks = oidc_fetch_json_from_uri(NULL, json_string_value(jwks_uri), &max_age);
 	if (!jwks) {
 		syslog(LOG_AUTH,
 		       "ocserv-oidc: failed to fetch keys from jwks_uri %s\n",
@@ -358,42 +645,127 @@ static bool oidc_fetch_oidc_keys(oidc_vctx_st * vctx)
 		goto cleanup;
 	}
 
-	array = json_object_get(jwks, "keys");
-	if (array == NULL) {
-		syslog(LOG_AUTH, "ocserv-oidc: JWK keys malformed\n");
+	keys = oidc_import_keys(jwks);
+	if (keys == NULL) {
 		goto cleanup;
 	}
 
-	// Log the keys obtained
-	json_array_foreach(array, index, value) {
-		json_t *key_kid = json_object_get(value, "kid");
-		syslog(LOG_INFO,
-		       "ocserv-oidc: fetched new JWK %s\n",
-			   json_string_value(key_kid)
-		       );
-	}
-
-	if (vctx->jwks) {
-		json_decref(vctx->jwks);
+	if (max_age < 0) {
+		*lifetime = DEFAULT_KEYS_LIFETIME;
+	} else {
+		*lifetime = max_age;
 	}
 
-	vctx->last_jwks_load_time = time(0);
-
-	vctx->jwks = jwks;
-	jwks = NULL;
-	result = true;
-
  cleanup:
 	if (oidc_config) {
 		json_decref(oidc_config);
 	}
 
 	if (jwks) {
-		json_decref(oidc_config);
+		json_decref(jwks);
 	}
-	return result;
+	return keys;
+}
+
+// Fetches the keys and replaces the current set. On failure the current
+// keys are kept, and the fetch is retried later.
+static bool oidc_refresh_keys(oidc_vctx_st * vctx)
+{
+	oidc_keys_st *keys, *old = NULL;
+	time_t lifetime = 0;
+	time_t now = time(0);
+
+	keys = oidc_fetch_oidc_keys(vctx, &lifetime);
+
+	if (lifetime < vctx->minimum_jwk_refresh_time) {
+		lifetime = vctx->minimum_jwk_refresh_time;
+	}
+	if (lifetime < MINIMUM_KEYS_LIFETIME) {
+		lifetime = MINIMUM_KEYS_LIFETIME;
+	}
+
+	oidc_lock(vctx);
+	vctx->last_jwks_load_time = now;
+	if (keys) {
+		old = vctx->keys;
+		vctx->keys = keys;
+		vctx->next_refresh = now + lifetime;
+	} else {
+		vctx->next_refresh = now + KEYS_RETRY_INTERVAL;
+	}
+	oidc_unlock(vctx);
+
+	if (old) {
+		oidc_keys_put(vctx, old);
+	}
+
+	return keys != NULL;
 }
 
+// Asks for the keys to be fetched, e.g., on an unknown kid. Concurrent
+// requests result to a single fetch, and fetches are at least
+// minimum_jwk_refresh_time apart.
+static void oidc_request_refresh(oidc_vctx_st * vctx)
+{
+	time_t now = time(0);
+	unsigned refresh = 0;
+
+	oidc_lock(vctx);
+	if ((now - vctx->last_jwks_load_time) > vctx->minimum_jwk_refresh_time &&
+	    vctx->refresh_requested == 0) {
+		vctx->refresh_requested = 1;
+		refresh = 1;
+#ifdef HAVE_PTHREAD_H
+		pthread_cond_signal(&vctx->cond);
+#endif
+	}
+	oidc_unlock(vctx);
+
+	if (refresh) {
+		syslog(LOG_AUTH, "ocserv-oidc: attempting to download new JWKs");
+	} else {
+		syslog(LOG_AUTH, "ocserv-oidc: skipping JWK refresh");
+	}
+
+#ifndef HAVE_PTHREAD_H
+	if (refresh) {
+		oidc_refresh_keys(vctx);
+		vctx->refresh_requested = 0;
+	}
+#endif
+}
+
+#ifdef HAVE_PTHREAD_H
+static void *oidc_refresh_thread(void *arg)
+{
+	oidc_vctx_st *vctx = arg;
+	struct timespec ts;
+
+	oidc_lock(vctx);
+	for (;;) {
+		while (vctx->stop == 0 && vctx->refresh_requested == 0 &&
+		       time(0) < vctx->next_refresh) {
+			ts.tv_sec = vctx->next_refresh;
+			ts.tv_nsec = 0;
+			pthread_cond_timedwait(&vctx->cond, &vctx->lock, &ts);
+		}
+
+		if (vctx->stop) {
+			break;
+		}
+		oidc_unlock(vctx);
+
+		oidc_refresh_keys(vctx);
+
+		oidc_lock(vctx);
+		vctx->refresh_requested = 0;
+	}
+	oidc_unlock(vctx);
+
+	return NULL;
+}
+#endif
+
 static bool oidc_verify_lifetime(json_t * token_claims)
 {
 	bool result = false;
@@ -520,25 +892,19 @@ static bool oidc_verify_singature(oidc_vctx_st * vctx, cjose_jws_t * jws)
 	bool result = false;
 
 	cjose_err err;
-	cjose_jwk_t *jwk = NULL;
+	oidc_keys_st *keys;
+	oidc_key_st *key;
 	json_t *token_header;
 	json_t *token_kid;
 	json_t *token_typ;
-	json_t *array;
-	size_t index;
-	json_t *value;
+	const char *kid;
 
-	if (vctx->jwks == NULL) {
+	keys = oidc_keys_get(vctx);
+	if (keys == NULL) {
 		syslog(LOG_AUTH, "ocserv-oidc: JWK keys not available\n");
 		goto cleanup;
 	}
 
-	array = json_object_get(vctx->jwks, "keys");
-	if (array == NULL) {
-		syslog(LOG_AUTH, "ocserv-oidc: JWK keys malformed\n");
-		goto cleanup;
-	}
-
 	// Get the token header
 	token_header = cjose_jws_get_protected(jws);
 	if (token_header == NULL) {
@@ -553,6 +919,7 @@ static bool oidc_verify_singature(oidc_vctx_st * vctx, cjose_jws_t * jws)
 		syslog(LOG_AUTH, "ocserv-oidc: Token malformed - no kid\n");
 		goto cleanup;
 	}
+	kid = json_string_value(token_kid);
 
 	token_typ = json_object_get(token_header, "typ");
 	if (token_typ == NULL || !json_string_value(token_typ) || strcmp(json_string_value(token_typ), "JWT")) {
@@ -560,34 +927,19 @@ static bool oidc_verify_singature(oidc_vctx_st * vctx, cjose_jws_t * jws)
 		goto cleanup;
 	}
 
-	// Find the signing key in the keys collection
-	json_array_foreach(array, index, value) {
-		json_t *key_kid = json_object_get(value, "kid");
-		if (json_equal(key_kid, token_kid)) {
-			jwk = cjose_jwk_import_json(value, &err);
-			break;
-		}
-	}
-
-	if (jwk == NULL) {
-		time_t now;
+	// Find the signing key
+	key = htable_get(&keys->keys, hash_any(kid, strlen(kid), 0), oidc_key_cmp, (void *)kid);
+	if (key == NULL) {
 		syslog(LOG_AUTH, "ocserv-oidc: JWK with kid=%s not found\n",
-		       json_string_value(token_kid));
+		       kid);
 
-		syslog(LOG_AUTH, "ocserv-oidc: attempting to download new JWKs");
-		now = time(0);
-		if ((now - vctx->last_jwks_load_time) > vctx->minimum_jwk_refresh_time) {
-			oidc_fetch_oidc_keys(vctx);
-		}
-		else {
-			syslog(LOG_AUTH, "ocserv-oidc: skipping JWK refresh");
-		}
-
-		// Fail the request and let the client try again.
+		// Fail the request and let the client try again, once
+		// the keys are refreshed.
+		oidc_request_refresh(vctx);
 		goto cleanup;
 	}
 
-	if (!cjose_jws_verify(jws, jwk, &err)) {
+	if (!cjose_jws_verify(jws, key->jwk, &err)) {
 		syslog(LOG_AUTH, "ocserv-oidc: Token failed validation %s\n",
 		       err.message);
 		goto cleanup;
@@ -596,6 +948,9 @@ static bool oidc_verify_singature(oidc_vctx_st * vctx, cjose_jws_t * jws)
 	result = true;
 
  cleanup:
+	if (keys) {
+		oidc_keys_put(vctx, keys);
+	}
 	return result;
 }
 
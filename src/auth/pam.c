@@ -332,6 +332,10 @@ static void pam_group_list(void *pool, void *_additional, char ***groupname, uns
 
 const struct auth_mod_st pam_auth_funcs = {
   .type = AUTH_TYPE_PAM | AUTH_TYPE_USERNAME_PASS,
+#ifdef HAVE_PCL_THREADS
+  /* the conversation coroutine may be resumed from any thread */
+  .threads = AUTH_THREADS_SERIAL,
+#endif
   .auth_init = pam_auth_init,
   .auth_deinit = pam_auth_deinit,
   .auth_msg = pam_auth_msg,
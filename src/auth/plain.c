@@ -27,6 +27,13 @@
 # define _XOPEN_SOURCE
 #endif
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifdef HAVE_SYS_INOTIFY_H
+# include <sys/inotify.h>
+#endif
+#include <gnutls/gnutls.h>
+#include <gnutls/crypto.h>
 #include <vpn.h>
 #include <c-ctype.h>
 #include "plain.h"
@@ -37,6 +44,9 @@
 #ifdef HAVE_LIBOATH
 # include <liboath/oath.h>
 #endif
+#ifdef HAVE_PTHREAD_H
+# include <pthread.h>
+#endif
 #ifdef HAVE_CRYPT_H
   /* libcrypt in Fedora28 does not provide prototype
    * in unistd.h */
@@ -46,6 +56,69 @@
 #define MAX_CPASS_SIZE 128
 #define HOTP_WINDOW 20
 
+/* for how long, and how many, successful password checks are remembered */
+#define PASS_CACHE_TIME 60
+#define PASS_CACHE_MAX 4096
+#define PASS_DIGEST_SIZE 32
+
+#if defined(HAVE_LIBOATH) && defined(HAVE_PTHREAD_H)
+/* the OTP file is rewritten on every authentication */
+static pthread_mutex_t otp_lock = PTHREAD_MUTEX_INITIALIZER;
+# define otp_file_lock() pthread_mutex_lock(&otp_lock)
+# define otp_file_unlock() pthread_mutex_unlock(&otp_lock)
+#else
+# define otp_file_lock()
+# define otp_file_unlock()
+#endif
+
+/* The password file is loaded into a snapshot indexed by username, which
+ * is replaced as a whole when the file changes. Lookups and replacements
+ * are done under the lock, as the lookups may be run by multiple auth
+ * threads; the file is read outside it, by a single thread. */
+struct plain_user_st {
+	char *name;
+	char *groups; /* as in the file */
+	char *cpass;
+};
+
+struct plain_db_st {
+	struct htable users;
+	struct stat st; /* of the file which was read */
+	unsigned size;
+};
+
+/* A successful password check; clients which retry in a loop, or
+ * reconnect, would otherwise cost a crypt() each time. The digest is
+ * keyed with a secret of the process and covers the stored hash, thus
+ * an entry no longer matches once the password is changed in the file. */
+struct plain_pass_hit_st {
+	char name[MAX_USERNAME_SIZE];
+	uint8_t digest[PASS_DIGEST_SIZE];
+	time_t expires;
+};
+
+struct plain_vhost_ctx_st {
+	const struct plain_cfg_st *config;
+	struct plain_db_st *db;
+	unsigned reloading;
+	int notify_fd; /* inotify on the directory of the file */
+
+	struct htable hits; /* plain_pass_hit_st */
+	unsigned hits_size;
+	uint8_t hits_key[PASS_DIGEST_SIZE];
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t lock;
+#endif
+};
+
+#ifdef HAVE_PTHREAD_H
+# define plain_db_lock(vctx) pthread_mutex_lock(&(vctx)->lock)
+# define plain_db_unlock(vctx) pthread_mutex_unlock(&(vctx)->lock)
+#else
+# define plain_db_lock(vctx)
+# define plain_db_unlock(vctx)
+#endif
+
 struct plain_ctx_st {
 	char username[MAX_USERNAME_SIZE];
 	char cpass[MAX_CPASS_SIZE];	/* crypt() passwd */
@@ -58,20 +131,75 @@ struct plain_ctx_st {
 	unsigned failed; /* non-zero if the username is wrong */
 
 	const struct plain_cfg_st *config;
+	struct plain_vhost_ctx_st *vctx;
 };
 
-static void plain_vhost_init(void **vctx, void *pool, void *additional)
+static void plain_db_refresh(struct plain_vhost_ctx_st *vctx);
+static size_t hit_rehash(const void *_e, void *unused);
+
+static void plain_vhost_init(void **_vctx, void *pool, void *additional)
 {
 	struct plain_cfg_st *config = additional;
-
-	/* vctx is plain_cfg_st */
+	struct plain_vhost_ctx_st *vctx;
+#ifdef HAVE_SYS_INOTIFY_H
+	char *dir, *p;
+#endif
 
 	if (config == NULL) {
 		fprintf(stderr, "plain: no configuration passed!\n");
 		exit(1);
 	}
 
-	*vctx = (void*)config;
+	vctx = talloc_zero(pool, struct plain_vhost_ctx_st);
+	if (vctx == NULL) {
+		fprintf(stderr, "plain: memory error\n");
+		exit(1);
+	}
+
+	vctx->config = config;
+	vctx->notify_fd = -1;
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_init(&vctx->lock, NULL);
+#endif
+
+	htable_init(&vctx->hits, hit_rehash, NULL);
+	if (gnutls_rnd(GNUTLS_RND_RANDOM, vctx->hits_key, sizeof(vctx->hits_key)) < 0) {
+		fprintf(stderr, "plain: cannot generate key\n");
+		exit(1);
+	}
+
+#ifdef HAVE_SYS_INOTIFY_H
+	/* ocpasswd replaces the file, so its directory is watched */
+	if (config->passwd != NULL) {
+		if (strchr(config->passwd, '/') != NULL)
+			dir = talloc_strdup(vctx, config->passwd);
+		else
+			dir = talloc_strdup(vctx, ".");
+
+		if (dir != NULL) {
+			p = strrchr(dir, '/');
+			if (p == dir)
+				p[1] = 0;
+			else if (p != NULL)
+				*p = 0;
+
+			vctx->notify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+			if (vctx->notify_fd != -1 &&
+			    inotify_add_watch(vctx->notify_fd, dir,
+					      IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM |
+					      IN_CREATE | IN_DELETE | IN_ATTRIB) == -1) {
+				close(vctx->notify_fd);
+				vctx->notify_fd = -1;
+			}
+			talloc_free(dir);
+		}
+	}
+#endif
+
+	*_vctx = vctx;
+
+	if (config->passwd != NULL)
+		plain_db_refresh(vctx);
 
 #ifdef HAVE_LIBOATH
 	oath_init();
@@ -79,6 +207,47 @@ static void plain_vhost_init(void **vctx, void *pool, void *additional)
 	return;
 }
 
+static void plain_db_free(struct plain_db_st *db)
+{
+	struct plain_user_st *u;
+	struct htable_iter iter;
+
+	if (db == NULL)
+		return;
+
+	u = htable_first(&db->users, &iter);
+	while (u != NULL) {
+		safe_memset(u->cpass, 0, strlen(u->cpass));
+		u = htable_next(&db->users, &iter);
+	}
+
+	htable_clear(&db->users);
+	talloc_free(db);
+}
+
+static void plain_vhost_deinit(void *_vctx)
+{
+	struct plain_vhost_ctx_st *vctx = _vctx;
+	struct plain_pass_hit_st *h;
+	struct htable_iter iter;
+
+	plain_db_free(vctx->db);
+	vctx->db = NULL;
+
+	h = htable_first(&vctx->hits, &iter);
+	while (h != NULL) {
+		talloc_free(h);
+		h = htable_next(&vctx->hits, &iter);
+	}
+	htable_clear(&vctx->hits);
+	vctx->hits_size = 0;
+	safe_memset(vctx->hits_key, 0, sizeof(vctx->hits_key));
+
+	if (vctx->notify_fd != -1)
+		close(vctx->notify_fd);
+	vctx->notify_fd = -1;
+}
+
 /* Breaks a list of "xxx", "yyy", to a character array, of
  * MAX_COMMA_SEP_ELEMENTS size; Note that the given string is modified.
   */
@@ -139,31 +308,50 @@ break_group_list(void *pool, char *text,
 	while (p != NULL && *elements < MAX_GROUPS);
 }
 
-/* Returns 0 if the user is successfully authenticated, and sets the appropriate group name.
- */
-static int read_auth_pass(struct plain_ctx_st *pctx)
+static size_t user_rehash(const void *_e, void *unused)
+{
+	const struct plain_user_st *e = _e;
+	return hash_any(e->name, strlen(e->name), 0);
+}
+
+static bool user_cmp(const void *_e, void *name)
+{
+	const struct plain_user_st *e = _e;
+
+	if (strcmp(e->name, name) == 0)
+		return 1;
+	return 0;
+}
+
+/* Reads the password file into a new snapshot. Of the lines with the
+ * same username only the first is used. */
+static struct plain_db_st *plain_db_load(const char *file)
 {
 	FILE *fp;
 	char line[512];
 	ssize_t ll;
-	char *p, *sp;
-	int ret;
-
-	if (pctx->config->passwd == NULL) {
-		/* no password file is set */
-		return 0;
-	}
-
-	pctx->failed = 1;
+	char *p, *sp, *name, *groups;
+	struct plain_db_st *db;
+	struct plain_user_st *u;
+	size_t hval;
 
-	fp = fopen(pctx->config->passwd, "r");
+	fp = fopen(file, "r");
 	if (fp == NULL) {
 		syslog(LOG_AUTH,
 		       "error in plain authentication; cannot open: %s",
-		       pctx->config->passwd);
-		return -1;
+		       file);
+		return NULL;
 	}
 
+	db = talloc_zero(NULL, struct plain_db_st);
+	if (db == NULL)
+		goto fail;
+
+	htable_init(&db->users, user_rehash, NULL);
+
+	if (fstat(fileno(fp), &db->st) == -1)
+		goto fail;
+
 	line[sizeof(line)-1] = 0;
 	while ((p=fgets(line, sizeof(line)-1, fp)) != NULL) {
 		ll = strlen(p);
@@ -181,48 +369,150 @@ static int read_auth_pass(struct plain_ctx_st *pctx)
 		}
 #ifdef HAVE_STRSEP
 		sp = line;
+		name = strsep(&sp, ":");
+		groups = strsep(&sp, ":");
 		p = strsep(&sp, ":");
+#else
+		name = strtok_r(line, ":", &sp);
+		groups = strtok_r(NULL, ":", &sp);
+		p = strtok_r(NULL, ":", &sp);
+#endif
+		if (name == NULL || groups == NULL || p == NULL)
+			continue;
 
-		if (p != NULL && strcmp(pctx->username, p) == 0) {
-			p = strsep(&sp, ":");
-			if (p != NULL) {
-				break_group_list(pctx, p, pctx->groupnames, &pctx->groupnames_size);
-
-				p = strsep(&sp, ":");
-				if (p != NULL) {
-					strlcpy(pctx->cpass, p, sizeof(pctx->cpass));
-					pctx->failed = 0;
-					ret = 0;
-					goto exit;
-				}
-			}
-		}
+		hval = hash_any(name, strlen(name), 0);
+		if (htable_get(&db->users, hval, user_cmp, name) != NULL)
+			continue;
 
-#else
-		p = strtok_r(line, ":", &sp);
+		u = talloc_zero(db, struct plain_user_st);
+		if (u == NULL)
+			goto fail;
 
-		if (p != NULL && strcmp(pctx->username, p) == 0) {
-			p = strtok_r(NULL, ":", &sp);
-			if (p != NULL) {
-				break_group_list(pctx, p, pctx->groupnames, &pctx->groupnames_size);
-
-				p = strtok_r(NULL, ":", &sp);
-				if (p != NULL) {
-					strlcpy(pctx->cpass, p, sizeof(pctx->cpass));
-					pctx->failed = 0;
-					ret = 0;
-					goto exit;
-				}
-			}
-		}
-#endif
+		u->name = talloc_strdup(u, name);
+		u->groups = talloc_strdup(u, groups);
+		u->cpass = talloc_strdup(u, p);
+		if (u->name == NULL || u->groups == NULL || u->cpass == NULL)
+			goto fail;
+
+		if (!htable_add(&db->users, hval, u))
+			goto fail;
+		db->size++;
 	}
 
-	/* always succeed */
-	ret = 0;
- exit:
 	safe_memset(line, 0, sizeof(line));
 	fclose(fp);
+	return db;
+ fail:
+	syslog(LOG_AUTH, "error in plain authentication; cannot load: %s", file);
+	safe_memset(line, 0, sizeof(line));
+	fclose(fp);
+	plain_db_free(db);
+	return NULL;
+}
+
+/* Returns non-zero if the snapshot must be reloaded. Must be called
+ * with the lock held. */
+static unsigned plain_db_changed(struct plain_vhost_ctx_st *vctx)
+{
+	struct stat st;
+#ifdef HAVE_SYS_INOTIFY_H
+	char buf[1024];
+	unsigned events = 0;
+#endif
+
+	if (vctx->db == NULL)
+		return 1;
+
+#ifdef HAVE_SYS_INOTIFY_H
+	if (vctx->notify_fd != -1) {
+		while (read(vctx->notify_fd, buf, sizeof(buf)) > 0)
+			events++;
+
+		/* nothing changed in the directory */
+		if (events == 0)
+			return 0;
+	}
+#endif
+
+	if (stat(vctx->config->passwd, &st) == -1)
+		return 1;
+
+	/* a rename() over the file changes the inode; an edit within the
+	 * same second only the nanoseconds of the times */
+	if (st.st_ino != vctx->db->st.st_ino || st.st_dev != vctx->db->st.st_dev ||
+	    st.st_size != vctx->db->st.st_size ||
+	    st.st_mtim.tv_sec != vctx->db->st.st_mtim.tv_sec ||
+	    st.st_mtim.tv_nsec != vctx->db->st.st_mtim.tv_nsec ||
+	    st.st_ctim.tv_sec != vctx->db->st.st_ctim.tv_sec ||
+	    st.st_ctim.tv_nsec != vctx->db->st.st_ctim.tv_nsec)
+		return 1;
+
+	return 0;
+}
+
+/* Reloads the snapshot if the file has changed. Threads which find
+ * another reloading it use the current snapshot. */
+static void plain_db_refresh(struct plain_vhost_ctx_st *vctx)
+{
+	struct plain_db_st *db, *old = NULL;
+	unsigned reload;
+
+	plain_db_lock(vctx);
+	reload = (vctx->reloading == 0 && plain_db_changed(vctx));
+	if (reload)
+		vctx->reloading = 1;
+	plain_db_unlock(vctx);
+
+	if (reload == 0)
+		return;
+
+	db = plain_db_load(vctx->config->passwd);
+	if (db != NULL && vctx->db != NULL)
+		syslog(LOG_INFO, "plain-auth: reloaded %s (%u users)",
+		       vctx->config->passwd, db->size);
+
+	plain_db_lock(vctx);
+	old = vctx->db;
+	vctx->db = db;
+	vctx->reloading = 0;
+	plain_db_unlock(vctx);
+
+	plain_db_free(old);
+}
+
+/* Returns 0 if the user is successfully authenticated, and sets the appropriate group name.
+ */
+static int read_auth_pass(struct plain_ctx_st *pctx)
+{
+	struct plain_vhost_ctx_st *vctx = pctx->vctx;
+	struct plain_user_st *u;
+	int ret = 0;
+
+	if (pctx->config->passwd == NULL) {
+		/* no password file is set */
+		return 0;
+	}
+
+	pctx->failed = 1;
+
+	plain_db_refresh(vctx);
+
+	plain_db_lock(vctx);
+	if (vctx->db == NULL) {
+		ret = -1;
+		goto exit;
+	}
+
+	u = htable_get(&vctx->db->users, hash_any(pctx->username, strlen(pctx->username), 0),
+		       user_cmp, pctx->username);
+	if (u != NULL) {
+		break_group_list(pctx, u->groups, pctx->groupnames, &pctx->groupnames_size);
+		strlcpy(pctx->cpass, u->cpass, sizeof(pctx->cpass));
+		pctx->failed = 0;
+	}
+
+ exit:
+	plain_db_unlock(vctx);
 	return ret;
 }
 
@@ -243,7 +533,8 @@ static int plain_auth_init(void **ctx, void *pool, void *vctx, const common_auth
 
 	strlcpy(pctx->username, info->username, sizeof(pctx->username));
 	pctx->pass_msg = NULL; /* use default */
-	pctx->config = vctx;
+	pctx->vctx = vctx;
+	pctx->config = pctx->vctx->config;
 
 	/* this doesn't fail on password mismatch but sets p->failed */
 	ret = read_auth_pass(pctx);
@@ -302,20 +593,152 @@ static int plain_auth_user(void *ctx, char *username, int username_size)
 	return -1;
 }
 
+static size_t hit_rehash(const void *_e, void *unused)
+{
+	const struct plain_pass_hit_st *e = _e;
+	return hash_any(e->name, strlen(e->name), 0);
+}
+
+static bool hit_cmp(const void *_e, void *name)
+{
+	const struct plain_pass_hit_st *e = _e;
+
+	if (strcmp(e->name, name) == 0)
+		return 1;
+	return 0;
+}
+
+static int pass_digest(struct plain_ctx_st *pctx, const char *pass, unsigned pass_len,
+		       uint8_t digest[PASS_DIGEST_SIZE])
+{
+	gnutls_hmac_hd_t h;
+	int ret;
+
+	ret = gnutls_hmac_init(&h, GNUTLS_MAC_SHA256, pctx->vctx->hits_key,
+			       sizeof(pctx->vctx->hits_key));
+	if (ret < 0)
+		return -1;
+
+	gnutls_hmac(h, pctx->username, strlen(pctx->username) + 1);
+	gnutls_hmac(h, pctx->cpass, strlen(pctx->cpass) + 1);
+	gnutls_hmac(h, pass, pass_len);
+	gnutls_hmac_deinit(h, digest);
+
+	return 0;
+}
+
+/* Returns non-zero if the password was recently found correct */
+static unsigned pass_cache_check(struct plain_ctx_st *pctx, const uint8_t digest[PASS_DIGEST_SIZE])
+{
+	struct plain_vhost_ctx_st *vctx = pctx->vctx;
+	struct plain_pass_hit_st *h;
+	unsigned found = 0;
+
+	plain_db_lock(vctx);
+	h = htable_get(&vctx->hits, hash_any(pctx->username, strlen(pctx->username), 0),
+		       hit_cmp, pctx->username);
+	if (h != NULL && h->expires > time(0) &&
+	    gnutls_memcmp(h->digest, digest, PASS_DIGEST_SIZE) == 0)
+		found = 1;
+	plain_db_unlock(vctx);
+
+	return found;
+}
+
+static void pass_cache_add(struct plain_ctx_st *pctx, const uint8_t digest[PASS_DIGEST_SIZE])
+{
+	struct plain_vhost_ctx_st *vctx = pctx->vctx;
+	struct plain_pass_hit_st *h;
+	struct htable_iter iter;
+	size_t hval;
+	time_t now = time(0);
+
+	hval = hash_any(pctx->username, strlen(pctx->username), 0);
+
+	plain_db_lock(vctx);
+	h = htable_get(&vctx->hits, hval, hit_cmp, pctx->username);
+	if (h == NULL) {
+		if (vctx->hits_size >= PASS_CACHE_MAX) {
+			h = htable_first(&vctx->hits, &iter);
+			while (h != NULL) {
+				if (h->expires <= now) {
+					htable_delval(&vctx->hits, &iter);
+					talloc_free(h);
+					vctx->hits_size--;
+				}
+				h = htable_next(&vctx->hits, &iter);
+			}
+
+			if (vctx->hits_size >= PASS_CACHE_MAX)
+				goto exit;
+		}
+
+		h = talloc_zero(vctx, struct plain_pass_hit_st);
+		if (h == NULL)
+			goto exit;
+		strlcpy(h->name, pctx->username, sizeof(h->name));
+
+		if (!htable_add(&vctx->hits, hval, h)) {
+			talloc_free(h);
+			goto exit;
+		}
+		vctx->hits_size++;
+	}
+
+	memcpy(h->digest, digest, PASS_DIGEST_SIZE);
+	h->expires = now + PASS_CACHE_TIME;
+ exit:
+	plain_db_unlock(vctx);
+}
+
+/* Returns 0 if the password matches the stored hash */
+static int check_pass(struct plain_ctx_st *pctx, const char *pass, unsigned pass_len)
+{
+	uint8_t digest[PASS_DIGEST_SIZE];
+	unsigned have_digest;
+	const char *p;
+	int ret = -1;
+#ifdef HAVE_CRYPT_R
+	struct crypt_data *cdata;
+#endif
+
+	have_digest = (pass_digest(pctx, pass, pass_len, digest) == 0);
+	if (have_digest && pass_cache_check(pctx, digest)) {
+		ret = 0;
+		goto exit;
+	}
+
+#ifdef HAVE_CRYPT_R
+	cdata = calloc(1, sizeof(*cdata));
+	if (cdata == NULL)
+		goto exit;
+
+	p = crypt_r(pass, pctx->cpass, cdata);
+#else
+	p = crypt(pass, pctx->cpass);
+#endif
+	if (p != NULL && strcmp(p, pctx->cpass) == 0)
+		ret = 0;
+#ifdef HAVE_CRYPT_R
+	safe_memset(cdata, 0, sizeof(*cdata));
+	free(cdata);
+#endif
+
+	if (ret == 0 && have_digest)
+		pass_cache_add(pctx, digest);
+ exit:
+	safe_memset(digest, 0, sizeof(digest));
+	return ret;
+}
+
 /* Returns 0 if the user is successfully authenticated, and sets the appropriate group name.
  */
 static int plain_auth_pass(void *ctx, const char *pass, unsigned pass_len)
 {
 	struct plain_ctx_st *pctx = ctx;
-	const char *p;
 
-	if (pctx->cpass[0] != 0) {
-		p = crypt(pass, pctx->cpass);
-		if (p == NULL) {
-			pctx->failed = 1;
-		} else if (strcmp(p, pctx->cpass) != 0)
-			pctx->failed = 1;
-	}
+	if (pctx->cpass[0] != 0 && check_pass(pctx, pass, pass_len) < 0)
+		pctx->failed = 1;
 
 	if (pctx->failed) {
 		if (pctx->retries++ < MAX_PASSWORD_TRIES-1) {
@@ -348,8 +771,10 @@ static int plain_auth_pass(void *ctx, const char *pass, unsigned pass_len)
 		}
 
 		/* no primary password -> check OTP */
+		otp_file_lock();
 		ret = oath_authenticate_usersfile(pctx->config->otp_file, pctx->username,
 			pass, HOTP_WINDOW, NULL, &last);
+		otp_file_unlock();
 		if (ret != OATH_OK) {
 			syslog(LOG_AUTH,
 			       "plain-auth: OTP auth failed for '%s': %s",
@@ -489,7 +914,13 @@ static void plain_group_list(void *pool, void *additional, char ***groupname, un
 const struct auth_mod_st plain_auth_funcs = {
 	.type = AUTH_TYPE_PLAIN | AUTH_TYPE_USERNAME_PASS,
 	.allows_retries = 1,
+#if defined(HAVE_CRYPT_R) && defined(HAVE_PTHREAD_H)
+	.threads = AUTH_THREADS_SAFE,
+#else
+	.threads = AUTH_THREADS_SERIAL,
+#endif
 	.vhost_init = plain_vhost_init,
+	.vhost_deinit = plain_vhost_deinit,
 	.auth_init = plain_auth_init,
 	.auth_deinit = plain_auth_deinit,
 	.auth_msg = plain_auth_msg,
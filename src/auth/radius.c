@@ -26,10 +26,13 @@
 #include <unistd.h>
 #include <vpn.h>
 #include <c-ctype.h>
+#include <c-strcase.h>
 #include <arpa/inet.h> /* inet_ntop */
+#include <pthread.h>
 #include "radius.h"
 #include "auth/common.h"
 #include "str.h"
+#include "radius-client.h"
 #include <ccan/hash/hash.h>
 
 #ifdef HAVE_RADIUS
@@ -88,6 +91,8 @@ static void radius_vhost_init(void **_vctx, void *pool, void *additional)
 		fprintf(stderr, "error reading the radius dictionary\n");
 		exit(1);
 	}
+
+	radius_transport_init(vctx, "authserver");
 	*_vctx = vctx;
 
 	return;
@@ -100,10 +105,291 @@ static void radius_vhost_deinit(void *_vctx)
 {
 	struct radius_vhost_ctx *vctx = _vctx;
 
+	radius_transport_deinit(vctx);
 	if (vctx->rh != NULL)
 		rc_destroy(vctx->rh);
 }
 
+#define RAD_VENDOR(x) (((x) >> 16) & 0xffff)
+#define RAD_ATTRID(x) ((x) & 0xffff)
+
+/* Looks up the secret of a server in radcli's servers file, for the
+ * servers listed without one. */
+static int find_secret(rc_handle *rh, const char *name, char *secret, unsigned secret_size)
+{
+	char line[512], *host, *sec, *p;
+	const char *file;
+	FILE *fp;
+	int ret = -1;
+
+	file = rc_conf_str(rh, "servers");
+	if (file == NULL)
+		return -1;
+
+	fp = fopen(file, "r");
+	if (fp == NULL)
+		return -1;
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (line[0] == '#')
+			continue;
+
+		host = strtok_r(line, " \t\r\n", &p);
+		sec = strtok_r(NULL, " \t\r\n", &p);
+		if (host == NULL || sec == NULL)
+			continue;
+
+		/* the optional client name follows a slash */
+		p = strchr(host, '/');
+		if (p)
+			*p = 0;
+
+		if (c_strcasecmp(host, name) == 0) {
+			strlcpy(secret, sec, secret_size);
+			ret = 0;
+			break;
+		}
+	}
+
+	safe_memset(line, 0, sizeof(line));
+	fclose(fp);
+	return ret;
+}
+
+/* Sets up the native transport for the servers of the given type
+ * (authserver or acctserver). The requests are sent via radcli when
+ * that is not possible; e.g., when radcli is configured for TLS. */
+void radius_transport_init(struct radius_vhost_ctx *vctx, const char *type)
+{
+	struct radius_client_cfg_st cfg;
+	char secrets[RADIUS_MAX_SERVERS][64];
+	SERVER *srv;
+	const char *str;
+	unsigned i;
+
+	vctx->client = NULL;
+
+#ifndef LEGACY_RADIUS
+	str = rc_conf_str(vctx->rh, "serv-type");
+	if (str != NULL && c_strcasecmp(str, "udp") != 0)
+		return;
+#endif
+
+	srv = rc_conf_srv(vctx->rh, type);
+	if (srv == NULL || srv->max <= 0)
+		return;
+
+	memset(&cfg, 0, sizeof(cfg));
+	for (i = 0; i < (unsigned)srv->max && i < RADIUS_MAX_SERVERS; i++) {
+		cfg.servers[i].name = srv->name[i];
+		cfg.servers[i].port = srv->port[i];
+		if (cfg.servers[i].port == 0)
+			cfg.servers[i].port = strcmp(type, "authserver") == 0 ? 1812 : 1813;
+
+		if (srv->secret[i] != NULL) {
+			cfg.servers[i].secret = srv->secret[i];
+		} else if (find_secret(vctx->rh, srv->name[i], secrets[i], sizeof(secrets[i])) == 0) {
+			cfg.servers[i].secret = secrets[i];
+		} else {
+			syslog(LOG_INFO, "radius: no secret for %s; using radcli's transport", srv->name[i]);
+			return;
+		}
+	}
+	cfg.servers_size = i;
+
+	cfg.timeout = rc_conf_int(vctx->rh, "radius_timeout");
+	cfg.retries = rc_conf_int(vctx->rh, "radius_retries");
+	cfg.deadtime = rc_conf_int(vctx->rh, "radius_deadtime");
+	cfg.bindaddr = rc_conf_str(vctx->rh, "bindaddr");
+
+	vctx->client = radius_client_new(&cfg);
+	safe_memset(secrets, 0, sizeof(secrets));
+}
+
+void radius_transport_deinit(struct radius_vhost_ctx *vctx)
+{
+	radius_client_deinit(vctx->client);
+	vctx->client = NULL;
+}
+
+static int pairs_to_attrs(VALUE_PAIR *vp, uint8_t *attrs, unsigned *attrs_size)
+{
+	uint32_t v;
+	const void *data;
+	unsigned len;
+	int ret;
+
+	for (; vp != NULL; vp = vp->next) {
+		switch (vp->type) {
+		case PW_TYPE_STRING:
+		case PW_TYPE_IPV6ADDR:
+		case PW_TYPE_IPV6PREFIX:
+			data = vp->strvalue;
+			len = vp->lvalue;
+			break;
+		case PW_TYPE_INTEGER:
+		case PW_TYPE_IPADDR:
+		case PW_TYPE_DATE:
+			v = htonl(vp->lvalue);
+			data = &v;
+			len = 4;
+			break;
+		default:
+			continue;
+		}
+
+		if (RAD_VENDOR(vp->attribute) != 0)
+			ret = radius_attr_append_vsa(attrs, attrs_size, RAD_VENDOR(vp->attribute),
+						     RAD_ATTRID(vp->attribute), data, len);
+		else
+			ret = radius_attr_append(attrs, attrs_size, RAD_ATTRID(vp->attribute),
+						 data, len);
+		if (ret < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+static int reply_to_rc(int ret, const radius_reply_st *reply)
+{
+	if (ret == RADIUS_TIMEOUT)
+		return TIMEOUT_RC;
+	if (ret != RADIUS_OK)
+		return ERROR_RC;
+
+	if (reply->code == RADIUS_ACCESS_ACCEPT || reply->code == RADIUS_ACCOUNTING_RESPONSE)
+		return OK_RC;
+	if (reply->code == RADIUS_ACCESS_CHALLENGE)
+		return CHALLENGE_RC;
+	return REJECT_RC;
+}
+
+/* rc_aaa() keeps its state in the handle and in static variables, so it
+ * is used by one thread at a time; it is only used when the native
+ * transport could not be set up. */
+static pthread_mutex_t rc_aaa_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int locked_rc_aaa(struct radius_vhost_ctx *vctx, VALUE_PAIR *send,
+			 VALUE_PAIR **recvd, char *msg, int code)
+{
+	int ret;
+
+	pthread_mutex_lock(&rc_aaa_lock);
+	ret = rc_aaa(vctx->rh, 0, send, recvd, msg, 0, code);
+	pthread_mutex_unlock(&rc_aaa_lock);
+
+	return ret;
+}
+
+/* A replacement of rc_aaa() which may be called by multiple threads; their
+ * requests are multiplexed by the native transport. The reply messages are
+ * concatenated into msg, as rc_aaa() does. */
+int radius_aaa(struct radius_vhost_ctx *vctx, VALUE_PAIR *send, VALUE_PAIR **recvd,
+	       char *msg, int code)
+{
+	uint8_t attrs[RADIUS_MAX_ATTRS];
+	unsigned attrs_size = 0;
+	radius_reply_st reply;
+	VALUE_PAIR *vp;
+	unsigned len;
+	int ret;
+
+	if (vctx->client == NULL)
+		return locked_rc_aaa(vctx, send, recvd, msg, code);
+
+	*recvd = NULL;
+	if (msg)
+		msg[0] = 0;
+
+	ret = pairs_to_attrs(send, attrs, &attrs_size);
+	if (ret < 0) {
+		syslog(LOG_ERR, "radius: request is too long");
+		return ERROR_RC;
+	}
+
+	ret = radius_client_send(vctx->client, code, attrs, attrs_size, &reply);
+	safe_memset(attrs, 0, attrs_size);
+
+	ret = reply_to_rc(ret, &reply);
+	if (ret == TIMEOUT_RC || ret == ERROR_RC)
+		return ret;
+
+	if (reply.attrs_size > 0)
+		*recvd = rc_avpair_gen(vctx->rh, NULL, reply.attrs, reply.attrs_size, 0);
+	radius_reply_deinit(&reply);
+
+	if (msg) {
+		len = 0;
+		for (vp = *recvd; vp != NULL; vp = vp->next) {
+			if (vp->attribute == PW_REPLY_MESSAGE && vp->type == PW_TYPE_STRING &&
+			    len < PW_MAX_MSG_SIZE - 1) {
+				strlcpy(msg + len, vp->strvalue, PW_MAX_MSG_SIZE - len);
+				len += strlen(msg + len);
+			}
+		}
+	}
+
+	return ret;
+}
+
+struct radius_async_st {
+	char what[32];
+};
+
+static void radius_aaa_done(int status, const radius_reply_st *reply, void *priv)
+{
+	struct radius_async_st *a = priv;
+	int ret;
+
+	ret = reply_to_rc(status, reply);
+	if (ret != OK_RC)
+		syslog(LOG_INFO, "radius-auth: %s: %d", a->what, ret);
+
+	free(a);
+}
+
+/* Sends the request without waiting for the reply; the result is only
+ * logged. Used for the accounting requests whose reply is not needed. */
+int radius_aaa_async(struct radius_vhost_ctx *vctx, VALUE_PAIR *send, int code,
+		     const char *what)
+{
+	uint8_t attrs[RADIUS_MAX_ATTRS];
+	unsigned attrs_size = 0;
+	struct radius_async_st *a;
+	VALUE_PAIR *recvd = NULL;
+	int ret;
+
+	if (vctx->client == NULL) {
+		ret = locked_rc_aaa(vctx, send, &recvd, NULL, code);
+		if (recvd != NULL)
+			rc_avpair_free(recvd);
+		if (ret != OK_RC)
+			syslog(LOG_INFO, "radius-auth: %s: %d", what, ret);
+		return ret;
+	}
+
+	if (pairs_to_attrs(send, attrs, &attrs_size) < 0) {
+		syslog(LOG_ERR, "radius: request is too long");
+		return ERROR_RC;
+	}
+
+	a = malloc(sizeof(*a));
+	if (a == NULL)
+		return ERROR_RC;
+	strlcpy(a->what, what, sizeof(a->what));
+
+	ret = radius_client_send_async(vctx->client, code, attrs, attrs_size,
+				       radius_aaa_done, a);
+	if (ret < 0) {
+		syslog(LOG_INFO, "radius-auth: %s: could not queue request", what);
+		free(a);
+		return ERROR_RC;
+	}
+
+	return OK_RC;
+}
+
 static int radius_auth_init(void **ctx, void *pool, void *_vctx, const common_auth_init_st *info)
 {
 	struct radius_ctx_st *pctx;
@@ -348,7 +634,7 @@ static int radius_auth_pass(void *ctx, const char *pass, unsigned pass_len)
 	}
 
 	pctx->pass_msg[0] = 0;
-	ret = rc_aaa(pctx->vctx->rh, 0, send, &recvd, pctx->pass_msg, 0, PW_ACCESS_REQUEST);
+	ret = radius_aaa(pctx->vctx, send, &recvd, pctx->pass_msg, PW_ACCESS_REQUEST);
 
 	if (ret == OK_RC) {
 		uint32_t ipv4;
@@ -519,6 +805,7 @@ static void radius_auth_deinit(void *ctx)
 const struct auth_mod_st radius_auth_funcs = {
 	.type = AUTH_TYPE_RADIUS | AUTH_TYPE_USERNAME_PASS,
 	.allows_retries = 1,
+	.threads = AUTH_THREADS_SAFE,
 	.vhost_init = radius_vhost_init,
 	.vhost_deinit = radius_vhost_deinit,
 	.auth_init = radius_auth_init,
@@ -34,6 +34,7 @@
 struct radius_vhost_ctx {
 	rc_handle *rh;
 	char nas_identifier[64];
+	struct radius_client_st *client;
 };
 
 struct radius_ctx_st {
@@ -75,5 +76,12 @@ struct radius_ctx_st {
 
 extern const struct auth_mod_st radius_auth_funcs;
 
+void radius_transport_init(struct radius_vhost_ctx *vctx, const char *type);
+void radius_transport_deinit(struct radius_vhost_ctx *vctx);
+int radius_aaa(struct radius_vhost_ctx *vctx, VALUE_PAIR *send, VALUE_PAIR **recvd,
+	       char *msg, int code);
+int radius_aaa_async(struct radius_vhost_ctx *vctx, VALUE_PAIR *send, int code,
+		     const char *what);
+
 # endif
 #endif
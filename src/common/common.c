@@ -119,6 +119,8 @@ const char *cmd_request_to_str(unsigned _cmd)
 		return "ban IP";
 	case CMD_BAN_IP_REPLY:
 		return "ban IP reply";
+	case CMD_WORKER_CONN:
+		return "worker connection";
 
 	case CMD_SEC_CLI_STATS:
 		return "sm: worker cli stats";
@@ -759,7 +761,7 @@ ssize_t oc_recvfrom_at(int sockfd, void *buf, size_t len, int flags,
 	};
 
 	do {
-		ret = recvmsg(sockfd, &mh, 0);
+		ret = recvmsg(sockfd, &mh, flags);
 	} while (ret == -1 && errno == EINTR);
 	if (ret < 0) {
 		return -1;
@@ -35,12 +35,16 @@
 #include <acct/pam.h>
 #include <auth/radius.h>
 #include <acct/radius.h>
+#include <tun-gso.h>
+#include <main-udp-steer.h>
+#include <main-ban-filter.h>
 #include <auth/plain.h>
 #include <auth/gssapi.h>
 #include <auth/openidconnect.h>
 #include <auth/common.h>
 #include <sec-mod-sup-config.h>
 #include <sec-mod-acct.h>
+#include <sealed-cookie.h>
 #include "inih/ini.h"
 
 #include <sys/types.h>
@@ -517,6 +521,11 @@ static void apply_default_conf(vhost_cfg_st *vhost, unsigned reload)
 	vhost->perm_config.config->use_utmp = 1;
 	vhost->perm_config.config->keepalive = 3600;
 	vhost->perm_config.config->dpd = 60;
+	vhost->perm_config.config->tun_batch_size = DEFAULT_TUN_BATCH_SIZE;
+	vhost->perm_config.config->prefork_rate = DEFAULT_PREFORK_RATE;
+	vhost->perm_config.config->auth_threads = DEFAULT_AUTH_THREADS;
+	vhost->perm_config.config->tls_session_tickets = 1;
+	vhost->perm_config.config->ticket_key_rotation = DEFAULT_TICKET_KEY_ROTATION;
 
 }
 
@@ -785,6 +794,27 @@ static int cfg_ini_handler(void *_ctx, const char *section, const char *name, co
 			 * re-read configuration too */
 			if (!PWARN_ON_VHOST(vhost->name, "server-stats-reset-time", stats_reset_time))
 				READ_NUMERIC(vhost->perm_config.stats_reset_time);
+		} else if (strcmp(name, "tun-offload") == 0) {
+			/* the worker must agree with main on the tun packet
+			 * format, so this cannot change on reload */
+			if (!PWARN_ON_VHOST(vhost->name, "tun-offload", tun_offload)) {
+				READ_TF(vhost->perm_config.tun_offload);
+#ifndef ENABLE_TUN_OFFLOAD
+				if (vhost->perm_config.tun_offload) {
+					fprintf(stderr, WARNSTR"tun-offload is not supported on this system\n");
+					vhost->perm_config.tun_offload = 0;
+				}
+#endif
+			}
+		} else if (strcmp(name, "cookie-key-file") == 0) {
+			/* the key is loaded once, by main on startup */
+			if (!PWARN_ON_VHOST_STRDUP(vhost->name, "cookie-key-file", cookie_key_file)) {
+#ifdef SUPPORT_SEALED_COOKIES
+				PREAD_STRING(pool, vhost->perm_config.cookie_key_file);
+#else
+				fprintf(stderr, WARNSTR"cookie-key-file requires gnutls 3.4.0 or later; ignoring\n");
+#endif
+			}
 		} else if (strcmp(name, "pid-file") == 0) {
 			if (pid_file[0] == 0) {
 				READ_STATIC_STRING(pid_file);
@@ -829,6 +859,30 @@ static int cfg_ini_handler(void *_ctx, const char *section, const char *name, co
 	} else if (strcmp(name, "rate-limit-ms") == 0) {
 		if (!WARN_ON_VHOST(vhost->name, "rate-limit-ms", rate_limit_ms))
 			READ_NUMERIC(config->rate_limit_ms);
+	} else if (strcmp(name, "prefork-workers") == 0) {
+		if (!WARN_ON_VHOST(vhost->name, "prefork-workers", prefork_workers))
+			READ_NUMERIC(config->prefork_workers);
+	} else if (strcmp(name, "prefork-rate") == 0) {
+		if (!WARN_ON_VHOST(vhost->name, "prefork-rate", prefork_rate))
+			READ_NUMERIC(config->prefork_rate);
+	} else if (strcmp(name, "auth-threads") == 0) {
+		if (!WARN_ON_VHOST(vhost->name, "auth-threads", auth_threads))
+			READ_NUMERIC(config->auth_threads);
+	} else if (strcmp(name, "udp-steering") == 0) {
+		if (!WARN_ON_VHOST(vhost->name, "udp-steering", udp_steering))
+			READ_TF(config->udp_steering);
+#ifndef ENABLE_UDP_STEERING
+		if (config->udp_steering) {
+			fprintf(stderr, WARNSTR"udp-steering is not supported on this system\n");
+			config->udp_steering = 0;
+		}
+#endif
+	} else if (strcmp(name, "tls-session-tickets") == 0) {
+		if (!WARN_ON_VHOST(vhost->name, "tls-session-tickets", tls_session_tickets))
+			READ_TF(config->tls_session_tickets);
+	} else if (strcmp(name, "tls-ticket-key-rotation") == 0) {
+		if (!WARN_ON_VHOST(vhost->name, "tls-ticket-key-rotation", ticket_key_rotation))
+			READ_NUMERIC(config->ticket_key_rotation);
 	} else if (strcmp(name, "ocsp-response") == 0) {
 		READ_STRING(config->ocsp_response);
 #ifdef ANYCONNECT_CLIENT_COMPAT
@@ -920,12 +974,22 @@ static int cfg_ini_handler(void *_ctx, const char *section, const char *name, co
 		}
 	} else if (strcmp(name, "tls-priorities") == 0) {
 		READ_STRING(config->priorities);
+	} else if (strcmp(name, "kernel-tls") == 0) {
+		READ_TF(config->kernel_tls);
+#ifndef ENABLE_KTLS
+		if (config->kernel_tls) {
+			fprintf(stderr, WARNSTR"%skernel-tls is not supported on this system\n", PREFIX_VHOST(vhost));
+			config->kernel_tls = 0;
+		}
+#endif
 	} else if (strcmp(name, "mtu") == 0) {
 		READ_NUMERIC(config->default_mtu);
 	} else if (strcmp(name, "net-priority") == 0) {
 		READ_PRIO_TOS(config->net_priority);
 	} else if (strcmp(name, "output-buffer") == 0) {
 		READ_NUMERIC(config->output_buffer);
+	} else if (strcmp(name, "tun-batch-size") == 0) {
+		READ_NUMERIC(config->tun_batch_size);
 	} else if (strcmp(name, "rx-data-per-sec") == 0) {
 		READ_NUMERIC(config->rx_per_sec);
 		config->rx_per_sec /= 1000; /* in kb */
@@ -981,6 +1045,24 @@ static int cfg_ini_handler(void *_ctx, const char *section, const char *name, co
 	} else if (strcmp(name, "ban-points-kkdcp") == 0) {
 		if (!WARN_ON_VHOST(vhost->name, "ban-points-kkdcp", ban_points_kkdcp))
 			READ_NUMERIC(config->ban_points_kkdcp);
+	} else if (strcmp(name, "ban-allow") == 0) {
+		if (!WARN_ON_VHOST_ONLY(vhost->name, "ban-allow"))
+			READ_MULTI_LINE(config->ban_allow, config->ban_allow_size);
+	} else if (strcmp(name, "ban-deny") == 0) {
+		if (!WARN_ON_VHOST_ONLY(vhost->name, "ban-deny"))
+			READ_MULTI_LINE(config->ban_deny, config->ban_deny_size);
+	} else if (strcmp(name, "ban-aggregate-threshold") == 0) {
+		if (!WARN_ON_VHOST(vhost->name, "ban-aggregate-threshold", ban_aggregate_threshold))
+			READ_NUMERIC(config->ban_aggregate_threshold);
+	} else if (strcmp(name, "ban-filter") == 0) {
+		if (!WARN_ON_VHOST(vhost->name, "ban-filter", ban_filter))
+			READ_TF(config->ban_filter);
+#ifndef ENABLE_BAN_FILTER
+		if (config->ban_filter) {
+			fprintf(stderr, WARNSTR"ban-filter is not supported on this system\n");
+			config->ban_filter = 0;
+		}
+#endif
 	} else if (strcmp(name, "max-same-clients") == 0) {
 		READ_NUMERIC(config->max_same_clients);
 	} else if (strcmp(name, "device") == 0) {
@@ -1338,6 +1420,17 @@ static void check_cfg(vhost_cfg_st *vhost, vhost_cfg_st *defvhost, unsigned sile
 	if (config->mobile_idle_timeout == (unsigned)-1)
 		config->mobile_idle_timeout = config->idle_timeout;
 
+	if (config->prefork_rate == 0)
+		config->prefork_rate = 1;
+
+	if (config->auth_threads > MAX_AUTH_THREADS)
+		config->auth_threads = MAX_AUTH_THREADS;
+
+	if (config->tun_batch_size == 0)
+		config->tun_batch_size = 1;
+	else if (config->tun_batch_size > MAX_TUN_BATCH_SIZE)
+		config->tun_batch_size = MAX_TUN_BATCH_SIZE;
+
 #ifdef ENABLE_COMPRESSION
 	if (config->no_compress_limit < MIN_NO_COMPRESS_LIMIT)
 		config->no_compress_limit = MIN_NO_COMPRESS_LIMIT;
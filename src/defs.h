@@ -74,6 +74,7 @@ typedef enum {
 	CMD_SESSION_INFO = 13,
 	CMD_BAN_IP = 16,
 	CMD_BAN_IP_REPLY = 17,
+	CMD_WORKER_CONN = 18,
 
 	/* from worker to sec-mod */
 	CMD_SEC_AUTH_INIT = 120,
@@ -88,8 +89,8 @@ typedef enum {
 
 	/* from main to sec-mod and vice versa */
 	MIN_SECM_CMD=239,
-	CMD_SECM_SESSION_OPEN, /* sync: reply is CMD_SECM_SESSION_REPLY */
-	CMD_SECM_SESSION_CLOSE, /* sync: reply is CMD_SECM_CLI_STATS */
+	CMD_SECM_SESSION_OPEN, /* async: reply is CMD_SECM_SESSION_REPLY */
+	CMD_SECM_SESSION_CLOSE, /* async: reply is CMD_SECM_CLI_STATS */
 	CMD_SECM_SESSION_REPLY,
 	CMD_SECM_BAN_IP,
 	CMD_SECM_BAN_IP_REPLY,
@@ -117,6 +118,7 @@ typedef enum {
 #define ERR_PEER_TERMINATED -11
 #define ERR_CTL -12
 #define ERR_NO_CMD_FD -13
+#define ERR_WAIT_FOR_SECMOD -14
 
 #define ERR_WORKER_TERMINATED ERR_PEER_TERMINATED
 
@@ -79,41 +79,55 @@
 #include <netinet/ip.h>
 #include <netinet/ip_icmp.h>
 #include <netinet/icmp6.h>
-#include <sys/select.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <errno.h>
 #include <gnutls/crypto.h>
+#include <cloexec.h>
+#include <ip-lease.h>
+#include <ip-util.h>
 #include <icmp-ping.h>
-#include <poll.h>
-
-#ifndef ICMP_DEST_UNREACH
-# ifdef ICMP_UNREACH
-#  define ICMP_DEST_UNREACH ICMP_UNREACH
-# else
-#  define ICMP_DEST_UNREACH 3
-# endif
-#endif
-
-/* I see RENUMBERED constants in bits/in.h - !!?
- * What a fuck is going on with libc? Is it a glibc joke? */
-#ifdef IPV6_2292HOPLIMIT
-#undef IPV6_HOPLIMIT
-#define IPV6_HOPLIMIT IPV6_2292HOPLIMIT
-#endif
 
 enum {
 	DEFDATALEN = 56,
 	MAXIPLEN = 60,
 	MAXICMPLEN = 76,
-	MAXPACKET = 65468,
-	MAX_DUP_CHK = (8 * 128),
-	MAXWAIT = 10,
-	PINGINTERVAL = 1,	/* 1 second */
 };
 
-/* common routines */
+/* The prober keeps a raw socket per family open in main. Every
+ * PROBE_INTERVAL seconds it sends echo requests to free addresses of
+ * the pools with ping-leases set, and an address which doesn't reply
+ * within PROBE_TIMEOUT seconds is added to the warm set of its pool,
+ * from which it is leased. Those which reply are added to the busy set,
+ * and are skipped for a while. The replies are read by the event loop,
+ * so that no lease waits for the network.
+ */
+#define PROBE_INTERVAL 1.
+#define PROBE_TIMEOUT 2
+
+/* the echo requests in flight; indexed by their sequence number */
+#define MAX_PROBES 256
+
+struct icmp_probe_st {
+	struct ip_pool_st *pool;
+	struct sockaddr_storage addr;
+	uint32_t slot;
+	uint16_t seq;
+	time_t sent;
+	unsigned active;
+};
+
+static int probe_fd4 = -1;
+static int probe_fd6 = -1;
+static ev_io probe_io4;
+static ev_io probe_io6;
+static ev_timer probe_watcher;
+
+static uint16_t probe_id;
+static uint16_t probe_seq;
+static struct icmp_probe_st probes[MAX_PROBES];
+static unsigned probes_active;
 
 static int in_cksum(unsigned short *buf, int sz)
 {
@@ -138,211 +152,306 @@ static int in_cksum(unsigned short *buf, int sz)
 	return ans;
 }
 
-inline static int retry(int e)
+static void probe_done(struct icmp_probe_st *p)
 {
-	if (e == EAGAIN || e == EWOULDBLOCK || e == EINTR)
-		return 1;
-	else
-		return 0;
+	p->pool->probing--;
+	p->active = 0;
+	probes_active--;
 }
 
-#define PING_TIMEOUT 3
-
-static
-ssize_t recvfrom_timeout(int sockfd, void *buf, size_t len, int flags,
-			 struct sockaddr *src_addr, socklen_t * addrlen)
+static unsigned is_probing(const struct sockaddr_storage *addr)
 {
-	int ret;
-    struct pollfd pfd;
-
-    pfd.fd = sockfd;
-    pfd.events = POLLIN;
-    pfd.revents = 0;
-
-    ret = poll(&pfd, 1, 250);
-	if (ret == -1)
-		return -1;
-	else if (ret > 0)
-		return recvfrom(sockfd, buf, len, 0, src_addr, addrlen);
-	else
-		return -1;
+	unsigned i;
 
+	if (probes_active == 0)
+		return 0;
 
+	for (i = 0; i < MAX_PROBES; i++) {
+		if (probes[i].active &&
+		    probes[i].addr.ss_family == addr->ss_family &&
+		    ip_cmp(&probes[i].addr, addr) == 0)
+			return 1;
+	}
+	return 0;
 }
 
-int icmp_ping4(main_server_st * s, struct sockaddr_in *addr1)
+/* Sends an echo request to the address. Returns -1 if no more requests
+ * can be sent at this time. */
+static int send_probe(main_server_st *s, struct ip_pool_st *pool,
+		      const struct sockaddr_storage *addr, uint32_t slot, time_t now)
 {
-	struct icmp *pkt;
-	int pingsock, c, e;
-	char packet1[DEFDATALEN + MAXIPLEN + MAXICMPLEN];
-	char buf1[64];
-	time_t now;
-	uint16_t id1;
-	unsigned gotreply = 0, unreachable = 0;
-
-	if (GETCONFIG(s)->ping_leases == 0)
-		return 0;
+	struct icmp_probe_st *p = &probes[probe_seq % MAX_PROBES];
+	char packet[DEFDATALEN + MAXICMPLEN];
+	struct icmp *pkt4;
+	struct icmp6_hdr *pkt6;
+	socklen_t addr_len;
+	size_t size;
+	int fd, ret, e;
+	char buf[64];
+
+	if (p->active)
+		return -1;
 
-	gnutls_rnd(GNUTLS_RND_NONCE, &id1, sizeof(id1));
+	memset(packet, 0, sizeof(packet));
+	if (addr->ss_family == AF_INET) {
+		fd = probe_fd4;
+		addr_len = sizeof(struct sockaddr_in);
+		size = DEFDATALEN + ICMP_MINLEN;
+
+		pkt4 = (struct icmp *) packet;
+		pkt4->icmp_type = ICMP_ECHO;
+		pkt4->icmp_id = probe_id;
+		pkt4->icmp_seq = htons(probe_seq);
+		pkt4->icmp_cksum = in_cksum((unsigned short *) pkt4, size);
+	} else {
+		fd = probe_fd6;
+		addr_len = sizeof(struct sockaddr_in6);
+		size = DEFDATALEN + sizeof(struct icmp6_hdr);
+
+		/* the kernel sets the checksum */
+		pkt6 = (struct icmp6_hdr *) packet;
+		pkt6->icmp6_type = ICMP6_ECHO_REQUEST;
+		pkt6->icmp6_id = probe_id;
+		pkt6->icmp6_seq = htons(probe_seq);
+	}
 
-	pingsock = socket(AF_INET, SOCK_RAW, 1);
-	if (pingsock == -1) {
+	if (fd == -1)
+		return -1;
+
+	ret = sendto(fd, packet, size, 0, (struct sockaddr *) addr, addr_len);
+	if (ret == -1) {
 		e = errno;
-		mslog(s, NULL, LOG_INFO,
-		      "could not open raw socket for ping: %s", strerror(e));
+		if (e == EAGAIN || e == EWOULDBLOCK || e == EINTR || e == ENOBUFS)
+			return -1;
+
+		/* no host can reply to it */
+		mslog(s, NULL, LOG_DEBUG, "could not ping %s: %s",
+		      human_addr((void *) addr, addr_len, buf, sizeof(buf)),
+		      strerror(e));
+		ip_pool_warm_add(pool, addr, slot, now);
 		return 0;
 	}
 
-	pkt = (struct icmp *) packet1;
-	memset(pkt, 0, sizeof(packet1));
-	pkt->icmp_type = ICMP_ECHO;
-	pkt->icmp_id = id1;
-	pkt->icmp_cksum =
-	    in_cksum((unsigned short *) pkt, sizeof(packet1));
-
-	while ((c = sendto(pingsock, packet1, DEFDATALEN + ICMP_MINLEN, 0,
-			   (struct sockaddr *) addr1,
-			   sizeof(*addr1)) == -1) && retry(errno));
-	/* listen for replies */
+	p->pool = pool;
+	memcpy(&p->addr, addr, sizeof(*addr));
+	p->slot = slot;
+	p->seq = probe_seq;
+	p->sent = now;
+	p->active = 1;
+
+	pool->probing++;
+	probes_active++;
+	probe_seq++;
+	return 0;
+}
 
-	now = time(0);
-	while (time(0) - now < PING_TIMEOUT
-	       && (unreachable + gotreply) < 2) {
-		struct sockaddr_in from;
-		socklen_t fromlen = sizeof(from);
+static void probe_reply_cb(EV_P_ ev_io *w, int revents)
+{
+	main_server_st *s = ev_userdata(loop);
+	char packet[DEFDATALEN + MAXIPLEN + MAXICMPLEN];
+	struct sockaddr_storage from;
+	socklen_t from_len;
+	struct icmp_probe_st *p;
+	struct icmp *pkt4;
+	struct icmp6_hdr *pkt6;
+	uint16_t id, seq;
+	unsigned hlen;
+	ssize_t ret;
+	char buf[64];
+
+	for (;;) {
+		from_len = sizeof(from);
+		ret = recvfrom(w->fd, packet, sizeof(packet), 0,
+			       (struct sockaddr *) &from, &from_len);
+		if (ret < 0)
+			break;
+
+		if (w == &probe_io4) {
+			/* skip the IP header */
+			hlen = (packet[0] & 0x0f) << 2;
+			if (ret < (ssize_t)(hlen + ICMP_MINLEN) ||
+			    from_len < sizeof(struct sockaddr_in))
+				continue;
+
+			pkt4 = (struct icmp *) (packet + hlen);
+			if (pkt4->icmp_type != ICMP_ECHOREPLY)
+				continue;
+			id = pkt4->icmp_id;
+			seq = ntohs(pkt4->icmp_seq);
+		} else {
+			if (ret < (ssize_t)sizeof(struct icmp6_hdr) ||
+			    from_len < sizeof(struct sockaddr_in6))
+				continue;
+
+			pkt6 = (struct icmp6_hdr *) packet;
+			if (pkt6->icmp6_type != ICMP6_ECHO_REPLY)
+				continue;
+			id = pkt6->icmp6_id;
+			seq = ntohs(pkt6->icmp6_seq);
+		}
 
-		c = recvfrom_timeout(pingsock, packet1, sizeof(packet1), 0,
-				     (struct sockaddr *) &from, &fromlen);
+		if (id != probe_id)
+			continue;
 
-		if (c < 0) {
+		p = &probes[seq % MAX_PROBES];
+		if (!p->active || p->seq != seq || ip_cmp(&p->addr, &from) != 0)
 			continue;
-		} else if (c >= 76 && fromlen == sizeof(struct sockaddr_in)) {	/* icmp6_hdr */
-			if (memcmp
-			    (SA_IN_P(&from), SA_IN_P(addr1),
-			     SA_IN_SIZE(sizeof(*addr1))) == 0) {
-
-#ifdef HAVE_STRUCT_IPHDR_IHL
-				struct iphdr *iphdr =
-				    (struct iphdr *) packet1;
-				pkt = (struct icmp *) (packet1 + (iphdr->ihl << 2));	/* skip ip hdr */
-#else
-				pkt = (struct icmp *) (packet1 + ((packet1[0] & 0x0f) << 2));	/* skip ip hdr */
-#endif
-				if (pkt->icmp_id == id1) {
-					if (pkt->icmp_type == ICMP_ECHOREPLY)
-						gotreply++;
-					else if (pkt->icmp_type == ICMP_DEST_UNREACH)
-						unreachable++;
-                                }
-			}
+
+		mslog(s, NULL, LOG_INFO, "pinged %s and is in use",
+		      human_addr((void *) &from, from_len, buf, sizeof(buf)));
+		ip_pool_busy_add(p->pool, &p->addr, p->slot, time(0));
+		probe_done(p);
+	}
+}
+
+static void probe_watcher_cb(EV_P_ ev_timer *w, int revents)
+{
+	main_server_st *s = ev_userdata(loop);
+	struct ip_pool_st *pool;
+	struct sockaddr_storage addr;
+	time_t now = time(0);
+	uint32_t slot;
+	unsigned i, tries, target;
+
+	/* the requests which were not answered */
+	for (i = 0; i < MAX_PROBES && probes_active > 0; i++) {
+		if (probes[i].active && now - probes[i].sent >= PROBE_TIMEOUT) {
+			ip_pool_warm_add(probes[i].pool, &probes[i].addr,
+					 probes[i].slot, now);
+			probe_done(&probes[i]);
 		}
 	}
 
-	close(pingsock);
+	/* top up the warm sets */
+	list_for_each(&s->ip_leases.pools, pool, list) {
+		if (!pool->probed)
+			continue;
 
-	if (gotreply > 0) {
-		mslog(s, NULL, LOG_INFO,
-		      "pinged %s and is in use",
-		      human_addr((void *) addr1,
-				 sizeof(struct sockaddr_in), buf1,
-				 sizeof(buf1)));
-		return gotreply;
-	} else {
-		mslog(s, NULL, LOG_INFO,
-		      "pinged %s and is not in use",
-		      human_addr((void *) addr1,
-				 sizeof(struct sockaddr_in), buf1,
-				 sizeof(buf1)));
-		return 0;
+		ip_pool_warm_expire(s, pool, now);
+		target = ip_pool_warm_target(pool, (unsigned)PROBE_INTERVAL, PROBE_TIMEOUT);
+
+		for (tries = 0; tries < target &&
+		     pool->warm_size + pool->probing < target; tries++) {
+			if (ip_pool_probe_candidate(s, pool, &addr, &slot) < 0)
+				break;
+			if (is_probing(&addr))
+				continue;
+			if (send_probe(s, pool, &addr, slot, now) < 0)
+				return;
+		}
 	}
 }
 
-int icmp_ping6(main_server_st * s,
-	       struct sockaddr_in6 *addr1)
+static int open_probe_socket(main_server_st *s, int family)
 {
-	struct icmp6_hdr *pkt;
-	char buf1[64];
-	int pingsock, c, e;
+	int fd, e;
 #if defined(SOL_RAW) && defined(IPV6_CHECKSUM)
 	int sockopt;
 #endif
-	char packet1[DEFDATALEN + MAXIPLEN + MAXICMPLEN];
-	uint16_t id1;
-	unsigned gotreply = 0, unreachable = 0;
-	time_t now;
-
-	if (GETCONFIG(s)->ping_leases == 0)
-		return 0;
-
-	gnutls_rnd(GNUTLS_RND_NONCE, &id1, sizeof(id1));
+#ifdef ICMP6_FILTER
+	struct icmp6_filter filter;
+#endif
 
-	pingsock = socket(AF_INET6, SOCK_RAW, IPPROTO_ICMPV6);
-	if (pingsock == -1) {
+	if (family == AF_INET)
+		fd = socket(AF_INET, SOCK_RAW, IPPROTO_ICMP);
+	else
+		fd = socket(AF_INET6, SOCK_RAW, IPPROTO_ICMPV6);
+	if (fd == -1) {
 		e = errno;
-		mslog(s, NULL, LOG_INFO,
+		mslog(s, NULL, LOG_ERR,
 		      "could not open raw socket for ping: %s", strerror(e));
-		return 0;
+		return -1;
 	}
 
-	pkt = (struct icmp6_hdr *) packet1;
-	memset(pkt, 0, sizeof(packet1));
-	pkt->icmp6_type = ICMP6_ECHO_REQUEST;
-	pkt->icmp6_id = id1;
+	set_non_block(fd);
+	set_cloexec_flag(fd, 1);
 
+	if (family == AF_INET6) {
 #if defined(SOL_RAW) && defined(IPV6_CHECKSUM)
-	sockopt = offsetof(struct icmp6_hdr, icmp6_cksum);
-	setsockopt(pingsock, SOL_RAW, IPV6_CHECKSUM,
-		   &sockopt, sizeof(sockopt));
+		sockopt = offsetof(struct icmp6_hdr, icmp6_cksum);
+		setsockopt(fd, SOL_RAW, IPV6_CHECKSUM,
+			   &sockopt, sizeof(sockopt));
 #endif
-	while ((c =
-		sendto(pingsock, packet1,
-		       DEFDATALEN + sizeof(struct icmp6_hdr), 0,
-		       (struct sockaddr *) addr1,
-		       sizeof(*addr1)) == -1) && retry(errno));
-
-	/* listen for replies */
-	now = time(0);
-	while (time(0) - now < PING_TIMEOUT
-	       && (unreachable + gotreply) < 2) {
-		struct sockaddr_in6 from;
-		socklen_t fromlen = sizeof(from);
-		c = recvfrom_timeout(pingsock, packet1,
-				     sizeof(packet1), 0,
-				     (struct sockaddr *)
-				     &from, &fromlen);
-		if (c < 0) {
-			continue;
-		} else if (c >= 8 && fromlen == sizeof(struct sockaddr_in6)) {	/* icmp6_hdr */
-			if (memcmp
-			    (SA_IN6_P(&from), SA_IN6_P(addr1),
-			     SA_IN_SIZE(sizeof(*addr1))) == 0) {
-
-				pkt = (struct icmp6_hdr *) packet1;
-				if (pkt->icmp6_id == id1) {
-					if (pkt->icmp6_type == ICMP6_ECHO_REPLY)
-						gotreply++;
-					else if (pkt->icmp6_type == ICMP6_DST_UNREACH)
-						unreachable++;
-				}
-			}
+#ifdef ICMP6_FILTER
+		ICMP6_FILTER_SETBLOCKALL(&filter);
+		ICMP6_FILTER_SETPASS(ICMP6_ECHO_REPLY, &filter);
+		setsockopt(fd, IPPROTO_ICMPV6, ICMP6_FILTER,
+			   &filter, sizeof(filter));
+#endif
+	}
+
+	return fd;
+}
+
+/* Starts the prober if ping-leases is set, or stops it otherwise; it is
+ * called on startup and after a reload, once the pools are in place.
+ */
+void icmp_prober_setup(main_server_st *s)
+{
+	if (GETCONFIG(s)->ping_leases == 0) {
+		icmp_prober_deinit(s);
+		return;
+	}
+
+	if (probe_fd4 == -1) {
+		probe_fd4 = open_probe_socket(s, AF_INET);
+		if (probe_fd4 != -1) {
+			ev_io_init(&probe_io4, probe_reply_cb, probe_fd4, EV_READ);
+			ev_io_start(loop, &probe_io4);
 		}
 	}
 
-	close(pingsock);
+	if (probe_fd6 == -1) {
+		probe_fd6 = open_probe_socket(s, AF_INET6);
+		if (probe_fd6 != -1) {
+			ev_io_init(&probe_io6, probe_reply_cb, probe_fd6, EV_READ);
+			ev_io_start(loop, &probe_io6);
+		}
+	}
 
-	if (gotreply > 0) {
-		mslog(s, NULL, LOG_INFO,
-		      "pinged %s and is in use",
-		      human_addr((void *) addr1,
-				 sizeof(struct sockaddr_in6), buf1,
-				 sizeof(buf1)));
-		return gotreply;
-	} else {
-		mslog(s, NULL, LOG_INFO,
-		      "pinged %s and is not in use",
-		      human_addr((void *) addr1,
-				 sizeof(struct sockaddr_in6), buf1,
-				 sizeof(buf1)));
-		return 0;
+	if (!ev_is_active(&probe_watcher)) {
+		gnutls_rnd(GNUTLS_RND_NONCE, &probe_id, sizeof(probe_id));
+		ev_timer_init(&probe_watcher, probe_watcher_cb, 0., PROBE_INTERVAL);
+		ev_timer_start(loop, &probe_watcher);
+	}
+}
+
+/* Stops the prober and closes its sockets; also called in the forked
+ * processes. */
+void icmp_prober_deinit(main_server_st *s)
+{
+	struct ip_pool_st *pool;
+
+	if (loop) {
+		ev_timer_stop(loop, &probe_watcher);
+		ev_io_stop(loop, &probe_io4);
+		ev_io_stop(loop, &probe_io6);
+	}
+
+	if (probe_fd4 != -1) {
+		close(probe_fd4);
+		probe_fd4 = -1;
+	}
+	if (probe_fd6 != -1) {
+		close(probe_fd6);
+		probe_fd6 = -1;
+	}
+
+	memset(probes, 0, sizeof(probes));
+	probes_active = 0;
+	list_for_each(&s->ip_leases.pools, pool, list)
+		pool->probing = 0;
+}
+
+/* Called when a pool is freed; its requests are forgotten */
+void icmp_prober_forget_pool(struct ip_pool_st *pool)
+{
+	unsigned i;
+
+	for (i = 0; i < MAX_PROBES && probes_active > 0; i++) {
+		if (probes[i].active && probes[i].pool == pool) {
+			probes[i].active = 0;
+			probes_active--;
+		}
 	}
 }
@@ -23,9 +23,12 @@
 
 #include <main.h>
 
-/* returns the number of positive replies received or
- * 0 if no host with this IP exists. */
-int icmp_ping4(main_server_st* s, struct sockaddr_in* addr1);
-int icmp_ping6(main_server_st* s, struct sockaddr_in6* addr1);
+struct ip_pool_st;
+
+/* The addresses of the pools are pinged in the background, prior to
+ * being leased; see ping-leases. */
+void icmp_prober_setup(main_server_st* s);
+void icmp_prober_deinit(main_server_st* s);
+void icmp_prober_forget_pool(struct ip_pool_st *pool);
 
 #endif
@@ -52,16 +52,23 @@ void ip_lease_deinit(struct ip_lease_db_st* db)
 {
 struct ip_lease_st * cache;
 struct htable_iter iter;
+struct ip_pool_st *pool, *tmp;
 
 	cache = htable_first(&db->ht, &iter);
 	while(cache != NULL) {
 		/* disable the destructor */
 		cache->db = NULL;
+		cache->pool = NULL;
 		talloc_free(cache);
 		
 		cache = htable_next(&db->ht, &iter);
 	}
 	htable_clear(&db->ht);
+
+	list_for_each_safe(&db->pools, pool, tmp, list) {
+		list_del(&pool->list);
+		talloc_free(pool);
+	}
 	
 	return;
 }
@@ -76,6 +83,7 @@ const struct ip_lease_st * e = _e;
 void ip_lease_init(struct ip_lease_db_st* db)
 {
 	htable_init(&db->ht, rehash, NULL);
+	list_head_init(&db->pools);
 }
 
 static bool ip_lease_cmp(const void* _c1, void* _c2)
@@ -179,14 +187,537 @@ static int is_ipv4_ok(main_server_st *s, struct sockaddr_storage *ip, struct soc
 #define MAX_IP_TRIES 16
 #define FIXED_IPS 5
 
+/* bit pos of an address, counting from the most significant */
+#define ADDR_BIT(a, pos) (((a)[(pos)/8] >> (7 - (pos)%8)) & 1)
+
+static void set_addr_bit(uint8_t *addr, unsigned pos, unsigned val)
+{
+	if (val)
+		addr[pos/8] |= 0x80 >> (pos%8);
+	else
+		addr[pos/8] &= ~(0x80 >> (pos%8));
+}
+
+/* Returns the length of the netmask, or -1 if it is not contiguous */
+static int mask_to_prefix(const uint8_t *mask, unsigned mask_size)
+{
+	unsigned i, prefix = 0;
+
+	for (i = 0; i < mask_size*8; i++) {
+		if (ADDR_BIT(mask, i)) {
+			if (prefix != i)
+				return -1;
+			prefix++;
+		}
+	}
+	return prefix;
+}
+
+/* The slot of an address is the number in its bits between the prefix
+ * of the pool's network and the slot prefix. */
+static uint32_t addr_to_slot(const struct ip_pool_st *pool, const uint8_t *addr)
+{
+	uint32_t slot = 0;
+	unsigned pos;
+
+	for (pos = pool->prefix; pos < pool->slot_prefix; pos++)
+		slot = (slot << 1) | ADDR_BIT(addr, pos);
+	return slot;
+}
+
+static void slot_to_addr(const struct ip_pool_st *pool, uint32_t slot, uint8_t *addr)
+{
+	unsigned pos;
+
+	for (pos = pool->slot_prefix; pos-- > pool->prefix; slot >>= 1)
+		set_addr_bit(addr, pos, slot & 1);
+}
+
+static unsigned slot_in_use(const struct ip_pool_st *pool, uint32_t slot)
+{
+	return (pool->map[slot / 64] >> (slot % 64)) & 1;
+}
+
+static void mark_slot(struct ip_pool_st *pool, uint32_t slot)
+{
+	uint32_t w = slot / 64;
+
+	pool->map[w] |= (uint64_t)1 << (slot % 64);
+	if (pool->map[w] == UINT64_MAX)
+		pool->full[w / 64] |= (uint64_t)1 << (w % 64);
+}
+
+static void clear_slot(struct ip_pool_st *pool, uint32_t slot)
+{
+	uint32_t w = slot / 64;
+
+	pool->map[w] &= ~((uint64_t)1 << (slot % 64));
+	pool->full[w / 64] &= ~((uint64_t)1 << (w % 64));
+}
+
+/* Returns the first free slot from start on, wrapping around at the end
+ * of the pool, or IP_POOL_NO_SLOT if there is none. The full words are
+ * skipped 64 at a time.
+ */
+static uint32_t find_free_slot(const struct ip_pool_st *pool, uint32_t start)
+{
+	uint32_t w = start / 64, sw;
+	uint64_t avail;
+	unsigned wrapped = 0;
+
+	avail = ~pool->map[w] & (UINT64_MAX << (start % 64));
+	if (avail)
+		return w * 64 + __builtin_ctzll(avail);
+
+	w++;
+	for (;;) {
+		if (w >= pool->words) {
+			if (wrapped)
+				return IP_POOL_NO_SLOT;
+			wrapped = 1;
+			w = 0;
+		}
+
+		sw = w / 64;
+		avail = ~pool->full[sw] & (UINT64_MAX << (w % 64));
+		if (avail) {
+			/* the bits past the last word are set */
+			w = sw * 64 + __builtin_ctzll(avail);
+			return w * 64 + __builtin_ctzll(~pool->map[w]);
+		}
+		w = (sw + 1) * 64;
+	}
+}
+
+/* Only addresses are pinged; IPv6 subnets are not */
+static unsigned pool_is_probed(main_server_st *s, const struct ip_pool_st *pool)
+{
+	return GETCONFIG(s)->ping_leases &&
+	       (pool->family == AF_INET || pool->slot_prefix == 128);
+}
+
+/* Returns the pool of the given network, creating it on first use. The
+ * pools are shared by the virtual hosts and users with the same network,
+ * as their addresses are.
+ */
+static struct ip_pool_st *get_ip_pool(main_server_st *s, int family,
+				      const uint8_t *network, unsigned prefix,
+				      unsigned slot_prefix)
+{
+	struct ip_pool_st *pool;
+	unsigned addr_size = (family == AF_INET) ? 4 : 16;
+	unsigned reserved;
+	uint32_t slots, i;
+
+	list_for_each(&s->ip_leases.pools, pool, list) {
+		if (pool->family == family && pool->prefix == prefix &&
+		    pool->slot_prefix == slot_prefix &&
+		    memcmp(pool->network, network, addr_size) == 0)
+			return pool;
+	}
+
+	pool = talloc_zero(s, struct ip_pool_st);
+	if (pool == NULL)
+		return NULL;
+
+	pool->family = family;
+	memcpy(pool->network, network, addr_size);
+	pool->prefix = prefix;
+	pool->slot_prefix = slot_prefix;
+	pool->bits = slot_prefix - prefix;
+	pool->probed = pool_is_probed(s, pool);
+
+	/* In IPv4 the network and broadcast addresses, and ours which is
+	 * the network address + 1, are not leased. In IPv6 the subnet which
+	 * contains our address is not. */
+	if (family == AF_INET)
+		reserved = (pool->bits >= 2) ? 3 : (1 << pool->bits);
+	else
+		reserved = 1;
+
+	if (pool->bits >= 64)
+		pool->capacity = UINT64_MAX;
+	else
+		pool->capacity = ((uint64_t)1 << pool->bits) - reserved;
+
+	if (pool->bits <= IP_POOL_MAX_BITS) {
+		slots = (uint32_t)1 << pool->bits;
+		pool->words = (slots + 63) / 64;
+		pool->map = talloc_zero_array(pool, uint64_t, pool->words);
+		pool->full = talloc_zero_array(pool, uint64_t, (pool->words + 63) / 64);
+		if (pool->map == NULL || pool->full == NULL) {
+			talloc_free(pool);
+			return NULL;
+		}
+
+		/* the bits past the end are never free */
+		for (i = slots; i < pool->words * 64; i++)
+			mark_slot(pool, i);
+		for (i = pool->words; i < ((pool->words + 63) / 64) * 64; i++)
+			pool->full[i / 64] |= (uint64_t)1 << (i % 64);
+
+		mark_slot(pool, 0);
+		if (family == AF_INET) {
+			if (slots > 1)
+				mark_slot(pool, 1);
+			mark_slot(pool, slots - 1);
+		}
+	}
+
+	list_add(&s->ip_leases.pools, &pool->list);
+
+	return pool;
+}
+
+static int probed_find(const struct ip_pool_probed_st *set, unsigned size,
+		       const struct sockaddr_storage *addr)
+{
+	unsigned i;
+
+	for (i = 0; i < size; i++) {
+		if (ip_cmp(&set[i].addr, addr) == 0)
+			return i;
+	}
+	return -1;
+}
+
+static void probed_del(struct ip_pool_probed_st *set, unsigned *size, unsigned i)
+{
+	(*size)--;
+	memmove(&set[i], &set[i + 1], (*size - i) * sizeof(set[0]));
+}
+
+/* The sets are kept in the order the addresses were probed, and the
+ * oldest is replaced when one is full. */
+static void probed_add(struct ip_pool_probed_st *set, unsigned *size, unsigned max,
+		       const struct sockaddr_storage *addr, uint32_t slot, time_t now)
+{
+	int i;
+
+	i = probed_find(set, *size, addr);
+	if (i >= 0)
+		probed_del(set, size, i);
+	else if (*size == max)
+		probed_del(set, size, 0);
+
+	memcpy(&set[*size].addr, addr, sizeof(*addr));
+	set[*size].slot = slot;
+	set[*size].verified = now;
+	(*size)++;
+}
+
+/* Adds an address that did not respond to ping to the warm set */
+void ip_pool_warm_add(struct ip_pool_st *pool, const struct sockaddr_storage *addr,
+		      uint32_t slot, time_t now)
+{
+	int i;
+
+	if (!pool->probed)
+		return;
+
+	i = probed_find(pool->busy, pool->busy_size, addr);
+	if (i >= 0)
+		probed_del(pool->busy, &pool->busy_size, i);
+
+	probed_add(pool->warm, &pool->warm_size, IP_POOL_WARM_SLOTS, addr, slot, now);
+}
+
+/* Adds an address that responded to ping to the busy set; it is neither
+ * leased nor probed again for a while. */
+void ip_pool_busy_add(struct ip_pool_st *pool, const struct sockaddr_storage *addr,
+		      uint32_t slot, time_t now)
+{
+	int i;
+
+	if (!pool->probed)
+		return;
+
+	i = probed_find(pool->warm, pool->warm_size, addr);
+	if (i >= 0)
+		probed_del(pool->warm, &pool->warm_size, i);
+
+	probed_add(pool->busy, &pool->busy_size, IP_POOL_BUSY_SLOTS, addr, slot, now);
+}
+
+static unsigned is_busy(const struct ip_pool_st *pool, const struct sockaddr_storage *addr)
+{
+	return pool->probed && probed_find(pool->busy, pool->busy_size, addr) >= 0;
+}
+
+/* Drops the addresses which were probed too long ago, and those of the
+ * warm set which were leased in the meantime. */
+void ip_pool_warm_expire(main_server_st *s, struct ip_pool_st *pool, time_t now)
+{
+	struct ip_pool_probed_st *w;
+	unsigned i = 0;
+
+	while (pool->busy_size > 0 && now - pool->busy[0].verified >= IP_POOL_WARM_TIME)
+		probed_del(pool->busy, &pool->busy_size, 0);
+
+	while (i < pool->warm_size) {
+		w = &pool->warm[i];
+		if (now - w->verified >= IP_POOL_WARM_TIME ||
+		    (pool->map && w->slot != IP_POOL_NO_SLOT && slot_in_use(pool, w->slot)) ||
+		    ip_lease_exists(s, &w->addr, (pool->family == AF_INET) ?
+				    sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6)) != 0)
+			probed_del(pool->warm, &pool->warm_size, i);
+		else
+			i++;
+	}
+}
+
+/* Takes the oldest address of the warm set which is still free. The
+ * addresses taken are counted, so that the prober keeps as many as
+ * are leased (see ip_pool_warm_target()). */
+static int take_warm(main_server_st *s, struct ip_pool_st *pool,
+		     struct sockaddr_storage *addr, uint32_t *slot)
+{
+	ip_pool_warm_expire(s, pool, time(0));
+	if (pool->warm_size == 0) {
+		pool->warm_missed++;
+		return -1;
+	}
+
+	memcpy(addr, &pool->warm[0].addr, sizeof(*addr));
+	*slot = pool->warm[0].slot;
+	probed_del(pool->warm, &pool->warm_size, 0);
+	pool->warm_taken++;
+	return 0;
+}
+
+/* Called by the prober every interval seconds; returns how many
+ * addresses the warm set should hold. That is enough for twice the
+ * leases of the last intervals, until the probes sent now are answered
+ * or time out, but no less than IP_POOL_WARM_MIN. */
+unsigned ip_pool_warm_target(struct ip_pool_st *pool, unsigned interval, unsigned timeout)
+{
+	unsigned target;
+
+	/* a moving average of the leases per interval, in 1/4 units */
+	pool->warm_rate = (pool->warm_rate + 4 * (pool->warm_taken + pool->warm_missed)) / 2;
+	pool->warm_taken = pool->warm_missed = 0;
+
+	target = 2 * pool->warm_rate * (timeout / interval + 1) / 4;
+	if (target < IP_POOL_WARM_MIN)
+		target = IP_POOL_WARM_MIN;
+	if (target > IP_POOL_WARM_SLOTS)
+		target = IP_POOL_WARM_SLOTS;
+
+	return target;
+}
+
+/* In IPv4 the network, our and the broadcast address; in IPv6 the
+ * network address and ours. */
+static unsigned is_reserved_addr(const struct ip_pool_st *pool, const uint8_t *addr)
+{
+	unsigned pos, ones = 0;
+
+	for (pos = pool->prefix; pos < pool->slot_prefix; pos++)
+		ones += ADDR_BIT(addr, pos);
+
+	if (ones == 0 || (ones == 1 && ADDR_BIT(addr, pool->slot_prefix - 1)))
+		return 1;
+	if (pool->family == AF_INET && ones == pool->bits)
+		return 1;
+	return 0;
+}
+
+/* Picks the next address of the pool to be probed by the prober: the
+ * free slots are visited in order in pools with a bitmap, and random
+ * addresses are picked in the others. Those that are leased or already
+ * in the warm set are skipped. */
+int ip_pool_probe_candidate(main_server_st *s, struct ip_pool_st *pool,
+			    struct sockaddr_storage *addr, uint32_t *slot)
+{
+	unsigned addr_size = (pool->family == AF_INET) ? 4 : 16;
+	uint8_t *a;
+	unsigned i, pos;
+
+	memset(addr, 0, sizeof(*addr));
+	if (pool->family == AF_INET) {
+		((struct sockaddr_in*)addr)->sin_family = AF_INET;
+		a = SA_IN_U8_P(addr);
+	} else {
+		((struct sockaddr_in6*)addr)->sin6_family = AF_INET6;
+		a = SA_IN6_U8_P(addr);
+	}
+
+	for (i = 0; i < IP_POOL_WARM_SLOTS; i++) {
+		if (pool->map) {
+			*slot = find_free_slot(pool, pool->probe_cursor);
+			if (*slot == IP_POOL_NO_SLOT)
+				return -1;
+			pool->probe_cursor = (*slot + 1) % ((uint32_t)1 << pool->bits);
+
+			memcpy(a, pool->network, addr_size);
+			slot_to_addr(pool, *slot, a);
+		} else {
+			*slot = IP_POOL_NO_SLOT;
+
+			gnutls_rnd(GNUTLS_RND_NONCE, a, addr_size);
+			for (pos = 0; pos < pool->prefix; pos++)
+				set_addr_bit(a, pos, ADDR_BIT(pool->network, pos));
+			if (is_reserved_addr(pool, a))
+				continue;
+		}
+
+		if (probed_find(pool->warm, pool->warm_size, addr) >= 0 || is_busy(pool, addr) ||
+		    ip_lease_exists(s, addr, (pool->family == AF_INET) ?
+				    sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6)) != 0)
+			continue;
+
+		return 0;
+	}
+
+	return -1;
+}
+
+static void put_ip_pool_lease(struct ip_lease_st *lease)
+{
+	struct ip_pool_st *pool = lease->pool;
+
+	if (pool == NULL)
+		return;
+
+	if (pool->map && lease->slot != IP_POOL_NO_SLOT)
+		clear_slot(pool, lease->slot);
+	lease->pool = NULL;
+
+	/* the address was ours until now; it can be leased without ping */
+	ip_pool_warm_add(pool, &lease->rip, lease->slot, time(0));
+
+	/* the pools of the configured networks are kept, to be probed */
+	if (--pool->used == 0 && !pool->configured) {
+		icmp_prober_forget_pool(pool);
+		list_del(&pool->list);
+		talloc_free(pool);
+	}
+}
+
+/* Sets the slot in the candidate address rnd, and leases it if no other
+ * pool did and it didn't respond to a recent ping. */
+static int try_pool_slot(main_server_st *s, struct proc_st *proc,
+			 struct ip_pool_st *pool, struct ip_lease_st *lease,
+			 struct sockaddr_storage *rnd, uint32_t slot)
+{
+	char buf[64];
+	unsigned i;
+
+	if (pool->family == AF_INET) {
+		slot_to_addr(pool, slot, SA_IN_U8_P(rnd));
+
+		if (ip_lease_exists(s, rnd, sizeof(struct sockaddr_in)) != 0 ||
+		    is_busy(pool, rnd))
+			return -1;
+
+		memcpy(&lease->rip, rnd, sizeof(struct sockaddr_in));
+		lease->rip_len = sizeof(struct sockaddr_in);
+		memcpy(&lease->sig, rnd, sizeof(struct sockaddr_in));
+	} else {
+		slot_to_addr(pool, slot, SA_IN6_U8_P(rnd));
+
+		memcpy(&lease->sig, rnd, sizeof(struct sockaddr_in6));
+		for (i = pool->slot_prefix; i < 128; i++)
+			set_addr_bit(SA_IN6_U8_P(&lease->sig), i, 0);
+
+		if (ip_lease_exists(s, &lease->sig, sizeof(struct sockaddr_in6)) != 0 ||
+		    is_busy(pool, rnd))
+			return -1;
+
+		memcpy(&lease->rip, rnd, sizeof(struct sockaddr_in6));
+		lease->rip_len = sizeof(struct sockaddr_in6);
+	}
+
+	mslog(s, proc, LOG_DEBUG, "selected IP: %s",
+	      human_addr((void*)&lease->rip, lease->rip_len, buf, sizeof(buf)));
+
+	mark_slot(pool, slot);
+	return 0;
+}
+
+/* Leases a free slot of the pool. The slots of the seeded candidates,
+ * starting from rnd, are tried first so that a client reconnecting with
+ * its cookie gets the address it had; then the search continues from
+ * where the previous one ended. The bits of rnd outside the slot are
+ * kept (i.e., the interface ID of IPv6 subnets).
+ *
+ * When the pool is probed, a free seeded candidate is taken unless it
+ * responded to a recent ping; it is likely the address the client had.
+ * Otherwise only the addresses of the warm set, which were found not
+ * to respond to ping, are leased. The lease doesn't wait for the
+ * network, so it fails when the warm set is empty.
+ */
+static int take_pool_slot(main_server_st *s, struct proc_st *proc,
+			  struct ip_pool_st *pool, struct ip_lease_st *lease,
+			  struct sockaddr_storage *rnd)
+{
+	struct sockaddr_storage warm;
+	uint8_t *addr;
+	unsigned addr_size, i;
+	uint32_t slot, slots = (uint32_t)1 << pool->bits;
+
+	if (pool->family == AF_INET) {
+		addr = SA_IN_U8_P(rnd);
+		addr_size = sizeof(struct in_addr);
+	} else {
+		addr = SA_IN6_U8_P(rnd);
+		addr_size = sizeof(struct in6_addr);
+	}
+
+	for (i = 0; i < FIXED_IPS; i++) {
+		if (i > 0) {
+			ip_from_seed(addr, addr_size, addr, addr_size);
+			for (slot = 0; slot < pool->prefix; slot++)
+				set_addr_bit(addr, slot, ADDR_BIT(pool->network, slot));
+		}
+
+		slot = addr_to_slot(pool, addr);
+		if (!slot_in_use(pool, slot) &&
+		    try_pool_slot(s, proc, pool, lease, rnd, slot) == 0)
+			goto found;
+	}
+
+	if (pool->probed) {
+		while (take_warm(s, pool, &warm, &slot) == 0) {
+			if (try_pool_slot(s, proc, pool, lease, rnd, slot) == 0)
+				goto found;
+		}
+		mslog(s, proc, LOG_DEBUG, "no address was found free by ping yet");
+		return -1;
+	}
+
+	slot = pool->cursor;
+	for (i = 0; i < MAX_IP_TRIES; i++) {
+		slot = find_free_slot(pool, slot);
+		if (slot == IP_POOL_NO_SLOT)
+			break;
+
+		if (try_pool_slot(s, proc, pool, lease, rnd, slot) == 0) {
+			pool->cursor = (slot + 1) % slots;
+			goto found;
+		}
+		slot = (slot + 1) % slots;
+	}
+
+	return -1;
+
+ found:
+	lease->pool = pool;
+	lease->slot = slot;
+	pool->used++;
+	return 0;
+}
+
 static
 int get_ipv4_lease(main_server_st* s, struct proc_st* proc)
 {
 
 	struct sockaddr_storage tmp, mask, network, rnd;
+	struct ip_pool_st *pool = NULL;
+	uint32_t slot;
 	unsigned i;
 	unsigned max_loops = MAX_IP_TRIES;
-	int ret;
+	int ret, prefix;
 	const char *c_network, *c_netmask;
 	char buf[64];
 
@@ -281,23 +812,60 @@ int get_ipv4_lease(main_server_st* s, struct proc_st* proc)
 	((struct sockaddr_in*)&rnd)->sin_family = AF_INET;
 	((struct sockaddr_in*)&rnd)->sin_port = 0;
 
-	do {
-		if (max_loops == 0) {
-			mslog(s, proc, LOG_ERR, "could not figure out a valid IPv4 IP");
+	prefix = mask_to_prefix(SA_IN_U8_P(&mask), sizeof(struct in_addr));
+	if (prefix >= 0)
+		pool = get_ip_pool(s, AF_INET, SA_IN_U8_P(&network), prefix, 32);
+
+	if (pool && pool->map) {
+		memcpy(SA_IN_U8_P(&rnd), proc->ipv4_seed, 4);
+		for (i=0;i<sizeof(struct in_addr);i++) {
+			SA_IN_U8_P(&rnd)[i] &= ~(SA_IN_U8_P(&mask)[i]);
+			SA_IN_U8_P(&rnd)[i] |= (SA_IN_U8_P(&network)[i]);
+		}
+
+		if (take_pool_slot(s, proc, pool, proc->ipv4, &rnd) < 0) {
+			mslog(s, proc, LOG_ERR, "could not figure out a valid IPv4 IP; %llu of %llu addresses in use",
+			      (unsigned long long)pool->used, (unsigned long long)pool->capacity);
 			ret = ERR_NO_IP;
 			goto fail;
 		}
-		if (max_loops == MAX_IP_TRIES) {
-			memcpy(SA_IN_U8_P(&rnd), proc->ipv4_seed, 4);
+
+		/* LIP = network address + 1 */
+		memcpy(&proc->ipv4->lip, &network, sizeof(struct sockaddr_in));
+		proc->ipv4->lip_len = sizeof(struct sockaddr_in);
+		SA_IN_U8_P(&proc->ipv4->lip)[3] |= 1;
+
+		return 0;
+	}
+
+	do {
+		if (pool && pool->probed && max_loops < MAX_IP_TRIES-FIXED_IPS) {
+			/* past the seeded candidates, only the addresses
+			 * that did not respond to ping */
+			if (take_warm(s, pool, &rnd, &slot) < 0) {
+				mslog(s, proc, LOG_ERR, "could not figure out a valid %s IP; no address was found free by ping yet",
+				      (pool->family == AF_INET) ? "IPv4" : "IPv6");
+				ret = ERR_NO_IP;
+				goto fail;
+			}
 		} else {
-			if (max_loops < MAX_IP_TRIES-FIXED_IPS) {
-				gnutls_rnd(GNUTLS_RND_NONCE, SA_IN_U8_P(&rnd), sizeof(struct in_addr));
+			if (max_loops == 0) {
+				mslog(s, proc, LOG_ERR, "could not figure out a valid IPv4 IP");
+				ret = ERR_NO_IP;
+				goto fail;
+			}
+			if (max_loops == MAX_IP_TRIES) {
+				memcpy(SA_IN_U8_P(&rnd), proc->ipv4_seed, 4);
 			} else {
-				ip_from_seed(SA_IN_U8_P(&rnd), sizeof(struct in_addr),
-					     SA_IN_U8_P(&rnd), sizeof(struct in_addr));
+				if (max_loops < MAX_IP_TRIES-FIXED_IPS) {
+					gnutls_rnd(GNUTLS_RND_NONCE, SA_IN_U8_P(&rnd), sizeof(struct in_addr));
+				} else {
+					ip_from_seed(SA_IN_U8_P(&rnd), sizeof(struct in_addr),
+						     SA_IN_U8_P(&rnd), sizeof(struct in_addr));
+				}
 			}
+			max_loops--;
 		}
-		max_loops--;
 
 		/* Mask the random number with the netmask */
         	for (i=0;i<sizeof(struct in_addr);i++) {
@@ -309,7 +877,8 @@ int get_ipv4_lease(main_server_st* s, struct proc_st* proc)
         		SA_IN_U8_P(&rnd)[i] |= (SA_IN_U8_P(&network)[i]);
 
 		/* check if it exists in the hash table */
-		if (is_ipv4_ok(s, &rnd, &network, &mask) == 0) {
+		if (is_ipv4_ok(s, &rnd, &network, &mask) == 0 ||
+		    (pool && is_busy(pool, &rnd))) {
 			mslog(s, proc, LOG_DEBUG, "cannot assign remote IP %s; it is in use or invalid", 
 			      human_addr((void*)&rnd, sizeof(struct sockaddr_in), buf, sizeof(buf)));
 			continue;
@@ -331,11 +900,15 @@ int get_ipv4_lease(main_server_st* s, struct proc_st* proc)
 
 		mslog(s, proc, LOG_DEBUG, "selected IP: %s",
 		      human_addr((void*)&proc->ipv4->rip, proc->ipv4->rip_len, buf, sizeof(buf)));
-
-       		if (icmp_ping4(s, (void*)&proc->ipv4->rip) == 0)
-       			break;
+		break;
 	} while(1);
 
+	if (pool) {
+		proc->ipv4->pool = pool;
+		proc->ipv4->slot = IP_POOL_NO_SLOT;
+		pool->used++;
+	}
+
 	return 0;
 
 fail:
@@ -350,6 +923,8 @@ int get_ipv6_lease(main_server_st* s, struct proc_st* proc)
 {
 
 	struct sockaddr_storage tmp, mask, network, rnd, subnet_mask;
+	struct ip_pool_st *pool = NULL;
+	uint32_t slot;
 	unsigned i, max_loops = MAX_IP_TRIES;
 	const char* c_network = NULL;
 	unsigned prefix, subnet_prefix ;
@@ -438,28 +1013,62 @@ int get_ipv6_lease(main_server_st* s, struct proc_st* proc)
        	((struct sockaddr_in6*)&tmp)->sin6_family = AF_INET6;
        	((struct sockaddr_in6*)&tmp)->sin6_port = 0;
 
-	do {
-		if (max_loops == 0) {
-			mslog(s, NULL, LOG_ERR, "could not figure out a valid IPv6 IP");
+	if (subnet_prefix > prefix)
+		pool = get_ip_pool(s, AF_INET6, SA_IN6_U8_P(&network), prefix, subnet_prefix);
+
+	if (pool && pool->map) {
+		memset(&rnd, 0, sizeof(rnd));
+	       	((struct sockaddr_in6*)&rnd)->sin6_family = AF_INET6;
+		ip_from_seed(proc->ipv4_seed, 4,
+			     SA_IN6_U8_P(&rnd), sizeof(struct in6_addr));
+		for (i=0;i<sizeof(struct in6_addr);i++) {
+			SA_IN6_U8_P(&rnd)[i] &= ~(SA_IN6_U8_P(&mask)[i]);
+			SA_IN6_U8_P(&rnd)[i] |= (SA_IN6_U8_P(&network)[i]);
+		}
+
+		if (take_pool_slot(s, proc, pool, proc->ipv6, &rnd) < 0) {
+			mslog(s, proc, LOG_ERR, "could not figure out a valid IPv6 IP; %llu of %llu subnets in use",
+			      (unsigned long long)pool->used, (unsigned long long)pool->capacity);
 			ret = ERR_NO_IP;
 			goto fail;
 		}
 
-		memset(&rnd, 0, sizeof(rnd));
-	       	((struct sockaddr_in6*)&rnd)->sin6_family = AF_INET6;
+		goto finish;
+	}
 
-		if (max_loops == MAX_IP_TRIES) {
-			ip_from_seed(proc->ipv4_seed, 4,
-				     SA_IN6_U8_P(&rnd), sizeof(struct in6_addr));
+	do {
+		if (pool && pool->probed && max_loops < MAX_IP_TRIES-FIXED_IPS) {
+			/* past the seeded candidates, only the addresses
+			 * that did not respond to ping */
+			if (take_warm(s, pool, &rnd, &slot) < 0) {
+				mslog(s, proc, LOG_ERR, "could not figure out a valid %s IP; no address was found free by ping yet",
+				      (pool->family == AF_INET) ? "IPv4" : "IPv6");
+				ret = ERR_NO_IP;
+				goto fail;
+			}
 		} else {
-			if (max_loops < MAX_IP_TRIES-FIXED_IPS) {
-				gnutls_rnd(GNUTLS_RND_NONCE, SA_IN_U8_P(&rnd), sizeof(struct in6_addr));
-			} else {
-				ip_from_seed(SA_IN6_U8_P(&rnd), sizeof(struct in6_addr),
+			if (max_loops == 0) {
+				mslog(s, NULL, LOG_ERR, "could not figure out a valid IPv6 IP");
+				ret = ERR_NO_IP;
+				goto fail;
+			}
+
+			memset(&rnd, 0, sizeof(rnd));
+		       	((struct sockaddr_in6*)&rnd)->sin6_family = AF_INET6;
+
+			if (max_loops == MAX_IP_TRIES) {
+				ip_from_seed(proc->ipv4_seed, 4,
 					     SA_IN6_U8_P(&rnd), sizeof(struct in6_addr));
+			} else {
+				if (max_loops < MAX_IP_TRIES-FIXED_IPS) {
+					gnutls_rnd(GNUTLS_RND_NONCE, SA_IN_U8_P(&rnd), sizeof(struct in6_addr));
+				} else {
+					ip_from_seed(SA_IN6_U8_P(&rnd), sizeof(struct in6_addr),
+						     SA_IN6_U8_P(&rnd), sizeof(struct in6_addr));
+				}
 			}
+			max_loops--;
 		}
-		max_loops--;
 
 		/* Mask the random number with the netmask */
        		for (i=0;i<sizeof(struct in6_addr);i++)
@@ -477,7 +1086,8 @@ int get_ipv6_lease(main_server_st* s, struct proc_st* proc)
 		}
 
 		/* check if it exists in the hash table */
-		if (is_ipv6_ok(s, &rnd, &network, &proc->ipv6->sig) == 0) {
+		if (is_ipv6_ok(s, &rnd, &network, &proc->ipv6->sig) == 0 ||
+		    (pool && is_busy(pool, &rnd))) {
 			mslog(s, proc, LOG_DEBUG, "cannot assign local IP %s; it is in use or invalid", 
 			      human_addr((void*)&rnd, sizeof(struct sockaddr_in6), buf, sizeof(buf)));
 			continue;
@@ -488,11 +1098,15 @@ int get_ipv6_lease(main_server_st* s, struct proc_st* proc)
 
 		mslog(s, proc, LOG_DEBUG, "selected IP: %s",
 		      human_addr((void*)&proc->ipv6->rip, proc->ipv6->rip_len, buf, sizeof(buf)));
-
-        	if (proc->ipv6->prefix != 128 || icmp_ping6(s, (void*)&proc->ipv6->rip) == 0)
-        		break;
+		break;
         } while(1);
 
+	if (pool) {
+		proc->ipv6->pool = pool;
+		proc->ipv6->slot = IP_POOL_NO_SLOT;
+		pool->used++;
+	}
+
  finish:
 	/* LIP = network address + 1 */
 	memcpy(&proc->ipv6->lip, &network, sizeof(struct sockaddr_in6));
@@ -517,6 +1131,7 @@ int unref_ip_lease(struct ip_lease_st *lease)
 	if (lease->db) {
 		htable_del(&lease->db->ht, rehash(lease, NULL), lease);
 	}
+	put_ip_pool_lease(lease);
 
 	return 0;
 }
@@ -534,6 +1149,7 @@ char buf[128];
 		if (proc->ipv4 && proc->ipv4->db) {
 			if (htable_add(&s->ip_leases.ht, rehash(proc->ipv4, NULL), proc->ipv4) == 0) {
 				mslog(s, proc, LOG_ERR, "could not add IPv4 lease to hash table");
+				put_ip_pool_lease(proc->ipv4);
 				return -1;
 			}
 			talloc_set_destructor(proc->ipv4, unref_ip_lease);
@@ -548,6 +1164,7 @@ char buf[128];
 		if (proc->ipv6 && proc->ipv6->db) {
 			if (htable_add(&s->ip_leases.ht, rehash(proc->ipv6, NULL), proc->ipv6) == 0) {
 				mslog(s, proc, LOG_ERR, "could not add IPv6 lease to hash table");
+				put_ip_pool_lease(proc->ipv6);
 				return -1;
 			}
 			talloc_set_destructor(proc->ipv6, unref_ip_lease);
@@ -587,3 +1204,88 @@ void remove_ip_lease(main_server_st* s, struct ip_lease_st * lease)
 {
 	talloc_free(lease);
 }
+
+/* The leases taken from the pools of the given family, and the number
+ * of addresses (or subnets) in those pools; the latter is UINT64_MAX if
+ * it is too large to count. */
+void ip_lease_pool_stats(struct ip_lease_db_st* db, int family,
+			 uint64_t *used, uint64_t *capacity)
+{
+	struct ip_pool_st *pool;
+
+	*used = 0;
+	*capacity = 0;
+
+	list_for_each(&db->pools, pool, list) {
+		if (pool->family != family)
+			continue;
+
+		*used += pool->used;
+		if (pool->capacity > UINT64_MAX - *capacity)
+			*capacity = UINT64_MAX;
+		else
+			*capacity += pool->capacity;
+	}
+}
+
+/* Called on startup and after a reload. It creates the pools of the
+ * virtual hosts' networks, so that their addresses are probed before
+ * the first lease, and drops the empty pools of the networks which are
+ * no longer configured.
+ */
+void ip_lease_pools_reload(main_server_st *s)
+{
+	struct ip_pool_st *pool, *tmp;
+	struct vhost_cfg_st *vhost;
+	struct cfg_st *config;
+	uint8_t network[16], mask[4];
+	unsigned pos;
+	int prefix;
+
+	list_for_each(&s->ip_leases.pools, pool, list)
+		pool->configured = 0;
+
+	list_for_each(s->vconfig, vhost, list) {
+		config = vhost->perm_config.config;
+
+		if (config->network.ipv4 && config->network.ipv4_netmask &&
+		    inet_pton(AF_INET, config->network.ipv4, network) == 1 &&
+		    inet_pton(AF_INET, config->network.ipv4_netmask, mask) == 1 &&
+		    (prefix = mask_to_prefix(mask, sizeof(mask))) >= 0) {
+			for (pos = 0; pos < sizeof(mask); pos++)
+				network[pos] &= mask[pos];
+
+			pool = get_ip_pool(s, AF_INET, network, prefix, 32);
+			if (pool)
+				pool->configured = 1;
+		}
+
+		if (config->network.ipv6 && config->network.ipv6_prefix > 0 &&
+		    config->network.ipv6_subnet_prefix > config->network.ipv6_prefix &&
+		    config->network.ipv6_subnet_prefix <= 128 &&
+		    inet_pton(AF_INET6, config->network.ipv6, network) == 1) {
+			for (pos = config->network.ipv6_prefix; pos < 128; pos++)
+				set_addr_bit(network, pos, 0);
+
+			pool = get_ip_pool(s, AF_INET6, network, config->network.ipv6_prefix,
+					   config->network.ipv6_subnet_prefix);
+			if (pool)
+				pool->configured = 1;
+		}
+	}
+
+	list_for_each_safe(&s->ip_leases.pools, pool, tmp, list) {
+		if (pool->used == 0 && !pool->configured) {
+			icmp_prober_forget_pool(pool);
+			list_del(&pool->list);
+			talloc_free(pool);
+			continue;
+		}
+
+		pool->probed = pool_is_probed(s, pool);
+		if (!pool->probed) {
+			pool->warm_size = 0;
+			pool->busy_size = 0;
+		}
+	}
+}
@@ -41,6 +41,71 @@ struct ip_lease_st {
         unsigned prefix; /* in ipv6 */
 
         struct ip_lease_db_st* db;
+
+        /* the pool the lease was taken from, if any, and its slot */
+        struct ip_pool_st *pool;
+        uint32_t slot;
+};
+
+/* Pools with up to 2^IP_POOL_MAX_BITS slots keep a bitmap of them */
+#define IP_POOL_MAX_BITS 20
+#define IP_POOL_NO_SLOT ((uint32_t)-1)
+
+/* When ping-leases is set, the addresses of each pool that were found
+ * free in advance, and those that responded. The prober keeps between
+ * IP_POOL_WARM_MIN and IP_POOL_WARM_SLOTS free addresses, depending on
+ * the rate of the leases. */
+#define IP_POOL_WARM_MIN 8
+#define IP_POOL_WARM_SLOTS 128
+#define IP_POOL_BUSY_SLOTS 16
+/* and for how long (in seconds) the result of a ping is valid */
+#define IP_POOL_WARM_TIME 30
+
+struct ip_pool_probed_st {
+        struct sockaddr_storage addr;
+        uint32_t slot; /* IP_POOL_NO_SLOT in pools without a bitmap */
+        time_t verified;
+};
+
+/* The addresses of an IPv4 network, or the subnets of an IPv6 network,
+ * that leases are taken from. Each slot is an address (or subnet), and
+ * those in use are marked in a bitmap; a second bitmap marks the words
+ * of the first which are full, so that a free slot is found without
+ * probing even when the pool is almost exhausted. Larger pools are
+ * only counted, and their leases are picked at random.
+ */
+struct ip_pool_st {
+        struct list_node list;
+
+        int family;
+        uint8_t network[16];
+        unsigned prefix; /* of the network */
+        unsigned slot_prefix; /* 32 for IPv4, the subnet prefix for IPv6 */
+        unsigned bits; /* slot_prefix - prefix */
+
+        uint64_t capacity; /* slots that can be leased */
+        uint64_t used;
+
+        uint64_t *map; /* a bit per slot, set if in use or reserved */
+        uint64_t *full; /* a bit per word of map, set if it is all ones */
+        uint32_t words; /* of map */
+        uint32_t cursor; /* where the next search starts */
+
+        unsigned configured; /* the network of a virtual host; kept when empty */
+
+        /* non-zero if the addresses are pinged prior to leasing; they
+         * are probed in the background (see icmp-ping.c), and those
+         * found free are leased from the warm set */
+        unsigned probed;
+        struct ip_pool_probed_st warm[IP_POOL_WARM_SLOTS];
+        unsigned warm_size;
+        unsigned warm_taken; /* leased from the warm set since the last probe */
+        unsigned warm_missed; /* not leased, as it was empty */
+        unsigned warm_rate; /* see ip_pool_warm_target() */
+        struct ip_pool_probed_st busy[IP_POOL_BUSY_SLOTS];
+        unsigned busy_size;
+        unsigned probing; /* echo requests in flight */
+        uint32_t probe_cursor;
 };
 
 void ip_lease_deinit(struct ip_lease_db_st* db);
@@ -52,4 +117,17 @@ int get_ip_leases(struct main_server_st* s, struct proc_st* proc);
 void remove_ip_leases(struct main_server_st* s, struct proc_st* proc);
 void remove_ip_lease(main_server_st* s, struct ip_lease_st * lease);
 
+void ip_lease_pools_reload(struct main_server_st* s);
+int ip_pool_probe_candidate(struct main_server_st* s, struct ip_pool_st *pool,
+			    struct sockaddr_storage *addr, uint32_t *slot);
+void ip_pool_warm_add(struct ip_pool_st *pool, const struct sockaddr_storage *addr,
+		      uint32_t slot, time_t now);
+void ip_pool_busy_add(struct ip_pool_st *pool, const struct sockaddr_storage *addr,
+		      uint32_t slot, time_t now);
+void ip_pool_warm_expire(struct main_server_st* s, struct ip_pool_st *pool, time_t now);
+unsigned ip_pool_warm_target(struct ip_pool_st *pool, unsigned interval, unsigned timeout);
+
+void ip_lease_pool_stats(struct ip_lease_db_st* db, int family,
+			 uint64_t *used, uint64_t *capacity);
+
 #endif
@@ -167,11 +167,43 @@ int handle_auth_cookie_req(main_server_st* s, struct proc_st* proc,
  			   const AuthCookieRequestMsg * req)
 {
 int ret;
-struct proc_st *old_proc;
+uint8_t sid[SID_SIZE];
 
-	if (req->cookie.data == NULL || req->cookie.len != sizeof(proc->sid))
+	if (req->cookie.data == NULL)
 		return -1;
 
+	if (IS_SEALED_COOKIE(req->cookie.len)) {
+		SealedCookieMsg *cmsg;
+		void *lpool;
+
+		if (s->cookie_key_set == 0)
+			return -1;
+
+		lpool = talloc_new(proc);
+		if (lpool == NULL)
+			return -1;
+
+		/* reject the invalid or expired cookies without
+		 * involving sec-mod */
+		cmsg = sealed_cookie_open(lpool, s->cookie_key, req->cookie.data, req->cookie.len);
+		if (cmsg == NULL || cmsg->sid.len != sizeof(sid)) {
+			mslog(s, proc, LOG_INFO, "received invalid cookie");
+			talloc_free(lpool);
+			return -1;
+		}
+
+		if (cmsg->expires <= (uint64_t)time(0)) {
+			mslog(s, proc, LOG_INFO, "received expired cookie of user '%s'", cmsg->username);
+			talloc_free(lpool);
+			return -1;
+		}
+
+		memcpy(sid, cmsg->sid.data, sizeof(sid));
+		talloc_free(lpool);
+	} else {
+		memcpy(sid, req->cookie.data, sizeof(sid));
+	}
+
 	/* generate a new DTLS session ID for each connection, to allow
 	 * openconnect of distinguishing when the DTLS key has switched. */
 	ret = gnutls_rnd(GNUTLS_RND_NONCE, proc->dtls_session_id, sizeof(proc->dtls_session_id));
@@ -179,20 +211,35 @@ struct proc_st *old_proc;
 		return -1;
 	proc->dtls_session_id_size = sizeof(proc->dtls_session_id);
 
-	/* loads sup config and basic proc info (e.g., username) */
-	ret = session_open(s, proc, req->cookie.data, req->cookie.len);
+	/* loads sup config and basic proc info (e.g., username); we
+	 * continue in handle_auth_cookie_rep() once sec-mod replies */
+	ret = session_open(s, proc, sid, req->cookie.data, req->cookie.len);
 	if (ret < 0) {
 		mslog(s, proc, LOG_INFO, "could not open session");
 		return -1;
 	}
 
+	return ERR_WAIT_FOR_SECMOD;
+}
+
+/* Completes handle_auth_cookie_req() with the result of the session open */
+int handle_auth_cookie_rep(main_server_st* s, struct proc_st* proc,
+			   const uint8_t sid[SID_SIZE], int result)
+{
+struct proc_st *old_proc;
+
+	if (result < 0) {
+		mslog(s, proc, LOG_INFO, "could not open session");
+		return -1;
+	}
+
 	/* Put into right cgroup */
         if (proc->config->cgroup != NULL) {
         	put_into_cgroup(s, proc->config->cgroup, proc->pid);
 	}
 
 	/* check for a user with the same sid as in the cookie */
-	old_proc = proc_search_sid(s, req->cookie.data);
+	old_proc = proc_search_sid(s, sid);
 	if (old_proc != NULL) {
 		mslog(s, old_proc, LOG_INFO, "disconnecting previous user session due to session re-use");
 
@@ -214,7 +261,7 @@ struct proc_st *old_proc;
 	}
 
 	/* update the SID */
-	memcpy(proc->sid, req->cookie.data, req->cookie.len);
+	memcpy(proc->sid, sid, sizeof(proc->sid));
 	/* this also hints to call session_close() */
 	proc->active_sid = 1;
 
@@ -0,0 +1,309 @@
+/*
+ * Copyright (C) 2026 Nikos Mavrogiannopoulos
+ *
+ * Author: Nikos Mavrogiannopoulos
+ *
+ * This file is part of ocserv.
+ *
+ * ocserv is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <main-ban-filter.h>
+
+#ifdef ENABLE_BAN_FILTER
+#include <stddef.h>
+#include <sys/syscall.h>
+#include <linux/bpf.h>
+#include <linux/filter.h>
+#include <linux/if_ether.h>
+
+/* The banned addresses and networks, and those of ban-deny, are copied
+ * to a longest-prefix-match map per address family. An eBPF socket
+ * filter attached to the TCP and UDP listeners looks up the source
+ * address of each packet, and drops those that match a banned prefix.
+ * That way a banned client is dropped by the kernel, prior to a TCP
+ * handshake or a wakeup of main. The networks of ban-allow are kept as
+ * prefixes that pass, so that the longest one applies as in main.
+ * The filter is not attached to TCP listeners with listen-proxy-proto,
+ * as the source address is that of the proxy, and it is detached from
+ * the accepted connections.
+ */
+
+#define INSN(c, d, s, o, i) \
+	((struct bpf_insn) { .code = (c), .dst_reg = (d), .src_reg = (s), .off = (o), .imm = (i) })
+#define MOV64_REG(d, s) INSN(BPF_ALU64|BPF_MOV|BPF_X, d, s, 0, 0)
+#define MOV64_IMM(d, i) INSN(BPF_ALU64|BPF_MOV|BPF_K, d, 0, 0, i)
+#define ADD64_IMM(d, i) INSN(BPF_ALU64|BPF_ADD|BPF_K, d, 0, 0, i)
+#define TO_BE32(d) INSN(BPF_ALU|BPF_END|BPF_TO_BE, d, 0, 0, 32)
+#define LD_ABS32(o) INSN(BPF_LD|BPF_ABS|BPF_W, 0, 0, 0, o)
+#define LDX_MEM(sz, d, s, o) INSN(BPF_LDX|BPF_MEM|sz, d, s, o, 0)
+#define STX_MEM(sz, d, s, o) INSN(BPF_STX|BPF_MEM|sz, d, s, o, 0)
+#define ST_MEM(sz, d, o, i) INSN(BPF_ST|BPF_MEM|sz, d, 0, o, i)
+#define JEQ_IMM(d, i, o) INSN(BPF_JMP|BPF_JEQ|BPF_K, d, 0, o, i)
+#define JA(o) INSN(BPF_JMP|BPF_JA, 0, 0, o, 0)
+#define CALL(f) INSN(BPF_JMP|BPF_CALL, 0, 0, 0, f)
+#define EXIT() INSN(BPF_JMP|BPF_EXIT, 0, 0, 0, 0)
+#define LD_MAP_FD(d, fd) \
+	INSN(BPF_LD|BPF_DW|BPF_IMM, d, BPF_PSEUDO_MAP_FD, 0, fd), INSN(0, 0, 0, 0, 0)
+
+/* the key of the maps; data holds the prefix in network order */
+struct filter_key_st {
+	uint32_t prefixlen;
+	uint8_t data[16];
+};
+
+#define KEY_SIZE(size) (offsetof(struct filter_key_st, data) + (size))
+
+/* the stack layout of the program */
+#define FP_KEY (-(int)sizeof(struct filter_key_st))
+#define FP_DATA (FP_KEY+(int)offsetof(struct filter_key_st, data))
+
+/* the instructions the checks jump to */
+#define PASS 4
+#define IPV6 15
+#define LOOKUP 32
+#define J(to, pc) ((to)-(pc)-1)
+
+static int map4_fd = -1;
+static int map6_fd = -1;
+static int prog_fd = -1;
+
+static int sys_bpf(int cmd, union bpf_attr *attr)
+{
+	return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+static int filter_map_create(unsigned size)
+{
+	union bpf_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_type = BPF_MAP_TYPE_LPM_TRIE;
+	attr.key_size = KEY_SIZE(size);
+	attr.value_size = sizeof(uint32_t);
+	attr.max_entries = BAN_FILTER_MAX_ENTRIES;
+	attr.map_flags = BPF_F_NO_PREALLOC;
+
+	return sys_bpf(BPF_MAP_CREATE, &attr);
+}
+
+/* Drops the packets whose source address matches a prefix with a
+ * non-zero verdict; the longest prefix applies. Anything else, including
+ * packets of other protocols, passes. */
+static int filter_prog_load(int fd4, int fd6)
+{
+	struct bpf_insn prog[] = {
+		/* 0 */ MOV64_REG(BPF_REG_6, BPF_REG_1),
+		LDX_MEM(BPF_W, BPF_REG_7, BPF_REG_6, offsetof(struct __sk_buff, protocol)),
+		JEQ_IMM(BPF_REG_7, htons(ETH_P_IP), J(6, 2)),
+		JEQ_IMM(BPF_REG_7, htons(ETH_P_IPV6), J(IPV6, 3)),
+		/* 4: PASS */ MOV64_IMM(BPF_REG_0, -1),
+		EXIT(),
+		/* 6: the IPv4 source address */
+		LD_ABS32(SKF_NET_OFF+12),
+		TO_BE32(BPF_REG_0),
+		STX_MEM(BPF_W, BPF_REG_10, BPF_REG_0, FP_DATA),
+		ST_MEM(BPF_W, BPF_REG_10, FP_KEY, 32),
+		/* 10 */ LD_MAP_FD(BPF_REG_1, fd4),
+		/* 12 */ MOV64_REG(BPF_REG_2, BPF_REG_10),
+		ADD64_IMM(BPF_REG_2, FP_KEY),
+		JA(J(LOOKUP, 14)),
+		/* 15: IPV6, the IPv6 source address */
+		LD_ABS32(SKF_NET_OFF+8),
+		TO_BE32(BPF_REG_0),
+		STX_MEM(BPF_W, BPF_REG_10, BPF_REG_0, FP_DATA),
+		LD_ABS32(SKF_NET_OFF+12),
+		TO_BE32(BPF_REG_0),
+		/* 20 */ STX_MEM(BPF_W, BPF_REG_10, BPF_REG_0, FP_DATA+4),
+		LD_ABS32(SKF_NET_OFF+16),
+		TO_BE32(BPF_REG_0),
+		STX_MEM(BPF_W, BPF_REG_10, BPF_REG_0, FP_DATA+8),
+		LD_ABS32(SKF_NET_OFF+20),
+		/* 25 */ TO_BE32(BPF_REG_0),
+		STX_MEM(BPF_W, BPF_REG_10, BPF_REG_0, FP_DATA+12),
+		ST_MEM(BPF_W, BPF_REG_10, FP_KEY, 128),
+		/* 28 */ LD_MAP_FD(BPF_REG_1, fd6),
+		/* 30 */ MOV64_REG(BPF_REG_2, BPF_REG_10),
+		ADD64_IMM(BPF_REG_2, FP_KEY),
+		/* 32: LOOKUP */ CALL(BPF_FUNC_map_lookup_elem),
+		JEQ_IMM(BPF_REG_0, 0, J(PASS, 33)),
+		LDX_MEM(BPF_W, BPF_REG_0, BPF_REG_0, 0),
+		/* 35 */ JEQ_IMM(BPF_REG_0, BAN_FILTER_PASS, J(PASS, 35)),
+		MOV64_IMM(BPF_REG_0, 0),
+		EXIT(),
+	};
+	union bpf_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.prog_type = BPF_PROG_TYPE_SOCKET_FILTER;
+	attr.insns = (uintptr_t)prog;
+	attr.insn_cnt = sizeof(prog)/sizeof(prog[0]);
+	attr.license = (uintptr_t)"GPL";
+
+	return sys_bpf(BPF_PROG_LOAD, &attr);
+}
+
+static unsigned filter_applies(main_server_st *s, struct listener_st *l)
+{
+	if (l->fd == -1 || (l->family != AF_INET && l->family != AF_INET6))
+		return 0;
+
+	if (l->sock_type == SOCK_TYPE_UDP)
+		return 1;
+	return l->sock_type == SOCK_TYPE_TCP && !GETCONFIG(s)->listen_proxy_proto;
+}
+
+/* Sets up the filter and attaches it to the listeners, or detaches it
+ * when ban-filter is no longer set; called on startup and after a
+ * reload. On failure, the bans are checked by main only. */
+void ban_filter_setup(main_server_st *s)
+{
+	struct listener_st *l;
+	int e;
+
+	if (GETCONFIG(s)->ban_filter == 0) {
+		if (prog_fd == -1)
+			return;
+
+		list_for_each(&s->listen_list.head, l, list) {
+			if (filter_applies(s, l))
+				setsockopt(l->fd, SOL_SOCKET, SO_DETACH_BPF, &prog_fd, sizeof(prog_fd));
+		}
+		ban_filter_deinit(s);
+		return;
+	}
+
+	if (prog_fd == -1) {
+		map4_fd = filter_map_create(4);
+		if (map4_fd == -1)
+			goto fail;
+
+		map6_fd = filter_map_create(16);
+		if (map6_fd == -1)
+			goto fail;
+
+		prog_fd = filter_prog_load(map4_fd, map6_fd);
+		if (prog_fd == -1)
+			goto fail;
+	}
+
+	list_for_each(&s->listen_list.head, l, list) {
+		if (!filter_applies(s, l))
+			continue;
+
+		if (setsockopt(l->fd, SOL_SOCKET, SO_ATTACH_BPF,
+			       &prog_fd, sizeof(prog_fd)) < 0) {
+			e = errno;
+			mslog(s, NULL, LOG_WARNING, "could not attach the ban filter: %s", strerror(e));
+		}
+	}
+	return;
+
+ fail:
+	e = errno;
+	mslog(s, NULL, LOG_WARNING, "could not set up the ban filter: %s", strerror(e));
+	ban_filter_deinit(s);
+}
+
+/* Closes the maps and the program; also called in the forked
+ * processes. The listeners keep the program while they are open. */
+void ban_filter_deinit(main_server_st *s)
+{
+	if (prog_fd != -1)
+		close(prog_fd);
+	if (map6_fd != -1)
+		close(map6_fd);
+	if (map4_fd != -1)
+		close(map4_fd);
+	prog_fd = map4_fd = map6_fd = -1;
+}
+
+/* The sockets accepted from a TCP listener inherit its filter; it is
+ * removed from them, as a client banned after connecting is handled
+ * by main, and the filter would otherwise drop its data without a
+ * notice to either side. */
+void ban_filter_detach(int fd)
+{
+	if (prog_fd == -1)
+		return;
+
+	setsockopt(fd, SOL_SOCKET, SO_DETACH_BPF, &prog_fd, sizeof(prog_fd));
+}
+
+unsigned ban_filter_enabled(void)
+{
+	return prog_fd != -1;
+}
+
+static void fill_key(struct filter_key_st *key, const uint8_t *ip, unsigned size,
+		     unsigned prefix)
+{
+	memset(key, 0, sizeof(*key));
+	key->prefixlen = prefix;
+	memcpy(key->data, ip, size);
+}
+
+void ban_filter_set(main_server_st *s, const uint8_t *ip, unsigned size,
+		    unsigned prefix, unsigned verdict)
+{
+	struct filter_key_st key;
+	union bpf_attr attr;
+	uint32_t value = verdict;
+	int e;
+
+	if (prog_fd == -1)
+		return;
+
+	fill_key(&key, ip, size, prefix);
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = (size == 4) ? map4_fd : map6_fd;
+	attr.key = (uintptr_t)&key;
+	attr.value = (uintptr_t)&value;
+	attr.flags = BPF_ANY;
+
+	if (sys_bpf(BPF_MAP_UPDATE_ELEM, &attr) < 0) {
+		e = errno;
+		mslog(s, NULL, LOG_DEBUG, "could not add to the ban filter: %s", strerror(e));
+	}
+}
+
+void ban_filter_del(const uint8_t *ip, unsigned size, unsigned prefix)
+{
+	struct filter_key_st key;
+	union bpf_attr attr;
+
+	if (prog_fd == -1)
+		return;
+
+	fill_key(&key, ip, size, prefix);
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = (size == 4) ? map4_fd : map6_fd;
+	attr.key = (uintptr_t)&key;
+
+	/* it may not be there */
+	sys_bpf(BPF_MAP_DELETE_ELEM, &attr);
+}
+#endif
@@ -0,0 +1,56 @@
+/*
+ * Copyright (C) 2026 Nikos Mavrogiannopoulos
+ *
+ * Author: Nikos Mavrogiannopoulos
+ *
+ * This file is part of ocserv.
+ *
+ * ocserv is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#ifndef MAIN_BAN_FILTER_H
+# define MAIN_BAN_FILTER_H
+
+#include <sys/socket.h>
+
+#if defined(__linux__) && defined(HAVE_LINUX_BPF_H) && defined(SO_ATTACH_BPF)
+# define ENABLE_BAN_FILTER 1
+#endif
+
+#ifdef ENABLE_BAN_FILTER
+# include "main.h"
+
+/* The prefixes the filter can hold per address family; the rest are
+ * only checked by main. */
+# define BAN_FILTER_MAX_ENTRIES 65536
+
+# define BAN_FILTER_PASS 0
+# define BAN_FILTER_DROP 1
+
+void ban_filter_setup(main_server_st *s);
+void ban_filter_deinit(main_server_st *s);
+unsigned ban_filter_enabled(void);
+void ban_filter_set(main_server_st *s, const uint8_t *ip, unsigned size,
+		    unsigned prefix, unsigned verdict);
+void ban_filter_del(const uint8_t *ip, unsigned size, unsigned prefix);
+void ban_filter_detach(int fd);
+#else
+# define ban_filter_setup(s)
+# define ban_filter_deinit(s)
+# define ban_filter_enabled() 0
+# define ban_filter_set(s, ip, size, prefix, verdict)
+# define ban_filter_del(ip, size, prefix)
+# define ban_filter_detach(fd)
+#endif
+
+#endif
@@ -40,39 +40,454 @@
 #include <tlslib.h>
 #include <main.h>
 #include <main-ban.h>
+#include <main-ban-filter.h>
 #include <arpa/inet.h>
-#include <ccan/hash/hash.h>
-#include <ccan/htable/htable.h>
 
-static size_t rehash(const void *_e, void *unused)
+/* The entries are kept in a prefix trie per address family, which is
+ * walked along the bits of an address to find the entries and the rules
+ * of all the prefixes covering it. An entry is kept for each address, or
+ * each /64 in IPv6; when ban-aggregate-threshold of those in the same
+ * /24 (or /48 in IPv6) are banned, the whole network is banned by an
+ * entry of its own. The entries are expired by a timer wheel, so that
+ * the maintenance only touches the entries that are due.
+ */
+#define FAMILY_IDX(size) (((size) == 4) ? 0 : 1)
+
+/* bit pos of an address, counting from the most significant */
+#define ADDR_BIT(a, pos) (((a)[(pos)/8] >> (7 - (pos)%8)) & 1)
+
+#define IS_BANNED(main, entry) (entry->score >= GETCONFIG(main)->max_ban_score)
+
+/* Returns the first bit from start on, up to end, that a and b differ in,
+ * or end if there is none. */
+static unsigned diff_bit(const uint8_t *a, const uint8_t *b, unsigned start, unsigned end)
 {
-	ban_entry_st *e = (void*)_e;
-	return hash_any(e->ip.ip, e->ip.size, 0);
+	unsigned i = start;
+
+	while (i < end) {
+		if (i % 8 == 0 && i + 8 <= end && a[i/8] == b[i/8]) {
+			i += 8;
+			continue;
+		}
+		if (ADDR_BIT(a, i) != ADDR_BIT(b, i))
+			break;
+		i++;
+	}
+	return i;
 }
 
-/* The first argument is the entry from the hash, and
- * the second is the entry from check_if_banned().
- */
-static bool ban_entry_cmp(const void *_c1, void *_c2)
+static void mask_bits(uint8_t *key, unsigned plen)
 {
-	const struct ban_entry_st *c1 = _c1;
-	struct ban_entry_st *c2 = _c2;
+	unsigned i;
 
-	if (c1->ip.size == c2->ip.size && memcmp(c1->ip.ip, c2->ip.ip, c1->ip.size) == 0)
-		return 1;
-	return 0;
+	for (i = plen; i < 128; i++)
+		key[i/8] &= ~(0x80 >> (i%8));
+}
+
+static ban_node_st *new_node(ban_db_st *db, const uint8_t *key, unsigned plen)
+{
+	ban_node_st *n;
+
+	n = talloc_zero(db, ban_node_st);
+	if (n == NULL)
+		return NULL;
+
+	memcpy(n->key, key, sizeof(n->key));
+	mask_bits(n->key, plen);
+	n->plen = plen;
+	return n;
+}
+
+/* Returns the node of the prefix, adding it if it doesn't exist. The
+ * key must be 16 bytes long. */
+static ban_node_st *trie_get(ban_db_st *db, ban_node_st **slot,
+			     const uint8_t *key, unsigned plen)
+{
+	ban_node_st *n, *nn, *split;
+	unsigned common, start = 0;
+
+	while ((n = *slot) != NULL) {
+		common = diff_bit(n->key, key, start, (n->plen < plen) ? n->plen : plen);
+		if (common == n->plen) {
+			if (n->plen == plen)
+				return n;
+			start = n->plen;
+			slot = &n->child[ADDR_BIT(key, n->plen)];
+			continue;
+		}
+
+		nn = new_node(db, key, plen);
+		if (nn == NULL)
+			return NULL;
+
+		if (common == plen) {
+			/* the prefix covers the node */
+			nn->child[ADDR_BIT(n->key, plen)] = n;
+			*slot = nn;
+		} else {
+			/* they diverge after common bits */
+			split = new_node(db, key, common);
+			if (split == NULL) {
+				talloc_free(nn);
+				return NULL;
+			}
+			split->child[ADDR_BIT(n->key, common)] = n;
+			split->child[ADDR_BIT(key, common)] = nn;
+			*slot = split;
+		}
+		return nn;
+	}
+
+	nn = new_node(db, key, plen);
+	*slot = nn;
+	return nn;
+}
+
+static ban_node_st *trie_find(ban_node_st *n, const uint8_t *key, unsigned plen)
+{
+	unsigned start = 0;
+
+	while (n != NULL && n->plen <= plen &&
+	       diff_bit(n->key, key, start, n->plen) == n->plen) {
+		if (n->plen == plen)
+			return n;
+		start = n->plen;
+		n = n->child[ADDR_BIT(key, n->plen)];
+	}
+	return NULL;
+}
+
+/* Returns the topmost node within the prefix */
+static ban_node_st *trie_cover(ban_node_st *n, const uint8_t *key, unsigned plen)
+{
+	unsigned start = 0;
+
+	while (n != NULL) {
+		if (n->plen >= plen)
+			return (diff_bit(n->key, key, start, plen) == plen) ? n : NULL;
+		if (diff_bit(n->key, key, start, n->plen) != n->plen)
+			return NULL;
+		start = n->plen;
+		n = n->child[ADDR_BIT(key, n->plen)];
+	}
+	return NULL;
+}
+
+/* Removes the nodes on the path to the prefix which no longer hold an
+ * entry or a rule, and are not needed to join two others. */
+static void trie_prune(ban_node_st **slot, const uint8_t *key, unsigned plen)
+{
+	ban_node_st *n = *slot;
+
+	if (n == NULL || n->plen > plen || diff_bit(n->key, key, 0, n->plen) != n->plen)
+		return;
+
+	if (n->plen < plen)
+		trie_prune(&n->child[ADDR_BIT(key, n->plen)], key, plen);
+
+	if (n->entry == NULL && n->rule == 0 &&
+	    (n->child[0] == NULL || n->child[1] == NULL)) {
+		*slot = (n->child[0] != NULL) ? n->child[0] : n->child[1];
+		talloc_free(n);
+	}
+}
+
+/* The addresses of the prefix which are counted as banned, up to limit */
+static unsigned count_banned(const ban_node_st *n, unsigned host_plen, unsigned limit)
+{
+	unsigned count = 0;
+
+	if (n == NULL)
+		return 0;
+
+	if (n->entry && n->entry->counted && n->entry->prefix == host_plen)
+		count++;
+	if (count < limit)
+		count += count_banned(n->child[0], host_plen, limit - count);
+	if (count < limit)
+		count += count_banned(n->child[1], host_plen, limit - count);
+	return count;
+}
+
+/* Adds the entry to the slot of the wheel for its due time. Entries due
+ * now or earlier are put to the next second, and those due past the last
+ * level to its furthest slot, from which they are put back when it is
+ * reached. */
+static void wheel_add(ban_db_st *db, ban_entry_st *e)
+{
+	time_t t = e->due, delta;
+	unsigned level;
+
+	if (t <= db->wheel_time)
+		t = db->wheel_time + 1;
+
+	delta = t - db->wheel_time;
+	for (level = 0; level < BAN_WHEEL_LEVELS - 1; level++) {
+		if (delta < (time_t)1 << (BAN_WHEEL_BITS * (level + 1)))
+			break;
+	}
+
+	if (delta >= (time_t)1 << (BAN_WHEEL_BITS * BAN_WHEEL_LEVELS))
+		t = db->wheel_time + ((time_t)1 << (BAN_WHEEL_BITS * BAN_WHEEL_LEVELS)) - 1;
+
+	list_add_tail(&db->wheel[level][(t >> (BAN_WHEEL_BITS * level)) & (BAN_WHEEL_SIZE - 1)],
+		      &e->wheel_list);
+}
+
+static void wheel_take(struct list_head *slot, struct list_head *to)
+{
+	ban_entry_st *e;
+
+	list_head_init(to);
+	while ((e = list_top(slot, ban_entry_st, wheel_list)) != NULL) {
+		list_del(&e->wheel_list);
+		list_add_tail(to, &e->wheel_list);
+	}
+}
+
+/* The next event of an entry: the end of its ban, if it is counted as
+ * banned, or else the time it can be forgotten. */
+static time_t entry_due(main_server_st *s, const ban_entry_st *e)
+{
+	time_t forget = e->last_reset + GETCONFIG(s)->ban_reset_time + 1;
+
+	if (e->counted)
+		return e->expires;
+	return (e->expires > forget) ? e->expires : forget;
+}
+
+/* The rule of the longest network above the prefix */
+static unsigned covering_rule(ban_node_st *n, const uint8_t *key, unsigned plen)
+{
+	unsigned rule = 0, start = 0;
+
+	while (n != NULL && n->plen < plen &&
+	       diff_bit(n->key, key, start, n->plen) == n->plen) {
+		if (n->rule)
+			rule = n->rule;
+		start = n->plen;
+		n = n->child[ADDR_BIT(key, n->plen)];
+	}
+	return rule;
+}
+
+/* Copies the verdict of a node to the kernel filter, given the rule of
+ * the longest network above it. Entries under ban-allow are not banned
+ * by main, and are left to the allowed network. */
+static void filter_sync(main_server_st *s, const ban_node_st *n, unsigned size,
+			unsigned rule)
+{
+	if (n->rule)
+		ban_filter_set(s, n->key, size, n->plen,
+			       (n->rule == BAN_RULE_DENY) ? BAN_FILTER_DROP : BAN_FILTER_PASS);
+	else if (n->entry && n->entry->counted && rule != BAN_RULE_ALLOW)
+		ban_filter_set(s, n->key, size, n->plen, BAN_FILTER_DROP);
+	else
+		ban_filter_del(n->key, size, n->plen);
+}
+
+static void filter_sync_entry(main_server_st *s, const ban_entry_st *e)
+{
+	ban_node_st *root = s->ban_db->root[FAMILY_IDX(e->ip.size)];
+	ban_node_st *n;
+
+	if (!ban_filter_enabled())
+		return;
+
+	n = trie_find(root, e->ip.ip, e->prefix);
+	if (n != NULL)
+		filter_sync(s, n, e->ip.size, covering_rule(root, e->ip.ip, e->prefix));
+}
+
+static void filter_sync_all(main_server_st *s, const ban_node_st *n, unsigned size,
+			    unsigned rule)
+{
+	if (n == NULL)
+		return;
+
+	filter_sync(s, n, size, rule);
+	if (n->rule)
+		rule = n->rule;
+
+	filter_sync_all(s, n->child[0], size, rule);
+	filter_sync_all(s, n->child[1], size, rule);
+}
+
+/* To be called after the score or the times of an entry changed */
+static void entry_update(main_server_st *s, ban_entry_st *e, time_t now)
+{
+	ban_db_st *db = s->ban_db;
+	unsigned banned;
+
+	banned = GETCONFIG(s)->max_ban_score > 0 && IS_BANNED(s, e) && e->expires > now;
+	if (banned && !e->counted) {
+		e->counted = 1;
+		db->banned++;
+		filter_sync_entry(s, e);
+	} else if (!banned && e->counted) {
+		e->counted = 0;
+		db->banned--;
+		filter_sync_entry(s, e);
+	}
+
+	list_del(&e->wheel_list);
+	e->due = entry_due(s, e);
+	wheel_add(db, e);
+}
+
+/* Returns the entry of the prefix, adding it if it doesn't exist */
+static ban_entry_st *get_entry(main_server_st *s, const inaddr_st *ip,
+			       unsigned prefix, time_t now)
+{
+	ban_db_st *db = s->ban_db;
+	ban_node_st *n;
+	ban_entry_st *e;
+
+	n = trie_get(db, &db->root[FAMILY_IDX(ip->size)], ip->ip, prefix);
+	if (n == NULL)
+		return NULL;
+
+	if (n->entry != NULL)
+		return n->entry;
+
+	e = talloc_zero(db, ban_entry_st);
+	if (e == NULL) {
+		trie_prune(&db->root[FAMILY_IDX(ip->size)], ip->ip, prefix);
+		return NULL;
+	}
+
+	memcpy(&e->ip, ip, sizeof(e->ip));
+	mask_bits(e->ip.ip, prefix);
+	e->prefix = prefix;
+	e->last_reset = now;
+
+	e->due = now;
+	wheel_add(db, e);
+	list_add_tail(&db->entries, &e->list);
+	n->entry = e;
+
+	return e;
+}
+
+/* Frees an entry which was taken off the wheel */
+static void entry_free(main_server_st *s, ban_entry_st *e)
+{
+	ban_db_st *db = s->ban_db;
+	ban_node_st *n;
+
+	if (e->counted)
+		db->banned--;
+
+	n = trie_find(db->root[FAMILY_IDX(e->ip.size)], e->ip.ip, e->prefix);
+	if (n != NULL)
+		n->entry = NULL;
+	trie_prune(&db->root[FAMILY_IDX(e->ip.size)], e->ip.ip, e->prefix);
+
+	list_del(&e->list);
+	talloc_free(e);
 }
 
+/* Runs the wheel up to now; the entries whose ban ended are no longer
+ * counted, and those that can be forgotten are removed. */
+static void wheel_run(main_server_st *s, time_t now)
+{
+	ban_db_st *db = s->ban_db;
+	struct list_head due;
+	ban_entry_st *e;
+	unsigned level, slot;
+	time_t t;
+
+	while (db->wheel_time < now) {
+		if (list_empty(&db->entries)) {
+			db->wheel_time = now;
+			break;
+		}
+
+		t = ++db->wheel_time;
+
+		/* bring the entries of the next turn of each level down */
+		for (level = BAN_WHEEL_LEVELS - 1; level > 0; level--) {
+			if ((t & (((time_t)1 << (BAN_WHEEL_BITS * level)) - 1)) != 0)
+				continue;
+
+			slot = (t >> (BAN_WHEEL_BITS * level)) & (BAN_WHEEL_SIZE - 1);
+			wheel_take(&db->wheel[level][slot], &due);
+			while ((e = list_top(&due, ban_entry_st, wheel_list)) != NULL) {
+				list_del(&e->wheel_list);
+				if (e->due <= t)
+					list_add_tail(&db->wheel[0][t & (BAN_WHEEL_SIZE - 1)], &e->wheel_list);
+				else
+					wheel_add(db, e);
+			}
+		}
+
+		wheel_take(&db->wheel[0][t & (BAN_WHEEL_SIZE - 1)], &due);
+		while ((e = list_top(&due, ban_entry_st, wheel_list)) != NULL) {
+			list_del(&e->wheel_list);
+
+			if (e->due <= t) {
+				if (e->counted) {
+					e->counted = 0;
+					db->banned--;
+					filter_sync_entry(s, e);
+				}
+				e->due = entry_due(s, e);
+				if (e->due <= t) {
+					entry_free(s, e);
+					continue;
+				}
+			}
+			wheel_add(db, e);
+		}
+	}
+}
+
+/* Walks the trie along the address. It returns the banned entry which
+ * covers it, if any, and sets rule to that of the longest network which
+ * has one. */
+static ban_entry_st *ban_match(main_server_st *s, const inaddr_st *ip,
+			       time_t now, unsigned *rule)
+{
+	ban_node_st *n = s->ban_db->root[FAMILY_IDX(ip->size)];
+	ban_entry_st *banned = NULL;
+	unsigned bits = ip->size * 8, start = 0;
+
+	*rule = 0;
+	while (n != NULL && n->plen <= bits &&
+	       diff_bit(n->key, ip->ip, start, n->plen) == n->plen) {
+		if (n->rule)
+			*rule = n->rule;
+
+		if (n->entry && banned == NULL && GETCONFIG(s)->max_ban_score > 0 &&
+		    IS_BANNED(s, n->entry) && now <= n->entry->expires)
+			banned = n->entry;
+
+		if (n->plen == bits)
+			break;
+		start = n->plen;
+		n = n->child[ADDR_BIT(ip->ip, n->plen)];
+	}
+	return banned;
+}
 
 void *main_ban_db_init(main_server_st *s)
 {
-	struct htable *db = talloc(s, struct htable);
+	ban_db_st *db;
+	unsigned i, j;
+
+	db = talloc_zero(s, ban_db_st);
 	if (db == NULL) {
 		fprintf(stderr, "error initializing ban DB\n");
 		exit(1);
 	}
 
-	htable_init(db, rehash, NULL);
+	list_head_init(&db->entries);
+	for (i = 0; i < BAN_WHEEL_LEVELS; i++) {
+		for (j = 0; j < BAN_WHEEL_SIZE; j++)
+			list_head_init(&db->wheel[i][j]);
+	}
+	db->wheel_time = time(0);
+
 	s->ban_db = db;
 
 	return db;
@@ -80,41 +495,171 @@ void *main_ban_db_init(main_server_st *s)
 
 void main_ban_db_deinit(main_server_st *s)
 {
-	struct htable *db = s->ban_db;
+	ban_db_st *db = s->ban_db;
 
 	if (db != NULL) {
-		htable_clear(db);
 		talloc_free(db);
+		s->ban_db = NULL;
 	}
 }
 
-#define IS_BANNED(main, entry) (entry->score >= GETCONFIG(main)->max_ban_score)
-
 unsigned main_ban_db_elems(main_server_st *s)
 {
-	struct htable *db = s->ban_db;
-	ban_entry_st *t;
-	struct htable_iter iter;
-	time_t now = time(0);
-	unsigned banned = 0;
+	ban_db_st *db = s->ban_db;
 
 	if (db == NULL || GETCONFIG(s)->max_ban_score == 0)
 		return 0;
 
-	t = htable_first(db, &iter);
-	while (t != NULL) {
-		if (t->expires > now && IS_BANNED(s, t)) {
-			banned++;
+	wheel_run(s, time(0));
+	return db->banned;
+}
+
+/* Parses a network as address/prefix; a plain address is a network of
+ * its own. */
+static int parse_network(const char *str, inaddr_st *ip, unsigned *plen)
+{
+	char buf[MAX_IP_STR + 8];
+	char *p, *end;
+	long prefix;
+	int ret;
+
+	if (strlen(str) >= sizeof(buf))
+		return -1;
+	strcpy(buf, str);
+	p = strchr(buf, '/');
+	if (p != NULL)
+		*p++ = 0;
+
+	memset(ip, 0, sizeof(*ip));
+	if (strchr(buf, ':') != 0) {
+		ret = inet_pton(AF_INET6, buf, ip->ip);
+		ip->size = 16;
+	} else {
+		ret = inet_pton(AF_INET, buf, ip->ip);
+		ip->size = 4;
+	}
+	if (ret != 1)
+		return -1;
+
+	if (p != NULL) {
+		prefix = strtol(p, &end, 10);
+		if (*p == 0 || *end != 0 || prefix < 0 || prefix > ip->size * 8)
+			return -1;
+		*plen = prefix;
+	} else {
+		*plen = ip->size * 8;
+	}
+
+	mask_bits(ip->ip, *plen);
+	return 0;
+}
+
+static void clear_rules(ban_node_st **slot, unsigned size)
+{
+	ban_node_st *n = *slot;
+
+	if (n == NULL)
+		return;
+
+	clear_rules(&n->child[0], size);
+	clear_rules(&n->child[1], size);
+
+	if (n->rule) {
+		ban_filter_del(n->key, size, n->plen);
+		n->rule = 0;
+	}
+	if (n->entry == NULL && (n->child[0] == NULL || n->child[1] == NULL)) {
+		*slot = (n->child[0] != NULL) ? n->child[0] : n->child[1];
+		talloc_free(n);
+	}
+}
+
+static void add_rules(main_server_st *s, char **nets, size_t nets_size,
+		      unsigned rule, const char *name)
+{
+	ban_db_st *db = s->ban_db;
+	ban_node_st *n;
+	inaddr_st ip;
+	unsigned plen;
+	size_t i;
+
+	for (i = 0; i < nets_size; i++) {
+		if (parse_network(nets[i], &ip, &plen) < 0) {
+			mslog(s, NULL, LOG_ERR, "%s: cannot parse network '%s'", name, nets[i]);
+			continue;
 		}
-		t = htable_next(db, &iter);
+
+		n = trie_get(db, &db->root[FAMILY_IDX(ip.size)], ip.ip, plen);
+		if (n != NULL)
+			n->rule = rule;
 	}
-	return banned;
 }
 
-static void massage_ipv6_address(ban_entry_st *t)
+/* Loads the networks of ban-allow and ban-deny; called on startup and
+ * after a reload. On the same network, ban-deny applies. */
+void main_ban_db_load_rules(main_server_st *s)
 {
-	if (t->ip.size == 16) {
-		memset(&t->ip.ip[8], 0, 8);
+	ban_db_st *db = s->ban_db;
+
+	if (db == NULL)
+		return;
+
+	clear_rules(&db->root[0], 4);
+	clear_rules(&db->root[1], 16);
+
+	add_rules(s, GETCONFIG(s)->ban_allow, GETCONFIG(s)->ban_allow_size,
+		  BAN_RULE_ALLOW, "ban-allow");
+	add_rules(s, GETCONFIG(s)->ban_deny, GETCONFIG(s)->ban_deny_size,
+		  BAN_RULE_DENY, "ban-deny");
+
+	/* the rules may change the verdict of any entry under them */
+	if (ban_filter_enabled()) {
+		filter_sync_all(s, db->root[0], 4, 0);
+		filter_sync_all(s, db->root[1], 16, 0);
+	}
+}
+
+static void massage_ipv6_address(inaddr_st *ip)
+{
+	if (ip->size == 16) {
+		memset(&ip->ip[8], 0, 8);
+	}
+}
+
+/* Bans the network of a newly banned address, if enough of its
+ * addresses are banned. */
+static void ban_network(main_server_st *s, const ban_entry_st *host, time_t now)
+{
+	ban_db_st *db = s->ban_db;
+	unsigned threshold = GETCONFIG(s)->ban_aggregate_threshold;
+	unsigned plen = AGGREGATE_PREFIX(host->ip.size);
+	ban_entry_st *e;
+	ban_node_st *n;
+	inaddr_st net;
+	char str_ip[MAX_IP_STR];
+
+	if (threshold == 0)
+		return;
+
+	memcpy(&net, &host->ip, sizeof(net));
+	mask_bits(net.ip, plen);
+
+	n = trie_cover(db->root[FAMILY_IDX(net.size)], net.ip, plen);
+	if (count_banned(n, HOST_PREFIX(net.size), threshold) < threshold)
+		return;
+
+	e = get_entry(s, &net, plen, now);
+	if (e == NULL || e->counted)
+		return;
+
+	e->score = GETCONFIG(s)->max_ban_score;
+	e->last_reset = now;
+	e->expires = now + GETCONFIG(s)->min_reauth_time;
+	entry_update(s, e, now);
+
+	if (inet_ntop((net.size == 16) ? AF_INET6 : AF_INET, net.ip, str_ip, sizeof(str_ip)) != NULL) {
+		mslog(s, NULL, LOG_INFO, "added network '%s/%u' to ban list, as %u of its addresses are banned; will be reset at: %s",
+		      str_ip, plen, threshold, ctime(&e->expires));
 	}
 }
 
@@ -122,45 +667,38 @@ static void massage_ipv6_address(ban_entry_st *t)
 static
 int add_ip_to_ban_list(main_server_st *s, const unsigned char *ip, unsigned ip_size, unsigned score)
 {
-	struct htable *db = s->ban_db;
+	ban_db_st *db = s->ban_db;
 	struct ban_entry_st *e;
-	ban_entry_st t;
+	inaddr_st t;
 	time_t now = time(0);
 	time_t expiration = now + GETCONFIG(s)->min_reauth_time;
 	int ret = 0;
 	char str_ip[MAX_IP_STR];
 	const char *p_str_ip = NULL;
-	unsigned print_msg;
+	unsigned print_msg, was_counted, rule;
 
 	if (db == NULL || GETCONFIG(s)->max_ban_score == 0 || ip == NULL || (ip_size != 4 && ip_size != 16))
 		return 0;
 
-	memcpy(t.ip.ip, ip, ip_size);
-	t.ip.size = ip_size;
+	memset(&t, 0, sizeof(t));
+	memcpy(t.ip, ip, ip_size);
+	t.size = ip_size;
+
+	/* the networks of ban-allow gather no points */
+	ban_match(s, &t, now, &rule);
+	if (rule == BAN_RULE_ALLOW)
+		return 0;
 
 	/* In IPv6 treat a /64 as a single address */
 	massage_ipv6_address(&t);
 
-	e = htable_get(db, rehash(&t, NULL), ban_entry_cmp, &t);
-	if (e == NULL) { /* new entry */
-		e = talloc_zero(db, ban_entry_st);
-		if (e == NULL) {
-			return 0;
-		}
+	e = get_entry(s, &t, HOST_PREFIX(ip_size), now);
+	if (e == NULL)
+		return 0;
 
-		memcpy(&e->ip, &t.ip, sizeof(e->ip));
+	if (now > e->last_reset + GETCONFIG(s)->ban_reset_time) {
+		e->score = 0;
 		e->last_reset = now;
-
-		if (htable_add(db, rehash(e, NULL), e) == 0) {
-			mslog(s, NULL, LOG_INFO,
-			       "could not add ban entry to hash table");
-			goto fail;
-		}
-	} else {
-		if (now > e->last_reset + GETCONFIG(s)->ban_reset_time) {
-			e->score = 0;
-			e->last_reset = now;
-		}
 	}
 
 	/* if the user is already banned, don't increase the expiration time
@@ -175,6 +713,9 @@ int add_ip_to_ban_list(main_server_st *s, const unsigned char *ip, unsigned ip_s
 	/* prevent overflow */
 	e->score = (e->score + score) > e->score ? (e->score + score) : (e->score);
 
+	was_counted = e->counted;
+	entry_update(s, e, now);
+
 	if (ip_size == 4)
 		p_str_ip = inet_ntop(AF_INET, ip, str_ip, sizeof(str_ip));
 	else
@@ -192,27 +733,27 @@ int add_ip_to_ban_list(main_server_st *s, const unsigned char *ip, unsigned ip_s
 		ret = 0;
 	}
 
-	return ret;
- fail:
-	talloc_free(e);
+	if (e->counted && !was_counted)
+		ban_network(s, e, now);
+
 	return ret;
 }
 
 int add_str_ip_to_ban_list(main_server_st *s, const char *ip, unsigned score)
 {
-	struct htable *db = s->ban_db;
-	ban_entry_st t;
+	ban_db_st *db = s->ban_db;
+	inaddr_st t;
 	int ret = 0;
 
 	if (db == NULL || GETCONFIG(s)->max_ban_score == 0 || ip == NULL || ip[0] == 0)
 		return 0;
 
 	if (strchr(ip, ':') != 0) {
-		ret = inet_pton(AF_INET6, ip, t.ip.ip);
-		t.ip.size = 16;
+		ret = inet_pton(AF_INET6, ip, t.ip);
+		t.size = 16;
 	} else {
-		ret = inet_pton(AF_INET, ip, t.ip.ip);
-		t.ip.size = 4;
+		ret = inet_pton(AF_INET, ip, t.ip);
+		t.size = 4;
 	}
 	if (ret != 1) {
 		mslog(s, NULL, LOG_INFO,
@@ -220,16 +761,20 @@ int add_str_ip_to_ban_list(main_server_st *s, const char *ip, unsigned score)
 		return 0;
 	}
 
-	return add_ip_to_ban_list(s, t.ip.ip, t.ip.size, score);
+	return add_ip_to_ban_list(s, t.ip, t.size, score);
 }
 
-/* returns non-zero if there is an IP removed */
+/* Resets the entries of the address, and of the networks which cover
+ * it. Returns non-zero if there is an IP removed. */
 int remove_ip_from_ban_list(main_server_st *s, const uint8_t *ip, unsigned size)
 {
-	struct htable *db = s->ban_db;
-	struct ban_entry_st *e;
-	ban_entry_st t;
+	ban_db_st *db = s->ban_db;
+	ban_node_st *n;
+	inaddr_st t;
 	char txt_ip[MAX_IP_STR];
+	time_t now = time(0);
+	unsigned start = 0;
+	int ret = 0;
 
 	if (db == NULL || ip == NULL || size == 0)
 		return 0;
@@ -240,32 +785,42 @@ int remove_ip_from_ban_list(main_server_st *s, const uint8_t *ip, unsigned size)
 				      "unbanning IP '%s'", txt_ip);
 		}
 
-		t.ip.size = size;
-		memcpy(&t.ip.ip, ip, size);
+		memset(&t, 0, sizeof(t));
+		memcpy(t.ip, ip, size);
+		t.size = size;
 
 		/* In IPv6 treat a /64 as a single address */
 		massage_ipv6_address(&t);
 
-		e = htable_get(db, rehash(&t, NULL), ban_entry_cmp, &t);
-		if (e != NULL) { /* new entry */
-			e->score = 0;
-			e->expires = 0;
-			return 1;
+		n = db->root[FAMILY_IDX(size)];
+		while (n != NULL && n->plen <= HOST_PREFIX(size) &&
+		       diff_bit(n->key, t.ip, start, n->plen) == n->plen) {
+			if (n->entry != NULL) {
+				n->entry->score = 0;
+				n->entry->expires = 0;
+				entry_update(s, n->entry, now);
+				ret = 1;
+			}
+
+			if (n->plen == HOST_PREFIX(size))
+				break;
+			start = n->plen;
+			n = n->child[ADDR_BIT(t.ip, n->plen)];
 		}
 	}
 
-	return 0;
+	return ret;
 }
 
 unsigned check_if_banned(main_server_st *s, struct sockaddr_storage *addr, socklen_t addr_size)
 {
-	struct htable *db = s->ban_db;
+	ban_db_st *db = s->ban_db;
 	time_t now;
-	ban_entry_st t, *e;
-	unsigned in_size;
+	inaddr_st t;
+	unsigned in_size, rule;
 	char txt[MAX_IP_STR];
 
-	if (db == NULL || GETCONFIG(s)->max_ban_score == 0)
+	if (db == NULL)
 		return 0;
 
 	(void)(txt);
@@ -276,47 +831,37 @@ unsigned check_if_banned(main_server_st *s, struct sockaddr_storage *addr, sockl
 		return 0;
 	}
 
-	memcpy(t.ip.ip, SA_IN_P_GENERIC(addr, addr_size), SA_IN_SIZE(addr_size));
-	t.ip.size = SA_IN_SIZE(addr_size);
+	memset(&t, 0, sizeof(t));
+	memcpy(t.ip, SA_IN_P_GENERIC(addr, addr_size), in_size);
+	t.size = in_size;
 
-	/* In IPv6 treat a /64 as a single address */
-	massage_ipv6_address(&t);
+	now = time(0);
+	ban_match(s, &t, now, &rule);
+	if (rule == BAN_RULE_ALLOW)
+		return 0;
+
+	if (rule == BAN_RULE_DENY) {
+	    	mslog(s, NULL, LOG_INFO, "rejected connection from denied IP: %s", human_addr2((struct sockaddr*)addr, addr_size, txt, sizeof(txt), 0));
+		return 1;
+	}
+
+	if (GETCONFIG(s)->max_ban_score == 0)
+		return 0;
 
 	/* add its current connection points */
-	add_ip_to_ban_list(s, t.ip.ip, t.ip.size, GETCONFIG(s)->ban_points_connect);
+	add_ip_to_ban_list(s, t.ip, t.size, GETCONFIG(s)->ban_points_connect);
 
-	now = time(0);
-	e = htable_get(db, rehash(&t, NULL), ban_entry_cmp, &t);
-	if (e != NULL) {
-		if (now > e->expires)
-			return 0;
-
-		if (e->score >= GETCONFIG(s)->max_ban_score) {
-		    	mslog(s, NULL, LOG_INFO, "rejected connection from banned IP: %s", human_addr2((struct sockaddr*)addr, addr_size, txt, sizeof(txt), 0));
-			return 1;
-		}
+	if (ban_match(s, &t, now, &rule) != NULL) {
+	    	mslog(s, NULL, LOG_INFO, "rejected connection from banned IP: %s", human_addr2((struct sockaddr*)addr, addr_size, txt, sizeof(txt), 0));
+		return 1;
 	}
 	return 0;
 }
 
 void cleanup_banned_entries(main_server_st *s)
 {
-	struct htable *db = s->ban_db;
-	ban_entry_st *t;
-	struct htable_iter iter;
-	time_t now = time(0);
-
-	if (db == NULL)
+	if (s->ban_db == NULL)
 		return;
 
-	t = htable_first(db, &iter);
-	while (t != NULL) {
-		if (now >= t->expires && now > t->last_reset + GETCONFIG(s)->ban_reset_time) {
-			htable_delval(db, &iter);
-			talloc_free(t);
-		}
-		t = htable_next(db, &iter);
-
-	}
+	wheel_run(s, time(0));
 }
-
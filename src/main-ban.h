@@ -30,17 +30,63 @@ typedef struct inaddr_st {
 
 typedef struct ban_entry_st {
 	inaddr_st ip;
+	unsigned prefix; /* 32 or 64 (IPv6); shorter for banned networks */
 	unsigned score;
 
 	time_t last_reset; /* the time its score counting started */
 	time_t expires; /* the time after the client is allowed to login */
+
+	/* the next event of the entry in the timer wheel: the end of its
+	 * ban if it is counted as banned, or else when it can be removed */
+	struct list_node wheel_list;
+	time_t due;
+	unsigned counted;
+
+	struct list_node list; /* in ban_db_st.entries */
 } ban_entry_st;
 
+/* entries are kept for an address, or a /64 in IPv6, and for the
+ * networks banned as a whole */
+#define HOST_PREFIX(size) (((size) == 4) ? 32 : 64)
+#define AGGREGATE_PREFIX(size) (((size) == 4) ? 24 : 48)
+
+/* the static rules of ban-allow and ban-deny */
+#define BAN_RULE_ALLOW 1
+#define BAN_RULE_DENY 2
+
+/* A node of the prefix trie. It is path compressed; there are nodes only
+ * for the prefixes with an entry or a rule, and where those diverge. */
+typedef struct ban_node_st {
+	uint8_t key[16]; /* the bits past plen are zero */
+	unsigned plen;
+	struct ban_node_st *child[2];
+
+	ban_entry_st *entry;
+	unsigned rule;
+} ban_node_st;
+
+#define BAN_WHEEL_BITS 6
+#define BAN_WHEEL_SIZE (1 << BAN_WHEEL_BITS)
+#define BAN_WHEEL_LEVELS 3
+
+typedef struct ban_db_st {
+	ban_node_st *root[2]; /* IPv4, IPv6 */
+	struct list_head entries;
+	unsigned banned; /* entries counted as banned */
+
+	/* A hierarchical timer wheel; a slot of the first level is a
+	 * second, and one of each next level is a full turn of the previous.
+	 * It holds every entry, at the time of its next event. */
+	struct list_head wheel[BAN_WHEEL_LEVELS][BAN_WHEEL_SIZE];
+	time_t wheel_time; /* the last second the wheel was run for */
+} ban_db_st;
+
 void cleanup_banned_entries(main_server_st *s);
 unsigned check_if_banned(main_server_st *s, struct sockaddr_storage *addr, socklen_t addr_size);
 int add_str_ip_to_ban_list(main_server_st *s, const char *ip, unsigned score);
 int remove_ip_from_ban_list(main_server_st *s, const uint8_t *ip, unsigned size);
 unsigned main_ban_db_elems(main_server_st *s);
+void main_ban_db_load_rules(main_server_st *s);
 void main_ban_db_deinit(main_server_st *s);
 void *main_ban_db_init(main_server_st *s);
 
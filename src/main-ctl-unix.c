@@ -204,6 +204,28 @@ static void method_status(method_ctx *ctx, int cfd, uint8_t * msg,
 	rep.total_auth_failures = ctx->s->stats.total_auth_failures;
 	rep.total_sessions_closed = ctx->s->stats.total_sessions_closed;
 
+	rep.conns_admitted = ctx->s->stats.conns_admitted;
+	rep.conns_rejected = ctx->s->stats.conns_rejected;
+	rep.avg_admit_wait = ctx->s->stats.avg_admit_wait;
+	rep.max_admit_wait = ctx->s->stats.max_admit_wait;
+	rep.avg_worker_start = ctx->s->stats.avg_worker_start;
+	rep.max_worker_start = ctx->s->stats.max_worker_start;
+	rep.avg_session_open = ctx->s->stats.avg_session_open;
+	rep.max_session_open = ctx->s->stats.max_session_open;
+	rep.avg_session_close = ctx->s->stats.avg_session_close;
+	rep.max_session_close = ctx->s->stats.max_session_close;
+	rep.secmod_pending = ctx->s->secm_reqs.total;
+
+	ip_lease_pool_stats(&ctx->s->ip_leases, AF_INET,
+			    &rep.ipv4_leases, &rep.ipv4_pool_size);
+	ip_lease_pool_stats(&ctx->s->ip_leases, AF_INET6,
+			    &rep.ipv6_leases, &rep.ipv6_pool_size);
+
+	rep.auth_wait_hist = ctx->s->stats.auth_wait_hist;
+	rep.n_auth_wait_hist = AUTH_LATENCY_BUCKETS;
+	rep.auth_run_hist = ctx->s->stats.auth_run_hist;
+	rep.n_auth_run_hist = AUTH_LATENCY_BUCKETS;
+
 	ret = send_msg(ctx->pool, cfd, CTL_CMD_STATUS_REP, &rep,
 		       (pack_size_func) status_rep__get_packed_size,
 		       (pack_func) status_rep__pack);
@@ -372,20 +394,20 @@ static int append_user_info(method_ctx *ctx,
 	rep->remote_ip6 = strtmp;
 
 	rep->conn_time = ctmp->conn_time;
-	rep->hostname = ctmp->hostname;
-	rep->user_agent = ctmp->user_agent;
+	rep->hostname = ctmp->info->hostname;
+	rep->user_agent = ctmp->info->user_agent;
 
 	rep->status = ctmp->status;
 
-	rep->tls_ciphersuite = ctmp->tls_ciphersuite;
-	rep->dtls_ciphersuite = ctmp->dtls_ciphersuite;
+	rep->tls_ciphersuite = ctmp->info->tls_ciphersuite;
+	rep->dtls_ciphersuite = ctmp->info->dtls_ciphersuite;
 
 	calc_safe_id(ctmp->sid, sizeof(ctmp->sid), safe_id, SAFE_ID_SIZE);
 	rep->safe_id.data = (unsigned char*)safe_id;
 	rep->safe_id.len = SAFE_ID_SIZE;
 
-	rep->cstp_compr = ctmp->cstp_compr;
-	rep->dtls_compr = ctmp->dtls_compr;
+	rep->cstp_compr = ctmp->info->cstp_compr;
+	rep->dtls_compr = ctmp->info->dtls_compr;
 	if (ctmp->mtu > 0) {
 		rep->mtu = ctmp->mtu;
 		rep->has_mtu = 1;
@@ -504,6 +526,11 @@ static int append_ban_info(method_ctx *ctx,
 		rep->has_expires = 1;
 	}
 
+	if (e->prefix < HOST_PREFIX(e->ip.size)) {
+		rep->prefix = e->prefix;
+		rep->has_prefix = 1;
+	}
+
 	return 0;
 }
 
@@ -512,21 +539,20 @@ static void method_list_banned(method_ctx *ctx, int cfd, uint8_t * msg,
 {
 	BanListRep rep = BAN_LIST_REP__INIT;
 	struct ban_entry_st *e = NULL;
-	struct htable *db = ctx->s->ban_db;
+	struct ban_db_st *db = ctx->s->ban_db;
 	int ret;
-	struct htable_iter iter;
 
 	mslog(ctx->s, NULL, LOG_DEBUG, "ctl: list-banned-ips");
 
-	e = htable_first(db, &iter);
-	while (e != NULL) {
+	cleanup_banned_entries(ctx->s);
+
+	list_for_each(&db->entries, e, list) {
 		ret = append_ban_info(ctx, &rep, e);
 		if (ret < 0) {
 			mslog(ctx->s, NULL, LOG_ERR,
 			      "error appending ban info to reply");
 			goto error;
 		}
-		e = htable_next(db, &iter);
 	}
 
 	ret = send_msg(ctx->pool, cfd, CTL_CMD_LIST_BANNED_REP, &rep,
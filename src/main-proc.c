@@ -57,6 +57,7 @@
 #include <vpn.h>
 #include <tun.h>
 #include <main.h>
+#include <main-udp-steer.h>
 #include <main-ban.h>
 #include <ccan/list/list.h>
 
@@ -71,6 +72,12 @@ struct proc_st *new_proc(main_server_st * s, pid_t pid, int cmd_fd,
 	if (ctmp == NULL)
 		return NULL;
 
+	ctmp->info = talloc_zero(ctmp, struct proc_info_st);
+	if (ctmp->info == NULL) {
+		talloc_free(ctmp);
+		return NULL;
+	}
+
 	ctmp->pid = pid;
 	ctmp->tun_lease.fd = -1;
 	ctmp->fd = cmd_fd;
@@ -95,6 +102,9 @@ struct proc_st *new_proc(main_server_st * s, pid_t pid, int cmd_fd,
 }
 
 /* k: whether to kill the process
+ *
+ * If the proc has an open session, it is released by release_proc()
+ * once sec-mod replied to the session close, or the reply is overdue.
  */
 void remove_proc(main_server_st * s, struct proc_st *proc, unsigned flags)
 {
@@ -109,34 +119,50 @@ void remove_proc(main_server_st * s, struct proc_st *proc, unsigned flags)
 	if ((flags&RPROC_KILL) && proc->pid != -1 && proc->pid != 0)
 		kill(proc->pid, SIGTERM);
 
+	/* a session open still in flight is closed on its reply */
+	secm_req_detach(proc);
+
+	pid = remove_from_script_list(s, proc);
+	if (pid > 0) {
+		int wstatus;
+		/* we were called during the connect script being run.
+		 * wait for it to finish and if it returns zero run the
+		 * disconnect script */
+		if (waitpid(pid, &wstatus, 0) > 0) {
+			if (WEXITSTATUS(wstatus) == 0)
+				proc->disconnect_due = 1;
+		}
+	} else if (proc->status == PS_AUTH_COMPLETED) {
+		/* pid > 0 or status == PS_AUTH_COMPLETED are mutually exclusive
+		 * since PS_AUTH_COMPLETED is set only after a successful script run.
+		 */
+		proc->disconnect_due = 1;
+	}
+
+	/* no longer reachable while its session is being closed */
+	udp_steer_del(s, proc);
+	proc_table_del(s, proc);
+
 	/* close any pending sessions */
 	if (proc->active_sid && !(flags & RPROC_QUIT)) {
 		if (session_close(s, proc) < 0) {
 			mslog(s, proc, LOG_ERR, "error closing session (communication with sec-mod issue)");
 			exit(1);
 		}
+		return;
 	}
 
+	release_proc(s, proc);
+}
+
+/* Completes remove_proc() */
+void release_proc(main_server_st * s, struct proc_st *proc)
+{
 	mslog(s, proc, LOG_INFO, "user disconnected (reason: %s, rx: %"PRIu64", tx: %"PRIu64")",
 		discon_reason_to_str(proc->discon_reason), proc->bytes_in, proc->bytes_out);
 
-	pid = remove_from_script_list(s, proc);
-	if (proc->status == PS_AUTH_COMPLETED || pid > 0) {
-		if (pid > 0) {
-			int wstatus;
-			/* we were called during the connect script being run.
-			 * wait for it to finish and if it returns zero run the
-			 * disconnect script */
-			 if (waitpid(pid, &wstatus, 0) > 0) {
-			 	if (WEXITSTATUS(wstatus) == 0)
-					user_disconnected(s, proc);
-			 }
-		} else { /* pid > 0 or status == PS_AUTH_COMPLETED are mutually exclusive
-		          * since PS_AUTH_COMPLETED is set only after a successful script run.
-		          */
-			user_disconnected(s, proc);
-		}
-	}
+	if (proc->disconnect_due)
+		user_disconnected(s, proc);
 
 	/* close the intercomm fd */
 	if (proc->fd >= 0)
@@ -150,7 +176,6 @@ void remove_proc(main_server_st * s, struct proc_st *proc, unsigned flags)
 		remove_ip_leases(s, proc);
 
 	close_tun(s, proc);
-	proc_table_del(s, proc);
 	if (proc->config_usage_count && *proc->config_usage_count > 0) {
 		(*proc->config_usage_count)--;
 	}
@@ -66,6 +66,9 @@ static void update_auth_failures(main_server_st * s, uint64_t auth_failures)
 	s->stats.total_auth_failures += auth_failures;
 }
 
+static int handle_session_open_rep(main_server_st *s, SecmSessionReplyMsg *msg, void *mpool);
+static int handle_session_close_rep(main_server_st *s, CliStatsMsg *msg);
+
 int handle_sec_mod_commands(main_server_st * s)
 {
 	struct iovec iov[3];
@@ -174,6 +177,46 @@ int handle_sec_mod_commands(main_server_st * s)
 			safe_memset(raw, 0, raw_len);
 		}
 
+		break;
+	case CMD_SECM_SESSION_REPLY:{
+			SecmSessionReplyMsg *rmsg;
+			void *mpool = talloc_new(s);
+			PROTOBUF_ALLOCATOR(mpa, mpool);
+
+			if (mpool == NULL) {
+				ret = ERR_MEM;
+				goto cleanup;
+			}
+
+			rmsg = secm_session_reply_msg__unpack(&mpa, raw_len, raw);
+			if (rmsg == NULL) {
+				talloc_free(mpool);
+				mslog(s, NULL, LOG_ERR, "error unpacking sec-mod data");
+				ret = ERR_BAD_COMMAND;
+				goto cleanup;
+			}
+
+			ret = handle_session_open_rep(s, rmsg, mpool);
+			if (ret < 0)
+				goto cleanup;
+		}
+
+		break;
+	case CMD_SECM_CLI_STATS:{
+			CliStatsMsg *cmsg;
+
+			cmsg = cli_stats_msg__unpack(&pa, raw_len, raw);
+			if (cmsg == NULL) {
+				mslog(s, NULL, LOG_ERR, "error unpacking sec-mod data");
+				ret = ERR_BAD_COMMAND;
+				goto cleanup;
+			}
+
+			ret = handle_session_close_rep(s, cmsg);
+			if (ret < 0)
+				goto cleanup;
+		}
+
 		break;
 	case CMD_SECM_STATS:{
 			SecmStatsMsg *smsg = NULL;
@@ -189,6 +232,13 @@ int handle_sec_mod_commands(main_server_st * s)
 			s->stats.tlsdb_entries = smsg->secmod_tlsdb_entries;
 			s->stats.max_auth_time = smsg->secmod_max_auth_time;
 			s->stats.avg_auth_time = smsg->secmod_avg_auth_time;
+			if (smsg->n_secmod_auth_wait == AUTH_LATENCY_BUCKETS &&
+			    smsg->n_secmod_auth_run == AUTH_LATENCY_BUCKETS) {
+				memcpy(s->stats.auth_wait_hist, smsg->secmod_auth_wait,
+				       sizeof(s->stats.auth_wait_hist));
+				memcpy(s->stats.auth_run_hist, smsg->secmod_auth_run,
+				       sizeof(s->stats.auth_run_hist));
+			}
 			update_auth_failures(s, smsg->secmod_auth_failures);
 
 		}
@@ -447,20 +497,157 @@ void apply_default_config(main_server_st *s, proc_st *proc, GroupCfgSt *gc)
 	(*proc->config_usage_count)++;
 }
 
-int session_open(main_server_st *s, struct proc_st *proc, const uint8_t *cookie, unsigned cookie_size)
+static void update_secm_stats(main_server_st *s, unsigned cmd, unsigned lat)
 {
-	int ret, e;
+	uint64_t *n;
+	uint32_t *avg, *max;
+
+	if (cmd == CMD_SECM_SESSION_OPEN) {
+		n = &s->stats.session_opens;
+		avg = &s->stats.avg_session_open;
+		max = &s->stats.max_session_open;
+	} else {
+		n = &s->stats.session_closes;
+		avg = &s->stats.avg_session_close;
+		max = &s->stats.max_session_close;
+	}
+
+	(*n)++;
+	if (*n == 0) { /* overflow */
+		*n = 1;
+		*avg = 0;
+	}
+
+	if (lat > *max)
+		*max = lat;
+	*avg = (*avg*(*n-1)+lat) / *n;
+}
+
+static struct secm_req_st *secm_req_new(main_server_st *s, struct proc_st *proc,
+					uint8_t cmd, const uint8_t sid[SID_SIZE])
+{
+	struct secm_req_st *req;
+
+	req = talloc_zero(s, struct secm_req_st);
+	if (req == NULL)
+		return NULL;
+
+	req->id = ++s->secm_reqs.next_id;
+	req->cmd = cmd;
+	req->proc = proc;
+	memcpy(req->sid, sid, sizeof(req->sid));
+	main_gettime(&req->sent);
+
+	list_add_tail(&s->secm_reqs.head, &req->list);
+	s->secm_reqs.total++;
+	if (proc)
+		proc->secm_req = req;
+
+	return req;
+}
+
+static void secm_req_free(main_server_st *s, struct secm_req_st *req)
+{
+	list_del(&req->list);
+	s->secm_reqs.total--;
+	if (req->proc)
+		req->proc->secm_req = NULL;
+	talloc_free(req);
+}
+
+/* Returns the request a reply from sec-mod is for, and accounts its
+ * latency. The replies arrive in order, so it is normally the first. */
+static struct secm_req_st *secm_req_complete(main_server_st *s, uint8_t cmd,
+					     unsigned has_id, uint64_t id)
+{
+	struct secm_req_st *req;
+	struct timespec now;
+
+	if (has_id == 0)
+		return NULL;
+
+	list_for_each(&s->secm_reqs.head, req, list) {
+		if (req->id == id && req->cmd == cmd) {
+			main_gettime(&now);
+			update_secm_stats(s, cmd, timespec_sub_us(&now, &req->sent));
+			return req;
+		}
+	}
+
+	return NULL;
+}
+
+/* The proc is going away; its request is completed without it */
+void secm_req_detach(struct proc_st *proc)
+{
+	if (proc->secm_req) {
+		proc->secm_req->proc = NULL;
+		proc->secm_req = NULL;
+	}
+}
+
+static void update_main_stats(main_server_st * s, struct proc_st *proc);
+
+/* Gives up on the requests that sec-mod did not reply to within
+ * MAIN_SEC_MOD_TIMEOUT, so that a lost reply does not keep the proc of
+ * a session close, with its leases and tun device, until restart. A
+ * session open is left to the auth timeout of its proc; it is only
+ * dropped here once the proc is gone.
+ */
+void secm_reqs_expire(main_server_st *s)
+{
+	struct secm_req_st *req, *tmp;
+	struct proc_st *proc;
+	struct timespec now;
+
+	main_gettime(&now);
+
+	list_for_each_safe(&s->secm_reqs.head, req, tmp, list) {
+		/* they are kept in the order they were sent */
+		if (now.tv_sec - req->sent.tv_sec < MAIN_SEC_MOD_TIMEOUT)
+			break;
+
+		proc = req->proc;
+		if (req->cmd == CMD_SECM_SESSION_OPEN && proc != NULL)
+			continue;
+
+		mslog(s, proc, LOG_ERR, "sec-mod did not reply to %s; giving up",
+		      cmd_request_to_str(req->cmd));
+		secm_req_free(s, req);
+
+		if (proc != NULL) {
+			update_main_stats(s, proc);
+			release_proc(s, proc);
+		}
+	}
+}
+
+/* Sends a session open for the sid to sec-mod. The authentication of
+ * the proc continues with handle_auth_cookie_rep(), once it replies. */
+int session_open(main_server_st *s, struct proc_st *proc, const uint8_t sid[SID_SIZE],
+		 const uint8_t *cookie, unsigned cookie_size)
+{
+	int ret;
 	SecmSessionOpenMsg ireq = SECM_SESSION_OPEN_MSG__INIT;
-	SecmSessionReplyMsg *msg = NULL;
+	struct secm_req_st *req;
 	char str_ipv4[MAX_IP_STR];
 	char str_ipv6[MAX_IP_STR];
-	char str_ip[MAX_IP_STR];
 
-	if (cookie == NULL || cookie_size != SID_SIZE)
+	req = secm_req_new(s, proc, CMD_SECM_SESSION_OPEN, sid);
+	if (req == NULL)
 		return -1;
 
-	ireq.sid.data = (void*)cookie;
-	ireq.sid.len = cookie_size;
+	ireq.sid.data = req->sid;
+	ireq.sid.len = sizeof(req->sid);
+	ireq.has_id = 1;
+	ireq.id = req->id;
+
+	/* sec-mod restores the session from it, if unknown */
+	if (IS_SEALED_COOKIE(cookie_size)) {
+		ireq.has_cookie = 1;
+		ireq.cookie.data = (void*)cookie;
+		ireq.cookie.len = cookie_size;
+	}
 
 	if (proc->ipv4 && 
 	    human_addr2((struct sockaddr *)&proc->ipv4->rip, proc->ipv4->rip_len,
@@ -476,22 +663,22 @@ int session_open(main_server_st *s, struct proc_st *proc, const uint8_t *cookie,
 
 	mslog(s, proc, LOG_DEBUG, "sending msg %s to sec-mod", cmd_request_to_str(CMD_SECM_SESSION_OPEN));
 
-	ret = send_msg(proc, s->sec_mod_fd_sync, CMD_SECM_SESSION_OPEN,
+	ret = send_msg(proc, s->sec_mod_fd, CMD_SECM_SESSION_OPEN,
 		&ireq, (pack_size_func)secm_session_open_msg__get_packed_size,
 		(pack_func)secm_session_open_msg__pack);
 	if (ret < 0) {
 		mslog(s, proc, LOG_ERR,
 		      "error sending message to sec-mod cmd socket");
+		secm_req_free(s, req);
 		return -1;
 	}
 
-	ret = recv_msg(proc, s->sec_mod_fd_sync, CMD_SECM_SESSION_REPLY,
-	       (void *)&msg, (unpack_func) secm_session_reply_msg__unpack, MAIN_SEC_MOD_TIMEOUT);
-	if (ret < 0) {
-		e = errno;
-		mslog(s, proc, LOG_ERR, "error receiving auth reply message from sec-mod cmd socket: %s", strerror(e));
-		return ret;
-	}
+	return 0;
+}
+
+static int session_open_rep(main_server_st *s, struct proc_st *proc, SecmSessionReplyMsg *msg)
+{
+	char str_ip[MAX_IP_STR];
 
 	if (msg->reply != AUTH__REP__OK) {
 		mslog(s, proc, LOG_DEBUG, "session initiation was rejected");
@@ -506,15 +693,15 @@ int session_open(main_server_st *s, struct proc_st *proc, const uint8_t *cookie,
 	strlcpy(proc->username, msg->username, sizeof(proc->username));
 
 	if (msg->user_agent != NULL) {
-		strlcpy(proc->user_agent, msg->user_agent, sizeof(proc->user_agent));
+		strlcpy(proc->info->user_agent, msg->user_agent, sizeof(proc->info->user_agent));
 	}
 
 	if (msg->device_type != NULL) {
-		strlcpy(proc->device_type, msg->device_type, sizeof(proc->device_type));
+		strlcpy(proc->info->device_type, msg->device_type, sizeof(proc->info->device_type));
 	}
 
 	if (msg->device_platform != NULL) {
-		strlcpy(proc->device_platform, msg->device_platform, sizeof(proc->device_platform));
+		strlcpy(proc->info->device_platform, msg->device_platform, sizeof(proc->info->device_platform));
 	}
 
 	/* override the group name in order to load the correct configuration in
@@ -554,6 +741,58 @@ int session_open(main_server_st *s, struct proc_st *proc, const uint8_t *cookie,
 	return 0;
 }
 
+static int session_close_sid(main_server_st *s, const uint8_t sid[SID_SIZE]);
+
+/* The reply to session_open(). The message is allocated under mpool,
+ * which is taken over by the proc, as its config is kept there, or
+ * freed. */
+static int handle_session_open_rep(main_server_st *s, SecmSessionReplyMsg *msg, void *mpool)
+{
+	struct secm_req_st *req;
+	struct proc_st *proc;
+	int ret;
+
+	req = secm_req_complete(s, CMD_SECM_SESSION_OPEN, msg->has_id, msg->id);
+	if (req == NULL) {
+		if (msg->has_id == 0) {
+			mslog(s, NULL, LOG_ERR, "received session reply for an unknown request");
+			talloc_free(mpool);
+			return ERR_BAD_COMMAND;
+		}
+
+		/* it was given up by secm_reqs_expire() */
+		mslog(s, NULL, LOG_INFO, "received session reply for an expired request");
+		ret = 0;
+		if (msg->reply == AUTH__REP__OK && msg->sid.len == SID_SIZE)
+			ret = session_close_sid(s, msg->sid.data);
+		talloc_free(mpool);
+		return ret;
+	}
+
+	proc = req->proc;
+	if (proc == NULL) {
+		/* the worker went away meanwhile */
+		ret = 0;
+		if (msg->reply == AUTH__REP__OK)
+			ret = session_close_sid(s, req->sid);
+		secm_req_free(s, req);
+		talloc_free(mpool);
+		return ret;
+	}
+
+	talloc_steal(proc, mpool);
+
+	ret = session_open_rep(s, proc, msg);
+	ret = handle_auth_cookie_rep(s, proc, req->sid, ret);
+	secm_req_free(s, req);
+
+	ret = handle_cookie_auth_res(s, proc, AUTH_COOKIE_REQ, ret);
+	if (ret < 0)
+		remove_proc(s, proc, RPROC_KILL);
+
+	return 0;
+}
+
 static void reset_stats(main_server_st *s, time_t now)
 {
 	mslog(s, NULL, LOG_INFO, "Start statistics block");
@@ -570,6 +809,9 @@ static void reset_stats(main_server_st *s, time_t now)
 	mslog(s, NULL, LOG_INFO, "Maximum authentication time: %lu sec", (unsigned long)s->stats.max_auth_time);
 	mslog(s, NULL, LOG_INFO, "Average authentication time: %lu sec", (unsigned long)s->stats.avg_auth_time);
 	mslog(s, NULL, LOG_INFO, "Data in: %lu, out: %lu kbytes", (unsigned long)s->stats.kbytes_in, (unsigned long)s->stats.kbytes_out);
+	mslog(s, NULL, LOG_INFO, "Connections admitted: %lu, rejected: %lu", (unsigned long)s->stats.conns_admitted, (unsigned long)s->stats.conns_rejected);
+	mslog(s, NULL, LOG_INFO, "Average admission wait: %lu usec, worker start: %lu usec", (unsigned long)s->stats.avg_admit_wait, (unsigned long)s->stats.avg_worker_start);
+	mslog(s, NULL, LOG_INFO, "Average session open: %lu usec, close: %lu usec", (unsigned long)s->stats.avg_session_open, (unsigned long)s->stats.avg_session_close);
 	mslog(s, NULL, LOG_INFO, "End of statistics block; resetting non-total stats");
 
 	s->stats.session_idle_timeouts = 0;
@@ -580,6 +822,18 @@ static void reset_stats(main_server_st *s, time_t now)
 	s->stats.last_reset = now;
 	s->stats.kbytes_in = 0;
 	s->stats.kbytes_out = 0;
+	s->stats.conns_admitted = 0;
+	s->stats.conns_rejected = 0;
+	s->stats.avg_admit_wait = 0;
+	s->stats.max_admit_wait = 0;
+	s->stats.avg_worker_start = 0;
+	s->stats.max_worker_start = 0;
+	s->stats.session_opens = 0;
+	s->stats.session_closes = 0;
+	s->stats.avg_session_open = 0;
+	s->stats.max_session_open = 0;
+	s->stats.avg_session_close = 0;
+	s->stats.max_session_close = 0;
 	s->stats.max_session_mins = 0;
 	s->stats.max_auth_time = 0;
 }
@@ -640,12 +894,18 @@ static void update_main_stats(main_server_st * s, struct proc_st *proc)
 	reset_stats(s, now);
 }
 
+/* Sends a session close for the proc to sec-mod. The proc is released
+ * with release_proc() once it replies with the session's statistics,
+ * or by secm_reqs_expire() if it does not reply in time. */
 int session_close(main_server_st * s, struct proc_st *proc)
 {
-	int ret, e;
+	int ret;
 	SecmSessionCloseMsg ireq = SECM_SESSION_CLOSE_MSG__INIT;
-	CliStatsMsg *msg = NULL;
-	PROTOBUF_ALLOCATOR(pa, proc);
+	struct secm_req_st *req;
+
+	req = secm_req_new(s, proc, CMD_SECM_SESSION_CLOSE, proc->sid);
+	if (req == NULL)
+		return -1;
 
 	ireq.uptime = time(0)-proc->conn_time;
 	ireq.has_uptime = 1;
@@ -655,35 +915,84 @@ int session_close(main_server_st * s, struct proc_st *proc)
 	ireq.has_bytes_out = 1;
 	ireq.sid.data = proc->sid;
 	ireq.sid.len = sizeof(proc->sid);
+	ireq.has_id = 1;
+	ireq.id = req->id;
 
 	mslog(s, proc, LOG_DEBUG, "sending msg %s to sec-mod", cmd_request_to_str(CMD_SECM_SESSION_CLOSE));
 
-	ret = send_msg(proc, s->sec_mod_fd_sync, CMD_SECM_SESSION_CLOSE,
+	ret = send_msg(proc, s->sec_mod_fd, CMD_SECM_SESSION_CLOSE,
 		&ireq, (pack_size_func)secm_session_close_msg__get_packed_size,
 		(pack_func)secm_session_close_msg__pack);
 	if (ret < 0) {
 		mslog(s, proc, LOG_ERR,
 		      "error sending message to sec-mod cmd socket");
+		secm_req_free(s, req);
 		return -1;
 	}
 
-	ret = recv_msg(proc, s->sec_mod_fd_sync, CMD_SECM_CLI_STATS,
-	       (void *)&msg, (unpack_func) cli_stats_msg__unpack, MAIN_SEC_MOD_TIMEOUT);
+	return 0;
+}
+
+/* Closes a session that was opened for a proc no longer present */
+static int session_close_sid(main_server_st *s, const uint8_t sid[SID_SIZE])
+{
+	int ret;
+	SecmSessionCloseMsg ireq = SECM_SESSION_CLOSE_MSG__INIT;
+	struct secm_req_st *req;
+
+	req = secm_req_new(s, NULL, CMD_SECM_SESSION_CLOSE, sid);
+	if (req == NULL)
+		return ERR_MEM;
+
+	ireq.sid.data = req->sid;
+	ireq.sid.len = sizeof(req->sid);
+	ireq.has_id = 1;
+	ireq.id = req->id;
+
+	ret = send_msg(NULL, s->sec_mod_fd, CMD_SECM_SESSION_CLOSE,
+		&ireq, (pack_size_func)secm_session_close_msg__get_packed_size,
+		(pack_func)secm_session_close_msg__pack);
 	if (ret < 0) {
-		e = errno;
-		mslog(s, proc, LOG_ERR, "error receiving auth cli stats message from sec-mod cmd socket: %s", strerror(e));
-		return ret;
+		mslog(s, NULL, LOG_ERR,
+		      "error sending message to sec-mod cmd socket");
+		secm_req_free(s, req);
+		return ERR_BAD_COMMAND;
 	}
 
-	proc->bytes_in = msg->bytes_in;
-	proc->bytes_out = msg->bytes_out;
-	if (msg->has_discon_reason) {
-		proc->discon_reason = msg->discon_reason;
+	return 0;
+}
+
+/* The reply to session_close() */
+static int handle_session_close_rep(main_server_st *s, CliStatsMsg *msg)
+{
+	struct secm_req_st *req;
+	struct proc_st *proc;
+
+	req = secm_req_complete(s, CMD_SECM_SESSION_CLOSE, msg->has_id, msg->id);
+	if (req == NULL) {
+		if (msg->has_id == 0) {
+			mslog(s, NULL, LOG_ERR, "received session stats for an unknown request");
+			return ERR_BAD_COMMAND;
+		}
+
+		/* it was given up by secm_reqs_expire() */
+		mslog(s, NULL, LOG_INFO, "received session stats for an expired request");
+		return 0;
 	}
 
-	update_main_stats(s, proc);
+	proc = req->proc;
+	secm_req_free(s, req);
+
+	if (proc != NULL) {
+		proc->bytes_in = msg->bytes_in;
+		proc->bytes_out = msg->bytes_out;
+		if (msg->has_discon_reason) {
+			proc->discon_reason = msg->discon_reason;
+		}
 
-	cli_stats_msg__free_unpacked(msg, &pa);
+		update_main_stats(s, proc);
+		release_proc(s, proc);
+	}
 
 	return 0;
 }
@@ -801,7 +1110,8 @@ int run_sec_mod(main_server_st *s, int *sync_fd)
 		set_cloexec_flag (fd[0], 1);
 		set_cloexec_flag (sfd[0], 1);
 		clear_unneeded_mem(s->vconfig);
-		sec_mod_server(s->main_pool, s->config_pool, s->vconfig, p, fd[0], sfd[0], sizeof(s->hmac_key), s->hmac_key);
+		sec_mod_server(s->main_pool, s->config_pool, s->vconfig, p, fd[0], sfd[0], sizeof(s->hmac_key), s->hmac_key,
+			       s->cookie_key_set ? s->cookie_key : NULL);
 		exit(0);
 	} else if (pid > 0) {	/* parent */
 		close(fd[0]);
@@ -0,0 +1,395 @@
+/*
+ * Copyright (C) 2026 Nikos Mavrogiannopoulos
+ *
+ * Author: Nikos Mavrogiannopoulos
+ *
+ * This file is part of ocserv.
+ *
+ * ocserv is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <main-udp-steer.h>
+
+#ifdef ENABLE_UDP_STEERING
+#include <sys/syscall.h>
+#include <linux/bpf.h>
+#include <ip-util.h>
+
+/* The UDP listeners are put into an SO_REUSEPORT group, together with
+ * an unconnected socket for each worker that may use DTLS. An eBPF
+ * program attached to the group looks up the DTLS session ID of a
+ * client hello, and steers the datagram to the socket of the worker
+ * that owns the session. Anything else goes to the listener, i.e.,
+ * to forward_udp_to_owner(), or is dropped if the listener cannot be
+ * selected. The worker connects its socket to the client once it
+ * receives the hello, so that main stays out of the UDP path of the
+ * session.
+ */
+
+/* offsets in the UDP datagram, which the program sees along with the
+ * 8-byte UDP header */
+#define STEER_RECORD_POS 8
+/* record header, handshake header, client version, random */
+#define STEER_SESSION_ID_LEN_POS (13+12+2+32)
+#define STEER_SESSION_ID_SIZE 32
+#define STEER_HELLO_SIZE (STEER_SESSION_ID_LEN_POS+1+STEER_SESSION_ID_SIZE)
+
+#define INSN(c, d, s, o, i) \
+	((struct bpf_insn) { .code = (c), .dst_reg = (d), .src_reg = (s), .off = (o), .imm = (i) })
+#define MOV64_REG(d, s) INSN(BPF_ALU64|BPF_MOV|BPF_X, d, s, 0, 0)
+#define MOV64_IMM(d, i) INSN(BPF_ALU64|BPF_MOV|BPF_K, d, 0, 0, i)
+#define ADD64_IMM(d, i) INSN(BPF_ALU64|BPF_ADD|BPF_K, d, 0, 0, i)
+#define LDX_MEM(sz, d, s, o) INSN(BPF_LDX|BPF_MEM|sz, d, s, o, 0)
+#define STX_MEM(sz, d, s, o) INSN(BPF_STX|BPF_MEM|sz, d, s, o, 0)
+#define ST_MEM(sz, d, o, i) INSN(BPF_ST|BPF_MEM|sz, d, 0, o, i)
+#define JNE_IMM(d, i, o) INSN(BPF_JMP|BPF_JNE|BPF_K, d, 0, o, i)
+#define JEQ_IMM(d, i, o) INSN(BPF_JMP|BPF_JEQ|BPF_K, d, 0, o, i)
+#define CALL(f) INSN(BPF_JMP|BPF_CALL, 0, 0, 0, f)
+#define EXIT() INSN(BPF_JMP|BPF_EXIT, 0, 0, 0, 0)
+#define LD_MAP_FD(d, fd) \
+	INSN(BPF_LD|BPF_DW|BPF_IMM, d, BPF_PSEUDO_MAP_FD, 0, fd), INSN(0, 0, 0, 0, 0)
+
+/* the stack layout of the program */
+#define FP_HELLO (-(STEER_HELLO_SIZE+4))
+#define FP_SESSION_ID (FP_HELLO+STEER_SESSION_ID_LEN_POS+1)
+#define FP_SLOT (FP_HELLO-4)
+
+/* the instruction the checks jump to when a datagram is not steered */
+#define FALLBACK 37
+#define J(pc) (FALLBACK-(pc)-1)
+
+static int sys_bpf(int cmd, union bpf_attr *attr)
+{
+	return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+static int steer_map_create(unsigned type, unsigned key_size, unsigned value_size,
+			    unsigned max_entries)
+{
+	union bpf_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_type = type;
+	attr.key_size = key_size;
+	attr.value_size = value_size;
+	attr.max_entries = max_entries;
+
+	return sys_bpf(BPF_MAP_CREATE, &attr);
+}
+
+static int steer_map_update(int map_fd, const void *key, const void *value)
+{
+	union bpf_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = map_fd;
+	attr.key = (uintptr_t)key;
+	attr.value = (uintptr_t)value;
+	attr.flags = BPF_ANY;
+
+	return sys_bpf(BPF_MAP_UPDATE_ELEM, &attr);
+}
+
+static int steer_map_delete(int map_fd, const void *key)
+{
+	union bpf_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = map_fd;
+	attr.key = (uintptr_t)key;
+
+	return sys_bpf(BPF_MAP_DELETE_ELEM, &attr);
+}
+
+/* Steers client hellos with a known session ID to the worker's socket,
+ * and removes the session from the map; the worker connects its socket
+ * to the client on the first hello. Everything else is steered to the
+ * listener in slot 0, and dropped if that fails. */
+static int steer_prog_load(int socks_fd, int sessions_fd)
+{
+	struct bpf_insn prog[] = {
+		/* 0 */ MOV64_REG(BPF_REG_6, BPF_REG_1),
+		MOV64_REG(BPF_REG_1, BPF_REG_6),
+		MOV64_IMM(BPF_REG_2, STEER_RECORD_POS),
+		MOV64_REG(BPF_REG_3, BPF_REG_10),
+		ADD64_IMM(BPF_REG_3, FP_HELLO),
+		/* 5 */ MOV64_IMM(BPF_REG_4, STEER_HELLO_SIZE),
+		CALL(BPF_FUNC_skb_load_bytes),
+		JNE_IMM(BPF_REG_0, 0, J(7)),
+		/* content type: handshake */
+		LDX_MEM(BPF_B, BPF_REG_1, BPF_REG_10, FP_HELLO),
+		JNE_IMM(BPF_REG_1, 22, J(9)),
+		/* 10: handshake type: client hello */
+		LDX_MEM(BPF_B, BPF_REG_1, BPF_REG_10, FP_HELLO+13),
+		JNE_IMM(BPF_REG_1, 1, J(11)),
+		LDX_MEM(BPF_B, BPF_REG_1, BPF_REG_10, FP_HELLO+STEER_SESSION_ID_LEN_POS),
+		JNE_IMM(BPF_REG_1, STEER_SESSION_ID_SIZE, J(13)),
+		/* 14 */ LD_MAP_FD(BPF_REG_1, sessions_fd),
+		/* 16 */ MOV64_REG(BPF_REG_2, BPF_REG_10),
+		ADD64_IMM(BPF_REG_2, FP_SESSION_ID),
+		CALL(BPF_FUNC_map_lookup_elem),
+		JEQ_IMM(BPF_REG_0, 0, J(19)),
+		/* 20 */ LDX_MEM(BPF_W, BPF_REG_1, BPF_REG_0, 0),
+		STX_MEM(BPF_W, BPF_REG_10, BPF_REG_1, FP_SLOT),
+		MOV64_REG(BPF_REG_1, BPF_REG_6),
+		/* 23 */ LD_MAP_FD(BPF_REG_2, socks_fd),
+		/* 25 */ MOV64_REG(BPF_REG_3, BPF_REG_10),
+		ADD64_IMM(BPF_REG_3, FP_SLOT),
+		MOV64_IMM(BPF_REG_4, 0),
+		CALL(BPF_FUNC_sk_select_reuseport),
+		JNE_IMM(BPF_REG_0, 0, J(29)),
+		/* 30 */ LD_MAP_FD(BPF_REG_1, sessions_fd),
+		/* 32 */ MOV64_REG(BPF_REG_2, BPF_REG_10),
+		ADD64_IMM(BPF_REG_2, FP_SESSION_ID),
+		CALL(BPF_FUNC_map_delete_elem),
+		MOV64_IMM(BPF_REG_0, SK_PASS),
+		/* 36 */ EXIT(),
+		/* 37: FALLBACK */ ST_MEM(BPF_W, BPF_REG_10, FP_SLOT, 0),
+		MOV64_REG(BPF_REG_1, BPF_REG_6),
+		/* 39 */ LD_MAP_FD(BPF_REG_2, socks_fd),
+		/* 41 */ MOV64_REG(BPF_REG_3, BPF_REG_10),
+		ADD64_IMM(BPF_REG_3, FP_SLOT),
+		MOV64_IMM(BPF_REG_4, 0),
+		CALL(BPF_FUNC_sk_select_reuseport),
+		/* 45: on failure the kernel would pick a socket by hash,
+		 * possibly a worker's */
+		MOV64_REG(BPF_REG_1, BPF_REG_0),
+		MOV64_IMM(BPF_REG_0, SK_PASS),
+		JEQ_IMM(BPF_REG_1, 0, 1),
+		MOV64_IMM(BPF_REG_0, SK_DROP),
+		/* 49 */ EXIT(),
+	};
+	union bpf_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.prog_type = BPF_PROG_TYPE_SK_REUSEPORT;
+	attr.insns = (uintptr_t)prog;
+	attr.insn_cnt = sizeof(prog)/sizeof(prog[0]);
+	attr.license = (uintptr_t)"GPL";
+
+	return sys_bpf(BPF_PROG_LOAD, &attr);
+}
+
+static void steer_free(struct udp_steer_st *st)
+{
+	if (st->prog_fd != -1)
+		close(st->prog_fd);
+	if (st->sessions_fd != -1)
+		close(st->sessions_fd);
+	if (st->socks_fd != -1)
+		close(st->socks_fd);
+	talloc_free(st);
+}
+
+/* Sets up steering for a UDP listener that was bound with SO_REUSEPORT.
+ * On failure the listener is used as before. */
+void udp_steer_attach(main_server_st *s, struct listener_st *l)
+{
+	struct udp_steer_st *st;
+	unsigned slots, i;
+	uint32_t key = 0;
+	uint64_t value = l->fd;
+	int e;
+
+	if (GETCONFIG(s)->udp_steering == 0 || l->sock_type != SOCK_TYPE_UDP)
+		return;
+
+	slots = GETCONFIG(s)->max_clients;
+	if (slots == 0)
+		slots = UDP_STEER_DEFAULT_SLOTS;
+
+	st = talloc_zero(l, struct udp_steer_st);
+	if (st == NULL)
+		return;
+	st->prog_fd = st->sessions_fd = -1;
+
+	st->free_slots = talloc_array(st, uint32_t, slots);
+	if (st->free_slots == NULL)
+		goto fail;
+
+	/* hand out the lower slots first */
+	for (i = 0; i < slots; i++)
+		st->free_slots[i] = slots - i;
+	st->free_slots_size = slots;
+
+	st->socks_fd = steer_map_create(BPF_MAP_TYPE_REUSEPORT_SOCKARRAY,
+					sizeof(uint32_t), sizeof(uint64_t), slots + 1);
+	if (st->socks_fd == -1)
+		goto fail;
+
+	st->sessions_fd = steer_map_create(BPF_MAP_TYPE_HASH,
+					   STEER_SESSION_ID_SIZE, sizeof(uint32_t), slots);
+	if (st->sessions_fd == -1)
+		goto fail;
+
+	st->prog_fd = steer_prog_load(st->socks_fd, st->sessions_fd);
+	if (st->prog_fd == -1)
+		goto fail;
+
+	if (steer_map_update(st->socks_fd, &key, &value) < 0)
+		goto fail;
+
+	if (setsockopt(l->fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_EBPF,
+		       &st->prog_fd, sizeof(st->prog_fd)) < 0)
+		goto fail;
+
+	l->steer = st;
+	return;
+
+ fail:
+	e = errno;
+	mslog(s, NULL, LOG_WARNING, "could not set up UDP steering: %s", strerror(e));
+	steer_free(st);
+}
+
+void udp_steer_close(struct listener_st *l)
+{
+	if (l->steer == NULL)
+		return;
+
+	steer_free(l->steer);
+	l->steer = NULL;
+}
+
+/* Returns the steered UDP listener a client of proc would send its
+ * datagrams to, if any */
+static struct listener_st *find_listener(main_server_st *s, struct proc_st *proc)
+{
+	struct listener_st *l = NULL;
+	int family = proc->our_addr.ss_family;
+
+	if (family != AF_INET && family != AF_INET6)
+		return NULL;
+
+	list_for_each(&s->listen_list.head, l, list) {
+		if (l->steer == NULL || l->family != family)
+			continue;
+
+		if (family == AF_INET) {
+			if (SA_IN_P(&l->addr)->s_addr == htonl(INADDR_ANY) ||
+			    SA_IN_P(&l->addr)->s_addr == SA_IN_P(&proc->our_addr)->s_addr)
+				return l;
+		} else {
+			if (IN6_IS_ADDR_UNSPECIFIED(SA_IN6_P(&l->addr)) ||
+			    IN6_ARE_ADDR_EQUAL(SA_IN6_P(&l->addr), SA_IN6_P(&proc->our_addr)))
+				return l;
+		}
+	}
+
+	return NULL;
+}
+
+/* Passes the worker of proc an unconnected socket in the SO_REUSEPORT
+ * group of its UDP listener, and registers its DTLS session ID, so
+ * that its client hello is steered to that socket. */
+void udp_steer_add(main_server_st *s, struct proc_st *proc)
+{
+	UdpFdMsg msg = UDP_FD_MSG__INIT;
+	struct listener_st *l;
+	struct udp_steer_st *st;
+	uint32_t slot;
+	uint64_t value;
+	int sfd, ret, e;
+
+	if (proc->dtls_session_id_size != STEER_SESSION_ID_SIZE ||
+	    proc->udp_steer != NULL)
+		return;
+
+	l = find_listener(s, proc);
+	if (l == NULL)
+		return;
+	st = l->steer;
+
+	if (st->free_slots_size == 0) {
+		mslog(s, proc, LOG_DEBUG, "no free UDP steering slot");
+		return;
+	}
+
+	sfd = socket(l->family, SOCK_DGRAM, l->protocol);
+	if (sfd < 0) {
+		e = errno;
+		mslog(s, proc, LOG_ERR, "new UDP socket failed: %s", strerror(e));
+		return;
+	}
+
+	set_worker_udp_opts(s, sfd, l->family);
+	set_udp_socket_options(GETPCONFIG(s), sfd, l->family);
+
+	if (bind(sfd, (struct sockaddr *)&l->addr, l->addr_len) < 0) {
+		e = errno;
+		mslog(s, proc, LOG_ERR, "bind UDP steering socket: %s", strerror(e));
+		goto fail;
+	}
+
+	slot = st->free_slots[st->free_slots_size - 1];
+	value = sfd;
+
+	if (steer_map_update(st->socks_fd, &slot, &value) < 0 ||
+	    steer_map_update(st->sessions_fd, proc->dtls_session_id, &slot) < 0) {
+		e = errno;
+		mslog(s, proc, LOG_ERR, "could not register UDP steering socket: %s", strerror(e));
+		steer_map_delete(st->socks_fd, &slot);
+		goto fail;
+	}
+
+	msg.hello = 0;
+	msg.has_steered = 1;
+	msg.steered = 1;
+
+	ret = send_socket_msg_to_worker(s, proc, CMD_UDP_FD, sfd, &msg,
+					(pack_size_func)udp_fd_msg__get_packed_size,
+					(pack_func)udp_fd_msg__pack);
+	if (ret < 0) {
+		mslog(s, proc, LOG_ERR, "error passing UDP steering socket");
+		steer_map_delete(st->sessions_fd, proc->dtls_session_id);
+		steer_map_delete(st->socks_fd, &slot);
+		goto fail;
+	}
+
+	st->free_slots_size--;
+	proc->udp_steer = l;
+	proc->udp_steer_slot = slot;
+
+	/* the kernel drops the socket from the map once the worker
+	 * closes it */
+ fail:
+	close(sfd);
+}
+
+void udp_steer_del(main_server_st *s, struct proc_st *proc)
+{
+	struct udp_steer_st *st;
+
+	if (proc->udp_steer == NULL)
+		return;
+	st = proc->udp_steer->steer;
+
+	/* either may have been removed already */
+	steer_map_delete(st->sessions_fd, proc->dtls_session_id);
+	steer_map_delete(st->socks_fd, &proc->udp_steer_slot);
+
+	st->free_slots[st->free_slots_size++] = proc->udp_steer_slot;
+	proc->udp_steer = NULL;
+}
+#endif
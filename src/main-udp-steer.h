@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2026 Nikos Mavrogiannopoulos
+ *
+ * Author: Nikos Mavrogiannopoulos
+ *
+ * This file is part of ocserv.
+ *
+ * ocserv is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#ifndef MAIN_UDP_STEER_H
+# define MAIN_UDP_STEER_H
+
+#include <sys/socket.h>
+
+#if defined(__linux__) && defined(HAVE_LINUX_BPF_H) && defined(SO_ATTACH_REUSEPORT_EBPF)
+# define ENABLE_UDP_STEERING 1
+#endif
+
+#ifdef ENABLE_UDP_STEERING
+# include "main.h"
+
+/* The number of sessions a UDP listener can steer when max-clients
+ * is not set. */
+# define UDP_STEER_DEFAULT_SLOTS 4096
+
+/* The eBPF state of a UDP listener. Slot 0 of the socket array holds
+ * the listener itself; the others hold a socket of a worker. */
+struct udp_steer_st {
+	int socks_fd; /* BPF_MAP_TYPE_REUSEPORT_SOCKARRAY */
+	int sessions_fd; /* DTLS session ID -> slot */
+	int prog_fd;
+
+	uint32_t *free_slots;
+	unsigned free_slots_size;
+};
+
+void udp_steer_attach(main_server_st *s, struct listener_st *l);
+void udp_steer_close(struct listener_st *l);
+void udp_steer_add(main_server_st *s, struct proc_st *proc);
+void udp_steer_del(main_server_st *s, struct proc_st *proc);
+#else
+# define udp_steer_attach(s, l)
+# define udp_steer_close(l)
+# define udp_steer_add(s, proc)
+# define udp_steer_del(s, proc)
+#endif
+
+#endif
@@ -58,6 +58,7 @@
 #include <tun.h>
 #include <main.h>
 #include <main-ban.h>
+#include <main-udp-steer.h>
 #include <ccan/list/list.h>
 
 int set_tun_mtu(main_server_st * s, struct proc_st *proc, unsigned mtu)
@@ -109,6 +110,8 @@ int handle_script_exit(main_server_st *s, struct proc_st *proc, int code)
 			goto fail;
 		}
 
+		udp_steer_add(s, proc);
+
 		ret = apply_iroutes(s, proc);
 		if (ret < 0) {
 			mslog(s, proc, LOG_ERR,
@@ -197,7 +200,7 @@ static int accept_user(main_server_st * s, struct proc_st *proc, unsigned cmd)
  * @cmd: the command received
  * @result: the auth result
  */
-static int handle_cookie_auth_res(main_server_st *s, struct proc_st *proc,
+int handle_cookie_auth_res(main_server_st *s, struct proc_st *proc,
 			   unsigned cmd, int result)
 {
 	int ret;
@@ -371,29 +374,29 @@ int handle_worker_commands(main_server_st * s, struct proc_st *proc)
 			}
 
 			if (tmsg->tls_ciphersuite)
-				strlcpy(proc->tls_ciphersuite, tmsg->tls_ciphersuite,
-					 sizeof(proc->tls_ciphersuite));
+				strlcpy(proc->info->tls_ciphersuite, tmsg->tls_ciphersuite,
+					 sizeof(proc->info->tls_ciphersuite));
 			if (tmsg->dtls_ciphersuite)
-				strlcpy(proc->dtls_ciphersuite, tmsg->dtls_ciphersuite,
-					 sizeof(proc->dtls_ciphersuite));
+				strlcpy(proc->info->dtls_ciphersuite, tmsg->dtls_ciphersuite,
+					 sizeof(proc->info->dtls_ciphersuite));
 			if (tmsg->cstp_compr)
-				strlcpy(proc->cstp_compr, tmsg->cstp_compr,
-					 sizeof(proc->cstp_compr));
+				strlcpy(proc->info->cstp_compr, tmsg->cstp_compr,
+					 sizeof(proc->info->cstp_compr));
 			if (tmsg->dtls_compr)
-				strlcpy(proc->dtls_compr, tmsg->dtls_compr,
-					 sizeof(proc->dtls_compr));
+				strlcpy(proc->info->dtls_compr, tmsg->dtls_compr,
+					 sizeof(proc->info->dtls_compr));
 
 			if (tmsg->user_agent && tmsg->device_type == NULL)
-				strlcpy(proc->user_agent, tmsg->user_agent,
-					 sizeof(proc->user_agent));
+				strlcpy(proc->info->user_agent, tmsg->user_agent,
+					 sizeof(proc->info->user_agent));
 			else if (tmsg->user_agent && tmsg->device_type)
-				snprintf(proc->user_agent, sizeof(proc->user_agent), "%s / %s",
+				snprintf(proc->info->user_agent, sizeof(proc->info->user_agent), "%s / %s",
 					 tmsg->user_agent, tmsg->device_type);
 
 			if (tmsg->hostname) {
-				strlcpy(proc->hostname, tmsg->hostname,
-					 sizeof(proc->hostname));
-				mslog(s, proc, LOG_DEBUG, "setting worker hostname to '%s'", proc->hostname);
+				strlcpy(proc->info->hostname, tmsg->hostname,
+					 sizeof(proc->info->hostname));
+				mslog(s, proc, LOG_DEBUG, "setting worker hostname to '%s'", proc->info->hostname);
 				user_hostname_update(s, proc);
 			}
 
@@ -422,7 +425,7 @@ int handle_worker_commands(main_server_st * s, struct proc_st *proc)
 
 		break;
 	case AUTH_COOKIE_REQ:
-		if (proc->status != PS_AUTH_INACTIVE) {
+		if (proc->status != PS_AUTH_INACTIVE || proc->secm_req != NULL) {
 			mslog(s, proc, LOG_ERR,
 			      "received unexpected cookie authentication.");
 			ret = ERR_BAD_COMMAND;
@@ -444,6 +447,10 @@ int handle_worker_commands(main_server_st * s, struct proc_st *proc)
 
 		auth_cookie_request_msg__free_unpacked(auth_cookie_req, &pa);
 
+		/* the reply of sec-mod completes it */
+		if (ret == ERR_WAIT_FOR_SECMOD)
+			break;
+
 		ret = handle_cookie_auth_res(s, proc, cmd, ret);
 		if (ret < 0) {
 			goto cleanup;
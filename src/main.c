@@ -55,14 +55,19 @@
 #include <main.h>
 #include <main-ctl.h>
 #include <main-ban.h>
+#include <main-ban-filter.h>
+#include <main-udp-steer.h>
 #include <route-add.h>
 #include <worker.h>
 #include <proc-search.h>
 #include <tun.h>
 #include <grp.h>
 #include <ip-lease.h>
+#include <icmp-ping.h>
 #include <ccan/list/list.h>
 #include <hmac.h>
+#include <sealed-cookie.h>
+#include <gettime.h>
 
 #ifdef HAVE_GSSAPI
 # include <libtasn1.h>
@@ -75,16 +80,31 @@ int saved_argc = 0;
 char **saved_argv = NULL;
 
 static void listen_watcher_cb (EV_P_ ev_io *w, int revents);
+static void prefork_refill(main_server_st *s);
+static void prefork_flush(main_server_st *s);
+static void ticket_key_setup(main_server_st *s);
+static void ban_filter_reload(main_server_st *s);
+static void admit_queue_flush(main_server_st *s);
 
 int syslog_open = 0;
 sigset_t sig_default_set;
 struct ev_loop *loop = NULL;
 static unsigned allow_broken_clients = 0;
 
+/* when the next connection may be accepted; see rate-limit-ms */
+static ev_tstamp admit_next = 0;
+static unsigned listeners_paused = 0;
+
 /* EV watchers */
 ev_io ctl_watcher;
 ev_io sec_mod_watcher;
 ev_timer maintenance_watcher;
+ev_timer prefork_watcher;
+ev_timer ticket_key_watcher;
+ev_timer ban_expire_watcher;
+ev_timer secm_req_watcher;
+ev_timer admit_watcher;
+ev_timer admit_resume_watcher;
 ev_signal maintenance_sig_watcher;
 ev_signal term_sig_watcher;
 ev_signal int_sig_watcher;
@@ -106,6 +126,10 @@ static void add_listener(void *pool, struct listen_list_st *list,
 	tmp->addr_len = addr_len;
 	memcpy(&tmp->addr, addr, addr_len);
 
+	/* connections are accepted in batches until EAGAIN */
+	if (socktype != SOCK_TYPE_UDP)
+		set_non_block(fd);
+
 	ev_init(&tmp->io, listen_watcher_cb);
 	ev_io_set(&tmp->io, fd, EV_READ);
 
@@ -113,12 +137,20 @@ static void add_listener(void *pool, struct listen_list_st *list,
 	list->total++;
 }
 
-static void set_udp_socket_options(struct perm_cfg_st* config, int fd, int family)
+void set_udp_socket_options(struct perm_cfg_st* config, int fd, int family)
 {
 int y;
 	if (config->config->try_mtu) {
 		set_mtu_disc(fd, family, 1);
 	}
+#ifdef ENABLE_UDP_STEERING
+	if (config->config->udp_steering) {
+		y = 1;
+		if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT,
+			       (const void *)&y, sizeof(y)) < 0)
+			perror("setsockopt(SO_REUSEPORT) failed");
+	}
+#endif
 #if defined(IP_PKTINFO)
 	y = 1;
 	if (setsockopt(fd, SOL_IP, IP_PKTINFO,
@@ -441,7 +473,6 @@ listen_ports(void *pool, struct perm_cfg_st* config,
 
 /* Sets the options needed in the UDP socket we forward to
  * worker */
-static
 void set_worker_udp_opts(main_server_st *s, int fd, int family)
 {
 int y;
@@ -608,8 +639,10 @@ void clear_lists(main_server_st *s)
 	struct listener_st *ltmp = NULL, *lpos;
 	struct proc_st *ctmp = NULL, *cpos;
 	struct script_wait_st *script_tmp = NULL, *script_pos;
+	struct prefork_st *ptmp = NULL, *ppos;
 
 	list_for_each_safe(&s->listen_list.head, ltmp, lpos, list) {
+		udp_steer_close(ltmp);
 		close(ltmp->fd);
 		list_del(&ltmp->list);
 		talloc_free(ltmp);
@@ -635,9 +668,21 @@ void clear_lists(main_server_st *s)
 		talloc_free(script_tmp);
 	}
 
+	list_for_each_safe(&s->prefork_list.head, ptmp, ppos, list) {
+		close(ptmp->cmd_fd);
+		list_del(&ptmp->list);
+		ev_child_stop(loop, &ptmp->ev_child);
+		talloc_free(ptmp);
+		s->prefork_list.total--;
+	}
+
+	admit_queue_flush(s);
+
+	icmp_prober_deinit(s);
 	ip_lease_deinit(&s->ip_leases);
 	proc_table_deinit(s);
 	ctl_handler_deinit(s);
+	ban_filter_deinit(s);
 	main_ban_db_deinit(s);
 
 	/* clear libev state */
@@ -646,6 +691,11 @@ void clear_lists(main_server_st *s)
 		ev_io_stop (loop, &sec_mod_watcher);
 		ev_child_stop (loop, &child_watcher);
 		ev_timer_stop(loop, &maintenance_watcher);
+		ev_timer_stop(loop, &ban_expire_watcher);
+		ev_timer_stop(loop, &secm_req_watcher);
+		ev_timer_stop(loop, &prefork_watcher);
+		ev_timer_stop(loop, &admit_watcher);
+		ev_timer_stop(loop, &admit_resume_watcher);
 		/* free memory and descriptors by the event loop */
 		ev_loop_destroy (loop);
 	}
@@ -1034,6 +1084,9 @@ static void kill_children(main_server_st* s)
 {
 	struct proc_st *ctmp = NULL, *cpos;
 
+	ev_timer_stop(loop, &prefork_watcher);
+	prefork_flush(s);
+
 	/* kill the security module server */
 	list_for_each_safe(&s->proc_list.head, ctmp, cpos, list) {
 		if (ctmp->pid != -1) {
@@ -1097,6 +1150,15 @@ static void reload_sig_watcher_cb(struct ev_loop *loop, ev_signal *w, int revent
 	}
 
 	reload_cfg_file(s->config_pool, s->vconfig, 0);
+	ticket_key_setup(s);
+	ban_filter_reload(s);
+	main_ban_db_load_rules(s);
+	ip_lease_pools_reload(s);
+	icmp_prober_setup(s);
+
+	/* the idle workers were forked with the previous configuration */
+	prefork_flush(s);
+	prefork_refill(s);
 }
 
 static void cmd_watcher_cb (EV_P_ ev_io *w, int revents)
@@ -1112,159 +1174,649 @@ static void cmd_watcher_cb (EV_P_ ev_io *w, int revents)
 	}
 }
 
-static void listen_watcher_cb (EV_P_ ev_io *w, int revents)
+/* Sets the fields of ws that identify the connection being accepted,
+ * and the HMAC that binds them, which sec-mod verifies. */
+static void set_worker_conn(main_server_st *s, struct worker_st *ws)
+{
+	hmac_component_st hmac_components[3];
+
+	ws->session_start_time = time(0);
+
+	human_addr2((const struct sockaddr *)&ws->remote_addr, ws->remote_addr_len, ws->remote_ip_str, sizeof(ws->remote_ip_str), 0);
+	human_addr2((const struct sockaddr *)&ws->our_addr, ws->our_addr_len, ws->our_ip_str, sizeof(ws->our_ip_str), 0);
+
+	hmac_components[0].data = ws->remote_ip_str;
+	hmac_components[0].length = strlen(ws->remote_ip_str);
+	hmac_components[1].data = ws->our_ip_str;
+	hmac_components[1].length = strlen(ws->our_ip_str);
+	hmac_components[2].data = &ws->session_start_time;
+	hmac_components[2].length = sizeof(ws->session_start_time);
+
+	generate_hmac(sizeof(s->hmac_key), s->hmac_key, sizeof(hmac_components) / sizeof(hmac_components[0]), hmac_components, (uint8_t*) ws->sec_auth_init_hmac);
+}
+
+/* To be called in a newly forked worker. It closes any open descriptors,
+ * and erases sensitive data before running the worker. The connection
+ * specific fields of ws are not touched.
+ */
+static void init_worker_proc(main_server_st *s, struct worker_st *ws, int cmd_fd)
+{
+	sigprocmask(SIG_SETMASK, &sig_default_set, NULL);
+	clear_lists(s);
+	if (s->top_fd != -1) close(s->top_fd);
+	close(s->sec_mod_fd);
+	close(s->sec_mod_fd_sync);
+
+	setproctitle(PACKAGE_NAME"-worker");
+	kill_on_parent_kill(SIGTERM);
+
+	set_self_oom_score_adj(s);
+
+	/* write sec-mod's address */
+	memcpy(&ws->secmod_addr, &s->secmod_addr, s->secmod_addr_len);
+	ws->secmod_addr_len = s->secmod_addr_len;
+	ws->secmod_fd = -1;
+
+	ws->main_pool = s->main_pool;
+
+	ws->vconfig = s->vconfig;
+
+	ws->cmd_fd = cmd_fd;
+	ws->tun_fd = -1;
+	ws->dtls_tptr.fd = -1;
+
+	// Clear the HMAC key
+	safe_memset((uint8_t*)s->hmac_key, 0, sizeof(s->hmac_key));
+	safe_memset(s->cookie_key, 0, sizeof(s->cookie_key));
+
+	/* an idle worker receives a newer key with its connection */
+	memcpy(ws->ticket_key, s->ticket_key, sizeof(ws->ticket_key));
+	ws->ticket_key_set = s->ticket_key_set;
+	safe_memset(s->ticket_key, 0, sizeof(s->ticket_key));
+
+	/* Drop privileges after this point */
+	drop_privileges(s);
+
+	/* creds and config are not allocated
+	 * under s.
+	 */
+	talloc_free(s);
+#ifdef HAVE_MALLOC_TRIM
+	/* try to return all the pages we've freed to
+	 * the operating system, to prevent the child from
+	 * accessing them. That's totally unreliable, so
+	 * sensitive data have to be overwritten anyway. */
+	malloc_trim(0);
+#endif
+}
+
+/* Forks a worker for the connection in fd. Returns the worker's pid
+ * and sets cmd_fd to our end of its command socket, or returns -1.
+ */
+static pid_t fork_worker(main_server_st *s, int fd, int stype, int *cmd_fd)
+{
+	struct worker_st *ws = s->ws;
+	int sp[2];
+	pid_t pid;
+	int ret;
+
+	/* Create a command socket */
+	ret = socketpair(AF_UNIX, SOCK_STREAM, 0, sp);
+	if (ret < 0) {
+		mslog(s, NULL, LOG_ERR, "error creating command socket");
+		return -1;
+	}
+
+	pid = fork();
+	if (pid == 0) {	/* child */
+		close(sp[0]);
+		init_worker_proc(s, ws, sp[1]);
+
+		ws->conn_fd = fd;
+		ws->conn_type = stype;
+
+		vpn_server(ws);
+		exit(0);
+	} else if (pid == -1) {
+		mslog(s, NULL, LOG_ERR, "fork failed");
+		close(sp[0]);
+	} else {
+		*cmd_fd = sp[0];
+	}
+	close(sp[1]);
+
+	return pid;
+}
+
+/* Waits for main to pass a connection to a pre-forked worker */
+static int recv_worker_conn(struct worker_st *ws)
+{
+	WorkerConnMsg *msg = NULL;
+	int fd = -1;
+	int ret;
+
+	ret = recv_socket_msg(ws, ws->cmd_fd, CMD_WORKER_CONN, &fd, (void *)&msg,
+			      (unpack_func) worker_conn_msg__unpack, 0);
+	if (ret < 0)
+		return ret;
+
+	if (fd == -1 ||
+	    msg->remote_addr.len > sizeof(ws->remote_addr) ||
+	    msg->our_addr.len > sizeof(ws->our_addr) ||
+	    msg->sec_auth_init_hmac.len != sizeof(ws->sec_auth_init_hmac) ||
+	    (msg->has_ticket_key && msg->ticket_key.len != sizeof(ws->ticket_key))) {
+		ret = ERR_BAD_COMMAND;
+		goto cleanup;
+	}
+
+	if (msg->has_ticket_key) {
+		memcpy(ws->ticket_key, msg->ticket_key.data, sizeof(ws->ticket_key));
+		safe_memset(msg->ticket_key.data, 0, msg->ticket_key.len);
+		ws->ticket_key_set = 1;
+	} else {
+		safe_memset(ws->ticket_key, 0, sizeof(ws->ticket_key));
+		ws->ticket_key_set = 0;
+	}
+
+	ws->conn_fd = fd;
+	ws->conn_type = msg->conn_type;
+	ws->session_start_time = msg->session_start_time;
+
+	memcpy(&ws->remote_addr, msg->remote_addr.data, msg->remote_addr.len);
+	ws->remote_addr_len = msg->remote_addr.len;
+	memcpy(&ws->our_addr, msg->our_addr.data, msg->our_addr.len);
+	ws->our_addr_len = msg->our_addr.len;
+	memcpy((uint8_t*) ws->sec_auth_init_hmac, msg->sec_auth_init_hmac.data,
+	       sizeof(ws->sec_auth_init_hmac));
+
+	human_addr2((const struct sockaddr *)&ws->remote_addr, ws->remote_addr_len, ws->remote_ip_str, sizeof(ws->remote_ip_str), 0);
+	human_addr2((const struct sockaddr *)&ws->our_addr, ws->our_addr_len, ws->our_ip_str, sizeof(ws->our_ip_str), 0);
+
+	fd = -1;
+	ret = 0;
+ cleanup:
+	if (fd != -1)
+		close(fd);
+	talloc_free(msg);
+	return ret;
+}
+
+static void prefork_child_watcher_cb(struct ev_loop *loop, ev_child *w, int revents)
 {
 	main_server_st *s = ev_userdata(loop);
-	struct listener_st *ltmp = (struct listener_st *)w;
-	struct proc_st *ctmp = NULL;
+	struct prefork_st *p = container_of(w, struct prefork_st, ev_child);
+
+	mslog(s, NULL, LOG_DEBUG, "idle worker %u exited", (unsigned)w->pid);
+
+	ev_child_stop(loop, w);
+	close(p->cmd_fd);
+	list_del(&p->list);
+	s->prefork_list.total--;
+	talloc_free(p);
+
+	prefork_refill(s);
+}
+
+/* Forks an idle worker, which waits in recv_worker_conn() until we
+ * hand it a connection.
+ */
+static int prefork_worker(main_server_st *s)
+{
 	struct worker_st *ws = s->ws;
-	int fd, ret;
-	int cmd_fd[2];
+	struct prefork_st *p;
+	int sp[2];
 	pid_t pid;
-	hmac_component_st hmac_components[3];
+	int ret;
 
-	if (ltmp->sock_type == SOCK_TYPE_TCP || ltmp->sock_type == SOCK_TYPE_UNIX) {
-		/* connection on TCP port */
-		int stype = ltmp->sock_type;
+	p = talloc_zero(s, struct prefork_st);
+	if (p == NULL)
+		return -1;
 
-		ws->remote_addr_len = sizeof(ws->remote_addr);
-		fd = accept(ltmp->fd, (void*)&ws->remote_addr, &ws->remote_addr_len);
-		if (fd < 0) {
-			mslog(s, NULL, LOG_ERR,
-			       "error in accept(): %s", strerror(errno));
-			return;
-		}
-		set_cloexec_flag (fd, 1);
-#ifndef __linux__
-		/* OpenBSD sets the non-blocking flag if accept's fd is non-blocking */
-		set_block(fd);
-#endif
+	ret = socketpair(AF_UNIX, SOCK_STREAM, 0, sp);
+	if (ret < 0) {
+		mslog(s, NULL, LOG_ERR, "error creating command socket");
+		talloc_free(p);
+		return -1;
+	}
 
-		if (GETCONFIG(s)->max_clients > 0 && s->stats.active_clients >= GETCONFIG(s)->max_clients) {
-			close(fd);
-			mslog(s, NULL, LOG_INFO, "reached maximum client limit (active: %u)", s->stats.active_clients);
-			return;
-		}
+	pid = fork();
+	if (pid == 0) {	/* child */
+		close(sp[0]);
+		init_worker_proc(s, ws, sp[1]);
 
-		if (check_tcp_wrapper(fd) < 0) {
-			close(fd);
-			mslog(s, NULL, LOG_INFO, "TCP wrappers rejected the connection (see /etc/hosts->[allow|deny])");
-			return;
-		}
+		/* main terminated us or went away */
+		if (recv_worker_conn(ws) < 0)
+			exit(0);
 
-		if (ws->conn_type != SOCK_TYPE_UNIX && !GETCONFIG(s)->listen_proxy_proto) {
-			memset(&ws->our_addr, 0, sizeof(ws->our_addr));
-			ws->our_addr_len = sizeof(ws->our_addr);
-			if (getsockname(fd, (struct sockaddr*)&ws->our_addr, &ws->our_addr_len) < 0)
-				ws->our_addr_len = 0;
+		vpn_server(ws);
+		exit(0);
+	} else if (pid == -1) {
+		mslog(s, NULL, LOG_ERR, "fork failed");
+		close(sp[0]);
+		close(sp[1]);
+		talloc_free(p);
+		return -1;
+	}
+	close(sp[1]);
 
-			if (check_if_banned(s, &ws->remote_addr, ws->remote_addr_len) != 0) {
-				close(fd);
-				return;
-			}
-		}
+	p->pid = pid;
+	p->cmd_fd = sp[0];
+	ev_child_init(&p->ev_child, prefork_child_watcher_cb, pid, 0);
+	ev_child_start(loop, &p->ev_child);
+
+	list_add_tail(&s->prefork_list.head, &p->list);
+	s->prefork_list.total++;
+
+	return 0;
+}
+
+static void prefork_watcher_cb(EV_P_ ev_timer *w, int revents)
+{
+	main_server_st *s = ev_userdata(loop);
+	unsigned n;
 
-		/* Create a command socket */
-		ret = socketpair(AF_UNIX, SOCK_STREAM, 0, cmd_fd);
+	/* fork at most prefork-rate workers per second */
+	n = (GETCONFIG(s)->prefork_rate + PREFORK_TICKS - 1) / PREFORK_TICKS;
+
+	while (n-- > 0 && s->prefork_list.total < GETCONFIG(s)->prefork_workers) {
+		if (prefork_worker(s) < 0)
+			break;
+	}
+
+	if (s->prefork_list.total >= GETCONFIG(s)->prefork_workers)
+		ev_timer_stop(loop, w);
+}
+
+/* Starts forking idle workers, if there are fewer than prefork-workers */
+static void prefork_refill(main_server_st *s)
+{
+	if (s->prefork_list.total < GETCONFIG(s)->prefork_workers &&
+	    !ev_is_active(&prefork_watcher))
+		ev_timer_start(loop, &prefork_watcher);
+}
+
+/* Terminates the idle workers */
+static void prefork_flush(main_server_st *s)
+{
+	struct prefork_st *p = NULL, *pos;
+
+	list_for_each_safe(&s->prefork_list.head, p, pos, list) {
+		ev_child_stop(loop, &p->ev_child);
+		kill(p->pid, SIGTERM);
+		close(p->cmd_fd);
+		list_del(&p->list);
+		talloc_free(p);
+	}
+	s->prefork_list.total = 0;
+}
+
+/* Passes the connection in fd to an idle worker. Returns the worker's
+ * pid and sets cmd_fd to our end of its command socket, or returns -1
+ * if no idle worker is available.
+ */
+static pid_t prefork_take(main_server_st *s, int fd, int stype, int *cmd_fd)
+{
+	struct worker_st *ws = s->ws;
+	WorkerConnMsg msg = WORKER_CONN_MSG__INIT;
+	struct prefork_st *p;
+	pid_t pid;
+	int ret;
+
+	msg.conn_type = stype;
+	msg.remote_addr.data = (void *)&ws->remote_addr;
+	msg.remote_addr.len = ws->remote_addr_len;
+	msg.our_addr.data = (void *)&ws->our_addr;
+	msg.our_addr.len = ws->our_addr_len;
+	msg.session_start_time = ws->session_start_time;
+	msg.sec_auth_init_hmac.data = (void *)ws->sec_auth_init_hmac;
+	msg.sec_auth_init_hmac.len = sizeof(ws->sec_auth_init_hmac);
+	if (s->ticket_key_set) {
+		msg.has_ticket_key = 1;
+		msg.ticket_key.data = s->ticket_key;
+		msg.ticket_key.len = sizeof(s->ticket_key);
+	}
+
+	while ((p = list_top(&s->prefork_list.head, struct prefork_st, list)) != NULL) {
+		list_del(&p->list);
+		s->prefork_list.total--;
+		ev_child_stop(loop, &p->ev_child);
+
+		ret = send_socket_msg(s, p->cmd_fd, CMD_WORKER_CONN, fd, &msg,
+				      (pack_size_func) worker_conn_msg__get_packed_size,
+				      (pack_func) worker_conn_msg__pack);
 		if (ret < 0) {
-			mslog(s, NULL, LOG_ERR, "error creating command socket");
-			close(fd);
-			return;
+			mslog(s, NULL, LOG_INFO, "could not pass connection to idle worker %u", (unsigned)p->pid);
+			kill(p->pid, SIGTERM);
+			close(p->cmd_fd);
+			talloc_free(p);
+			continue;
 		}
 
-		pid = fork();
-		if (pid == 0) {	/* child */
-			/* close any open descriptors, and erase
-			 * sensitive data before running the worker
-			 */
-			sigprocmask(SIG_SETMASK, &sig_default_set, NULL);
-			close(cmd_fd[0]);
-			clear_lists(s);
-			if (s->top_fd != -1) close(s->top_fd);
-			close(s->sec_mod_fd);
-			close(s->sec_mod_fd_sync);
-
-			setproctitle(PACKAGE_NAME"-worker");
-			kill_on_parent_kill(SIGTERM);
-
-			set_self_oom_score_adj(s);
-
-			/* write sec-mod's address */
-			memcpy(&ws->secmod_addr, &s->secmod_addr, s->secmod_addr_len);
-			ws->secmod_addr_len = s->secmod_addr_len;
-
-			ws->main_pool = s->main_pool;
-
-			ws->vconfig = s->vconfig;
-
-			ws->cmd_fd = cmd_fd[1];
-			ws->tun_fd = -1;
-			ws->dtls_tptr.fd = -1;
-			ws->conn_fd = fd;
-			ws->conn_type = stype;
-			ws->session_start_time = time(0);
-
-			human_addr2((const struct sockaddr *)&ws->remote_addr, ws->remote_addr_len, ws->remote_ip_str, sizeof(ws->remote_ip_str), 0);
-			human_addr2((const struct sockaddr *)&ws->our_addr, ws->our_addr_len, ws->our_ip_str, sizeof(ws->our_ip_str), 0);
-
-			hmac_components[0].data = ws->remote_ip_str;
-			hmac_components[0].length = strlen(ws->remote_ip_str);
-			hmac_components[1].data = ws->our_ip_str;
-			hmac_components[1].length = strlen(ws->our_ip_str);
-			hmac_components[2].data = &ws->session_start_time;
-			hmac_components[2].length = sizeof(ws->session_start_time);
-
-			generate_hmac(sizeof(s->hmac_key), s->hmac_key, sizeof(hmac_components) / sizeof(hmac_components[0]), hmac_components, (uint8_t*) ws->sec_auth_init_hmac);
-			
-			// Clear the HMAC key
-			safe_memset((uint8_t*)s->hmac_key, 0, sizeof(s->hmac_key));
-
-			/* Drop privileges after this point */
-			drop_privileges(s);
-
-			/* creds and config are not allocated
-			 * under s.
-			 */
-			talloc_free(s);
-#ifdef HAVE_MALLOC_TRIM
-			/* try to return all the pages we've freed to
-			 * the operating system, to prevent the child from
-			 * accessing them. That's totally unreliable, so
-			 * sensitive data have to be overwritten anyway. */
-			malloc_trim(0);
+		pid = p->pid;
+		*cmd_fd = p->cmd_fd;
+		talloc_free(p);
+
+		prefork_refill(s);
+		return pid;
+	}
+
+	return -1;
+}
+
+/* Stops accepting TCP and UNIX connections; the connections stay in
+ * the kernel's listen queue until resume_listeners() is called. */
+static void pause_listeners(main_server_st *s)
+{
+	struct listener_st *ltmp = NULL;
+
+	if (listeners_paused)
+		return;
+
+	list_for_each(&s->listen_list.head, ltmp, list) {
+		if (ltmp->fd == -1 || ltmp->sock_type == SOCK_TYPE_UDP)
+			continue;
+		ev_io_stop(loop, &ltmp->io);
+	}
+	listeners_paused = 1;
+}
+
+static void resume_listeners(main_server_st *s)
+{
+	struct listener_st *ltmp = NULL;
+
+	if (!listeners_paused)
+		return;
+
+	list_for_each(&s->listen_list.head, ltmp, list) {
+		if (ltmp->fd == -1 || ltmp->sock_type == SOCK_TYPE_UDP)
+			continue;
+		ev_io_start(loop, &ltmp->io);
+	}
+	listeners_paused = 0;
+}
+
+/* The rate-limit-ms token bucket. It holds a single token, which is
+ * refilled rate-limit-ms after it was taken, so that connections are
+ * admitted no faster than before, without blocking the event loop.
+ * Returns the time in seconds until a token is available. */
+static ev_tstamp admit_token_wait(main_server_st *s)
+{
+	ev_tstamp now = ev_now(loop);
+
+	if (GETCONFIG(s)->rate_limit_ms == 0 || now >= admit_next)
+		return 0;
+
+	return admit_next - now;
+}
+
+static void admit_token_take(main_server_st *s)
+{
+	if (GETCONFIG(s)->rate_limit_ms > 0)
+		admit_next = ev_now(loop) + GETCONFIG(s)->rate_limit_ms / 1000.;
+}
+
+static void admit_resume_watcher_cb(EV_P_ ev_timer *w, int revents)
+{
+	main_server_st *s = ev_userdata(loop);
+
+	if (s->admit_queue.total < ADMIT_BACKLOG)
+		resume_listeners(s);
+}
+
+static void admit_queue_flush(main_server_st *s)
+{
+	struct admit_queue_st *q = &s->admit_queue;
+
+	while (q->total > 0) {
+		close(q->entry[q->head].fd);
+		q->head = (q->head + 1) % ADMIT_BACKLOG;
+		q->total--;
+	}
+	q->head = 0;
+}
+
+/* gettime() is too coarse for the admission and sec-mod latencies */
+void main_gettime(struct timespec *t)
+{
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+	clock_gettime(CLOCK_MONOTONIC, t);
+#else
+	gettime(t);
 #endif
-			vpn_server(ws);
-			exit(0);
-		} else if (pid == -1) {
-fork_failed:
-			mslog(s, NULL, LOG_ERR, "fork failed");
-			close(cmd_fd[0]);
-		} else { /* parent */
-			/* add_proc */
-			ctmp = new_proc(s, pid, cmd_fd[0], 
-					&ws->remote_addr, ws->remote_addr_len,
-					&ws->our_addr, ws->our_addr_len,
-					ws->sid, sizeof(ws->sid));
-			if (ctmp == NULL) {
-				kill(pid, SIGTERM);
-				goto fork_failed;
-			}
+}
+
+unsigned timespec_sub_us(struct timespec *a, struct timespec *b)
+{
+	int64_t us;
+
+	us = (int64_t)(a->tv_sec - b->tv_sec) * 1000000 +
+	     (a->tv_nsec - b->tv_nsec) / 1000;
+	if (us < 0)
+		return 0;
+	if (us > UINT32_MAX)
+		return UINT32_MAX;
+	return us;
+}
+
+static void update_admit_stats(main_server_st *s, unsigned wait, unsigned start)
+{
+	uint64_t n;
 
-			ev_io_init(&ctmp->io, cmd_watcher_cb, cmd_fd[0], EV_READ);
+	s->stats.conns_admitted++;
+	if (s->stats.conns_admitted == 0) { /* overflow */
+		s->stats.conns_admitted = 1;
+		s->stats.avg_admit_wait = 0;
+		s->stats.avg_worker_start = 0;
+	}
+	n = s->stats.conns_admitted;
+
+	if (wait > s->stats.max_admit_wait)
+		s->stats.max_admit_wait = wait;
+	s->stats.avg_admit_wait = (s->stats.avg_admit_wait*(n-1)+wait) / n;
+
+	if (start > s->stats.max_worker_start)
+		s->stats.max_worker_start = start;
+	s->stats.avg_worker_start = (s->stats.avg_worker_start*(n-1)+start) / n;
+}
+
+/* Passes an accepted connection to an idle worker, or to a newly
+ * forked one, and closes our copy of it */
+static void admit_conn(main_server_st *s, struct admit_st *e)
+{
+	struct proc_st *ctmp = NULL;
+	struct worker_st *ws = s->ws;
+	struct timespec start, end;
+	int cmd_fd;
+	pid_t pid;
+
+	main_gettime(&start);
+
+	if (GETCONFIG(s)->max_clients > 0 && s->stats.active_clients >= GETCONFIG(s)->max_clients) {
+		close(e->fd);
+		s->stats.conns_rejected++;
+		mslog(s, NULL, LOG_INFO, "reached maximum client limit (active: %u)", s->stats.active_clients);
+		return;
+	}
+
+	memcpy(&ws->remote_addr, &e->remote_addr, e->remote_addr_len);
+	ws->remote_addr_len = e->remote_addr_len;
+	memcpy(&ws->our_addr, &e->our_addr, e->our_addr_len);
+	ws->our_addr_len = e->our_addr_len;
+
+	set_worker_conn(s, ws);
+
+	pid = prefork_take(s, e->fd, e->sock_type, &cmd_fd);
+	if (pid == -1)
+		pid = fork_worker(s, e->fd, e->sock_type, &cmd_fd);
+
+	if (pid != -1) {
+		/* add_proc */
+		ctmp = new_proc(s, pid, cmd_fd,
+				&ws->remote_addr, ws->remote_addr_len,
+				&ws->our_addr, ws->our_addr_len,
+				ws->sid, sizeof(ws->sid));
+		if (ctmp == NULL) {
+			mslog(s, NULL, LOG_ERR, "could not add worker %u", (unsigned)pid);
+			kill(pid, SIGTERM);
+			close(cmd_fd);
+		} else {
+			ev_io_init(&ctmp->io, cmd_watcher_cb, cmd_fd, EV_READ);
 			ev_io_start(loop, &ctmp->io);
 
 			ev_child_init(&ctmp->ev_child, worker_child_watcher_cb, pid, 0);
 			ev_child_start(loop, &ctmp->ev_child);
 		}
-		close(cmd_fd[1]);
+	}
+	close(e->fd);
+
+	if (ctmp != NULL) {
+		main_gettime(&end);
+		update_admit_stats(s, timespec_sub_us(&start, &e->accept_time),
+				   timespec_sub_us(&end, &start));
+	}
+}
+
+/* A zero-delay timer, which runs once per loop iteration while there
+ * are queued connections, and passes up to ADMIT_BATCH of them to
+ * workers. That way the UDP, sec-mod and occtl descriptors are served
+ * in between, even when many clients connect at once, and the queue
+ * moves on even when those are always busy. */
+static void admit_watcher_start(void)
+{
+	if (!ev_is_active(&admit_watcher)) {
+		ev_timer_set(&admit_watcher, 0., 0.);
+		ev_timer_start(loop, &admit_watcher);
+	}
+}
+
+static void admit_watcher_cb(EV_P_ ev_timer *w, int revents)
+{
+	main_server_st *s = ev_userdata(loop);
+	struct admit_queue_st *q = &s->admit_queue;
+	struct admit_st *e;
+	unsigned i;
+
+	for (i = 0; i < ADMIT_BATCH && q->total > 0; i++) {
+		e = &q->entry[q->head];
+		q->head = (q->head + 1) % ADMIT_BACKLOG;
+		q->total--;
+
+		admit_conn(s, e);
+	}
+
+	if (q->total > 0)
+		admit_watcher_start();
+
+	if (!ev_is_active(&admit_resume_watcher))
+		resume_listeners(s);
+}
+
+/* Accepts a single connection from a TCP or UNIX listener and applies
+ * the checks that do not need a worker. Returns -1 when there are no
+ * more connections to accept. */
+static int accept_conn(main_server_st *s, struct listener_st *ltmp)
+{
+	struct admit_queue_st *q = &s->admit_queue;
+	struct admit_st *e;
+	int fd;
+
+	e = &q->entry[(q->head + q->total) % ADMIT_BACKLOG];
+
+	e->remote_addr_len = sizeof(e->remote_addr);
+#ifdef HAVE_ACCEPT4
+	fd = accept4(ltmp->fd, (void*)&e->remote_addr, &e->remote_addr_len, SOCK_CLOEXEC);
+#else
+	fd = accept(ltmp->fd, (void*)&e->remote_addr, &e->remote_addr_len);
+#endif
+	if (fd < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+			mslog(s, NULL, LOG_ERR,
+			       "error in accept(): %s", strerror(errno));
+		return -1;
+	}
+#ifndef HAVE_ACCEPT4
+	set_cloexec_flag (fd, 1);
+#endif
+#ifndef __linux__
+	/* OpenBSD sets the non-blocking flag if accept's fd is non-blocking */
+	set_block(fd);
+#endif
+	if (ltmp->sock_type == SOCK_TYPE_TCP)
+		ban_filter_detach(fd);
+	main_gettime(&e->accept_time);
+
+	if (GETCONFIG(s)->max_clients > 0 &&
+	    s->stats.active_clients + q->total >= GETCONFIG(s)->max_clients) {
+		close(fd);
+		s->stats.conns_rejected++;
+		mslog(s, NULL, LOG_INFO, "reached maximum client limit (active: %u)", s->stats.active_clients);
+		return 0;
+	}
+
+	if (check_tcp_wrapper(fd) < 0) {
 		close(fd);
-	} else if (ltmp->sock_type == SOCK_TYPE_UDP) {
+		s->stats.conns_rejected++;
+		mslog(s, NULL, LOG_INFO, "TCP wrappers rejected the connection (see /etc/hosts->[allow|deny])");
+		return 0;
+	}
+
+	memset(&e->our_addr, 0, sizeof(e->our_addr));
+	e->our_addr_len = 0;
+	if (ltmp->sock_type != SOCK_TYPE_UNIX && !GETCONFIG(s)->listen_proxy_proto) {
+		e->our_addr_len = sizeof(e->our_addr);
+		if (getsockname(fd, (struct sockaddr*)&e->our_addr, &e->our_addr_len) < 0)
+			e->our_addr_len = 0;
+
+		if (check_if_banned(s, &e->remote_addr, e->remote_addr_len) != 0) {
+			close(fd);
+			s->stats.conns_rejected++;
+			return 0;
+		}
+	}
+
+	e->fd = fd;
+	e->sock_type = ltmp->sock_type;
+	q->total++;
+	admit_token_take(s);
+
+	return 0;
+}
+
+static void listen_watcher_cb (EV_P_ ev_io *w, int revents)
+{
+	main_server_st *s = ev_userdata(loop);
+	struct listener_st *ltmp = (struct listener_st *)w;
+	ev_tstamp wait;
+	unsigned i;
+
+	if (ltmp->sock_type == SOCK_TYPE_UDP) {
 		/* connection on UDP port */
 		forward_udp_to_owner(s, ltmp);
+		return;
 	}
 
-	if (GETCONFIG(s)->rate_limit_ms > 0)
-		ms_sleep(GETCONFIG(s)->rate_limit_ms);
+	/* connection on TCP port */
+	for (i = 0; i < ADMIT_BATCH; i++) {
+		if (s->admit_queue.total >= ADMIT_BACKLOG) {
+			/* resumed by admit_watcher_cb() */
+			pause_listeners(s);
+			break;
+		}
+
+		wait = admit_token_wait(s);
+		if (wait > 0) {
+			pause_listeners(s);
+			ev_timer_set(&admit_resume_watcher, wait, 0.);
+			ev_timer_start(loop, &admit_resume_watcher);
+			break;
+		}
+
+		if (accept_conn(s, ltmp) < 0)
+			break;
+	}
+
+	if (s->admit_queue.total > 0)
+		admit_watcher_start();
 }
 
 static void sec_mod_watcher_cb (EV_P_ ev_io *w, int revents)
@@ -1303,6 +1855,81 @@ static void perform_maintenance(main_server_st *s)
 	}
 }
 
+/* Replaces the key of the TLS session tickets. Workers are given the
+ * key that is current when they receive their connection, so tickets
+ * issued under an older key are not accepted; these clients resume
+ * from sec-mod's session cache, if at all.
+ */
+static void rotate_ticket_key(main_server_st *s)
+{
+	if (gnutls_rnd(GNUTLS_RND_KEY, s->ticket_key, sizeof(s->ticket_key)) < 0) {
+		mslog(s, NULL, LOG_ERR, "could not generate a session ticket key; disabling tickets");
+		safe_memset(s->ticket_key, 0, sizeof(s->ticket_key));
+		s->ticket_key_set = 0;
+		return;
+	}
+	s->ticket_key_set = 1;
+}
+
+static void ticket_key_watcher_cb(EV_P_ ev_timer *w, int revents)
+{
+	main_server_st *s = ev_userdata(loop);
+
+	mslog(s, NULL, LOG_DEBUG, "rotating the session ticket key");
+	rotate_ticket_key(s);
+}
+
+/* Applies tls-session-tickets and tls-ticket-key-rotation; called on
+ * startup and after a reload.
+ */
+static void ticket_key_setup(main_server_st *s)
+{
+	unsigned period = GETCONFIG(s)->ticket_key_rotation;
+
+	ev_timer_stop(loop, &ticket_key_watcher);
+
+	if (!GETCONFIG(s)->tls_session_tickets) {
+		safe_memset(s->ticket_key, 0, sizeof(s->ticket_key));
+		s->ticket_key_set = 0;
+		return;
+	}
+
+	if (!s->ticket_key_set)
+		rotate_ticket_key(s);
+
+	if (period > 0) {
+		ev_timer_set(&ticket_key_watcher, period, period);
+		ev_timer_start(loop, &ticket_key_watcher);
+	}
+}
+
+static void ban_expire_watcher_cb(EV_P_ ev_timer *w, int revents)
+{
+	main_server_st *s = ev_userdata(loop);
+
+	cleanup_banned_entries(s);
+}
+
+/* With the ban filter the bans are expired as they are due, rather than
+ * on maintenance, so that the kernel doesn't drop a client past its ban */
+static void ban_filter_reload(main_server_st *s)
+{
+	ban_filter_setup(s);
+
+	ev_timer_stop(loop, &ban_expire_watcher);
+	if (ban_filter_enabled()) {
+		ev_timer_set(&ban_expire_watcher, 1., 1.);
+		ev_timer_start(loop, &ban_expire_watcher);
+	}
+}
+
+static void secm_req_watcher_cb(EV_P_ ev_timer *w, int revents)
+{
+	main_server_st *s = ev_userdata(loop);
+
+	secm_reqs_expire(s);
+}
+
 static void maintenance_watcher_cb(EV_P_ ev_timer *w, int revents)
 {
 	main_server_st *s = ev_userdata(loop);
@@ -1379,7 +2006,9 @@ int main(int argc, char** argv)
 		allow_broken_clients = 1;
 
 	list_head_init(&s->proc_list.head);
+	list_head_init(&s->secm_reqs.head);
 	list_head_init(&s->script_list.head);
+	list_head_init(&s->prefork_list.head);
 	ip_lease_init(&s->ip_leases);
 	proc_table_init(s);
 	main_ban_db_init(s);
@@ -1405,6 +2034,14 @@ int main(int argc, char** argv)
 		exit(1);
 	}
 
+	if (GETPCONFIG(s)->cookie_key_file) {
+		if (sealed_cookie_load_key(GETPCONFIG(s)->cookie_key_file, s->cookie_key) < 0) {
+			fprintf(stderr, "unable to load the cookie key from %s\n", GETPCONFIG(s)->cookie_key_file);
+			exit(1);
+		}
+		s->cookie_key_set = 1;
+	}
+
 	setproctitle(PACKAGE_NAME"-main");
 
 	if (getuid() != 0) {
@@ -1528,6 +2165,7 @@ int main(int argc, char** argv)
 	list_for_each(&s->listen_list.head, ltmp, list) {
 		if (ltmp->fd == -1) continue;
 
+		udp_steer_attach(s, ltmp);
 		ev_io_start (loop, &ltmp->io);
 	}
 
@@ -1544,6 +2182,26 @@ int main(int argc, char** argv)
 	ev_timer_set(&maintenance_watcher, MAIN_MAINTENANCE_TIME, MAIN_MAINTENANCE_TIME);
 	ev_timer_start(loop, &maintenance_watcher);
 
+	ev_init(&secm_req_watcher, secm_req_watcher_cb);
+	ev_timer_set(&secm_req_watcher, SECM_REQ_CHECK_TIME, SECM_REQ_CHECK_TIME);
+	ev_timer_start(loop, &secm_req_watcher);
+
+	ev_init(&prefork_watcher, prefork_watcher_cb);
+	ev_timer_set(&prefork_watcher, 0., 1./PREFORK_TICKS);
+	prefork_refill(s);
+
+	ev_init(&ticket_key_watcher, ticket_key_watcher_cb);
+	ticket_key_setup(s);
+
+	ev_init(&ban_expire_watcher, ban_expire_watcher_cb);
+	ban_filter_reload(s);
+	main_ban_db_load_rules(s);
+	ip_lease_pools_reload(s);
+	icmp_prober_setup(s);
+
+	ev_init(&admit_watcher, admit_watcher_cb);
+	ev_init(&admit_resume_watcher, admit_resume_watcher_cb);
+
 	/* allow forcing maintenance with SIGUSR2 */
 	ev_init (&maintenance_sig_watcher, maintenance_sig_watcher_cb);
 	ev_signal_set (&maintenance_sig_watcher, SIGUSR2);
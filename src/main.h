@@ -35,6 +35,7 @@
 #include <signal.h>
 #include <ev.h>
 #include <hmac.h>
+#include <sealed-cookie.h>
 #include "vhost.h"
 
 #if defined(__FreeBSD__) || defined(__OpenBSD__)
@@ -51,6 +52,11 @@ extern struct ev_loop *loop;
 extern ev_timer maintainance_watcher;
 
 #define MAIN_MAINTENANCE_TIME (900)
+/* how often per second idle workers are forked; see prefork-rate */
+#define PREFORK_TICKS 10
+/* how often (secs) the requests to sec-mod are checked for a reply
+ * that is overdue; see secm_reqs_expire() */
+#define SECM_REQ_CHECK_TIME 5
 
 int cmd_parser (void *pool, int argc, char **argv, struct list_head *head);
 
@@ -64,6 +70,8 @@ struct listener_st {
 	socklen_t addr_len;
 	int family;
 	int protocol;
+
+	struct udp_steer_st *steer; /* set if udp-steering is in use */
 };
 
 struct listen_list_st {
@@ -81,7 +89,28 @@ struct script_wait_st {
 	struct proc_st* proc;
 };
 
-/* Each worker process maps to a unique proc_st structure.
+/* The strings of a proc_st which are only read for reporting, i.e., by
+ * occtl and the scripts. They are kept apart from the proc_st, so that
+ * the lookups and the walks of the proc list don't bring them to the
+ * cache. */
+struct proc_info_st {
+	char hostname[MAX_HOSTNAME_SIZE]; /* the requested hostname */
+
+	/* the following are copied here from the worker process for reporting
+	 * purposes (from main-ctl-handler). */
+	char user_agent[MAX_AGENT_NAME];
+	char device_type[MAX_DEVICE_TYPE];
+	char device_platform[MAX_DEVICE_PLATFORM];
+	char tls_ciphersuite[MAX_CIPHERSUITE_NAME];
+	char dtls_ciphersuite[MAX_CIPHERSUITE_NAME];
+	char cstp_compr[8];
+	char dtls_compr[8];
+};
+
+/* Each worker process maps to a unique proc_st structure. The fields
+ * read on each event of the worker, by the lookups, and by the walks of
+ * the proc list come first; those only read on connection and
+ * disconnection follow.
  */
 typedef struct proc_st {
 	/* This is first so this structure can behave as an ev_io */
@@ -93,15 +122,28 @@ typedef struct proc_st {
 	pid_t pid;
 	unsigned pid_killed; /* if explicitly disconnected */
 
-	time_t udp_fd_receive_time; /* when the corresponding process has received a UDP fd */
-	
+	unsigned status; /* PS_AUTH_ */
 	time_t conn_time; /* the time the user connected */
+	time_t udp_fd_receive_time; /* when the corresponding process has received a UDP fd */
 
-	/* the tun lease this process has */
-	struct tun_lease_st tun_lease;
-	struct ip_lease_st *ipv4;
-	struct ip_lease_st *ipv6;
-	unsigned leases_in_use; /* someone else got our IP leases */
+	/* The SID which acts as a cookie */
+	uint8_t sid[SID_SIZE];
+	unsigned active_sid;
+
+	/* The DTLS session ID associated with the TLS session 
+	 * it is either generated or restored from a cookie.
+	 */
+	uint8_t dtls_session_id[GNUTLS_MAX_SESSION_ID];
+	unsigned dtls_session_id_size; /* would act as a flag if session_id is set */
+
+	/* the session open or close awaiting the reply of sec-mod */
+	struct secm_req_st *secm_req;
+	/* whether user_disconnected() is due once the session is closed */
+	unsigned disconnect_due;
+
+	/* The following are set by the worker process (or by a stored cookie) */
+	char username[MAX_USERNAME_SIZE]; /* the owner */
+	char groupname[MAX_GROUPNAME_SIZE]; /* the owner's group */
 
 	struct sockaddr_storage remote_addr; /* peer address (CSTP) */
 	socklen_t remote_addr_len;
@@ -112,33 +154,19 @@ typedef struct proc_st {
 	struct sockaddr_storage our_addr; /* our address */
 	socklen_t our_addr_len;
 
-	/* The SID which acts as a cookie */
-	uint8_t sid[SID_SIZE];
-	unsigned active_sid;
+	/* the tun lease this process has */
+	struct tun_lease_st tun_lease;
+	struct ip_lease_st *ipv4;
+	struct ip_lease_st *ipv6;
+	unsigned leases_in_use; /* someone else got our IP leases */
 
 	/* whether the host-update script has already been called */
 	unsigned host_updated;
 
-	/* The DTLS session ID associated with the TLS session 
-	 * it is either generated or restored from a cookie.
-	 */
-	uint8_t dtls_session_id[GNUTLS_MAX_SESSION_ID];
-	unsigned dtls_session_id_size; /* would act as a flag if session_id is set */
-	
-	/* The following are set by the worker process (or by a stored cookie) */
-	char username[MAX_USERNAME_SIZE]; /* the owner */
-	char groupname[MAX_GROUPNAME_SIZE]; /* the owner's group */
-	char hostname[MAX_HOSTNAME_SIZE]; /* the requested hostname */
+	/* the listener whose UDP steering slot this process has */
+	struct listener_st *udp_steer;
+	uint32_t udp_steer_slot;
 
-	/* the following are copied here from the worker process for reporting
-	 * purposes (from main-ctl-handler). */
-	char user_agent[MAX_AGENT_NAME];
-	char device_type[MAX_DEVICE_TYPE];
-	char device_platform[MAX_DEVICE_PLATFORM];
-	char tls_ciphersuite[MAX_CIPHERSUITE_NAME];
-	char dtls_ciphersuite[MAX_CIPHERSUITE_NAME];
-	char cstp_compr[8];
-	char dtls_compr[8];
 	unsigned mtu;
 
 	/* if the session is initiated by a cookie the following two are set
@@ -147,8 +175,6 @@ typedef struct proc_st {
 	 */
 	uint8_t ipv4_seed[4];
 
-	unsigned status; /* PS_AUTH_ */
-
 	/* these are filled in after the worker process dies, using the
 	 * Cli stats message. */
 	uint64_t bytes_in;
@@ -158,6 +184,7 @@ typedef struct proc_st {
 	unsigned applied_iroutes; /* whether the iroutes in the config have been successfully applied */
 
 	/* The following we rely on talloc for deallocation */
+	struct proc_info_st *info; /* allocated along with the proc */
 	GroupCfgSt *config; /* custom user/group config */
 	int *config_usage_count; /* points to s->config->usage_count */
 	/* pointer to perm_cfg - set after we know the virtual host. As
@@ -173,6 +200,7 @@ inline static void kill_proc(proc_st *proc)
 
 struct ip_lease_db_st {
 	struct htable ht;
+	struct list_head pools; /* of struct ip_pool_st; see ip-lease.h */
 };
 
 struct proc_list_st {
@@ -184,6 +212,62 @@ struct script_list_st {
 	struct list_head head;
 };
 
+/* An idle worker, forked in advance to take a new connection;
+ * see prefork-workers. */
+struct prefork_st {
+	struct list_node list;
+	pid_t pid;
+	int cmd_fd; /* our end of the command socket */
+	ev_child ev_child;
+};
+
+struct prefork_list_st {
+	struct list_head head;
+	unsigned int total;
+};
+
+/* the maximum number of accepted connections waiting for a worker */
+#define ADMIT_BACKLOG 64
+/* how many connections are accepted, or passed to workers, per
+ * event loop iteration */
+#define ADMIT_BATCH 16
+
+/* A connection accepted by main, waiting to be passed to a worker */
+struct admit_st {
+	int fd;
+	int sock_type;
+	struct sockaddr_storage remote_addr;
+	socklen_t remote_addr_len;
+	struct sockaddr_storage our_addr;
+	socklen_t our_addr_len;
+	struct timespec accept_time;
+};
+
+/* a ring of accepted connections, in the order they were accepted */
+struct admit_queue_st {
+	struct admit_st entry[ADMIT_BACKLOG];
+	unsigned int head;
+	unsigned int total;
+};
+
+/* A session open or close sent to sec-mod, whose reply has not yet
+ * arrived; see session_open() */
+struct secm_req_st {
+	struct list_node list;
+	uint64_t id;
+	uint8_t cmd; /* CMD_SECM_SESSION_OPEN or CMD_SECM_SESSION_CLOSE */
+	struct proc_st *proc; /* NULL if it was removed meanwhile */
+	uint8_t sid[SID_SIZE];
+	struct timespec sent;
+};
+
+/* the requests in the order they were sent */
+struct secm_req_list_st {
+	struct list_head head;
+	unsigned int total;
+	uint64_t next_id;
+};
+
 struct proc_hash_db_st {
 	struct htable *db_ip;
 	struct htable *db_dtls_ip;
@@ -216,6 +300,24 @@ struct main_stats_st {
 	uint32_t max_session_mins;
 	uint64_t auth_failures; /* authentication failures */
 
+	uint64_t conns_admitted; /* connections passed to a worker */
+	uint64_t conns_rejected; /* connections rejected before a worker */
+	uint32_t avg_admit_wait; /* in microseconds; from accept to dispatch */
+	uint32_t max_admit_wait;
+	uint32_t avg_worker_start; /* in microseconds; to hand over or fork */
+	uint32_t max_worker_start;
+
+	uint64_t session_opens; /* sessions opened by sec-mod */
+	uint64_t session_closes;
+	uint32_t avg_session_open; /* in microseconds; until sec-mod replies */
+	uint32_t max_session_open;
+	uint32_t avg_session_close;
+	uint32_t max_session_close;
+
+	/* from sec-mod; see AUTH_LATENCY_BUCKETS */
+	uint32_t auth_wait_hist[AUTH_LATENCY_BUCKETS];
+	uint32_t auth_run_hist[AUTH_LATENCY_BUCKETS];
+
 	/* These are counted since start time */
 	uint64_t total_auth_failures; /* authentication failures since start_time */
 	uint64_t total_sessions_closed; /* sessions closed since start_time */
@@ -227,11 +329,14 @@ typedef struct main_server_st {
 
 	struct ip_lease_db_st ip_leases;
 
-	struct htable *ban_db;
+	struct ban_db_st *ban_db;
 
 	struct listen_list_st listen_list;
 	struct proc_list_st proc_list;
 	struct script_list_st script_list;
+	struct prefork_list_st prefork_list;
+	struct admit_queue_st admit_queue;
+	struct secm_req_list_st secm_reqs;
 	/* maps DTLS session IDs to proc entries */
 	struct proc_hash_db_st proc_table;
 	
@@ -259,12 +364,24 @@ typedef struct main_server_st {
 
 	const uint8_t hmac_key[HMAC_DIGEST_SIZE];
 
+	/* the key of the sealed cookies; see sealed-cookie.h */
+	uint8_t cookie_key[SEALED_COOKIE_KEY_SIZE];
+	unsigned cookie_key_set;
+
+	/* the key of the TLS session tickets; replaced every
+	 * tls-ticket-key-rotation seconds and given to each worker */
+	uint8_t ticket_key[TLS_TICKET_KEY_SIZE];
+	unsigned ticket_key_set;
+
 	/* used as temporary buffer (currently by forward_udp_to_owner) */
 	uint8_t msg_buffer[MAX_MSG_SIZE];
 } main_server_st;
 
 void clear_lists(main_server_st *s);
 
+void set_worker_udp_opts(main_server_st *s, int fd, int family);
+void set_udp_socket_options(struct perm_cfg_st* config, int fd, int family);
+
 int handle_worker_commands(main_server_st *s, struct proc_st* cur);
 int handle_sec_mod_commands(main_server_st *s);
 
@@ -274,8 +391,14 @@ void user_disconnected(main_server_st *s, struct proc_st* cur);
 
 int send_udp_fd(main_server_st* s, struct proc_st * proc, int fd);
 
-int session_open(main_server_st * s, struct proc_st *proc, const uint8_t *cookie, unsigned cookie_size);
+int session_open(main_server_st * s, struct proc_st *proc, const uint8_t sid[SID_SIZE],
+		 const uint8_t *cookie, unsigned cookie_size);
 int session_close(main_server_st * s, struct proc_st *proc);
+void secm_req_detach(struct proc_st *proc);
+void secm_reqs_expire(main_server_st *s);
+
+void main_gettime(struct timespec *t);
+unsigned timespec_sub_us(struct timespec *a, struct timespec *b);
 
 #ifdef UNDER_TEST
 /* for testing */
@@ -312,6 +435,10 @@ int send_cookie_auth_reply(main_server_st* s, struct proc_st* proc,
 
 int handle_auth_cookie_req(main_server_st* s, struct proc_st* proc,
  			   const AuthCookieRequestMsg * req);
+int handle_auth_cookie_rep(main_server_st* s, struct proc_st* proc,
+			   const uint8_t sid[SID_SIZE], int result);
+int handle_cookie_auth_res(main_server_st *s, struct proc_st *proc,
+			   unsigned cmd, int result);
 
 int check_multiple_users(main_server_st *s, struct proc_st* proc);
 int handle_script_exit(main_server_st *s, struct proc_st* proc, int code);
@@ -329,6 +456,7 @@ struct proc_st *new_proc(main_server_st * s, pid_t pid, int cmd_fd,
 #define RPROC_QUIT (1<<1)
 
 void remove_proc(main_server_st* s, struct proc_st *proc, unsigned flags);
+void release_proc(main_server_st* s, struct proc_st *proc);
 void proc_to_zombie(main_server_st* s, struct proc_st *proc);
 
 inline static void terminate_proc(main_server_st *s, proc_st *proc)
@@ -197,6 +197,49 @@ error:
 
 }
 
+/* Formats the non-empty buckets of a latency histogram, where bucket i
+ * counts the values under 2^i ms, and the last one the rest. */
+static void format_hist(char *buf, size_t buf_size, const uint32_t *hist, size_t hist_size)
+{
+	size_t i, len = 0;
+
+	buf[0] = 0;
+	for (i = 0; i < hist_size && len < buf_size; i++) {
+		if (hist[i] == 0)
+			continue;
+
+		if (i + 1 < hist_size)
+			len += snprintf(buf + len, buf_size - len, "%s<%ums:%u",
+					len ? " " : "", 1U << i, (unsigned)hist[i]);
+		else
+			len += snprintf(buf + len, buf_size - len, "%s>=%ums:%u",
+					len ? " " : "", i ? 1U << (i - 1) : 0, (unsigned)hist[i]);
+	}
+
+	if (buf[0] == 0)
+		snprintf(buf, buf_size, "none");
+}
+
+/* Prints the leases of the address pools of a family; the pools are
+ * too large to count if size is UINT64_MAX. */
+static void print_pool_usage(cmd_params_st *params, const char *name, const char *raw_name,
+			     uint64_t used, uint64_t size)
+{
+	char buf[128];
+
+	if (size == 0)
+		return;
+
+	if (size == UINT64_MAX)
+		snprintf(buf, sizeof(buf), "%llu", (unsigned long long)used);
+	else
+		snprintf(buf, sizeof(buf), "%llu of %llu (%.1f%%)", (unsigned long long)used,
+			 (unsigned long long)size, used * 100. / size);
+	print_single_value(stdout, params, name, buf, 1);
+	if (HAVE_JSON(params))
+		print_single_value_int(stdout, params, raw_name, used, 1);
+}
+
 int handle_status_cmd(struct unix_ctx *ctx, const char *arg, cmd_params_st *params)
 {
 	int ret;
@@ -204,6 +247,7 @@ int handle_status_cmd(struct unix_ctx *ctx, const char *arg, cmd_params_st *para
 	StatusRep *rep;
 	char str_since[64];
 	char buf[MAX_TMPSTR_SIZE];
+	char hist[256];
 	time_t t;
 	struct tm *tm;
 	PROTOBUF_ALLOCATOR(pa, ctx);
@@ -250,6 +294,10 @@ int handle_status_cmd(struct unix_ctx *ctx, const char *arg, cmd_params_st *para
 		print_single_value_int(stdout, params, "Total sessions", rep->total_sessions_closed, 1);
 		print_single_value_int(stdout, params, "Total authentication failures", rep->total_auth_failures, 1);
 		print_single_value_int(stdout, params, "IPs in ban list", rep->banned_ips, 1);
+		print_pool_usage(params, "Leased IPv4 addresses", "raw_ipv4_leases",
+				 rep->ipv4_leases, rep->ipv4_pool_size);
+		print_pool_usage(params, "Leased IPv6 subnets", "raw_ipv6_leases",
+				 rep->ipv6_leases, rep->ipv6_pool_size);
 		if (params && params->debug) {
 			print_single_value_int(stdout, params, "Sec-mod client entries", rep->secmod_client_entries, 1);
 			print_single_value_int(stdout, params, "TLS DB entries", rep->stored_tls_sessions, 1);
@@ -296,6 +344,61 @@ int handle_status_cmd(struct unix_ctx *ctx, const char *arg, cmd_params_st *para
 		if (HAVE_JSON(params))
 			print_single_value_int(stdout, params, "raw_max_session_time", rep->max_session_mins*60, 1);
 
+		print_single_value_int(stdout, params, "Admitted connections", rep->conns_admitted, 1);
+		print_single_value_int(stdout, params, "Rejected connections", rep->conns_rejected, 1);
+
+		snprintf(buf, sizeof(buf), "%.3f ms", rep->avg_admit_wait / 1000.);
+		print_single_value(stdout, params, "Average admission wait", buf, 1);
+		if (HAVE_JSON(params))
+			print_single_value_int(stdout, params, "raw_avg_admit_wait", rep->avg_admit_wait, 1);
+
+		snprintf(buf, sizeof(buf), "%.3f ms", rep->max_admit_wait / 1000.);
+		print_single_value(stdout, params, "Max admission wait", buf, 1);
+		if (HAVE_JSON(params))
+			print_single_value_int(stdout, params, "raw_max_admit_wait", rep->max_admit_wait, 1);
+
+		snprintf(buf, sizeof(buf), "%.3f ms", rep->avg_worker_start / 1000.);
+		print_single_value(stdout, params, "Average worker start", buf, 1);
+		if (HAVE_JSON(params))
+			print_single_value_int(stdout, params, "raw_avg_worker_start", rep->avg_worker_start, 1);
+
+		snprintf(buf, sizeof(buf), "%.3f ms", rep->max_worker_start / 1000.);
+		print_single_value(stdout, params, "Max worker start", buf, 1);
+		if (HAVE_JSON(params))
+			print_single_value_int(stdout, params, "raw_max_worker_start", rep->max_worker_start, 1);
+
+		snprintf(buf, sizeof(buf), "%.3f ms", rep->avg_session_open / 1000.);
+		print_single_value(stdout, params, "Average session open", buf, 1);
+		if (HAVE_JSON(params))
+			print_single_value_int(stdout, params, "raw_avg_session_open", rep->avg_session_open, 1);
+
+		snprintf(buf, sizeof(buf), "%.3f ms", rep->max_session_open / 1000.);
+		print_single_value(stdout, params, "Max session open", buf, 1);
+		if (HAVE_JSON(params))
+			print_single_value_int(stdout, params, "raw_max_session_open", rep->max_session_open, 1);
+
+		snprintf(buf, sizeof(buf), "%.3f ms", rep->avg_session_close / 1000.);
+		print_single_value(stdout, params, "Average session close", buf, 1);
+		if (HAVE_JSON(params))
+			print_single_value_int(stdout, params, "raw_avg_session_close", rep->avg_session_close, 1);
+
+		snprintf(buf, sizeof(buf), "%.3f ms", rep->max_session_close / 1000.);
+		print_single_value(stdout, params, "Max session close", buf, 1);
+		if (HAVE_JSON(params))
+			print_single_value_int(stdout, params, "raw_max_session_close", rep->max_session_close, 1);
+
+		print_single_value_int(stdout, params, "Pending sec-mod requests", rep->secmod_pending, 1);
+
+		if (rep->n_auth_wait_hist > 0) {
+			format_hist(hist, sizeof(hist), rep->auth_wait_hist, rep->n_auth_wait_hist);
+			print_single_value(stdout, params, "Auth queue wait", hist, 1);
+		}
+
+		if (rep->n_auth_run_hist > 0) {
+			format_hist(hist, sizeof(hist), rep->auth_run_hist, rep->n_auth_run_hist);
+			print_single_value(stdout, params, "Auth module time", hist, 1);
+		}
+
 		if (rep->min_mtu > 0)
 			print_single_value_int(stdout, params, "Min MTU", rep->min_mtu, 1);
 		if (rep->max_mtu > 0)
@@ -979,6 +1082,12 @@ int handle_list_banned_cmd(struct unix_ctx *ctx, const char *arg, cmd_params_st
 		if (tmp_str == NULL)
 			strlcpy(txt_ip, "(unknown)", sizeof(txt_ip));
 
+		/* networks are unbanned by any of their addresses */
+		ip_entries_add(ctx, txt_ip, strlen(txt_ip));
+		if (rep->info[i]->has_prefix)
+			snprintf(txt_ip + strlen(txt_ip), sizeof(txt_ip) - strlen(txt_ip),
+				 "/%u", (unsigned)rep->info[i]->prefix);
+
 		/* add header */
 		if (points == 0) {
 			if (rep->info[i]->has_expires) {
@@ -1022,8 +1131,6 @@ int handle_list_banned_cmd(struct unix_ctx *ctx, const char *arg, cmd_params_st
 		}
 
 		print_end_block(out, params, i<(rep->n_info-1)?1:0);
-
-		ip_entries_add(ctx, txt_ip, strlen(txt_ip));
 	}
 
 	print_end_array_block(out, params);
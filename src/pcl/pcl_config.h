@@ -44,6 +44,9 @@
 /*
  * Use threads.
  */
+#if defined(HAVE_PCL_THREADS)
+#define CO_MULTI_THREAD
+#endif
 #elif defined(HAVE_SIGACTION)
 
 /*
@@ -0,0 +1,1103 @@
+/*
+ * Copyright (C) 2026 Nikos Mavrogiannopoulos
+ *
+ * Author: Nikos Mavrogiannopoulos
+ *
+ * This file is part of ocserv.
+ *
+ * ocserv is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <syslog.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <gnutls/gnutls.h>
+#include <gnutls/crypto.h>
+#ifdef HAVE_PTHREAD_H
+# include <pthread.h>
+#endif
+#include <ccan/list/list.h>
+
+#include "radius-client.h"
+
+/* A RADIUS client which multiplexes the requests of sec-mod over a single
+ * UDP socket per address family. A thread owns the sockets; it assigns
+ * each request one of the 256 identifiers of the selected server, and
+ * retransmits it until a reply arrives or the retries are exhausted.
+ *
+ * The retransmission timeout is derived from the round-trip time measured
+ * for each server, and doubles with every retransmission. A server which
+ * lets a request time out is avoided for the configured dead time; its
+ * requests fail over to the next server in the order of the configuration.
+ */
+
+#define RADIUS_IDS 256
+#define MIN_RTO_MS 1000
+#define INITIAL_RTO_MS 2000
+#define DEFAULT_DEADTIME_MS (10 * 1000)
+#define MAX_QUEUED 4096
+#define MAX_DRAIN_MS (5 * 1000)
+
+#ifdef HAVE_PTHREAD_H
+
+struct radius_req_st;
+
+struct radius_server_st {
+	char *name;
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+	char *secret;
+	unsigned secret_size;
+
+	struct radius_req_st *ids[RADIUS_IDS]; /* outstanding requests */
+	unsigned next_id;
+
+	/* smoothed round-trip time and its variance, in ms; srtt is zero
+	 * until there is a sample */
+	unsigned srtt;
+	unsigned rttvar;
+	uint64_t dead_until;
+};
+
+struct radius_req_st {
+	struct list_node list; /* in queue or inflight */
+	uint8_t code;
+	uint8_t *attrs;
+	unsigned attrs_size;
+
+	int server; /* -1 if not sent */
+	unsigned tried; /* bitmask of the servers tried */
+	uint8_t id;
+	uint8_t auth[16];
+	uint8_t pkt[RADIUS_MAX_PACKET];
+	unsigned pkt_size;
+	unsigned sends;
+	uint64_t sent_at;
+	uint64_t deadline;
+
+	int status;
+	radius_reply_st reply;
+
+	/* either a callback, or a waiting thread */
+	radius_done_func done;
+	void *priv;
+	pthread_cond_t cond;
+	unsigned completed;
+};
+
+struct radius_client_st {
+	pthread_mutex_t lock;
+	pthread_t thread;
+	unsigned started;
+	unsigned stop; /* no new requests; the thread exits once drained */
+	uint64_t drain_until;
+	unsigned waiters; /* threads in radius_client_send() */
+	pthread_cond_t idle; /* signalled when the last waiter leaves */
+
+	struct list_head queue; /* requests waiting for an identifier */
+	struct list_head inflight; /* requests sent to a server */
+	unsigned queued;
+
+	struct radius_server_st servers[RADIUS_MAX_SERVERS];
+	unsigned servers_size;
+
+	unsigned timeout_ms;
+	unsigned retries;
+	unsigned deadtime_ms;
+
+	int fd4;
+	int fd6;
+	int wake_fd[2];
+};
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void set_fd_flags(int fd)
+{
+	int val;
+
+	val = fcntl(fd, F_GETFL, 0);
+	fcntl(fd, F_SETFL, val | O_NONBLOCK);
+	val = fcntl(fd, F_GETFD, 0);
+	fcntl(fd, F_SETFD, val | FD_CLOEXEC);
+}
+
+static int md5(const void *d1, unsigned d1_size, const void *d2, unsigned d2_size,
+	       uint8_t out[16])
+{
+	gnutls_hash_hd_t h;
+
+	if (gnutls_hash_init(&h, GNUTLS_DIG_MD5) < 0)
+		return -1;
+
+	gnutls_hash(h, d1, d1_size);
+	gnutls_hash(h, d2, d2_size);
+	gnutls_hash_deinit(h, out);
+	return 0;
+}
+
+/* RFC2865 section 5.2 */
+static int hide_password(struct radius_server_st *srv, const uint8_t auth[16],
+			 const uint8_t *pass, unsigned pass_size,
+			 uint8_t *out, unsigned *out_size)
+{
+	uint8_t b[16];
+	const uint8_t *prev = auth;
+	unsigned i, j, size;
+
+	if (pass_size > 128)
+		return -1;
+
+	size = (pass_size + 15) & ~15;
+	if (size == 0)
+		size = 16;
+
+	memset(out, 0, size);
+	memcpy(out, pass, pass_size);
+
+	for (i = 0; i < size; i += 16) {
+		if (md5(srv->secret, srv->secret_size, prev, 16, b) < 0)
+			return -1;
+		for (j = 0; j < 16; j++)
+			out[i + j] ^= b[j];
+		prev = out + i;
+	}
+
+	*out_size = size;
+	return 0;
+}
+
+/* Creates the packet of the request for the given server */
+static int encode_req(struct radius_server_st *srv, struct radius_req_st *req)
+{
+	uint8_t *p = req->pkt;
+	unsigned pos = RADIUS_HDR_SIZE, i, hidden_size;
+	unsigned ma_pos = 0;
+	uint8_t type, len;
+
+	p[0] = req->code;
+	p[1] = req->id;
+
+	if (req->code == RADIUS_ACCESS_REQUEST) {
+		if (gnutls_rnd(GNUTLS_RND_NONCE, req->auth, sizeof(req->auth)) < 0)
+			return -1;
+		memcpy(p + 4, req->auth, 16);
+	} else {
+		memset(p + 4, 0, 16);
+	}
+
+	for (i = 0; i + 2 <= req->attrs_size; i += len) {
+		type = req->attrs[i];
+		len = req->attrs[i + 1];
+		if (len < 2 || i + len > req->attrs_size)
+			return -1;
+
+		/* ours is added below */
+		if (type == RADIUS_ATTR_MESSAGE_AUTHENTICATOR)
+			continue;
+
+		if (type == RADIUS_ATTR_USER_PASSWORD) {
+			/* it is padded to a multiple of 16 bytes */
+			hidden_size = (len - 2 + 15) & ~15;
+			if (hidden_size == 0)
+				hidden_size = 16;
+			if (pos + 2 + hidden_size > RADIUS_MAX_PACKET)
+				return -1;
+
+			if (hide_password(srv, req->auth, req->attrs + i + 2, len - 2,
+					  p + pos + 2, &hidden_size) < 0)
+				return -1;
+			p[pos] = type;
+			p[pos + 1] = hidden_size + 2;
+			pos += hidden_size + 2;
+		} else {
+			if (pos + len > RADIUS_MAX_PACKET)
+				return -1;
+			memcpy(p + pos, req->attrs + i, len);
+			pos += len;
+		}
+	}
+
+	/* RFC3579; it protects the whole of the request */
+	if (req->code == RADIUS_ACCESS_REQUEST) {
+		if (pos + 18 > RADIUS_MAX_PACKET)
+			return -1;
+		ma_pos = pos;
+		p[pos] = RADIUS_ATTR_MESSAGE_AUTHENTICATOR;
+		p[pos + 1] = 18;
+		memset(p + pos + 2, 0, 16);
+		pos += 18;
+	}
+
+	p[2] = pos >> 8;
+	p[3] = pos & 0xff;
+
+	if (ma_pos != 0) {
+		if (gnutls_hmac_fast(GNUTLS_MAC_MD5, srv->secret, srv->secret_size,
+				     p, pos, p + ma_pos + 2) < 0)
+			return -1;
+	} else {
+		/* RFC2866 section 3 */
+		if (md5(p, pos, srv->secret, srv->secret_size, req->auth) < 0)
+			return -1;
+		memcpy(p + 4, req->auth, 16);
+	}
+
+	req->pkt_size = pos;
+	return 0;
+}
+
+static int verify_reply(struct radius_server_st *srv, struct radius_req_st *req,
+			uint8_t *p, unsigned size)
+{
+	uint8_t digest[16], mac[16], rauth[16];
+	unsigned i, len, ma_pos = 0;
+	int ret;
+
+	if (size < RADIUS_HDR_SIZE)
+		return -1;
+
+	len = ((unsigned)p[2] << 8) | p[3];
+	if (len < RADIUS_HDR_SIZE || len > size)
+		return -1;
+
+	if (req->code == RADIUS_ACCESS_REQUEST) {
+		if (p[0] != RADIUS_ACCESS_ACCEPT && p[0] != RADIUS_ACCESS_REJECT &&
+		    p[0] != RADIUS_ACCESS_CHALLENGE)
+			return -1;
+	} else if (p[0] != RADIUS_ACCOUNTING_RESPONSE) {
+		return -1;
+	}
+
+	for (i = RADIUS_HDR_SIZE; i < len; i += p[i + 1]) {
+		if (i + 2 > len || p[i + 1] < 2 || i + p[i + 1] > len)
+			return -1;
+		if (p[i] == RADIUS_ATTR_MESSAGE_AUTHENTICATOR) {
+			if (p[i + 1] != 18)
+				return -1;
+			ma_pos = i;
+		}
+	}
+
+	/* both authenticators are calculated over the request's */
+	memcpy(rauth, p + 4, 16);
+	memcpy(p + 4, req->auth, 16);
+
+	ret = -1;
+	if (ma_pos != 0) {
+		memcpy(mac, p + ma_pos + 2, 16);
+		memset(p + ma_pos + 2, 0, 16);
+
+		if (gnutls_hmac_fast(GNUTLS_MAC_MD5, srv->secret, srv->secret_size,
+				     p, len, digest) < 0)
+			goto cleanup;
+
+		memcpy(p + ma_pos + 2, mac, 16);
+		if (gnutls_memcmp(mac, digest, 16) != 0)
+			goto cleanup;
+	}
+
+	if (md5(p, len, srv->secret, srv->secret_size, digest) < 0)
+		goto cleanup;
+
+	if (gnutls_memcmp(rauth, digest, 16) == 0)
+		ret = len;
+
+ cleanup:
+	memcpy(p + 4, rauth, 16);
+	return ret;
+}
+
+/* Returns the retransmission timeout for the n-th transmission */
+static unsigned server_rto(struct radius_client_st *c, struct radius_server_st *srv,
+			   unsigned n)
+{
+	uint64_t rto;
+
+	if (srv->srtt != 0)
+		rto = srv->srtt + 4 * srv->rttvar;
+	else
+		rto = INITIAL_RTO_MS;
+
+	if (rto < MIN_RTO_MS)
+		rto = MIN_RTO_MS;
+
+	if (n > 1)
+		rto <<= (n - 1 < 16 ? n - 1 : 16);
+
+	if (rto > c->timeout_ms)
+		rto = c->timeout_ms;
+
+	return rto;
+}
+
+/* RFC6298 */
+static void server_rtt_sample(struct radius_server_st *srv, unsigned rtt)
+{
+	unsigned delta;
+
+	if (rtt == 0)
+		rtt = 1;
+
+	if (srv->srtt == 0) {
+		srv->srtt = rtt;
+		srv->rttvar = rtt / 2;
+		return;
+	}
+
+	delta = srv->srtt > rtt ? srv->srtt - rtt : rtt - srv->srtt;
+	srv->rttvar = (3 * srv->rttvar + delta) / 4;
+	srv->srtt = (7 * srv->srtt + rtt) / 8;
+	if (srv->srtt == 0)
+		srv->srtt = 1;
+}
+
+/* Returns the first server which is up and has not been tried by the
+ * request; if they are all down, the one which is expected back first. */
+static int pick_server(struct radius_client_st *c, struct radius_req_st *req,
+		       uint64_t now)
+{
+	unsigned i;
+	int best = -1;
+
+	for (i = 0; i < c->servers_size; i++) {
+		if (req->tried & (1 << i))
+			continue;
+
+		if (c->servers[i].dead_until <= now)
+			return i;
+
+		if (best == -1 || c->servers[i].dead_until < c->servers[best].dead_until)
+			best = i;
+	}
+
+	return best;
+}
+
+static int alloc_id(struct radius_server_st *srv)
+{
+	unsigned i, id;
+
+	for (i = 0; i < RADIUS_IDS; i++) {
+		id = (srv->next_id + i) % RADIUS_IDS;
+		if (srv->ids[id] == NULL) {
+			srv->next_id = (id + 1) % RADIUS_IDS;
+			return id;
+		}
+	}
+
+	return -1;
+}
+
+static void send_req(struct radius_client_st *c, struct radius_server_st *srv,
+		     struct radius_req_st *req)
+{
+	int fd = srv->addr.ss_family == AF_INET6 ? c->fd6 : c->fd4;
+	int ret;
+
+	do {
+		ret = sendto(fd, req->pkt, req->pkt_size, 0,
+			     (struct sockaddr *)&srv->addr, srv->addr_len);
+	} while (ret == -1 && errno == EINTR);
+
+	/* on failure the request is retransmitted as if it were lost */
+	if (ret == -1)
+		syslog(LOG_DEBUG, "radius: could not send to %s: %s",
+		       srv->name, strerror(errno));
+}
+
+/* Called with the lock held. Completed requests with a callback are
+ * moved to done, to be called without the lock. */
+static void finish_req(struct radius_req_st *req, int status, struct list_head *done)
+{
+	req->status = status;
+
+	if (req->done) {
+		list_add_tail(done, &req->list);
+	} else {
+		req->completed = 1;
+		pthread_cond_signal(&req->cond);
+	}
+}
+
+static void dispatch(struct radius_client_st *c, uint64_t now, struct list_head *done)
+{
+	struct radius_server_st *srv;
+	struct radius_req_st *req;
+	int s, id;
+
+	while ((req = list_top(&c->queue, struct radius_req_st, list)) != NULL) {
+		s = pick_server(c, req, now);
+		if (s == -1) {
+			list_del(&req->list);
+			c->queued--;
+			finish_req(req, RADIUS_TIMEOUT, done);
+			continue;
+		}
+
+		srv = &c->servers[s];
+		id = alloc_id(srv);
+		if (id == -1) /* wait for a reply from that server */
+			break;
+
+		list_del(&req->list);
+		c->queued--;
+
+		req->id = id;
+		if (encode_req(srv, req) < 0) {
+			syslog(LOG_ERR, "radius: could not encode request");
+			finish_req(req, RADIUS_ERROR, done);
+			continue;
+		}
+
+		srv->ids[id] = req;
+		req->server = s;
+		req->tried |= 1 << s;
+		req->sends = 1;
+		req->sent_at = now;
+		req->deadline = now + server_rto(c, srv, 1);
+		list_add_tail(&c->inflight, &req->list);
+
+		send_req(c, srv, req);
+	}
+}
+
+static void expire(struct radius_client_st *c, uint64_t now)
+{
+	struct radius_server_st *srv;
+	struct radius_req_st *req, *rtmp;
+
+	list_for_each_safe(&c->inflight, req, rtmp, list) {
+		if (req->deadline > now)
+			continue;
+
+		srv = &c->servers[req->server];
+		if (req->sends < c->retries) {
+			req->sends++;
+			req->deadline = now + server_rto(c, srv, req->sends);
+			send_req(c, srv, req);
+			continue;
+		}
+
+		if (srv->dead_until <= now)
+			syslog(LOG_NOTICE, "radius: server %s is not responding", srv->name);
+		srv->dead_until = now + c->deadtime_ms;
+
+		/* fail over; it is placed first to keep the order */
+		srv->ids[req->id] = NULL;
+		req->server = -1;
+		list_del(&req->list);
+		list_add(&c->queue, &req->list);
+		c->queued++;
+	}
+}
+
+static struct radius_server_st *find_server(struct radius_client_st *c,
+					    struct sockaddr_storage *from,
+					    socklen_t from_size)
+{
+	unsigned i;
+
+	for (i = 0; i < c->servers_size; i++) {
+		if (c->servers[i].addr_len == from_size &&
+		    memcmp(&c->servers[i].addr, from, from_size) == 0)
+			return &c->servers[i];
+	}
+
+	return NULL;
+}
+
+static void recv_replies(struct radius_client_st *c, int fd, struct list_head *done)
+{
+	uint8_t buf[RADIUS_MAX_PACKET];
+	struct sockaddr_storage from;
+	socklen_t from_size;
+	struct radius_server_st *srv;
+	struct radius_req_st *req;
+	uint64_t now;
+	int ret, len;
+
+	for (;;) {
+		from_size = sizeof(from);
+		ret = recvfrom(fd, buf, sizeof(buf), 0, (struct sockaddr *)&from, &from_size);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			return;
+		}
+
+		/* zero the unused part, for the comparison with ours */
+		if (from_size < sizeof(from))
+			memset((uint8_t *)&from + from_size, 0, sizeof(from) - from_size);
+
+		srv = find_server(c, &from, from_size);
+		if (srv == NULL || ret < RADIUS_HDR_SIZE)
+			continue;
+
+		req = srv->ids[buf[1]];
+		if (req == NULL) /* a late reply */
+			continue;
+
+		len = verify_reply(srv, req, buf, ret);
+		if (len < 0) {
+			syslog(LOG_INFO, "radius: received invalid reply from %s", srv->name);
+			continue;
+		}
+
+		req->reply.attrs_size = len - RADIUS_HDR_SIZE;
+		req->reply.attrs = malloc(req->reply.attrs_size + 1);
+		if (req->reply.attrs == NULL)
+			continue;
+		memcpy(req->reply.attrs, buf + RADIUS_HDR_SIZE, req->reply.attrs_size);
+		req->reply.code = buf[0];
+
+		now = now_ms();
+		/* Karn's algorithm; ambiguous samples are ignored */
+		if (req->sends == 1)
+			server_rtt_sample(srv, now - req->sent_at);
+
+		if (srv->dead_until > now)
+			syslog(LOG_NOTICE, "radius: server %s is responding", srv->name);
+		srv->dead_until = 0;
+
+		srv->ids[req->id] = NULL;
+		list_del(&req->list);
+		finish_req(req, RADIUS_OK, done);
+	}
+}
+
+static void free_req(struct radius_req_st *req)
+{
+	if (req->attrs) {
+		/* may contain a password */
+		memset(req->attrs, 0, req->attrs_size);
+		free(req->attrs);
+	}
+	memset(req->pkt, 0, sizeof(req->pkt));
+	free(req->reply.attrs);
+	pthread_cond_destroy(&req->cond);
+	free(req);
+}
+
+static void call_done(struct list_head *done)
+{
+	struct radius_req_st *req;
+
+	while ((req = list_top(done, struct radius_req_st, list)) != NULL) {
+		list_del(&req->list);
+		req->done(req->status, req->status == RADIUS_OK ? &req->reply : NULL,
+			  req->priv);
+		free_req(req);
+	}
+}
+
+static void *radius_client_thread(void *arg)
+{
+	struct radius_client_st *c = arg;
+	struct radius_req_st *req;
+	struct list_head done;
+	struct pollfd pfd[3];
+	uint64_t now, next;
+	char buf[64];
+	int timeout;
+
+	list_head_init(&done);
+
+	pfd[0].fd = c->wake_fd[0];
+	pfd[1].fd = c->fd4;
+	pfd[2].fd = c->fd6;
+
+	pthread_mutex_lock(&c->lock);
+	for (;;) {
+		now = now_ms();
+		/* on stop, the outstanding requests are given a while */
+		if (c->stop && (now >= c->drain_until ||
+				(list_empty(&c->queue) && list_empty(&c->inflight))))
+			break;
+
+		expire(c, now);
+		dispatch(c, now, &done);
+
+		next = 0;
+		list_for_each(&c->inflight, req, list) {
+			if (next == 0 || req->deadline < next)
+				next = req->deadline;
+		}
+		if (c->stop && (next == 0 || c->drain_until < next))
+			next = c->drain_until;
+		pthread_mutex_unlock(&c->lock);
+
+		call_done(&done);
+
+		if (next == 0)
+			timeout = -1;
+		else if (next <= now)
+			timeout = 0;
+		else
+			timeout = next - now;
+
+		pfd[0].events = pfd[1].events = pfd[2].events = POLLIN;
+		pfd[0].revents = pfd[1].revents = pfd[2].revents = 0;
+		poll(pfd, 3, timeout);
+
+		if (pfd[0].revents)
+			while (read(c->wake_fd[0], buf, sizeof(buf)) > 0)
+				;
+
+		pthread_mutex_lock(&c->lock);
+		if (pfd[1].revents)
+			recv_replies(c, c->fd4, &done);
+		if (pfd[2].revents)
+			recv_replies(c, c->fd6, &done);
+	}
+	pthread_mutex_unlock(&c->lock);
+
+	call_done(&done);
+	return NULL;
+}
+
+static int open_socket(int family, const char *bindaddr)
+{
+	struct sockaddr_storage sa;
+	socklen_t sa_len = 0;
+	int fd;
+
+	fd = socket(family, SOCK_DGRAM, 0);
+	if (fd == -1)
+		return -1;
+
+	set_fd_flags(fd);
+
+	if (bindaddr == NULL || strcmp(bindaddr, "*") == 0)
+		return fd;
+
+	memset(&sa, 0, sizeof(sa));
+	if (family == AF_INET &&
+	    inet_pton(AF_INET, bindaddr, &((struct sockaddr_in *)&sa)->sin_addr) == 1) {
+		sa.ss_family = AF_INET;
+		sa_len = sizeof(struct sockaddr_in);
+	} else if (family == AF_INET6 &&
+		   inet_pton(AF_INET6, bindaddr, &((struct sockaddr_in6 *)&sa)->sin6_addr) == 1) {
+		sa.ss_family = AF_INET6;
+		sa_len = sizeof(struct sockaddr_in6);
+	}
+
+	if (sa_len != 0 && bind(fd, (struct sockaddr *)&sa, sa_len) == -1)
+		syslog(LOG_ERR, "radius: could not bind to %s: %s", bindaddr, strerror(errno));
+
+	return fd;
+}
+
+static int resolve_server(struct radius_server_st *srv, const struct radius_server_cfg_st *cfg)
+{
+	struct addrinfo hints, *res;
+	char port[16];
+	int ret;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_flags = AI_NUMERICSERV;
+
+	snprintf(port, sizeof(port), "%u", cfg->port);
+	ret = getaddrinfo(cfg->name, port, &hints, &res);
+	if (ret != 0) {
+		syslog(LOG_ERR, "radius: could not resolve %s: %s", cfg->name, gai_strerror(ret));
+		return -1;
+	}
+
+	if (res->ai_addrlen > sizeof(srv->addr)) {
+		freeaddrinfo(res);
+		return -1;
+	}
+
+	memset(&srv->addr, 0, sizeof(srv->addr));
+	memcpy(&srv->addr, res->ai_addr, res->ai_addrlen);
+	srv->addr_len = res->ai_addrlen;
+	freeaddrinfo(res);
+
+	srv->name = strdup(cfg->name);
+	srv->secret = strdup(cfg->secret);
+	if (srv->name == NULL || srv->secret == NULL)
+		return -1;
+	srv->secret_size = strlen(srv->secret);
+
+	return 0;
+}
+
+struct radius_client_st *radius_client_new(const struct radius_client_cfg_st *cfg)
+{
+	struct radius_client_st *c;
+	unsigned i;
+
+	c = calloc(1, sizeof(*c));
+	if (c == NULL)
+		return NULL;
+
+	c->fd4 = c->fd6 = -1;
+	c->wake_fd[0] = c->wake_fd[1] = -1;
+	list_head_init(&c->queue);
+	list_head_init(&c->inflight);
+
+	c->timeout_ms = (cfg->timeout ? cfg->timeout : 1) * 1000;
+	c->retries = cfg->retries ? cfg->retries : 1;
+	c->deadtime_ms = cfg->deadtime ? cfg->deadtime * 1000 : DEFAULT_DEADTIME_MS;
+
+	for (i = 0; i < cfg->servers_size && i < RADIUS_MAX_SERVERS; i++) {
+		if (cfg->servers[i].name == NULL || cfg->servers[i].secret == NULL)
+			continue;
+
+		if (resolve_server(&c->servers[c->servers_size], &cfg->servers[i]) < 0) {
+			free(c->servers[c->servers_size].name);
+			free(c->servers[c->servers_size].secret);
+			continue;
+		}
+		c->servers_size++;
+	}
+
+	if (c->servers_size == 0)
+		goto fail;
+
+	for (i = 0; i < c->servers_size; i++) {
+		if (c->servers[i].addr.ss_family == AF_INET6 && c->fd6 == -1)
+			c->fd6 = open_socket(AF_INET6, cfg->bindaddr);
+		else if (c->servers[i].addr.ss_family == AF_INET && c->fd4 == -1)
+			c->fd4 = open_socket(AF_INET, cfg->bindaddr);
+	}
+
+	if (c->fd4 == -1 && c->fd6 == -1)
+		goto fail;
+
+	if (pipe(c->wake_fd) < 0)
+		goto fail;
+	set_fd_flags(c->wake_fd[0]);
+	set_fd_flags(c->wake_fd[1]);
+
+	if (pthread_mutex_init(&c->lock, NULL) != 0)
+		goto fail;
+
+	if (pthread_cond_init(&c->idle, NULL) != 0) {
+		pthread_mutex_destroy(&c->lock);
+		goto fail;
+	}
+
+	return c;
+ fail:
+	radius_client_deinit(c);
+	return NULL;
+}
+
+/* The thread is started with the first request, so that a client which is
+ * created before a fork() is usable by the child. */
+static int start_thread(struct radius_client_st *c)
+{
+	sigset_t set, oldset;
+	int ret;
+
+	sigfillset(&set);
+	pthread_sigmask(SIG_SETMASK, &set, &oldset);
+	ret = pthread_create(&c->thread, NULL, radius_client_thread, c);
+	pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+
+	if (ret != 0) {
+		syslog(LOG_ERR, "radius: could not start thread: %s", strerror(ret));
+		return -1;
+	}
+
+	c->started = 1;
+	return 0;
+}
+
+/* The requests outstanding are given up to one timeout to complete;
+ * those still outstanding after that fail with RADIUS_ERROR. Their
+ * callbacks are called and the waiting threads return before this does. */
+void radius_client_deinit(struct radius_client_st *c)
+{
+	struct radius_req_st *req;
+	struct list_head *lists[2];
+	unsigned i;
+
+	if (c == NULL)
+		return;
+
+	if (c->started) {
+		pthread_mutex_lock(&c->lock);
+		c->stop = 1;
+		c->drain_until = now_ms() +
+			(c->timeout_ms < MAX_DRAIN_MS ? c->timeout_ms : MAX_DRAIN_MS);
+		pthread_mutex_unlock(&c->lock);
+
+		if (write(c->wake_fd[1], "", 1) < 0)
+			syslog(LOG_DEBUG, "radius: could not wake thread");
+		pthread_join(c->thread, NULL);
+
+		lists[0] = &c->queue;
+		lists[1] = &c->inflight;
+		for (i = 0; i < 2; i++) {
+			while ((req = list_top(lists[i], struct radius_req_st, list)) != NULL) {
+				list_del(&req->list);
+				if (req->done) {
+					req->done(RADIUS_ERROR, NULL, req->priv);
+					free_req(req);
+				} else {
+					/* the waiter frees it */
+					pthread_mutex_lock(&c->lock);
+					req->status = RADIUS_ERROR;
+					req->completed = 1;
+					pthread_cond_signal(&req->cond);
+					pthread_mutex_unlock(&c->lock);
+				}
+			}
+		}
+
+		pthread_mutex_lock(&c->lock);
+		while (c->waiters > 0)
+			pthread_cond_wait(&c->idle, &c->lock);
+		pthread_mutex_unlock(&c->lock);
+
+		pthread_cond_destroy(&c->idle);
+		pthread_mutex_destroy(&c->lock);
+	}
+
+	for (i = 0; i < c->servers_size; i++) {
+		free(c->servers[i].name);
+		if (c->servers[i].secret) {
+			memset(c->servers[i].secret, 0, c->servers[i].secret_size);
+			free(c->servers[i].secret);
+		}
+	}
+
+	if (c->fd4 != -1)
+		close(c->fd4);
+	if (c->fd6 != -1)
+		close(c->fd6);
+	if (c->wake_fd[0] != -1) {
+		close(c->wake_fd[0]);
+		close(c->wake_fd[1]);
+	}
+	free(c);
+}
+
+static struct radius_req_st *new_req(uint8_t code, const uint8_t *attrs, unsigned attrs_size)
+{
+	struct radius_req_st *req;
+
+	if (attrs_size > RADIUS_MAX_ATTRS)
+		return NULL;
+
+	req = calloc(1, sizeof(*req));
+	if (req == NULL)
+		return NULL;
+
+	req->attrs = malloc(attrs_size + 1);
+	if (req->attrs == NULL) {
+		free(req);
+		return NULL;
+	}
+
+	if (pthread_cond_init(&req->cond, NULL) != 0) {
+		free(req->attrs);
+		free(req);
+		return NULL;
+	}
+
+	memcpy(req->attrs, attrs, attrs_size);
+	req->attrs_size = attrs_size;
+	req->code = code;
+	req->server = -1;
+
+	return req;
+}
+
+/* Called with the lock held */
+static int queue_req(struct radius_client_st *c, struct radius_req_st *req)
+{
+	int ret;
+
+	if (c->stop)
+		return -1;
+
+	if (c->started == 0 && start_thread(c) < 0)
+		return -1;
+
+	if (c->queued >= MAX_QUEUED) {
+		syslog(LOG_ERR, "radius: too many queued requests");
+		return -1;
+	}
+
+	list_add_tail(&c->queue, &req->list);
+	c->queued++;
+
+	do {
+		ret = write(c->wake_fd[1], "", 1);
+	} while (ret == -1 && errno == EINTR);
+	/* on EAGAIN the thread has already been woken */
+
+	return 0;
+}
+
+/* Sends the request and waits for the reply. It may be called by multiple
+ * threads at once; their requests are outstanding at the same time. On
+ * RADIUS_OK the reply must be released with radius_reply_deinit(). */
+int radius_client_send(struct radius_client_st *c, uint8_t code,
+		       const uint8_t *attrs, unsigned attrs_size,
+		       radius_reply_st *reply)
+{
+	struct radius_req_st *req;
+	int ret;
+
+	req = new_req(code, attrs, attrs_size);
+	if (req == NULL)
+		return RADIUS_ERROR;
+
+	pthread_mutex_lock(&c->lock);
+	if (queue_req(c, req) < 0) {
+		pthread_mutex_unlock(&c->lock);
+		free_req(req);
+		return RADIUS_ERROR;
+	}
+
+	c->waiters++;
+	while (req->completed == 0)
+		pthread_cond_wait(&req->cond, &c->lock);
+	/* c may be freed once the last waiter left */
+	if (--c->waiters == 0 && c->stop)
+		pthread_cond_signal(&c->idle);
+	pthread_mutex_unlock(&c->lock);
+
+	ret = req->status;
+	if (ret == RADIUS_OK) {
+		*reply = req->reply;
+		req->reply.attrs = NULL;
+	}
+
+	free_req(req);
+	return ret;
+}
+
+/* Sends the request without waiting; done() is called from the client's
+ * thread when the request completes. */
+int radius_client_send_async(struct radius_client_st *c, uint8_t code,
+			     const uint8_t *attrs, unsigned attrs_size,
+			     radius_done_func done, void *priv)
+{
+	struct radius_req_st *req;
+
+	req = new_req(code, attrs, attrs_size);
+	if (req == NULL)
+		return RADIUS_ERROR;
+
+	req->done = done;
+	req->priv = priv;
+
+	pthread_mutex_lock(&c->lock);
+	if (queue_req(c, req) < 0) {
+		pthread_mutex_unlock(&c->lock);
+		free_req(req);
+		return RADIUS_ERROR;
+	}
+	pthread_mutex_unlock(&c->lock);
+
+	return 0;
+}
+
+#else /* no threads; the callers use their synchronous fallback */
+
+struct radius_client_st *radius_client_new(const struct radius_client_cfg_st *cfg)
+{
+	return NULL;
+}
+
+void radius_client_deinit(struct radius_client_st *c)
+{
+}
+
+int radius_client_send(struct radius_client_st *c, uint8_t code,
+		       const uint8_t *attrs, unsigned attrs_size,
+		       radius_reply_st *reply)
+{
+	return RADIUS_ERROR;
+}
+
+int radius_client_send_async(struct radius_client_st *c, uint8_t code,
+			     const uint8_t *attrs, unsigned attrs_size,
+			     radius_done_func done, void *priv)
+{
+	return RADIUS_ERROR;
+}
+
+#endif
+
+void radius_reply_deinit(radius_reply_st *reply)
+{
+	free(reply->attrs);
+	reply->attrs = NULL;
+	reply->attrs_size = 0;
+}
+
+int radius_attr_append(uint8_t *attrs, unsigned *attrs_size, uint8_t type,
+		       const void *data, unsigned data_size)
+{
+	if (data_size > 253 || *attrs_size + 2 + data_size > RADIUS_MAX_ATTRS)
+		return -1;
+
+	attrs[*attrs_size] = type;
+	attrs[*attrs_size + 1] = data_size + 2;
+	memcpy(attrs + *attrs_size + 2, data, data_size);
+	*attrs_size += data_size + 2;
+
+	return 0;
+}
+
+int radius_attr_append_vsa(uint8_t *attrs, unsigned *attrs_size, uint32_t vendor,
+			   uint8_t type, const void *data, unsigned data_size)
+{
+	uint8_t *p;
+
+	if (data_size > 247 || *attrs_size + 8 + data_size > RADIUS_MAX_ATTRS)
+		return -1;
+
+	p = attrs + *attrs_size;
+	p[0] = RADIUS_ATTR_VENDOR_SPECIFIC;
+	p[1] = data_size + 8;
+	p[2] = vendor >> 24;
+	p[3] = (vendor >> 16) & 0xff;
+	p[4] = (vendor >> 8) & 0xff;
+	p[5] = vendor & 0xff;
+	p[6] = type;
+	p[7] = data_size + 2;
+	memcpy(p + 8, data, data_size);
+	*attrs_size += data_size + 8;
+
+	return 0;
+}
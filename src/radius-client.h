@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2026 Nikos Mavrogiannopoulos
+ *
+ * Author: Nikos Mavrogiannopoulos
+ *
+ * This file is part of ocserv.
+ *
+ * ocserv is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#ifndef RADIUS_CLIENT_H
+# define RADIUS_CLIENT_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+#define RADIUS_ACCESS_REQUEST 1
+#define RADIUS_ACCESS_ACCEPT 2
+#define RADIUS_ACCESS_REJECT 3
+#define RADIUS_ACCOUNTING_REQUEST 4
+#define RADIUS_ACCOUNTING_RESPONSE 5
+#define RADIUS_ACCESS_CHALLENGE 11
+
+#define RADIUS_ATTR_USER_PASSWORD 2
+#define RADIUS_ATTR_VENDOR_SPECIFIC 26
+#define RADIUS_ATTR_MESSAGE_AUTHENTICATOR 80
+
+#define RADIUS_HDR_SIZE 20
+#define RADIUS_MAX_PACKET 4096
+#define RADIUS_MAX_ATTRS (RADIUS_MAX_PACKET - RADIUS_HDR_SIZE)
+#define RADIUS_MAX_SERVERS 8
+
+/* status of a request */
+#define RADIUS_OK 0
+#define RADIUS_TIMEOUT -1
+#define RADIUS_ERROR -2
+
+struct radius_server_cfg_st {
+	const char *name;
+	unsigned port;
+	const char *secret;
+};
+
+struct radius_client_cfg_st {
+	struct radius_server_cfg_st servers[RADIUS_MAX_SERVERS];
+	unsigned servers_size;
+
+	unsigned timeout; /* in seconds; the maximum wait for a reply */
+	unsigned retries; /* transmissions to each server */
+	unsigned deadtime; /* seconds a server is avoided after a timeout */
+	const char *bindaddr;
+};
+
+typedef struct radius_reply_st {
+	uint8_t code;
+	uint8_t *attrs; /* malloc'ed */
+	unsigned attrs_size;
+} radius_reply_st;
+
+typedef void (*radius_done_func)(int status, const radius_reply_st *reply, void *priv);
+
+struct radius_client_st;
+
+struct radius_client_st *radius_client_new(const struct radius_client_cfg_st *cfg);
+void radius_client_deinit(struct radius_client_st *c);
+
+int radius_attr_append(uint8_t *attrs, unsigned *attrs_size, uint8_t type,
+		       const void *data, unsigned data_size);
+int radius_attr_append_vsa(uint8_t *attrs, unsigned *attrs_size, uint32_t vendor,
+			   uint8_t type, const void *data, unsigned data_size);
+
+int radius_client_send(struct radius_client_st *c, uint8_t code,
+		       const uint8_t *attrs, unsigned attrs_size,
+		       radius_reply_st *reply);
+int radius_client_send_async(struct radius_client_st *c, uint8_t code,
+			     const uint8_t *attrs, unsigned attrs_size,
+			     radius_done_func done, void *priv);
+void radius_reply_deinit(radius_reply_st *reply);
+
+#endif
@@ -0,0 +1,178 @@
+/*
+ * Copyright (C) 2026 Nikos Mavrogiannopoulos
+ *
+ * Author: Nikos Mavrogiannopoulos
+ *
+ * This file is part of ocserv.
+ *
+ * ocserv is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <talloc.h>
+#include <gnutls/gnutls.h>
+#include <gnutls/crypto.h>
+#include <common.h>
+#include <sealed-cookie.h>
+
+#define NONCE_SIZE 12
+#define TAG_SIZE 16
+#define HEADER_SIZE (1 + NONCE_SIZE)
+#define MIN_KEY_FILE_SIZE 16
+#define MAX_KEY_FILE_SIZE 4096
+
+/* The key is the SHA-256 of the contents of the file, which should be
+ * random data, e.g., from 'head -c 32 /dev/urandom'. */
+int sealed_cookie_load_key(const char *file, uint8_t key[SEALED_COOKIE_KEY_SIZE])
+{
+	uint8_t data[MAX_KEY_FILE_SIZE];
+	size_t size;
+	FILE *fp;
+	int ret;
+
+	fp = fopen(file, "r");
+	if (fp == NULL)
+		return -1;
+
+	size = fread(data, 1, sizeof(data), fp);
+	fclose(fp);
+
+	if (size < MIN_KEY_FILE_SIZE || size == sizeof(data)) {
+		ret = -1;
+		goto cleanup;
+	}
+
+	ret = gnutls_hash_fast(GNUTLS_DIG_SHA256, data, size, key);
+	if (ret < 0) {
+		ret = -1;
+		goto cleanup;
+	}
+
+	ret = 0;
+ cleanup:
+	safe_memset(data, 0, sizeof(data));
+	return ret;
+}
+
+#ifdef SUPPORT_SEALED_COOKIES
+static int cipher_init(gnutls_aead_cipher_hd_t *cipher, const uint8_t key[SEALED_COOKIE_KEY_SIZE])
+{
+	gnutls_datum_t k;
+
+	k.data = (void*)key;
+	k.size = SEALED_COOKIE_KEY_SIZE;
+
+	return gnutls_aead_cipher_init(cipher, GNUTLS_CIPHER_AES_256_GCM, &k);
+}
+
+int sealed_cookie_seal(void *pool, const uint8_t key[SEALED_COOKIE_KEY_SIZE],
+		       const SealedCookieMsg *msg, uint8_t **cookie, size_t *cookie_size)
+{
+	gnutls_aead_cipher_hd_t cipher;
+	uint8_t *plain = NULL, *out = NULL;
+	size_t plain_size, out_size;
+	int ret;
+
+	plain_size = sealed_cookie_msg__get_packed_size(msg);
+	out_size = HEADER_SIZE + plain_size + TAG_SIZE;
+	if (out_size > MAX_COOKIE_SIZE)
+		return -1;
+
+	plain = talloc_size(pool, plain_size);
+	out = talloc_size(pool, out_size);
+	if (plain == NULL || out == NULL)
+		goto fail;
+
+	sealed_cookie_msg__pack(msg, plain);
+
+	out[0] = SEALED_COOKIE_VERSION;
+	ret = gnutls_rnd(GNUTLS_RND_NONCE, out + 1, NONCE_SIZE);
+	if (ret < 0)
+		goto fail;
+
+	if (cipher_init(&cipher, key) < 0)
+		goto fail;
+
+	out_size -= HEADER_SIZE;
+	ret = gnutls_aead_cipher_encrypt(cipher, out + 1, NONCE_SIZE,
+					 out, 1, TAG_SIZE,
+					 plain, plain_size,
+					 out + HEADER_SIZE, &out_size);
+	gnutls_aead_cipher_deinit(cipher);
+	if (ret < 0)
+		goto fail;
+
+	safe_memset(plain, 0, plain_size);
+	talloc_free(plain);
+
+	*cookie = out;
+	*cookie_size = HEADER_SIZE + out_size;
+	return 0;
+
+ fail:
+	if (plain != NULL)
+		safe_memset(plain, 0, plain_size);
+	talloc_free(plain);
+	talloc_free(out);
+	return -1;
+}
+
+SealedCookieMsg *sealed_cookie_open(void *pool, const uint8_t key[SEALED_COOKIE_KEY_SIZE],
+				    const uint8_t *cookie, size_t cookie_size)
+{
+	gnutls_aead_cipher_hd_t cipher;
+	SealedCookieMsg *msg = NULL;
+	uint8_t plain[MAX_COOKIE_SIZE];
+	size_t plain_size = sizeof(plain);
+	PROTOBUF_ALLOCATOR(pa, pool);
+	int ret;
+
+	if (cookie_size < HEADER_SIZE + TAG_SIZE || cookie_size > MAX_COOKIE_SIZE ||
+	    cookie[0] != SEALED_COOKIE_VERSION)
+		return NULL;
+
+	if (cipher_init(&cipher, key) < 0)
+		return NULL;
+
+	ret = gnutls_aead_cipher_decrypt(cipher, cookie + 1, NONCE_SIZE,
+					 cookie, 1, TAG_SIZE,
+					 cookie + HEADER_SIZE, cookie_size - HEADER_SIZE,
+					 plain, &plain_size);
+	gnutls_aead_cipher_deinit(cipher);
+	if (ret < 0)
+		return NULL;
+
+	msg = sealed_cookie_msg__unpack(&pa, plain_size, plain);
+	safe_memset(plain, 0, plain_size);
+
+	return msg;
+}
+#else
+int sealed_cookie_seal(void *pool, const uint8_t key[SEALED_COOKIE_KEY_SIZE],
+		       const SealedCookieMsg *msg, uint8_t **cookie, size_t *cookie_size)
+{
+	return -1;
+}
+
+SealedCookieMsg *sealed_cookie_open(void *pool, const uint8_t key[SEALED_COOKIE_KEY_SIZE],
+				    const uint8_t *cookie, size_t cookie_size)
+{
+	return NULL;
+}
+#endif
@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2026 Nikos Mavrogiannopoulos
+ *
+ * Author: Nikos Mavrogiannopoulos
+ *
+ * This file is part of ocserv.
+ *
+ * ocserv is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#ifndef SEALED_COOKIE_H
+# define SEALED_COOKIE_H
+
+#include <stdint.h>
+#include <gnutls/gnutls.h>
+#include <vpn.h>
+#include <ipc.pb-c.h>
+
+/* A sealed cookie carries the state of the session it was issued for,
+ * encrypted and authenticated with a key which is shared by main and
+ * sec-mod. It is used in place of the plain session ID when cookie-key-file
+ * is set, and allows the session to be restored when sec-mod no longer
+ * knows it, e.g., after a restart of the server.
+ *
+ * Format: version (1 byte) | nonce (12 bytes) | AES-256-GCM(SealedCookieMsg) | tag
+ */
+
+/* gnutls_aead_cipher_encrypt() */
+# if GNUTLS_VERSION_NUMBER >= 0x030400
+#  define SUPPORT_SEALED_COOKIES
+# endif
+
+#define SEALED_COOKIE_KEY_SIZE 32
+#define SEALED_COOKIE_VERSION 1
+
+/* A cookie of SID_SIZE is a plain session ID */
+#define IS_SEALED_COOKIE(size) ((size) != SID_SIZE)
+
+/* The longest a sealed cookie is valid for, when there is no session-timeout */
+#define SEALED_COOKIE_MAX_LIFETIME (24*60*60)
+
+int sealed_cookie_load_key(const char *file, uint8_t key[SEALED_COOKIE_KEY_SIZE]);
+
+int sealed_cookie_seal(void *pool, const uint8_t key[SEALED_COOKIE_KEY_SIZE],
+		       const SealedCookieMsg *msg, uint8_t **cookie, size_t *cookie_size);
+SealedCookieMsg *sealed_cookie_open(void *pool, const uint8_t key[SEALED_COOKIE_KEY_SIZE],
+				    const uint8_t *cookie, size_t cookie_size);
+
+#endif
@@ -0,0 +1,446 @@
+/*
+ * Copyright (C) 2026 Nikos Mavrogiannopoulos
+ *
+ * Author: Nikos Mavrogiannopoulos
+ *
+ * This file is part of ocserv.
+ *
+ * ocserv is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <syslog.h>
+#include <talloc.h>
+#ifdef HAVE_PTHREAD_H
+# include <pthread.h>
+#endif
+#ifdef HAVE_PCL_THREADS
+# include <pcl.h>
+#endif
+
+#include <vpn.h>
+#include <common.h>
+#include <cloexec.h>
+#include <gettime.h>
+#include <sec-mod.h>
+#include "sec-mod-auth-pool.h"
+
+/* The authentication modules may block for long; e.g., while waiting
+ * for a radius server or during a PAM conversation. To prevent them from
+ * stalling everything else in sec-mod, their calls are run by a fixed
+ * number of threads. The client entries and all replies remain with
+ * the main loop, which is notified of finished calls via a pipe.
+ *
+ * Calls to modules which are AUTH_THREADS_SERIAL are run one at a time;
+ * a thread never picks such a call while another is running, so that a
+ * slow module cannot occupy the threads needed by the others.
+ *
+ * The queue is bounded, in total and per client address, and a thread
+ * prefers the calls of addresses which have none running; that way a
+ * client retrying in a loop (or many behind one address) delays mostly
+ * itself. The time spent queued and running is counted per call.
+ */
+
+#define MAX_QUEUED 1024
+#define MAX_SOURCE_QUEUED 64
+
+static void auth_gettime(struct timespec *t)
+{
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+	clock_gettime(CLOCK_MONOTONIC, t);
+#else
+	gettime(t);
+#endif
+}
+
+static void hist_add(uint32_t *hist, struct timespec *end, struct timespec *start)
+{
+	int64_t ms;
+	unsigned i;
+
+	ms = (int64_t)(end->tv_sec - start->tv_sec) * 1000 +
+	     (end->tv_nsec - start->tv_nsec) / 1000000;
+
+	for (i = 0; i < AUTH_LATENCY_BUCKETS - 1; i++) {
+		if (ms < (1 << i))
+			break;
+	}
+	hist[i]++;
+}
+
+static void account_job(sec_mod_st *sec, auth_job_st *job)
+{
+	hist_add(sec->auth_wait_hist, &job->started, &job->queued);
+	hist_add(sec->auth_run_hist, &job->finished, &job->started);
+}
+
+/* for the calls which are not queued */
+static void run_job(sec_mod_st *sec, auth_job_st *job)
+{
+	auth_gettime(&job->queued);
+	job->started = job->queued;
+	job->run(job);
+	auth_gettime(&job->finished);
+	account_job(sec, job);
+	job->done(sec, job);
+}
+
+#ifdef HAVE_PTHREAD_H
+
+/* one per module which does not allow concurrent calls */
+struct auth_serial_st {
+	struct list_node list;
+	const struct auth_mod_st *module;
+	unsigned busy;
+};
+
+struct auth_pool_st {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	struct list_head queue; /* auth_job_st to be run */
+	struct list_head active; /* auth_job_st being run */
+	struct list_head done; /* auth_job_st to be completed by main */
+	struct list_head serials; /* auth_serial_st */
+
+	unsigned queued;
+	unsigned running;
+	unsigned paused;
+
+	int notify_fd[2];
+};
+
+static unsigned source_running(struct auth_pool_st *p, uint32_t source)
+{
+	auth_job_st *job;
+
+	list_for_each(&p->active, job, list) {
+		if (job->source == source)
+			return 1;
+	}
+
+	return 0;
+}
+
+/* Returns the first queued job which may run now, preferring those of
+ * addresses with no running job. Must be called with the lock held. */
+static auth_job_st *next_job(struct auth_pool_st *p)
+{
+	auth_job_st *job, *first = NULL;
+
+	if (p->paused)
+		return NULL;
+
+	list_for_each(&p->queue, job, list) {
+		if (job->serial != NULL && job->serial->busy != 0)
+			continue;
+
+		if (!source_running(p, job->source))
+			return job;
+
+		if (first == NULL)
+			first = job;
+	}
+
+	return first;
+}
+
+static void *auth_pool_thread(void *arg)
+{
+	struct auth_pool_st *p = arg;
+	auth_job_st *job;
+	int ret;
+
+#ifdef HAVE_PCL_THREADS
+	/* the PAM module runs its conversation in a coroutine */
+	if (co_thread_init() < 0) {
+		syslog(LOG_ERR, "sec-mod: could not initialize coroutines in auth thread");
+		return NULL;
+	}
+#endif
+
+	pthread_mutex_lock(&p->lock);
+	for (;;) {
+		job = next_job(p);
+		if (job == NULL) {
+			pthread_cond_wait(&p->cond, &p->lock);
+			continue;
+		}
+
+		list_del(&job->list);
+		list_add_tail(&p->active, &job->list);
+		if (job->serial)
+			job->serial->busy = 1;
+		p->queued--;
+		p->running++;
+		pthread_mutex_unlock(&p->lock);
+
+		auth_gettime(&job->started);
+		job->run(job);
+		auth_gettime(&job->finished);
+
+		pthread_mutex_lock(&p->lock);
+		if (job->serial) {
+			job->serial->busy = 0;
+			/* a job of that module may be waiting */
+			pthread_cond_signal(&p->cond);
+		}
+		p->running--;
+		list_del(&job->list);
+		list_add_tail(&p->done, &job->list);
+
+		do {
+			ret = write(p->notify_fd[1], "", 1);
+		} while (ret == -1 && errno == EINTR);
+		/* on EAGAIN main has already been notified */
+	}
+
+	return NULL;
+}
+
+int auth_pool_init(sec_mod_st *sec, unsigned threads)
+{
+	struct auth_pool_st *p;
+	sigset_t set, oldset;
+	pthread_t thread;
+	unsigned i;
+	int ret;
+
+	if (threads == 0)
+		return 0;
+
+	p = talloc_zero(sec, struct auth_pool_st);
+	if (p == NULL)
+		return -1;
+
+	if (pthread_mutex_init(&p->lock, NULL) != 0 ||
+	    pthread_cond_init(&p->cond, NULL) != 0)
+		return -1;
+
+	list_head_init(&p->queue);
+	list_head_init(&p->active);
+	list_head_init(&p->done);
+	list_head_init(&p->serials);
+
+	if (pipe(p->notify_fd) < 0)
+		return -1;
+
+	for (i = 0; i < 2; i++) {
+		set_non_block(p->notify_fd[i]);
+		set_cloexec_flag(p->notify_fd[i], 1);
+	}
+
+	/* signals are only handled by the main loop */
+	sigfillset(&set);
+	pthread_sigmask(SIG_SETMASK, &set, &oldset);
+
+	for (i = 0; i < threads; i++) {
+		ret = pthread_create(&thread, NULL, auth_pool_thread, p);
+		if (ret != 0) {
+			seclog(sec, LOG_ERR, "could not start auth thread: %s", strerror(ret));
+			break;
+		}
+		pthread_detach(thread);
+	}
+
+	pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+
+	if (i == 0) {
+		close(p->notify_fd[0]);
+		close(p->notify_fd[1]);
+		talloc_free(p);
+		return -1;
+	}
+
+	seclog(sec, LOG_DEBUG, "started %u auth threads", i);
+	sec->auth_pool = p;
+	return 0;
+}
+
+/* Returns -1 if the queue is full; otherwise the job is run, and its
+ * done() callback is called, possibly before this function returns. */
+int auth_pool_submit(sec_mod_st *sec, auth_job_st *job)
+{
+	struct auth_pool_st *p = sec->auth_pool;
+	struct auth_serial_st *s;
+	auth_job_st *j;
+	unsigned same = 0;
+
+	job->serial = NULL;
+
+	if (p == NULL || job->module == NULL || job->module->threads == AUTH_THREADS_NONE) {
+		run_job(sec, job);
+		return 0;
+	}
+
+	pthread_mutex_lock(&p->lock);
+	if (p->queued >= MAX_QUEUED) {
+		pthread_mutex_unlock(&p->lock);
+		return -1;
+	}
+
+	list_for_each(&p->queue, j, list) {
+		if (j->source == job->source && ++same >= MAX_SOURCE_QUEUED) {
+			pthread_mutex_unlock(&p->lock);
+			return -1;
+		}
+	}
+
+	if (job->module->threads == AUTH_THREADS_SERIAL) {
+		list_for_each(&p->serials, s, list) {
+			if (s->module == job->module) {
+				job->serial = s;
+				break;
+			}
+		}
+
+		if (job->serial == NULL) {
+			/* freed with the pool; there are only a few modules */
+			s = talloc_zero(p, struct auth_serial_st);
+			if (s == NULL) {
+				pthread_mutex_unlock(&p->lock);
+				run_job(sec, job);
+				return 0;
+			}
+			s->module = job->module;
+			list_add_tail(&p->serials, &s->list);
+			job->serial = s;
+		}
+	}
+
+	auth_gettime(&job->queued);
+	list_add_tail(&p->queue, &job->list);
+	p->queued++;
+	pthread_cond_signal(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+
+	return 0;
+}
+
+/* Returns the fd which becomes readable when jobs are done, or -1 if
+ * there are no threads. */
+int auth_pool_get_fd(sec_mod_st *sec)
+{
+	struct auth_pool_st *p = sec->auth_pool;
+
+	if (p == NULL)
+		return -1;
+
+	return p->notify_fd[0];
+}
+
+/* Calls the done() callback of the finished jobs */
+void auth_pool_complete(sec_mod_st *sec)
+{
+	struct auth_pool_st *p = sec->auth_pool;
+	struct list_head done;
+	auth_job_st *job, *jtmp;
+	char buf[64];
+
+	if (p == NULL)
+		return;
+
+	while (read(p->notify_fd[0], buf, sizeof(buf)) > 0)
+		;
+
+	list_head_init(&done);
+
+	pthread_mutex_lock(&p->lock);
+	while ((job = list_top(&p->done, auth_job_st, list)) != NULL) {
+		list_del(&job->list);
+		list_add_tail(&done, &job->list);
+	}
+	pthread_mutex_unlock(&p->lock);
+
+	list_for_each_safe(&done, job, jtmp, list) {
+		list_del(&job->list);
+		account_job(sec, job);
+		job->done(sec, job);
+	}
+}
+
+/* Stops the threads from picking new jobs, e.g., while the
+ * configuration is being reloaded. Returns the number of jobs which
+ * are still running; the caller should wait for them to complete. */
+unsigned auth_pool_pause(sec_mod_st *sec)
+{
+	struct auth_pool_st *p = sec->auth_pool;
+	unsigned running;
+
+	if (p == NULL)
+		return 0;
+
+	pthread_mutex_lock(&p->lock);
+	p->paused = 1;
+	running = p->running;
+	pthread_mutex_unlock(&p->lock);
+
+	return running;
+}
+
+void auth_pool_resume(sec_mod_st *sec)
+{
+	struct auth_pool_st *p = sec->auth_pool;
+
+	if (p == NULL)
+		return;
+
+	pthread_mutex_lock(&p->lock);
+	p->paused = 0;
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+}
+
+#else /* no threads; jobs are run when submitted */
+
+int auth_pool_init(sec_mod_st *sec, unsigned threads)
+{
+	if (threads != 0)
+		seclog(sec, LOG_INFO, "auth-threads is set but threads are not supported");
+	return 0;
+}
+
+int auth_pool_submit(sec_mod_st *sec, auth_job_st *job)
+{
+	job->serial = NULL;
+	run_job(sec, job);
+	return 0;
+}
+
+int auth_pool_get_fd(sec_mod_st *sec)
+{
+	return -1;
+}
+
+void auth_pool_complete(sec_mod_st *sec)
+{
+}
+
+unsigned auth_pool_pause(sec_mod_st *sec)
+{
+	return 0;
+}
+
+void auth_pool_resume(sec_mod_st *sec)
+{
+}
+
+#endif
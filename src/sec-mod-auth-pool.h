@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2026 Nikos Mavrogiannopoulos
+ *
+ * Author: Nikos Mavrogiannopoulos
+ *
+ * This file is part of ocserv.
+ *
+ * ocserv is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#ifndef SEC_MOD_AUTH_POOL_H
+# define SEC_MOD_AUTH_POOL_H
+
+#include <time.h>
+#include <ccan/list/list.h>
+#include "sec-mod.h"
+#include "sec-mod-auth.h"
+
+/* A call into an authentication module. The run() callback is called
+ * by a thread of the pool and must only touch the job and its client
+ * entry; done() is called afterwards by sec-mod's main loop, which
+ * owns everything else. The source identifies the client's address,
+ * so that a single address cannot occupy all threads. */
+typedef struct auth_job_st {
+	struct list_node list;
+	const struct auth_mod_st *module;
+	void (*run)(struct auth_job_st *job);
+	void (*done)(sec_mod_st *sec, struct auth_job_st *job);
+	uint32_t source;
+
+	/* set by the pool */
+	struct auth_serial_st *serial;
+	struct timespec queued;
+	struct timespec started;
+	struct timespec finished;
+} auth_job_st;
+
+int auth_pool_init(sec_mod_st *sec, unsigned threads);
+int auth_pool_submit(sec_mod_st *sec, auth_job_st *job);
+int auth_pool_get_fd(sec_mod_st *sec);
+void auth_pool_complete(sec_mod_st *sec);
+unsigned auth_pool_pause(sec_mod_st *sec);
+void auth_pool_resume(sec_mod_st *sec);
+
+#endif
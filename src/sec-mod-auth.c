@@ -44,6 +44,7 @@
 #include <main.h>
 #include <ccan/list/list.h>
 #include <sec-mod-auth.h>
+#include <sec-mod-auth-pool.h>
 #include <auth/plain.h>
 #include <common.h>
 #include <auth/pam.h>
@@ -134,10 +135,60 @@ static void update_auth_time_stats(sec_mod_st * sec, time_t secs)
 	sec->avg_auth_time = (sec->avg_auth_time*(sec->total_authentications-1)+secs) / sec->total_authentications;
 }
 
+static uint32_t ipv4_seed(client_entry_st *e)
+{
+	uint32_t seed;
+
+	/* Fixme: possibly we should allow for completely random seeds */
+	if (e->vhost->perm_config.config->predictable_ips != 0) {
+		seed = hash_any(e->acct_info.username, strlen(e->acct_info.username), 0);
+	} else {
+		if (gnutls_rnd(GNUTLS_RND_NONCE, &seed, sizeof(seed)) < 0)
+			seed = 0;
+	}
+
+	return seed;
+}
+
+/* Seals the state of the session into a cookie. The cookie is valid
+ * for the session-timeout, or SEALED_COOKIE_MAX_LIFETIME, plus the
+ * cookie-timeout. */
+static int seal_cookie(sec_mod_st *sec, client_entry_st *e, void *pool,
+		       uint8_t **cookie, size_t *cookie_size)
+{
+	SealedCookieMsg msg = SEALED_COOKIE_MSG__INIT;
+	struct cfg_st *config = e->vhost->perm_config.config;
+	time_t now = time(0);
+
+	e->ipv4_seed = ipv4_seed(e);
+	e->sealed_expires = now + config->cookie_timeout + AUTH_SLACK_TIME +
+		(config->session_timeout > 0 ? config->session_timeout : SEALED_COOKIE_MAX_LIFETIME);
+
+	msg.sid.data = e->sid;
+	msg.sid.len = sizeof(e->sid);
+	msg.username = e->acct_info.username;
+	msg.groupname = e->acct_info.groupname;
+	msg.vhost = e->vhost->name;
+	msg.auth_type = e->auth_type;
+	msg.ipv4_seed = e->ipv4_seed;
+	msg.created = e->created;
+	msg.expires = e->sealed_expires;
+	msg.remote_ip = e->acct_info.remote_ip;
+	msg.our_ip = e->acct_info.our_ip;
+	msg.tls_auth_ok = e->tls_auth_ok;
+	msg.user_agent = e->acct_info.user_agent;
+	msg.device_platform = e->acct_info.device_platform;
+	msg.device_type = e->acct_info.device_type;
+
+	return sealed_cookie_seal(pool, sec->cookie_key, &msg, cookie, cookie_size);
+}
+
 static
 int send_sec_auth_reply(int cfd, sec_mod_st * sec, client_entry_st * entry, AUTHREP r)
 {
 	SecAuthReplyMsg msg = SEC_AUTH_REPLY_MSG__INIT;
+	uint8_t *cookie = NULL;
+	size_t cookie_size;
 	int ret;
 
 	if (r == AUTH__REP__OK) {
@@ -161,11 +212,24 @@ int send_sec_auth_reply(int cfd, sec_mod_st * sec, client_entry_st * entry, AUTH
 		msg.dtls_session_id.data = entry->dtls_session_id;
 		msg.dtls_session_id.len = sizeof(entry->dtls_session_id);
 
+		if (sec->cookie_key_set) {
+			if (seal_cookie(sec, entry, entry, &cookie, &cookie_size) < 0) {
+				seclog(sec, LOG_ERR, "could not seal cookie for user '%s' "SESSION_STR,
+				       entry->acct_info.username, entry->acct_info.safe_id);
+				return -1;
+			}
+
+			msg.has_cookie = 1;
+			msg.cookie.data = cookie;
+			msg.cookie.len = cookie_size;
+		}
+
 		ret = send_msg(entry, cfd, CMD_SEC_AUTH_REPLY,
 			       &msg,
 			       (pack_size_func)
 			       sec_auth_reply_msg__get_packed_size,
 			       (pack_func) sec_auth_reply_msg__pack);
+		talloc_free(cookie);
 	} else {
 		sec->auth_failures++;
 
@@ -321,29 +385,29 @@ int check_group(sec_mod_st * sec, client_entry_st * e)
 /* Performs the required steps based on the result from the
  * authentication function (e.g. handle_auth_init).
  *
- * @cmd: the command received
  * @result: the auth result
+ * @msg_ret: the return value of the module's auth_msg()
+ * @pst: the message from auth_msg(); it is only used if the result
+ *   is zero or ERR_AUTH_CONTINUE
  */
 static
-int handle_sec_auth_res(int cfd, sec_mod_st * sec, client_entry_st * e, int result)
+int handle_sec_auth_res(int cfd, sec_mod_st * sec, client_entry_st * e, int result,
+			int msg_ret, const passwd_msg_st *pst)
 {
 	int ret;
-	passwd_msg_st pst;
 	int passwd_retries = 1;
 
 	if ((result == ERR_AUTH_CONTINUE || result == 0) && e->module) {
-		memset(&pst, 0, sizeof(pst));
-		ret = e->module->auth_msg(e->auth_ctx, e, &pst);
-		if (ret < 0) {
+		if (msg_ret < 0) {
 			e->status = PS_AUTH_FAILED;
 			seclog(sec, LOG_ERR, "error getting auth msg");
-			return ret;
+			return msg_ret;
 		}
-		e->msg_str = pst.msg_str;
+		e->msg_str = pst->msg_str;
 
 		/* password requested for the next stage in multifactor auth OR password is requested again at the same stage */
-		passwd_retries = (e->passwd_counter < pst.counter) ? 0 : 1;
-		e->passwd_counter = pst.counter;
+		passwd_retries = (e->passwd_counter < pst->counter) ? 0 : 1;
+		e->passwd_counter = pst->counter;
 	}
 
 	if (result == ERR_AUTH_CONTINUE) {
@@ -420,13 +484,15 @@ static void stats_add_to(stats_st *dst, stats_st *src1, stats_st *src2)
 }
 
 static
-int send_failed_session_open_reply(sec_mod_st *sec, int fd)
+int send_failed_session_open_reply(sec_mod_st *sec, int fd, const SecmSessionOpenMsg *req)
 {
 	SecmSessionReplyMsg rep = SECM_SESSION_REPLY_MSG__INIT;
 	void *lpool;
 	int ret;
 
 	rep.reply = AUTH__REP__FAILED;
+	rep.has_id = req->has_id;
+	rep.id = req->id;
 
 	lpool = talloc_new(sec);
 	if (lpool == NULL) {
@@ -445,6 +511,76 @@ int send_failed_session_open_reply(sec_mod_st *sec, int fd)
 	return ret;
 }
 
+static int set_module(sec_mod_st * sec, vhost_cfg_st *vhost, client_entry_st *e, unsigned auth_type);
+
+/* Restores a session which we no longer know, from its sealed cookie */
+static client_entry_st *restore_client_entry(sec_mod_st *sec, const SecmSessionOpenMsg *req)
+{
+	SealedCookieMsg *msg;
+	client_entry_st *e = NULL;
+	vhost_cfg_st *vhost;
+	void *lpool;
+
+	lpool = talloc_new(sec);
+	if (lpool == NULL)
+		return NULL;
+
+	msg = sealed_cookie_open(lpool, sec->cookie_key, req->cookie.data, req->cookie.len);
+	if (msg == NULL || msg->sid.len != SID_SIZE ||
+	    memcmp(msg->sid.data, req->sid.data, SID_SIZE) != 0) {
+		seclog(sec, LOG_INFO, "session open with invalid cookie");
+		goto cleanup;
+	}
+
+	if (msg->expires <= (uint64_t)time(0)) {
+		seclog(sec, LOG_INFO, "session open with expired cookie of user '%s'", msg->username);
+		goto cleanup;
+	}
+
+	if (is_revoked_sid(sec, msg->sid.data)) {
+		seclog(sec, LOG_INFO, "session open with the cookie of a closed session of user '%s'", msg->username);
+		goto cleanup;
+	}
+
+	vhost = find_vhost(sec->vconfig, msg->vhost);
+
+	e = new_client_entry(sec, vhost, msg->remote_ip, 0, msg->sid.data);
+	if (e == NULL)
+		goto cleanup;
+
+	if (set_module(sec, vhost, e, msg->auth_type) < 0 || e->auth_type != msg->auth_type) {
+		seclog(sec, LOG_INFO, "session open with cookie for a no longer available authentication method");
+		del_client_entry(sec, e);
+		e = NULL;
+		goto cleanup;
+	}
+
+	strlcpy(e->acct_info.username, msg->username, sizeof(e->acct_info.username));
+	if (msg->groupname)
+		strlcpy(e->acct_info.groupname, msg->groupname, sizeof(e->acct_info.groupname));
+	if (msg->our_ip)
+		strlcpy(e->acct_info.our_ip, msg->our_ip, sizeof(e->acct_info.our_ip));
+	if (msg->user_agent)
+		strlcpy(e->acct_info.user_agent, msg->user_agent, sizeof(e->acct_info.user_agent));
+	if (msg->device_platform)
+		strlcpy(e->acct_info.device_platform, msg->device_platform, sizeof(e->acct_info.device_platform));
+	if (msg->device_type)
+		strlcpy(e->acct_info.device_type, msg->device_type, sizeof(e->acct_info.device_type));
+
+	e->tls_auth_ok = msg->tls_auth_ok;
+	e->ipv4_seed = msg->ipv4_seed;
+	e->created = msg->created;
+	e->sealed_expires = msg->expires;
+	e->status = PS_AUTH_COMPLETED;
+
+	seclog(sec, LOG_INFO, "%srestored session of user '%s' "SESSION_STR" from its cookie",
+	       PREFIX_VHOST(vhost), e->acct_info.username, e->acct_info.safe_id);
+
+ cleanup:
+	talloc_free(lpool);
+	return e;
+}
+
 int handle_secm_session_open_cmd(sec_mod_st *sec, int fd, const SecmSessionOpenMsg *req)
 {
 	client_entry_st *e;
@@ -458,24 +594,26 @@ int handle_secm_session_open_cmd(sec_mod_st *sec, int fd, const SecmSessionOpenM
 	if (req->sid.len != SID_SIZE) {
 		seclog(sec, LOG_ERR, "auth session open but with illegal sid size (%d)!",
 		       (int)req->sid.len);
-		return send_failed_session_open_reply(sec, fd);
+		return send_failed_session_open_reply(sec, fd, req);
 	}
 
 	e = find_client_entry(sec, req->sid.data);
+	if (e == NULL && req->has_cookie && sec->cookie_key_set)
+		e = restore_client_entry(sec, req);
 	if (e == NULL) {
 		seclog(sec, LOG_INFO, "session open but with non-existing SID!");
-		return send_failed_session_open_reply(sec, fd);
+		return send_failed_session_open_reply(sec, fd, req);
 	}
 
 	if (e->status != PS_AUTH_COMPLETED) {
 		seclog(sec, LOG_ERR, "session open received in unauthenticated client %s "SESSION_STR"!", e->acct_info.username, e->acct_info.safe_id);
-		return send_failed_session_open_reply(sec, fd);
+		return send_failed_session_open_reply(sec, fd, req);
 	}
 
 	if IS_CLIENT_ENTRY_EXPIRED(sec, e, time(0)) {
 		seclog(sec, LOG_ERR, "session expired; denied session for user '%s' "SESSION_STR, e->acct_info.username, e->acct_info.safe_id);
 		e->status = PS_AUTH_FAILED;
-		return send_failed_session_open_reply(sec, fd);
+		return send_failed_session_open_reply(sec, fd, req);
 	}
 
 	if (req->ipv4)
@@ -488,7 +626,7 @@ int handle_secm_session_open_cmd(sec_mod_st *sec, int fd, const SecmSessionOpenM
 		if (ret < 0) {
 			e->status = PS_AUTH_FAILED;
 			seclog(sec, LOG_INFO, "denied session for user '%s' "SESSION_STR, e->acct_info.username, e->acct_info.safe_id);
-			return send_failed_session_open_reply(sec, fd);
+			return send_failed_session_open_reply(sec, fd, req);
 		}
 	}
 	e->session_is_open = 1;
@@ -502,18 +640,19 @@ int handle_secm_session_open_cmd(sec_mod_st *sec, int fd, const SecmSessionOpenM
 	rep.tls_auth_ok = e->tls_auth_ok;
 	rep.vhost = e->vhost->name;
 
-	/* Fixme: possibly we should allow for completely random seeds */
-	if (e->vhost->perm_config.config->predictable_ips != 0) {
-		rep.ipv4_seed = hash_any(e->acct_info.username, strlen(e->acct_info.username), 0);
-	} else {
-		ret = gnutls_rnd(GNUTLS_RND_NONCE, &rep.ipv4_seed, sizeof(rep.ipv4_seed));
-		if (ret < 0)
-			return -1;
-	}
+	/* the sessions with a sealed cookie keep their seed, which
+	 * outlives this process */
+	if (e->sealed_expires != 0)
+		rep.ipv4_seed = e->ipv4_seed;
+	else
+		rep.ipv4_seed = ipv4_seed(e);
 
 	rep.sid.data = e->sid;
 	rep.sid.len = sizeof(e->sid);
 
+	rep.has_id = req->has_id;
+	rep.id = req->id;
+
 	rep.reply = AUTH__REP__OK;
 
 	lpool = talloc_new(e);
@@ -526,7 +665,7 @@ int handle_secm_session_open_cmd(sec_mod_st *sec, int fd, const SecmSessionOpenM
 		if (ret < 0) {
 			seclog(sec, LOG_ERR, "error reading additional configuration for '%s' "SESSION_STR, e->acct_info.username, e->acct_info.safe_id);
 			talloc_free(lpool);
-			return send_failed_session_open_reply(sec, fd);
+			return send_failed_session_open_reply(sec, fd, req);
 		}
 	}
 
@@ -559,6 +698,9 @@ int handle_secm_session_close_cmd(sec_mod_st *sec, int fd, const SecmSessionClos
 		return ERR_BAD_COMMAND;
 	}
 
+	rep.has_id = req->has_id;
+	rep.id = req->id;
+
 	e = find_client_entry(sec, req->sid.data);
 	if (e == NULL) {
 		seclog(sec, LOG_INFO, "session close but with non-existing SID");
@@ -683,7 +825,114 @@ int handle_sec_auth_stats_cmd(sec_mod_st * sec, const CliStatsMsg * req, pid_t p
 	return 0;
 }
 
-int handle_sec_auth_cont(int cfd, sec_mod_st * sec, const SecAuthContMsg * req)
+/* A call to the auth_init() or auth_pass() of a module, followed by
+ * auth_msg(). It is run by the auth pool, and while it runs neither the
+ * client entry nor the worker's connection are used by sec-mod.
+ */
+struct auth_step_st {
+	auth_job_st job;
+	sec_mod_conn_st *conn;
+	client_entry_st *e;
+
+	unsigned init; /* auth_init() if set, otherwise auth_pass() */
+	common_auth_init_st st;
+	char *password;
+
+	int result;
+	int msg_ret;
+	passwd_msg_st pst;
+};
+
+static void auth_step_run(auth_job_st *job)
+{
+	struct auth_step_st *step = (struct auth_step_st *)job;
+	client_entry_st *e = step->e;
+
+	if (step->init)
+		step->result = e->module->auth_init(&e->auth_ctx, e, e->vhost_auth_ctx, &step->st);
+	else
+		step->result = e->module->auth_pass(e->auth_ctx, step->password, strlen(step->password));
+
+	if (step->result == ERR_AUTH_CONTINUE || step->result == 0)
+		step->msg_ret = e->module->auth_msg(e->auth_ctx, e, &step->pst);
+}
+
+static void auth_step_done(sec_mod_st *sec, auth_job_st *job)
+{
+	struct auth_step_st *step = (struct auth_step_st *)job;
+	client_entry_st *e = step->e;
+
+	e->auth_pending = 0;
+	step->conn->auth_pending = 0;
+
+	if (!step->init && step->result < 0 && step->result != ERR_AUTH_CONTINUE) {
+		seclog(sec, LOG_DEBUG,
+		       "error in password given in auth cont for user '%s' "SESSION_STR,
+		       e->acct_info.username, e->acct_info.safe_id);
+	}
+
+	/* a failure is reported to the worker; the connection stays open */
+	handle_sec_auth_res(step->conn->fd, sec, e, step->result, step->msg_ret, &step->pst);
+
+	/* its next request can be read */
+	if (sec_mod_conn_watch(sec, step->conn) < 0)
+		sec_mod_conn_close(sec, step->conn);
+
+	if (step->password)
+		safe_memset(step->password, 0, strlen(step->password));
+	talloc_free(step);
+}
+
+/* Passes the call to the module to the auth pool. The reply is sent to
+ * the worker once the call is done; until then the worker's connection
+ * is not polled. */
+static int start_auth_step(sec_mod_conn_st *conn, sec_mod_st *sec, client_entry_st *e,
+			   const common_auth_init_st *st, const char *password)
+{
+	struct auth_step_st *step;
+
+	step = talloc_zero(sec, struct auth_step_st);
+	if (step == NULL)
+		return handle_sec_auth_res(conn->fd, sec, e, ERR_MEM, 0, NULL);
+
+	step->conn = conn;
+	step->e = e;
+
+	if (st) {
+		step->init = 1;
+		step->st.username = talloc_strdup(step, st->username);
+		step->st.ip = talloc_strdup(step, st->ip);
+		step->st.our_ip = talloc_strdup(step, st->our_ip);
+		step->st.user_agent = talloc_strdup(step, st->user_agent);
+		step->st.id = st->id;
+	} else {
+		step->password = talloc_strdup(step, password);
+		if (step->password == NULL) {
+			talloc_free(step);
+			return handle_sec_auth_res(conn->fd, sec, e, ERR_MEM, 0, NULL);
+		}
+	}
+
+	step->job.module = e->module;
+	step->job.run = auth_step_run;
+	step->job.done = auth_step_done;
+	step->job.source = hash_any(e->acct_info.remote_ip, strlen(e->acct_info.remote_ip), 0);
+
+	e->auth_pending = 1;
+	conn->auth_pending = 1;
+	if (auth_pool_submit(sec, &step->job) < 0) {
+		seclog(sec, LOG_NOTICE, "too many pending authentications; rejecting user '%s' "SESSION_STR,
+		       e->acct_info.username, e->acct_info.safe_id);
+		e->auth_pending = 0;
+		conn->auth_pending = 0;
+		talloc_free(step);
+		return handle_sec_auth_res(conn->fd, sec, e, ERR_AUTH_FAIL, 0, NULL);
+	}
+
+	return 0;
+}
+
+int handle_sec_auth_cont(sec_mod_conn_st *conn, sec_mod_st * sec, const SecAuthContMsg * req)
 {
 	client_entry_st *e;
 	int ret;
@@ -700,6 +949,12 @@ int handle_sec_auth_cont(int cfd, sec_mod_st * sec, const SecAuthContMsg * req)
 		return -1;
 	}
 
+	if (e->auth_pending) {
+		seclog(sec, LOG_ERR, "auth cont received for %s "SESSION_STR" while authenticating!",
+		       e->acct_info.username, e->acct_info.safe_id);
+		return -1;
+	}
+
 	if (e->status != PS_AUTH_INIT && e->status != PS_AUTH_CONT) {
 		seclog(sec, LOG_ERR, "auth cont received for %s "SESSION_STR" but we are on state %u!",
 		       e->acct_info.username, e->acct_info.safe_id, e->status);
@@ -724,20 +979,10 @@ int handle_sec_auth_cont(int cfd, sec_mod_st * sec, const SecAuthContMsg * req)
 
 	e->status = PS_AUTH_CONT;
 
-	ret =
-	    e->module->auth_pass(e->auth_ctx, req->password,
-			      strlen(req->password));
-	if (ret < 0) {
-		if (ret != ERR_AUTH_CONTINUE) {
-			seclog(sec, LOG_DEBUG,
-			       "error in password given in auth cont for user '%s' "SESSION_STR,
-			       e->acct_info.username, e->acct_info.safe_id);
-		}
-		goto cleanup;
-	}
+	return start_auth_step(conn, sec, e, NULL, req->password);
 
  cleanup:
-	return handle_sec_auth_res(cfd, sec, e, ret);
+	return handle_sec_auth_res(conn->fd, sec, e, ret, 0, NULL);
 }
 
 static
@@ -765,13 +1010,13 @@ int set_module(sec_mod_st * sec, vhost_cfg_st *vhost, client_entry_st *e, unsign
 	return -1;
 }
 
-int handle_sec_auth_init(int cfd, sec_mod_st *sec, const SecAuthInitMsg *req, pid_t pid)
+int handle_sec_auth_init(sec_mod_conn_st *conn, sec_mod_st *sec, const SecAuthInitMsg *req)
 {
 	int ret = -1;
 	client_entry_st *e;
 	unsigned i;
-	unsigned need_continue = 0;
 	vhost_cfg_st *vhost;
+	common_auth_init_st st;
 	hmac_component_st hmac_components[3];
 	uint8_t computed_hmac[HMAC_DIGEST_SIZE];
 	time_t now = time(0);
@@ -807,7 +1052,7 @@ int handle_sec_auth_init(int cfd, sec_mod_st *sec, const SecAuthInitMsg *req, pi
 		return -1;
 	}
 
-	e = new_client_entry(sec, vhost, req->ip, pid);
+	e = new_client_entry(sec, vhost, req->ip, conn->pid, NULL);
 	if (e == NULL) {
 		seclog(sec, LOG_ERR, "cannot initialize memory");
 		return -1;
@@ -819,24 +1064,6 @@ int handle_sec_auth_init(int cfd, sec_mod_st *sec, const SecAuthInitMsg *req, pi
 		goto cleanup;
 	}
 
-	if (e->module) {
-		common_auth_init_st st;
-
-		st.username = req->user_name;
-		st.ip = req->ip;
-		st.our_ip = req->our_ip;
-		st.user_agent = req->user_agent;
-		st.id = pid;
-
-		ret =
-		    e->module->auth_init(&e->auth_ctx, e, e->vhost_auth_ctx, &st);
-		if (ret == ERR_AUTH_CONTINUE) {
-			need_continue = 1;
-		} else if (ret < 0) {
-			goto cleanup;
-		}
-	}
-
 	e->tls_auth_ok = req->tls_auth_ok;
 
 	if (req->device_platform != NULL) {
@@ -883,14 +1110,19 @@ int handle_sec_auth_init(int cfd, sec_mod_st *sec, const SecAuthInitMsg *req, pi
 	       req->tls_auth_ok?"(with cert) ":"",
 	       e->acct_info.username, e->acct_info.safe_id, e->acct_info.groupname, req->ip);
 
-	if (need_continue != 0) {
-		ret = ERR_AUTH_CONTINUE;
-		goto cleanup;
+	if (e->module) {
+		st.username = req->user_name;
+		st.ip = req->ip;
+		st.our_ip = req->our_ip;
+		st.user_agent = req->user_agent;
+		st.id = conn->pid;
+
+		return start_auth_step(conn, sec, e, &st, NULL);
 	}
 
 	ret = 0;
  cleanup:
-	return handle_sec_auth_res(cfd, sec, e, ret);
+	return handle_sec_auth_res(conn->fd, sec, e, ret, 0, NULL);
 }
 
 void sec_auth_user_deinit(sec_mod_st *sec, client_entry_st *e)
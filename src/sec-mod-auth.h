@@ -31,9 +31,16 @@ typedef struct passwd_msg_st {
 	unsigned counter;
 } passwd_msg_st;
 
+/* How the auth_init, auth_pass and auth_msg callbacks of a module may
+ * be called when sec-mod runs authentication in threads. */
+#define AUTH_THREADS_NONE 0 /* only in sec-mod's main thread */
+#define AUTH_THREADS_SERIAL 1 /* in any thread, one call at a time */
+#define AUTH_THREADS_SAFE 2 /* in any thread, concurrently */
+
 typedef struct auth_mod_st {
 	unsigned int type;
 	unsigned int allows_retries; /* whether the module allows retries of the same password */
+	unsigned int threads; /* AUTH_THREADS_* */
 	void (*vhost_init)(void **vctx, void *pool, void* additional);
 	void (*vhost_deinit)(void *vctx);
 	int (*auth_init)(void **ctx, void *pool, void *vctx, const common_auth_init_st *);
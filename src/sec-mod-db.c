@@ -54,6 +54,20 @@ static size_t rehash(const void *_e, void *unused)
 	return hash_any(e->sid, sizeof(e->sid), 0);
 }
 
+/* A session removed before its sealed cookie expired. The cookie
+ * may not restore it. */
+typedef struct revoked_sid_st {
+	uint8_t sid[SID_SIZE];
+	time_t expires;
+} revoked_sid_st;
+
+static size_t revoked_rehash(const void *_e, void *unused)
+{
+	const revoked_sid_st *e = _e;
+
+	return hash_any(e->sid, sizeof(e->sid), 0);
+}
+
 void *sec_mod_client_db_init(sec_mod_st *sec)
 {
 	struct htable *db = talloc(sec, struct htable);
@@ -63,6 +77,11 @@ void *sec_mod_client_db_init(sec_mod_st *sec)
 	htable_init(db, rehash, NULL);
 	sec->client_db = db;
 
+	sec->revoked_db = talloc(sec, struct htable);
+	if (sec->revoked_db == NULL)
+		return NULL;
+	htable_init(sec->revoked_db, revoked_rehash, NULL);
+
 	return db;
 }
 
@@ -72,6 +91,9 @@ struct htable *db = sec->client_db;
 
 	htable_clear(db);
 	talloc_free(db);
+
+	htable_clear(sec->revoked_db);
+	talloc_free(sec->revoked_db);
 }
 
 /* The number of elements */
@@ -85,7 +107,9 @@ struct htable *db = sec->client_db;
 		return 0;
 }
 
-client_entry_st *new_client_entry(sec_mod_st *sec, struct vhost_cfg_st *vhost, const char *ip, unsigned pid)
+/* Adds an entry with the provided sid, or with a random one if sid is NULL */
+client_entry_st *new_client_entry(sec_mod_st *sec, struct vhost_cfg_st *vhost, const char *ip, unsigned pid,
+				  const uint8_t *sid)
 {
 	struct htable *db = sec->client_db;
 	client_entry_st *e, *te;
@@ -103,7 +127,10 @@ client_entry_st *new_client_entry(sec_mod_st *sec, struct vhost_cfg_st *vhost, c
 	e->acct_info.id = pid;
 	e->vhost = vhost;
 
-	do {
+	if (sid != NULL) {
+		memcpy(e->sid, sid, sizeof(e->sid));
+		te = find_client_entry(sec, e->sid);
+	} else do {
 		ret = gnutls_rnd(GNUTLS_RND_RANDOM, e->sid, sizeof(e->sid));
 		if (ret < 0) {
 			seclog(sec, LOG_ERR, "error generating SID");
@@ -158,8 +185,48 @@ client_entry_st *find_client_entry(sec_mod_st *sec, uint8_t sid[SID_SIZE])
 	return htable_get(db, rehash(&t, NULL), client_entry_cmp, &t);
 }
 
+static bool revoked_cmp(const void *_c1, void *_c2)
+{
+	const revoked_sid_st *c1 = _c1;
+	const revoked_sid_st *c2 = _c2;
+
+	if (memcmp(c1->sid, c2->sid, SID_SIZE) == 0)
+		return 1;
+	return 0;
+}
+
+unsigned is_revoked_sid(sec_mod_st *sec, const uint8_t sid[SID_SIZE])
+{
+	revoked_sid_st t;
+
+	memcpy(t.sid, sid, SID_SIZE);
+
+	return htable_get(sec->revoked_db, revoked_rehash(&t, NULL), revoked_cmp, &t) != NULL;
+}
+
+static void revoke_sid(sec_mod_st *sec, client_entry_st * e)
+{
+	revoked_sid_st *r;
+
+	if (is_revoked_sid(sec, e->sid))
+		return;
+
+	r = talloc(sec->revoked_db, revoked_sid_st);
+	if (r == NULL)
+		return;
+
+	memcpy(r->sid, e->sid, SID_SIZE);
+	r->expires = e->sealed_expires;
+
+	if (htable_add(sec->revoked_db, revoked_rehash(r, NULL), r) == 0)
+		talloc_free(r);
+}
+
 static void clean_entry(sec_mod_st *sec, client_entry_st * e)
 {
+	if (e->sealed_expires > time(0))
+		revoke_sid(sec, e);
+
 	sec_auth_user_deinit(sec, e);
 	talloc_free(e->msg_str);
 	talloc_free(e);
@@ -169,6 +236,7 @@ void cleanup_client_entries(sec_mod_st *sec)
 {
 	struct htable *db = sec->client_db;
 	client_entry_st *t;
+	revoked_sid_st *r;
 	struct htable_iter iter;
 	time_t now = time(0);
 
@@ -181,6 +249,15 @@ void cleanup_client_entries(sec_mod_st *sec)
 		t = htable_next(db, &iter);
 
 	}
+
+	r = htable_first(sec->revoked_db, &iter);
+	while (r != NULL) {
+		if (now >= r->expires) {
+			htable_delval(sec->revoked_db, &iter);
+			talloc_free(r);
+		}
+		r = htable_next(sec->revoked_db, &iter);
+	}
 }
 
 void del_client_entry(sec_mod_st *sec, client_entry_st * e)
@@ -44,6 +44,9 @@ void sup_config_init(sec_mod_st *sec)
 			vhost->config_module = &radius_sup_config;
 #endif
 		}
+
+		if (vhost->config_module && vhost->config_module->clear_cache)
+			vhost->config_module->clear_cache();
 	}
 }
 
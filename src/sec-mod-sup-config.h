@@ -41,10 +41,13 @@ const char *sup_config_name(unsigned s)
 
 /* The get_sup_config() should read any additional configuration for
  * proc->username/proc->groupname and save it in proc->config.
+ * The optional clear_cache() drops any cached configuration, and is
+ * called on reload.
  */
 struct config_mod_st {
 	int (*get_sup_config)(struct cfg_st *perm_config, client_entry_st *entry,
 	                      SecmSessionReplyMsg *msg, void *pool);
+	void (*clear_cache)(void);
 };
 
 void sup_config_init(sec_mod_st *sec);
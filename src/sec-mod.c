@@ -24,7 +24,10 @@
 #include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
-#include <sys/select.h>
+#include <poll.h>
+#ifdef HAVE_EPOLL_CREATE1
+# include <sys/epoll.h>
+#endif
 #include <sys/wait.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -42,6 +45,7 @@
 #include <ipc.pb-c.h>
 #include <sec-mod-sup-config.h>
 #include <sec-mod-resume.h>
+#include <sec-mod-auth-pool.h>
 #include <cloexec.h>
 #include <assert.h>
 
@@ -55,7 +59,7 @@ static int need_maintainance = 0;
 static int need_reload = 0;
 static int need_exit = 0;
 
-static void reload_server(sec_mod_st *sec);
+static void try_reload_server(sec_mod_st *sec);
 
 static int load_keys(sec_mod_st *sec, unsigned force);
 
@@ -196,9 +200,11 @@ static int handle_op(void *pool, int cfd, sec_mod_st * sec, uint8_t type, uint8_
 }
 
 static
-int process_worker_packet(void *pool, int cfd, pid_t pid, sec_mod_st *sec, cmd_request_t cmd,
+int process_worker_packet(void *pool, sec_mod_conn_st *conn, sec_mod_st *sec, cmd_request_t cmd,
 		   uint8_t * buffer, size_t buffer_size)
 {
+	int cfd = conn->fd;
+	pid_t pid = conn->pid;
 	unsigned i;
 	gnutls_datum_t data, out;
 	int ret;
@@ -361,7 +367,7 @@ int process_worker_packet(void *pool, int cfd, pid_t pid, sec_mod_st *sec, cmd_r
 				return -1;
 			}
 
-			ret = handle_sec_auth_init(cfd, sec, auth_init, pid);
+			ret = handle_sec_auth_init(conn, sec, auth_init);
 			sec_auth_init_msg__free_unpacked(auth_init, &pa);
 			return ret;
 		}
@@ -376,7 +382,7 @@ int process_worker_packet(void *pool, int cfd, pid_t pid, sec_mod_st *sec, cmd_r
 				return -1;
 			}
 
-			ret = handle_sec_auth_cont(cfd, sec, auth_cont);
+			ret = handle_sec_auth_cont(conn, sec, auth_cont);
 			sec_auth_cont_msg__free_unpacked(auth_cont, &pa);
 			return ret;
 		}
@@ -499,7 +505,7 @@ int process_packet_from_main(void *pool, int fd, sec_mod_st * sec, cmd_request_t
 
 	switch (cmd) {
 	case CMD_SECM_RELOAD:
-		reload_server(sec);
+		try_reload_server(sec);
 
 		ret = send_msg(pool, fd, CMD_SECM_RELOAD_REPLY, NULL,
 			       NULL, NULL);
@@ -589,6 +595,8 @@ static void send_stats_to_main(sec_mod_st *sec)
 		sec->auth_failures = 0;
 		sec->avg_auth_time = 0;
 		sec->max_auth_time = 0;
+		memset(sec->auth_wait_hist, 0, sizeof(sec->auth_wait_hist));
+		memset(sec->auth_run_hist, 0, sizeof(sec->auth_run_hist));
 		sec->last_stats_reset = now;
 	}
 
@@ -597,6 +605,10 @@ static void send_stats_to_main(sec_mod_st *sec)
 	msg.secmod_auth_failures = sec->auth_failures;
 	msg.secmod_avg_auth_time = sec->avg_auth_time;
 	msg.secmod_max_auth_time = sec->max_auth_time;
+	msg.secmod_auth_wait = sec->auth_wait_hist;
+	msg.n_secmod_auth_wait = AUTH_LATENCY_BUCKETS;
+	msg.secmod_auth_run = sec->auth_run_hist;
+	msg.n_secmod_auth_run = AUTH_LATENCY_BUCKETS;
 	/* we only report the number of failures since last call */
 	sec->auth_failures = 0;
 
@@ -631,6 +643,20 @@ static void reload_server(sec_mod_st *sec)
 	need_reload = 0;
 }
 
+/* The modules may not be reloaded while an auth thread uses them. In
+ * that case the reload is done once the running calls complete. */
+static void try_reload_server(sec_mod_st *sec)
+{
+	if (auth_pool_pause(sec) != 0) {
+		seclog(sec, LOG_DEBUG, "delaying reload until authentication completes");
+		need_reload = 1;
+		return;
+	}
+
+	reload_server(sec);
+	auth_pool_resume(sec);
+}
+
 static void check_other_work(sec_mod_st *sec)
 {
 	vhost_cfg_st *vhost = NULL;
@@ -646,6 +672,10 @@ static void check_other_work(sec_mod_st *sec)
 			vhost->key_size = 0;
 		}
 
+		/* the client entries may be in use by an auth thread */
+		if (auth_pool_pause(sec) != 0)
+			exit(0);
+
 		sec_mod_client_db_deinit(sec);
 		tls_cache_deinit(&sec->tls_db);
 		talloc_free(sec->config_pool);
@@ -654,7 +684,7 @@ static void check_other_work(sec_mod_st *sec)
 	}
 
 	if (need_reload) {
-		reload_server(sec);
+		try_reload_server(sec);
 	}
 
 	if (need_maintainance) {
@@ -719,48 +749,228 @@ int serve_request_main(sec_mod_st *sec, int fd, uint8_t *buffer, unsigned buffer
 	return ret;
 }
 
+/* Reads what is available of size bytes without blocking. Returns the
+ * bytes read, 0 if there were none, or a negative error code. */
+static int conn_recv(int fd, uint8_t *data, size_t size)
+{
+	int ret;
+
+	do {
+		ret = recv(fd, data, size, MSG_DONTWAIT);
+	} while (ret == -1 && errno == EINTR);
+
+	if (ret == 0)
+		return ERR_PEER_TERMINATED;
+	if (ret == -1) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return 0;
+		return ERR_BAD_COMMAND;
+	}
+
+	return ret;
+}
+
+/* Reads the available part of a worker's message into the buffer of its
+ * connection, and processes the message once it is complete; a slow
+ * worker doesn't hold up the others. Nothing past the message is read,
+ * so that the next one is left to the next readiness of the socket.
+ * Returns 0 while the message is incomplete.
+ */
 static
-int serve_request_worker(sec_mod_st *sec, int cfd, pid_t pid, uint8_t *buffer, unsigned buffer_size)
+int serve_request_worker(sec_mod_st *sec, sec_mod_conn_st *conn, uint8_t *buffer, unsigned buffer_size)
 {
-	int ret, e;
+	int ret;
 	uint8_t cmd;
-	size_t length;
+	uint32_t length;
 	void *pool = buffer;
 
-	/* read request */
-	ret = recv_msg_headers(cfd, &cmd, MAX_WAIT_SECS);
-	if (ret < 0) {
-		seclog(sec, LOG_DEBUG, "error receiving msg head from worker");
-		goto leave;
-	}
+	/* read the header: the command and the length of the body */
+	if (conn->hdr_size < sizeof(conn->hdr)) {
+		ret = conn_recv(conn->fd, conn->hdr + conn->hdr_size,
+				sizeof(conn->hdr) - conn->hdr_size);
+		if (ret == ERR_PEER_TERMINATED) /* the worker closed the connection */
+			return ret;
+		if (ret < 0) {
+			seclog(sec, LOG_DEBUG, "error receiving msg head from worker");
+			return ret;
+		}
 
-	length = ret;
+		conn->hdr_size += ret;
+		if (conn->hdr_size < sizeof(conn->hdr))
+			return 0;
 
-	if (length > buffer_size) {
-		seclog(sec, LOG_INFO, "too big message (%d)", (int)length);
-		ret = -1;
-		goto leave;
+		memcpy(&length, conn->hdr + 1, 4);
+		if (length > buffer_size) {
+			seclog(sec, LOG_INFO, "too big message (%d)", (int)length);
+			return -1;
+		}
+
+		conn->body = talloc_size(conn, length + 1);
+		if (conn->body == NULL) {
+			seclog(sec, LOG_ERR, "error in memory allocation");
+			return -1;
+		}
+		conn->body_size = length;
+		conn->body_received = 0;
 	}
 
 	/* read the body */
-	ret = force_read_timeout(cfd, buffer, length, MAX_WAIT_SECS);
-	if (ret < 0) {
-		e = errno;
-		seclog(sec, LOG_INFO, "error receiving msg body: %s",
-		       strerror(e));
-		ret = -1;
-		goto leave;
+	if (conn->body_received < conn->body_size) {
+		ret = conn_recv(conn->fd, conn->body + conn->body_received,
+				conn->body_size - conn->body_received);
+		if (ret < 0) {
+			seclog(sec, LOG_INFO, "error receiving msg body");
+			return ret;
+		}
+
+		conn->body_received += ret;
+		if (conn->body_received < conn->body_size)
+			return 0;
 	}
 
-	ret = process_worker_packet(pool, cfd, pid, sec, cmd, buffer, ret);
+	cmd = conn->hdr[0];
+	length = conn->body_size;
+	memcpy(buffer, conn->body, length);
+
+	/* ready for the next message */
+	conn->hdr_size = 0;
+	safe_memset(conn->body, 0, length);
+	talloc_free(conn->body);
+	conn->body = NULL;
+	conn->body_size = 0;
+
+	ret = process_worker_packet(pool, conn, sec, cmd, buffer, length);
 	if (ret < 0) {
 		seclog(sec, LOG_DEBUG, "error processing '%s' command (%d)", cmd_request_to_str(cmd), ret);
 	}
-	
- leave:
+
 	return ret;
 }
 
+static void accept_conn(sec_mod_st *sec, int sd)
+{
+	struct sockaddr_un sa;
+	socklen_t sa_len = sizeof(sa);
+	sec_mod_conn_st *conn;
+	uid_t uid;
+	pid_t pid;
+	int cfd, ret, e;
+
+	cfd = accept(sd, (struct sockaddr *)&sa, &sa_len);
+	if (cfd == -1) {
+		e = errno;
+		if (e != EINTR)
+			seclog(sec, LOG_DEBUG,
+			       "sec-mod error accepting connection: %s",
+			       strerror(e));
+		return;
+	}
+	set_cloexec_flag (cfd, 1);
+
+	/* do not allow unauthorized processes to issue commands
+	 */
+	ret = check_upeer_id("sec-mod", GETPCONFIG(sec)->debug, cfd,
+			     GETPCONFIG(sec)->uid, GETPCONFIG(sec)->gid,
+			     &uid, &pid);
+	if (ret < 0) {
+		seclog(sec, LOG_INFO, "rejected unauthorized connection");
+		close(cfd);
+		return;
+	}
+
+	conn = talloc_zero(sec, sec_mod_conn_st);
+	if (conn == NULL) {
+		seclog(sec, LOG_ERR, "error in memory allocation");
+		close(cfd);
+		return;
+	}
+
+	conn->fd = cfd;
+	conn->pid = pid;
+	list_add_tail(&sec->conns, &conn->list);
+	sec->conns_size++;
+
+	if (sec_mod_conn_watch(sec, conn) < 0)
+		sec_mod_conn_close(sec, conn);
+}
+
+void sec_mod_conn_close(sec_mod_st *sec, sec_mod_conn_st *conn)
+{
+	/* part of a message, which may contain a password */
+	if (conn->body)
+		safe_memset(conn->body, 0, conn->body_size);
+
+	list_del(&conn->list);
+	sec->conns_size--;
+	/* this also removes it from the epoll set */
+	close(conn->fd);
+	talloc_free(conn);
+}
+
+/* The fds watched besides the worker connections. In the epoll set
+ * they are told apart from the connections by their data.u64. */
+enum {
+	SEC_EV_CMD_FD_SYNC = 0,
+	SEC_EV_CMD_FD,
+	SEC_EV_LISTEN_FD,
+	SEC_EV_AUTH_FD,
+	SEC_EV_FIXED
+};
+
+#ifdef HAVE_EPOLL_CREATE1
+#define SEC_EV_MAX_EVENTS 64
+
+static int sec_ev_add(sec_mod_st *sec, int fd, unsigned idx)
+{
+	struct epoll_event event;
+
+	if (fd == -1)
+		return 0;
+
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.u64 = idx;
+	return epoll_ctl(sec->epfd, EPOLL_CTL_ADD, fd, &event);
+}
+#endif
+
+/* Adds the worker connection to the epoll set. It is taken out of it
+ * while an auth thread handles its request, and added back once the
+ * reply is sent. This is a no-op when poll() is used. */
+int sec_mod_conn_watch(sec_mod_st *sec, sec_mod_conn_st *conn)
+{
+#ifdef HAVE_EPOLL_CREATE1
+	struct epoll_event event;
+	int e;
+
+	if (sec->epfd == -1 || conn->watched)
+		return 0;
+
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.ptr = conn;
+	if (epoll_ctl(sec->epfd, EPOLL_CTL_ADD, conn->fd, &event) == -1) {
+		e = errno;
+		seclog(sec, LOG_ERR, "could not add worker connection to epoll: %s",
+		       strerror(e));
+		return -1;
+	}
+	conn->watched = 1;
+#endif
+	return 0;
+}
+
+static void sec_mod_conn_unwatch(sec_mod_st *sec, sec_mod_conn_st *conn)
+{
+#ifdef HAVE_EPOLL_CREATE1
+	if (sec->epfd == -1 || conn->watched == 0)
+		return;
+
+	epoll_ctl(sec->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+	conn->watched = 0;
+#endif
+}
+
 #define CHECK_LOOP_ERR(x) \
 	if (force != 0) { GNUTLS_FATAL_ERR(x); } \
 	else { if (ret < 0) { \
@@ -862,11 +1072,15 @@ static int load_keys(sec_mod_st *sec, unsigned force)
  * @socket_file: the name of the socket
  * @cmd_fd: socket to exchange commands with main
  * @cmd_fd_sync: socket to received sync commands from main
+ * @cookie_key: the key of the sealed cookies, or NULL
  *
  * This is the main part of the security module.
  * It creates the unix domain socket identified by @socket_file
- * and then accepts connections from the workers to it. Then 
- * it serves commands requested on the server's private key.
+ * and then accepts connections from the workers to it. Each worker
+ * keeps its connection open and sends all its requests over it, which
+ * are served as they arrive. These are the commands requested on the
+ * server's private key, and the authentication and session resumption
+ * requests.
  *
  * When the operation is decrypt the provided data are
  * decrypted and sent back to worker. The sign operation
@@ -888,24 +1102,28 @@ static int load_keys(sec_mod_st *sec, unsigned force)
  */
 void sec_mod_server(void *main_pool, void *config_pool, struct list_head *vconfig,
 		    const char *socket_file, int cmd_fd, int cmd_fd_sync,
-		    size_t  hmac_key_length, const uint8_t * hmac_key)
+		    size_t  hmac_key_length, const uint8_t * hmac_key,
+		    const uint8_t *cookie_key)
 {
 	struct sockaddr_un sa;
-	socklen_t sa_len;
-	int cfd, ret, e, n;
+	int ret, e;
 	unsigned buffer_size;
-	uid_t uid;
 	uint8_t *buffer;
 	int sd;
 	sec_mod_st *sec;
 	void *sec_mod_pool;
 	vhost_cfg_st *vhost = NULL;
-	fd_set rd_set;
-	pid_t pid;
-#ifdef HAVE_PSELECT
+	sec_mod_conn_st *conn;
+	struct pollfd *pfd = NULL;
+	sec_mod_conn_st **ready = NULL, **pfd_ready = NULL;
+	unsigned revents[SEC_EV_FIXED];
+	unsigned i, n, pfd_size = 0, ready_size;
+#ifdef HAVE_EPOLL_CREATE1
+	struct epoll_event events[SEC_EV_MAX_EVENTS];
+	sec_mod_conn_st *ev_ready[SEC_EV_MAX_EVENTS];
+#endif
+#ifdef HAVE_PPOLL
 	struct timespec ts;
-#else
-	struct timeval ts;
 #endif
 	sigset_t emptyset, blockset;
 
@@ -932,9 +1150,15 @@ void sec_mod_server(void *main_pool, void *config_pool, struct list_head *vconfi
 	}
 
 	sec->vconfig = vconfig;
+	list_head_init(&sec->conns);
+	sec->epfd = -1;
 	sec->config_pool = config_pool;
 	sec->sec_mod_pool = sec_mod_pool;
 	memcpy((uint8_t*)sec->hmac_key, hmac_key, hmac_key_length);
+	if (cookie_key != NULL) {
+		memcpy(sec->cookie_key, cookie_key, sizeof(sec->cookie_key));
+		sec->cookie_key_set = 1;
+	}
 
 	tls_cache_init(sec, &sec->tls_db);
 	sup_config_init(sec);
@@ -960,6 +1184,13 @@ void sec_mod_server(void *main_pool, void *config_pool, struct list_head *vconfi
 
 	sec->cmd_fd = cmd_fd;
 	sec->cmd_fd_sync = cmd_fd_sync;
+	/* the first statistics are not reset on their first report */
+	sec->last_stats_reset = time(0);
+
+	if (auth_pool_init(sec, GETCONFIG(sec)->auth_threads) < 0) {
+		seclog(sec, LOG_ERR, "error initializing the auth threads");
+		exit(1);
+	}
 
 	if (sec_mod_client_db_init(sec) == NULL) {
 		seclog(sec, LOG_ERR, "error in client db initialization");
@@ -1010,40 +1241,118 @@ void sec_mod_server(void *main_pool, void *config_pool, struct list_head *vconfi
 	seclog(sec, LOG_INFO, "sec-mod initialized (socket: %s)", SOCKET_FILE);
 
 
+#ifdef HAVE_EPOLL_CREATE1
+	/* the worker connections are added as they are accepted */
+	sec->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (sec->epfd != -1 &&
+	    (sec_ev_add(sec, cmd_fd_sync, SEC_EV_CMD_FD_SYNC) < 0 ||
+	     sec_ev_add(sec, cmd_fd, SEC_EV_CMD_FD) < 0 ||
+	     sec_ev_add(sec, sd, SEC_EV_LISTEN_FD) < 0 ||
+	     sec_ev_add(sec, auth_pool_get_fd(sec), SEC_EV_AUTH_FD) < 0)) {
+		close(sec->epfd);
+		sec->epfd = -1;
+	}
+	if (sec->epfd == -1)
+		seclog(sec, LOG_DEBUG, "could not initialize epoll; using poll()");
+#endif
+
 	for (;;) {
 		check_other_work(sec);
 
-		FD_ZERO(&rd_set);
-		n = 0;
+		memset(revents, 0, sizeof(revents));
+		ready_size = 0;
 
-		FD_SET(cmd_fd, &rd_set);
-		n = MAX(n, cmd_fd);
+#ifdef HAVE_EPOLL_CREATE1
+		if (sec->epfd != -1) {
+			ret = epoll_pwait(sec->epfd, events, SEC_EV_MAX_EVENTS,
+					  120 * 1000, &emptyset);
+			if (ret == 0 || (ret == -1 && errno == EINTR))
+				continue;
 
-		FD_SET(cmd_fd_sync, &rd_set);
-		n = MAX(n, cmd_fd_sync);
+			if (ret < 0) {
+				e = errno;
+				seclog(sec, LOG_ERR, "Error in epoll_pwait(): %s",
+				       strerror(e));
+				exit(1);
+			}
 
-		FD_SET(sd, &rd_set);
-		n = MAX(n, sd);
+			ready = ev_ready;
+			for (i = 0; i < (unsigned)ret; i++) {
+				if (events[i].data.u64 < SEC_EV_FIXED) {
+					revents[events[i].data.u64] = 1;
+					continue;
+				}
 
-#ifdef HAVE_PSELECT
-		ts.tv_nsec = 0;
-		ts.tv_sec = 120;
-		ret = pselect(n + 1, &rd_set, NULL, NULL, &ts, &emptyset);
+				conn = events[i].data.ptr;
+				/* its reply is sent when the auth thread is
+				 * done; until then it is not watched */
+				if (conn->auth_pending) {
+					sec_mod_conn_unwatch(sec, conn);
+					continue;
+				}
+				ready[ready_size++] = conn;
+			}
+		} else
+#endif
+		{
+			/* the sockets to main, the listening socket, the auth
+			 * threads and a connection per worker */
+			if (pfd_size < SEC_EV_FIXED + sec->conns_size) {
+				pfd_size = SEC_EV_FIXED + sec->conns_size + 64;
+				pfd = talloc_realloc(sec, pfd, struct pollfd, pfd_size);
+				pfd_ready = talloc_realloc(sec, pfd_ready, sec_mod_conn_st *, pfd_size);
+				if (pfd == NULL || pfd_ready == NULL) {
+					seclog(sec, LOG_ERR, "error in memory allocation");
+					exit(1);
+				}
+			}
+
+			pfd[SEC_EV_CMD_FD_SYNC].fd = cmd_fd_sync;
+			pfd[SEC_EV_CMD_FD].fd = cmd_fd;
+			pfd[SEC_EV_LISTEN_FD].fd = sd;
+			pfd[SEC_EV_AUTH_FD].fd = auth_pool_get_fd(sec);
+			n = SEC_EV_FIXED;
+
+			list_for_each(&sec->conns, conn, list) {
+				/* its reply is sent when the auth thread is done */
+				if (conn->auth_pending)
+					continue;
+				pfd[n].fd = conn->fd;
+				conn->pfd_idx = n++;
+			}
+
+			for (i = 0; i < n; i++) {
+				pfd[i].events = POLLIN;
+				pfd[i].revents = 0;
+			}
+
+#ifdef HAVE_PPOLL
+			ts.tv_nsec = 0;
+			ts.tv_sec = 120;
+			ret = ppoll(pfd, n, &ts, &emptyset);
 #else
-		ts.tv_usec = 0;
-		ts.tv_sec = 120;
-		sigprocmask(SIG_UNBLOCK, &blockset, NULL);
-		ret = select(n + 1, &rd_set, NULL, NULL, &ts);
-		sigprocmask(SIG_BLOCK, &blockset, NULL);
+			sigprocmask(SIG_UNBLOCK, &blockset, NULL);
+			ret = poll(pfd, n, 120 * 1000);
+			sigprocmask(SIG_BLOCK, &blockset, NULL);
 #endif
-		if (ret == 0 || (ret == -1 && errno == EINTR))
-			continue;
+			if (ret == 0 || (ret == -1 && errno == EINTR))
+				continue;
 
-		if (ret < 0) {
-			e = errno;
-			seclog(sec, LOG_ERR, "Error in pselect(): %s",
-			       strerror(e));
-			exit(1);
+			if (ret < 0) {
+				e = errno;
+				seclog(sec, LOG_ERR, "Error in poll(): %s",
+				       strerror(e));
+				exit(1);
+			}
+
+			for (i = 0; i < SEC_EV_FIXED; i++)
+				revents[i] = (pfd[i].revents != 0);
+
+			ready = pfd_ready;
+			list_for_each(&sec->conns, conn, list) {
+				if (conn->auth_pending == 0 && pfd[conn->pfd_idx].revents != 0)
+					ready[ready_size++] = conn;
+			}
 		}
 
 		/* we do a new allocation, to also use it as pool for the
@@ -1058,7 +1367,7 @@ void sec_mod_server(void *main_pool, void *config_pool, struct list_head *vconfi
 		/* we use two fds for communication with main. The synchronous is for
 		 * ping-pong communication which each request is answered immediated. The
 		 * async is for messages sent back and forth in no particular order */
-		if (FD_ISSET(cmd_fd_sync, &rd_set)) {
+		if (revents[SEC_EV_CMD_FD_SYNC]) {
 			ret = serve_request_main(sec, cmd_fd_sync, buffer, buffer_size);
 			if (ret < 0 && ret == ERR_BAD_COMMAND) {
 				seclog(sec, LOG_ERR, "error processing sync command from main");
@@ -1066,42 +1375,34 @@ void sec_mod_server(void *main_pool, void *config_pool, struct list_head *vconfi
 			}
 		}
 
-		if (FD_ISSET(cmd_fd, &rd_set)) {
+		if (revents[SEC_EV_CMD_FD]) {
 			ret = serve_request_main(sec, cmd_fd, buffer, buffer_size);
 			if (ret < 0 && ret == ERR_BAD_COMMAND) {
 				seclog(sec, LOG_ERR, "error processing async command from main");
 				exit(1);
 			}
 		}
-		
-		if (FD_ISSET(sd, &rd_set)) {
-			sa_len = sizeof(sa);
-			cfd = accept(sd, (struct sockaddr *)&sa, &sa_len);
-			if (cfd == -1) {
-				e = errno;
-				if (e != EINTR) {
-					seclog(sec, LOG_DEBUG,
-					       "sec-mod error accepting connection: %s",
-					       strerror(e));
-					goto cont;
-				}
-			}
-			set_cloexec_flag (cfd, 1);
 
-			/* do not allow unauthorized processes to issue commands
-			 */
-			ret = check_upeer_id("sec-mod", GETPCONFIG(sec)->debug, cfd,
-					     GETPCONFIG(sec)->uid, GETPCONFIG(sec)->gid,
-					     &uid, &pid);
-			if (ret < 0) {
-				seclog(sec, LOG_INFO, "rejected unauthorized connection");
-			} else {
-				memset(buffer, 0, buffer_size);
-				serve_request_worker(sec, cfd, pid, buffer, buffer_size);
-			}
-			close(cfd);
+		/* a request from each worker that has sent one */
+		for (i = 0; i < ready_size; i++) {
+			conn = ready[i];
+
+			memset(buffer, 0, buffer_size);
+			ret = serve_request_worker(sec, conn, buffer, buffer_size);
+			/* the connection is closed on error, as it may be left
+			 * in the middle of a message. The worker reconnects. */
+			if (ret < 0 && conn->auth_pending == 0)
+				sec_mod_conn_close(sec, conn);
 		}
- cont:
+
+		/* only after the connections above, as those that get
+		 * their reply here were not polled */
+		if (revents[SEC_EV_AUTH_FD])
+			auth_pool_complete(sec);
+
+		if (revents[SEC_EV_LISTEN_FD])
+			accept_conn(sec, sd);
+
 		talloc_free(buffer);
 #ifdef DEBUG_LEAKS
 		talloc_report_full(sec, stderr);
@@ -26,6 +26,7 @@
 #include <nettle/base64.h>
 #include <tlslib.h>
 #include <hmac.h>
+#include <sealed-cookie.h>
 #include "common/common.h"
 
 #include "vhost.h"
@@ -33,6 +34,26 @@
 #define SESSION_STR "(session: %.6s)"
 #define MAX_GROUPS 32
 
+/* A connection from a worker. It is kept open for the lifetime of the
+ * worker and carries all its requests, one at a time. */
+typedef struct sec_mod_conn_st {
+	struct list_node list;
+	int fd;
+	pid_t pid; /* the worker's pid */
+	unsigned pfd_idx; /* the conn's index in the poll set */
+	unsigned watched; /* it is in the epoll set */
+	unsigned auth_pending; /* its request is handled by an auth thread */
+
+	/* the message being received; see serve_request_worker() */
+	uint8_t hdr[5]; /* the command and the length of the body */
+	unsigned hdr_size;
+	uint8_t *body;
+	size_t body_size;
+	size_t body_received;
+} sec_mod_conn_st;
+
+struct auth_pool_st;
+
 typedef struct sec_mod_st {
 	struct list_head *vconfig;
 	void *config_pool;
@@ -42,13 +63,27 @@ typedef struct sec_mod_st {
 	int cmd_fd;
 	int cmd_fd_sync;
 
+	struct list_head conns; /* sec_mod_conn_st */
+	unsigned conns_size;
+	int epfd; /* -1 when poll() is used */
+
+	struct auth_pool_st *auth_pool; /* NULL if auth is not threaded */
+
 	tls_sess_db_st tls_db;
 	uint64_t auth_failures; /* auth failures since the last update (SECM_CLI_STATS) we sent to main */
 	uint32_t max_auth_time; /* the maximum time spent in (sucessful) authentication */
 	uint32_t avg_auth_time; /* the average time spent in (sucessful) authentication */
 	uint32_t total_authentications; /* successful authentications: to calculate the average above */
+	uint32_t auth_wait_hist[AUTH_LATENCY_BUCKETS]; /* time auth calls were queued */
+	uint32_t auth_run_hist[AUTH_LATENCY_BUCKETS]; /* time spent in the auth modules */
 	time_t last_stats_reset;
 	const uint8_t hmac_key[HMAC_DIGEST_SIZE];
+
+	/* the key of the sealed cookies, if cookie_key_set */
+	uint8_t cookie_key[SEALED_COOKIE_KEY_SIZE];
+	unsigned cookie_key_set;
+	/* the sealed cookies of removed sessions, which may not restore them */
+	struct htable *revoked_db;
 } sec_mod_st;
 
 typedef struct stats_st {
@@ -79,7 +114,7 @@ typedef struct common_acct_info_st {
 	unsigned id;
 } common_acct_info_st;
 
-#define IS_CLIENT_ENTRY_EXPIRED_FULL(sec, e, now, clean) (e->exptime != -1 && now >= e->exptime && e->in_use == 0)
+#define IS_CLIENT_ENTRY_EXPIRED_FULL(sec, e, now, clean) (e->exptime != -1 && now >= e->exptime && e->in_use == 0 && e->auth_pending == 0)
 #define IS_CLIENT_ENTRY_EXPIRED(sec, e, now) IS_CLIENT_ENTRY_EXPIRED_FULL(sec, e, now, 0)
 
 typedef struct client_entry_st {
@@ -93,6 +128,7 @@ typedef struct client_entry_st {
 	void *auth_ctx; /* the context of authentication */
 	unsigned session_is_open; /* whether open_session was done */
 	unsigned in_use; /* counter of users of this structure */
+	unsigned auth_pending; /* the module is called by an auth thread */
 	unsigned tls_auth_ok;
 
 	char *msg_str;
@@ -129,14 +165,20 @@ typedef struct client_entry_st {
 
 	/* the vhost this user is associated with */
 	vhost_cfg_st *vhost;
+
+	/* set if a sealed cookie was issued for this session */
+	time_t sealed_expires; /* the time the sealed cookie expires */
+	uint32_t ipv4_seed; /* the seed in the sealed cookie */
 } client_entry_st;
 
 void *sec_mod_client_db_init(sec_mod_st *sec);
 void sec_mod_client_db_deinit(sec_mod_st *sec);
 unsigned sec_mod_client_db_elems(sec_mod_st *sec);
-client_entry_st * new_client_entry(sec_mod_st *sec, struct vhost_cfg_st *, const char *ip, unsigned pid);
+client_entry_st * new_client_entry(sec_mod_st *sec, struct vhost_cfg_st *, const char *ip, unsigned pid,
+				   const uint8_t *sid);
 client_entry_st * find_client_entry(sec_mod_st *sec, uint8_t sid[SID_SIZE]);
 void del_client_entry(sec_mod_st *sec, client_entry_st * e);
+unsigned is_revoked_sid(sec_mod_st *sec, const uint8_t sid[SID_SIZE]);
 void expire_client_entry(sec_mod_st *sec, client_entry_st * e);
 void cleanup_client_entries(sec_mod_st *sec);
 
@@ -159,8 +201,10 @@ void sec_auth_init(struct vhost_cfg_st *vhost);
 
 void handle_secm_list_cookies_reply(void *pool, int fd, sec_mod_st *sec);
 void handle_sec_auth_ban_ip_reply(sec_mod_st *sec, const BanIpReplyMsg *msg);
-int handle_sec_auth_init(int cfd, sec_mod_st *sec, const SecAuthInitMsg * req, pid_t pid);
-int handle_sec_auth_cont(int cfd, sec_mod_st *sec, const SecAuthContMsg * req);
+int handle_sec_auth_init(sec_mod_conn_st *conn, sec_mod_st *sec, const SecAuthInitMsg * req);
+int handle_sec_auth_cont(sec_mod_conn_st *conn, sec_mod_st *sec, const SecAuthContMsg * req);
+int sec_mod_conn_watch(sec_mod_st *sec, sec_mod_conn_st *conn);
+void sec_mod_conn_close(sec_mod_st *sec, sec_mod_conn_st *conn);
 int handle_secm_session_open_cmd(sec_mod_st *sec, int fd, const SecmSessionOpenMsg *req);
 int handle_secm_session_close_cmd(sec_mod_st *sec, int fd, const SecmSessionCloseMsg *req);
 int handle_sec_auth_stats_cmd(sec_mod_st * sec, const CliStatsMsg * req, pid_t pid);
@@ -169,6 +213,7 @@ void sec_auth_user_deinit(sec_mod_st *sec, client_entry_st *e);
 void sec_mod_server(void *main_pool, void *config_pool, struct list_head *vconfig,
 		    const char *socket_file,
 		    int cmd_fd, int cmd_fd_sync,
-			size_t  hmac_key_length, const uint8_t * hmac_key);
+			size_t  hmac_key_length, const uint8_t * hmac_key,
+			const uint8_t *cookie_key);
 
 #endif
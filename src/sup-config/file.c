@@ -21,8 +21,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <pwd.h>
 #include <grp.h>
 #include <fcntl.h>
@@ -31,6 +33,8 @@
 #include <ip-util.h>
 #include <c-strcase.h>
 #include <c-ctype.h>
+#include <ccan/htable/htable.h>
+#include <ccan/hash/hash.h>
 
 #include "inih/ini.h"
 
@@ -253,6 +257,211 @@ int parse_group_cfg_file(struct cfg_st *global_config,
 	return ret;
 }
 
+/* The parsed files are kept in a cache keyed by their path, and are used
+ * for as long as the inode, size and times of the file are unchanged. That
+ * way the files of a reconnecting user are not parsed on each session
+ * open. The cache is cleared on reload.
+ */
+#define MAX_CFG_CACHE_ENTRIES 16384
+
+struct cfg_cache_entry_st {
+	char *file;
+	struct stat st;
+	GroupCfgSt *config;
+};
+
+static struct htable cfg_cache;
+static unsigned cfg_cache_size = 0;
+static unsigned cfg_cache_init = 0;
+
+static size_t cfg_cache_rehash(const void *_e, void *unused)
+{
+	const struct cfg_cache_entry_st *e = _e;
+	return hash_any(e->file, strlen(e->file), 0);
+}
+
+static bool cfg_cache_cmp(const void *_e, void *file)
+{
+	const struct cfg_cache_entry_st *e = _e;
+
+	if (strcmp(e->file, file) == 0)
+		return 1;
+	return 0;
+}
+
+static void clear_cache(void)
+{
+	struct htable_iter iter;
+	struct cfg_cache_entry_st *e;
+
+	if (cfg_cache_init == 0)
+		return;
+
+	e = htable_first(&cfg_cache, &iter);
+	while (e != NULL) {
+		talloc_free(e);
+		e = htable_next(&cfg_cache, &iter);
+	}
+	htable_clear(&cfg_cache);
+	cfg_cache_size = 0;
+}
+
+static unsigned same_file(const struct stat *a, const struct stat *b)
+{
+	/* the seconds alone miss the edits made within the same second */
+	if (a->st_ino == b->st_ino && a->st_dev == b->st_dev &&
+	    a->st_size == b->st_size &&
+	    a->st_mtim.tv_sec == b->st_mtim.tv_sec &&
+	    a->st_mtim.tv_nsec == b->st_mtim.tv_nsec &&
+	    a->st_ctim.tv_sec == b->st_ctim.tv_sec &&
+	    a->st_ctim.tv_nsec == b->st_ctim.tv_nsec)
+		return 1;
+	return 0;
+}
+
+/* Returns the parsed contents of the file, from the cache if it is
+ * unchanged, or NULL on error. */
+static GroupCfgSt *get_cached_cfg_file(struct cfg_st *global_config,
+				       const char *file, const struct stat *st)
+{
+	SecmSessionReplyMsg msg = SECM_SESSION_REPLY_MSG__INIT;
+	struct cfg_cache_entry_st *e;
+	size_t hval;
+	int ret;
+
+	if (cfg_cache_init == 0) {
+		htable_init(&cfg_cache, cfg_cache_rehash, NULL);
+		cfg_cache_init = 1;
+	}
+
+	hval = hash_any(file, strlen(file), 0);
+	e = htable_get(&cfg_cache, hval, cfg_cache_cmp, file);
+	if (e != NULL) {
+		if (same_file(&e->st, st))
+			return e->config;
+
+		htable_del(&cfg_cache, hval, e);
+		talloc_free(e);
+		cfg_cache_size--;
+	}
+
+	e = talloc_zero(NULL, struct cfg_cache_entry_st);
+	if (e == NULL)
+		return NULL;
+
+	e->file = talloc_strdup(e, file);
+	e->config = talloc(e, GroupCfgSt);
+	if (e->file == NULL || e->config == NULL)
+		goto fail;
+	group_cfg_st__init(e->config);
+	e->st = *st;
+
+	msg.config = e->config;
+	ret = parse_group_cfg_file(global_config, &msg, e, file);
+	if (ret < 0)
+		goto fail;
+
+	if (cfg_cache_size >= MAX_CFG_CACHE_ENTRIES)
+		clear_cache();
+
+	if (!htable_add(&cfg_cache, hval, e))
+		goto fail;
+	cfg_cache_size++;
+
+	return e->config;
+ fail:
+	talloc_free(e);
+	return NULL;
+}
+
+/* Applies the values of src over dst, as if the file of src was parsed
+ * after the file of dst; the set values are replaced and the lists are
+ * appended to. The strings are shared with src.
+ */
+static int merge_group_cfg(void *pool, GroupCfgSt *dst, const GroupCfgSt *src)
+{
+	const ProtobufCMessageDescriptor *desc = dst->base.descriptor;
+	const ProtobufCFieldDescriptor *f;
+	size_t *dst_n, src_n, elt_size;
+	void **dst_p, *const *src_p;
+	uint8_t *n;
+	unsigned i, is_ptr;
+
+	for (i = 0; i < desc->n_fields; i++) {
+		f = &desc->fields[i];
+		is_ptr = 0;
+
+		switch (f->type) {
+		case PROTOBUF_C_TYPE_STRING:
+		case PROTOBUF_C_TYPE_MESSAGE:
+			elt_size = sizeof(void *);
+			is_ptr = 1;
+			break;
+		case PROTOBUF_C_TYPE_UINT32:
+			elt_size = sizeof(uint32_t);
+			break;
+		case PROTOBUF_C_TYPE_BOOL:
+			elt_size = sizeof(protobuf_c_boolean);
+			break;
+		default:
+			/* a new field type; update this function */
+			return -1;
+		}
+
+		dst_p = (void **)((uint8_t *)dst + f->offset);
+		src_p = (void *const *)((const uint8_t *)src + f->offset);
+
+		if (f->label == PROTOBUF_C_LABEL_REPEATED) {
+			dst_n = (size_t *)((uint8_t *)dst + f->quantifier_offset);
+			src_n = *(const size_t *)((const uint8_t *)src + f->quantifier_offset);
+			if (src_n == 0)
+				continue;
+
+			n = talloc_realloc_size(pool, *dst_p, (*dst_n + src_n) * elt_size);
+			if (n == NULL)
+				return -1;
+			memcpy(n + *dst_n * elt_size, *src_p, src_n * elt_size);
+			*dst_p = n;
+			*dst_n += src_n;
+		} else if (is_ptr) {
+			if (*src_p != NULL)
+				*dst_p = *src_p;
+		} else {
+			if (*(const protobuf_c_boolean *)((const uint8_t *)src + f->quantifier_offset)) {
+				memcpy(dst_p, src_p, elt_size);
+				*(protobuf_c_boolean *)((uint8_t *)dst + f->quantifier_offset) = 1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+static int load_group_cfg_file(struct cfg_st *global_config,
+			       SecmSessionReplyMsg *msg, void *pool,
+			       const char *file)
+{
+	GroupCfgSt *config;
+	struct stat st;
+
+	/* the strings of msg may be owned by the cache; the file is only
+	 * parsed into a cache entry */
+	if (stat(file, &st) < 0) {
+		int e = errno;
+		syslog(LOG_ERR, "cannot load config file %s: %s", file, strerror(e));
+		return ERR_READ_CONFIG;
+	}
+
+	config = get_cached_cfg_file(global_config, file, &st);
+	if (config == NULL)
+		return ERR_READ_CONFIG;
+
+	if (merge_group_cfg(pool, msg->config, config) < 0)
+		return ERR_READ_CONFIG;
+
+	return 0;
+}
+
 static int read_sup_config_file(struct cfg_st *global_config,
 				SecmSessionReplyMsg *msg, void *pool,
 				const char *file, const char *fallback, const char *type)
@@ -263,14 +472,14 @@ static int read_sup_config_file(struct cfg_st *global_config,
 		syslog(LOG_DEBUG, "Loading %s configuration '%s'", type,
 		      file);
 
-		ret = parse_group_cfg_file(global_config, msg, pool, file);
+		ret = load_group_cfg_file(global_config, msg, pool, file);
 		if (ret < 0)
 			return ERR_READ_CONFIG;
 	} else {
 		if (fallback != NULL) {
 			syslog(LOG_DEBUG, "Loading default %s configuration '%s'", type, fallback);
 
-			ret = parse_group_cfg_file(global_config, msg, pool, fallback);
+			ret = load_group_cfg_file(global_config, msg, pool, fallback);
 			if (ret < 0)
 				return ERR_READ_CONFIG;
 		}
@@ -307,4 +516,5 @@ static int get_sup_config(struct cfg_st *cfg, client_entry_st *entry,
 
 struct config_mod_st file_sup_config = {
 	.get_sup_config = get_sup_config,
+	.clear_cache = clear_cache,
 };
@@ -24,6 +24,7 @@
 #include <gnutls/crypto.h>
 #include <gnutls/pkcs11.h>
 #include <gnutls/abstract.h>
+#include <gnutls/dtls.h>
 #include <errno.h>
 #include <stdlib.h>
 #include <stdarg.h>
@@ -50,12 +51,27 @@
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <c-ctype.h>
+#ifdef ENABLE_KTLS
+# include <linux/tls.h>
+# ifndef TCP_ULP
+#  define TCP_ULP 31
+# endif
+# ifndef SOL_TLS
+#  define SOL_TLS 282
+# endif
+#endif
+
+/* The session the CSTP records are sent and received through; NULL
+ * when TLS is done elsewhere, i.e., by a proxy or, once the keys of
+ * that direction were handed over, by the kernel. */
+#define CSTP_SESSION(ws) ((ws)->cstp_ktls ? NULL : (ws)->session)
+#define CSTP_RX_SESSION(ws) ((ws)->cstp_ktls_rx ? NULL : (ws)->session)
 
 static void tls_reload_ocsp(main_server_st* s, struct vhost_cfg_st *vhost);
 
 void cstp_cork(worker_st *ws)
 {
-	if (ws->session) {
+	if (CSTP_SESSION(ws)) {
 		gnutls_record_cork(ws->session);
 	} else {
 		int state = 1;
@@ -69,7 +85,7 @@ void cstp_cork(worker_st *ws)
 
 int cstp_uncork(worker_st *ws)
 {
-	if (ws->session) {
+	if (CSTP_SESSION(ws)) {
 		return gnutls_record_uncork(ws->session, GNUTLS_RECORD_WAIT);
 	} else {
 		int state = 0;
@@ -83,6 +99,208 @@ int cstp_uncork(worker_st *ws)
 }
 
 
+#ifdef ENABLE_KTLS
+/* Sets the keys of one direction of the TLS session to the
+ * socket. Returns -1 and sets errno if the session's parameters
+ * cannot be used by the kernel, or if setsockopt() fails. */
+static int ktls_set_keys(worker_st *ws, unsigned read)
+{
+	gnutls_datum_t mac_key, iv, cipher_key;
+	unsigned char seq[8];
+	union {
+		struct tls12_crypto_info_aes_gcm_128 gcm128;
+#ifdef TLS_CIPHER_AES_GCM_256
+		struct tls12_crypto_info_aes_gcm_256 gcm256;
+#endif
+	} info;
+	struct tls_crypto_info *hdr = (struct tls_crypto_info *)&info;
+	unsigned char *info_iv, *info_key, *info_salt, *info_seq;
+	gnutls_protocol_t version;
+	size_t info_size, key_size;
+	int ret;
+
+	version = gnutls_protocol_get_version(ws->session);
+
+	ret = gnutls_record_get_state(ws->session, read, &mac_key, &iv,
+				      &cipher_key, seq);
+	if (ret < 0)
+		goto unsupported;
+
+	memset(&info, 0, sizeof(info));
+
+	switch (gnutls_cipher_get(ws->session)) {
+	case GNUTLS_CIPHER_AES_128_GCM:
+		hdr->cipher_type = TLS_CIPHER_AES_GCM_128;
+		info_iv = info.gcm128.iv;
+		info_key = info.gcm128.key;
+		info_salt = info.gcm128.salt;
+		info_seq = info.gcm128.rec_seq;
+		key_size = TLS_CIPHER_AES_GCM_128_KEY_SIZE;
+		info_size = sizeof(info.gcm128);
+		break;
+#ifdef TLS_CIPHER_AES_GCM_256
+	case GNUTLS_CIPHER_AES_256_GCM:
+		hdr->cipher_type = TLS_CIPHER_AES_GCM_256;
+		info_iv = info.gcm256.iv;
+		info_key = info.gcm256.key;
+		info_salt = info.gcm256.salt;
+		info_seq = info.gcm256.rec_seq;
+		key_size = TLS_CIPHER_AES_GCM_256_KEY_SIZE;
+		info_size = sizeof(info.gcm256);
+		break;
+#endif
+	default:
+		goto unsupported;
+	}
+
+	if (cipher_key.size != key_size)
+		goto unsupported;
+	memcpy(info_key, cipher_key.data, key_size);
+	memcpy(info_seq, seq, 8);
+
+	/* TLS 1.2 has a 4-byte implicit IV, with the explicit part of
+	 * the nonce set to the record sequence number (as GnuTLS does),
+	 * while TLS 1.3 derives the nonce from a 12-byte IV */
+	if (version == GNUTLS_TLS1_2 && iv.size == 4) {
+		hdr->version = TLS_1_2_VERSION;
+		memcpy(info_salt, iv.data, 4);
+		memcpy(info_iv, seq, 8);
+#ifdef TLS_1_3_VERSION
+	} else if (version == GNUTLS_TLS1_3 && iv.size == 12) {
+		hdr->version = TLS_1_3_VERSION;
+		memcpy(info_salt, iv.data, 4);
+		memcpy(info_iv, iv.data + 4, 8);
+#endif
+	} else {
+		goto unsupported;
+	}
+
+	ret = setsockopt(ws->conn_fd, SOL_TLS, read ? TLS_RX : TLS_TX,
+			 &info, info_size);
+	safe_memset(&info, 0, sizeof(info));
+
+	return ret;
+ unsupported:
+	errno = EOPNOTSUPP;
+	return -1;
+}
+
+static void ktls_send_alert(worker_st *ws, gnutls_alert_level_t level,
+			    gnutls_alert_description_t desc)
+{
+	uint8_t alert[2] = { level, desc };
+	char cbuf[CMSG_SPACE(sizeof(unsigned char))];
+	struct iovec iov;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+
+	iov.iov_base = alert;
+	iov.iov_len = sizeof(alert);
+
+	memset(&msg, 0, sizeof(msg));
+	memset(cbuf, 0, sizeof(cbuf));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_TLS;
+	cmsg->cmsg_type = TLS_SET_RECORD_TYPE;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(unsigned char));
+	*CMSG_DATA(cmsg) = 21; /* alert */
+
+	if (sendmsg(ws->conn_fd, &msg, MSG_DONTWAIT) == -1) {
+		int e = errno;
+		oclog(ws, LOG_DEBUG, "could not send TLS alert: %s", strerror(e));
+	}
+}
+
+/* Once the transmit keys are in the kernel, the ones GnuTLS holds are
+ * stale; a record it would send, e.g., a KeyUpdate in reply to the
+ * peer's, fails the session instead of corrupting the stream. */
+static ssize_t ktls_gnutls_push(gnutls_transport_ptr_t ptr, const void *data,
+				size_t size)
+{
+	errno = EIO;
+	return -1;
+}
+#endif
+
+/* Hands the keys of the established TLS session to the kernel; from
+ * then on the CSTP records are sent, and with TLS 1.2 received, as
+ * plain data over the socket. Only TLS 1.2 and 1.3 with AES-GCM are
+ * supported, and it must be called when no data are pending in the
+ * session.
+ *
+ * With TLS 1.3 the records are still received by GnuTLS, as the kernel
+ * fails the reads with EIO on the KeyUpdate and NewSessionTicket
+ * messages the peer may send after the handshake.
+ *
+ * Returns 0 on success, and 1 if the session was left to GnuTLS. A
+ * negative error code is returned if the keys of only one direction
+ * could be set; the connection cannot be used after that.
+ */
+int cstp_enable_ktls(worker_st *ws)
+{
+#ifdef ENABLE_KTLS
+	unsigned rx;
+	int ret, e;
+
+	if (ws->session == NULL || ws->cstp_ktls)
+		return 1;
+
+	if (gnutls_record_check_pending(ws->session) != 0)
+		return 1;
+
+	rx = (gnutls_protocol_get_version(ws->session) == GNUTLS_TLS1_2);
+
+	ret = setsockopt(ws->conn_fd, IPPROTO_TCP, TCP_ULP, "tls", sizeof("tls"));
+	if (ret == -1) {
+		e = errno;
+		oclog(ws, LOG_DEBUG, "kernel TLS is not available: %s", strerror(e));
+		return 1;
+	}
+
+	/* the receive direction is the one missing on older kernels, and
+	 * if it fails nothing was handed to the kernel yet */
+	if (rx) {
+		ret = ktls_set_keys(ws, 1);
+		if (ret == -1) {
+			e = errno;
+			oclog(ws, LOG_DEBUG, "could not use kernel TLS for %s: %s",
+			      gnutls_cipher_get_name(gnutls_cipher_get(ws->session)),
+			      strerror(e));
+			return 1;
+		}
+	}
+
+	ret = ktls_set_keys(ws, 0);
+	if (ret == -1) {
+		e = errno;
+		if (!rx) {
+			oclog(ws, LOG_DEBUG, "could not use kernel TLS for %s: %s",
+			      gnutls_cipher_get_name(gnutls_cipher_get(ws->session)),
+			      strerror(e));
+			return 1;
+		}
+		oclog(ws, LOG_ERR, "could not set kernel TLS transmit keys");
+		return GNUTLS_E_INTERNAL_ERROR;
+	}
+
+	gnutls_transport_set_push_function(ws->session, ktls_gnutls_push);
+
+	ws->cstp_ktls = 1;
+	ws->cstp_ktls_rx = rx;
+	oclog(ws, LOG_DEBUG, "CSTP channel is using kernel TLS%s",
+	      rx ? "" : " for transmission");
+
+	return 0;
+#else
+	return 1;
+#endif
+}
+
 ssize_t cstp_send(worker_st *ws, const void *data,
 			size_t data_size)
 {
@@ -90,7 +308,7 @@ ssize_t cstp_send(worker_st *ws, const void *data,
 	int left = data_size;
 	const uint8_t* p = data;
 
-	if (ws->session != NULL) {
+	if (CSTP_SESSION(ws) != NULL) {
 		while(left > 0) {
 			ret = gnutls_record_send(ws->session, p, data_size);
 			if (ret < 0) {
@@ -182,7 +400,7 @@ static ssize_t _cstp_recv_packet(worker_st *ws, void *data, size_t data_size)
 
 	/* socket is in non-blocking mode already */
 
-	if (ws->session != NULL) {
+	if (CSTP_RX_SESSION(ws) != NULL) {
 		return gnutls_record_recv(ws->session, data, data_size);
 	} else {
 		/* It can happen in UNIX sockets case that we receive an
@@ -220,7 +438,7 @@ ssize_t cstp_recv_packet(worker_st *ws, gnutls_datum_t *data, void **p)
 #ifdef ZERO_COPY
 	gnutls_packet_t packet = NULL;
 
-	if (ws->session != NULL) {
+	if (CSTP_RX_SESSION(ws) != NULL) {
 		ret = gnutls_record_recv_packet(ws->session, &packet);
 		if (ret > 0) {
 			*p = packet;
@@ -246,7 +464,7 @@ ssize_t cstp_recv(worker_st *ws, void *data, size_t data_size)
 	int ret;
 	int counter = 5;
 
-	if (ws->session != NULL) {
+	if (CSTP_RX_SESSION(ws) != NULL) {
 		do {
 			ret = gnutls_record_recv(ws->session, data, data_size);
 			if (ret == GNUTLS_E_AGAIN || ret == GNUTLS_E_INTERRUPTED) {
@@ -314,6 +532,13 @@ int __attribute__ ((format(printf, 2, 3)))
 
 void cstp_close(worker_st *ws)
 {
+#ifdef ENABLE_KTLS
+	if (ws->cstp_ktls) {
+		ktls_send_alert(ws, GNUTLS_AL_WARNING, GNUTLS_A_CLOSE_NOTIFY);
+		gnutls_deinit(ws->session);
+		return;
+	}
+#endif
 	if (ws->session) {
 		gnutls_bye(ws->session, GNUTLS_SHUT_WR);
 		gnutls_deinit(ws->session);
@@ -325,6 +550,13 @@ void cstp_close(worker_st *ws)
 void cstp_fatal_close(worker_st *ws,
 			    gnutls_alert_description_t a)
 {
+#ifdef ENABLE_KTLS
+	if (ws->cstp_ktls) {
+		ktls_send_alert(ws, GNUTLS_AL_FATAL, a);
+		gnutls_deinit(ws->session);
+		return;
+	}
+#endif
 	if (ws->session) {
 		gnutls_alert_send(ws->session, GNUTLS_AL_FATAL, a);
 		gnutls_deinit(ws->session);
@@ -333,15 +565,132 @@ void cstp_fatal_close(worker_st *ws,
 	}
 }
 
+#ifdef DTLS_SEAL_IN_PLACE
+/* The bulk data records are sealed here rather than by
+ * gnutls_record_send(), which would copy the plaintext into its own
+ * record buffer first. The record is built around the data, in the
+ * room the caller left for it, and the sequence number of the GnuTLS
+ * session is moved forward by us. Only DTLS 1.2 with an AEAD cipher
+ * is handled this way; everything else uses gnutls_record_send().
+ *
+ * This relies on how GnuTLS keeps the record state, so it is only done
+ * with the library versions between DTLS_SEAL_MIN_VERSION and
+ * DTLS_SEAL_UNVERIFIED_VERSION, and once the first record of each key
+ * sealed by us matched the one gnutls_record_send() made of the same
+ * data. Setting the sequence number also resets the replay window of
+ * GnuTLS, so the received records are checked against a window of ours.
+ */
+struct dtls_seal_st {
+	gnutls_aead_cipher_hd_t cipher;
+	gnutls_cipher_algorithm_t algo;
+	uint8_t key[32];
+	unsigned key_size;
+	uint8_t iv[12];
+	unsigned iv_size;
+	unsigned explicit_nonce; /* 8 with AES-GCM, none with ChaCha20 */
+	unsigned verified; /* a record of this key matched GnuTLS' */
+
+	/* the replay window of the received records */
+	unsigned rx_init;
+	uint64_t rx_last; /* the highest epoch and sequence number seen */
+	uint64_t rx_window; /* bit n is set if rx_last - n was seen */
+};
+
+#define DTLS_REPLAY_WINDOW 64
+
+/* 0 if not checked yet, 1 if the sealing is usable, -1 if not */
+static int dtls_seal_usable = 0;
+
+static unsigned dtls_seal_supported(void)
+{
+	if (dtls_seal_usable == 0) {
+		if (gnutls_check_version(DTLS_SEAL_MIN_VERSION) != NULL &&
+		    gnutls_check_version(DTLS_SEAL_UNVERIFIED_VERSION) == NULL)
+			dtls_seal_usable = 1;
+		else
+			dtls_seal_usable = -1;
+	}
+
+	return dtls_seal_usable > 0;
+}
+
+static uint64_t seq_to_uint64(const uint8_t seq[8])
+{
+	uint64_t n = 0;
+	unsigned i;
+
+	for (i = 0; i < 8; i++)
+		n = (n << 8) | seq[i];
+	return n;
+}
+
+static void uint64_to_seq(uint64_t n, uint8_t seq[8])
+{
+	unsigned i;
+
+	for (i = 8; i > 0; i--) {
+		seq[i - 1] = n & 0xff;
+		n >>= 8;
+	}
+}
+
+/* Returns 0 if the record with the given epoch and sequence number was
+ * not seen before, and marks it as seen; RFC6347 section 4.1.2.6 */
+static int dtls_replay_check(struct dtls_seal_st *st, const uint8_t seq[8])
+{
+	uint64_t n = seq_to_uint64(seq), diff;
+
+	/* a new epoch starts a new window; GnuTLS only accepts the
+	 * previous one for the records still in flight */
+	if (st->rx_init == 0 || (n >> 48) > (st->rx_last >> 48)) {
+		/* the records before the first one seen here were checked
+		 * by GnuTLS; take the older ones in the window as seen */
+		st->rx_init = 1;
+		st->rx_last = n;
+		st->rx_window = ~(uint64_t)0;
+		return 0;
+	}
+
+	if ((n >> 48) < (st->rx_last >> 48))
+		return 0;
+
+	if (n > st->rx_last) {
+		diff = n - st->rx_last;
+		if (diff >= DTLS_REPLAY_WINDOW)
+			st->rx_window = 1;
+		else
+			st->rx_window = (st->rx_window << diff) | 1;
+		st->rx_last = n;
+		return 0;
+	}
+
+	diff = st->rx_last - n;
+	if (diff >= DTLS_REPLAY_WINDOW || (st->rx_window & ((uint64_t)1 << diff)))
+		return -1;
+
+	st->rx_window |= (uint64_t)1 << diff;
+	return 0;
+}
+#endif
+
 ssize_t dtls_recv_packet(worker_st *ws, gnutls_datum_t *data, void **p)
 {
 	int ret;
 #ifdef ZERO_COPY
 	gnutls_packet_t packet = NULL;
+	uint8_t seq[8];
 
 	ret = gnutls_record_recv_packet(ws->dtls_session, &packet);
 	if (ret > 0) {
-		gnutls_packet_get(packet, data, NULL);
+		gnutls_packet_get(packet, data, seq);
+# ifdef DTLS_SEAL_IN_PLACE
+		/* see dtls_send_inplace() */
+		if (ws->dtls_seal && dtls_replay_check(ws->dtls_seal, seq) < 0) {
+			gnutls_packet_deinit(packet);
+			data->size = 0;
+			return GNUTLS_E_AGAIN;
+		}
+# endif
 		*p = packet;
 	} else {
 		data->size = 0;
@@ -383,12 +732,538 @@ ssize_t dtls_send(worker_st *ws, const void *data,
 	return data_size;
 }
 
+/* The push function of the DTLS sessions */
+ssize_t dtls_push(gnutls_transport_ptr_t ptr, const void *data, size_t size)
+{
+	dtls_transport_ptr *p = ptr;
+
+	if (p->capture) {
+		p->capture_size = size < p->capture_max ? size : p->capture_max;
+		memcpy(p->capture, data, p->capture_size);
+	}
+
+	if (p->txq && p->txq->corked)
+		return dtls_queue_push(p, data, size);
+
+	return send(p->fd, data, size, 0);
+}
+
+#ifdef HAVE_SENDMMSG
+/* Records of the size of one that got EMSGSIZE are not queued for the
+ * rest of the cork; they fail immediately, so that their sender can
+ * fall back to CSTP. */
+static unsigned dtls_queue_too_large(const dtls_tx_queue_st *q, size_t size)
+{
+	return q->too_large != 0 && size >= q->too_large;
+}
+#endif
+
+#ifdef DTLS_SEAL_IN_PLACE
+static int dtls_seal_destructor(struct dtls_seal_st *st)
+{
+	if (st->cipher)
+		gnutls_aead_cipher_deinit(st->cipher);
+	safe_memset(st->key, 0, sizeof(st->key));
+	return 0;
+}
+
+/* Returns the sealing state for the current DTLS session and write
+ * keys, and the sequence number of the next record, or NULL if
+ * the session cannot be handled. */
+static struct dtls_seal_st *dtls_seal_get(worker_st *ws, uint8_t seq[8])
+{
+	struct dtls_seal_st *st = ws->dtls_seal;
+	gnutls_cipher_algorithm_t algo;
+	gnutls_datum_t iv, key;
+	unsigned explicit_nonce, iv_size;
+
+	if (!dtls_seal_supported())
+		return NULL;
+
+	if (gnutls_protocol_get_version(ws->dtls_session) != GNUTLS_DTLS1_2)
+		return NULL;
+
+	algo = gnutls_cipher_get(ws->dtls_session);
+	switch (algo) {
+	case GNUTLS_CIPHER_AES_128_GCM:
+	case GNUTLS_CIPHER_AES_256_GCM:
+		explicit_nonce = 8;
+		iv_size = 4;
+		break;
+	case GNUTLS_CIPHER_CHACHA20_POLY1305:
+		explicit_nonce = 0;
+		iv_size = 12;
+		break;
+	default:
+		return NULL;
+	}
+
+	if (gnutls_record_get_state(ws->dtls_session, 0, NULL, &iv, &key, seq) < 0)
+		return NULL;
+
+	if (iv.size != iv_size || key.size > sizeof(st->key))
+		return NULL;
+
+	if (st == NULL) {
+		st = talloc_zero(ws, struct dtls_seal_st);
+		if (st == NULL)
+			return NULL;
+		talloc_set_destructor(st, dtls_seal_destructor);
+		ws->dtls_seal = st;
+	}
+
+	/* a new DTLS session or a rehandshake changes the keys */
+	if (st->cipher != NULL && st->algo == algo &&
+	    st->key_size == key.size && memcmp(st->key, key.data, key.size) == 0 &&
+	    memcmp(st->iv, iv.data, iv.size) == 0)
+		return st;
+
+	if (st->cipher != NULL) {
+		gnutls_aead_cipher_deinit(st->cipher);
+		st->cipher = NULL;
+	}
+
+	if (gnutls_aead_cipher_init(&st->cipher, algo, &key) < 0) {
+		st->cipher = NULL;
+		return NULL;
+	}
+
+	st->algo = algo;
+	memcpy(st->key, key.data, key.size);
+	st->key_size = key.size;
+	memcpy(st->iv, iv.data, iv.size);
+	st->iv_size = iv.size;
+	st->explicit_nonce = explicit_nonce;
+	st->verified = 0;
+
+	return st;
+}
+
+static ssize_t dtls_transport_send(dtls_transport_ptr *p, uint8_t *data, size_t size)
+{
+	int ret;
+
+#ifdef HAVE_SENDMMSG
+	if (p->txq && p->txq->corked) {
+		dtls_tx_queue_st *q = p->txq;
+
+		if (dtls_queue_too_large(q, size)) {
+			/* the sender lowers the MTU; the uncork need
+			 * not report it again */
+			q->dropped = 0;
+			q->reserved = 0;
+			return GNUTLS_E_LARGE_PACKET;
+		}
+
+		/* the record was built in the queue; no need to copy it */
+		if (q->reserved && q->msgs < DTLS_TX_QUEUE_MSGS &&
+		    data >= q->data + q->size &&
+		    data + size <= q->data + q->size + q->reserved) {
+			q->off[q->msgs] = data - q->data;
+			q->len[q->msgs++] = size;
+			q->size = data + size - q->data;
+			q->reserved = 0;
+			return size;
+		}
+
+		ret = dtls_queue_push(p, data, size);
+		if (ret < 0)
+			return errno == EMSGSIZE ? GNUTLS_E_LARGE_PACKET : GNUTLS_E_PUSH_ERROR;
+		return ret;
+	}
+#endif
+
+	for (;;) {
+		ret = send(p->fd, data, size, 0);
+		if (ret >= 0)
+			return ret;
+
+		if (errno == EMSGSIZE)
+			return GNUTLS_E_LARGE_PACKET;
+		if (errno != EAGAIN && errno != EINTR)
+			return GNUTLS_E_PUSH_ERROR;
+		/* do not cause mayhem */
+		ms_sleep(20);
+	}
+}
+
+/* Encrypts data in place as the record with the given sequence number,
+ * and puts its header in front of it. Returns the size of the record,
+ * which starts at data - DTLS_RECORD_HEADER_SIZE - st->explicit_nonce,
+ * or a negative error code. */
+static ssize_t dtls_seal_record(struct dtls_seal_st *st, const uint8_t seq[8],
+				uint8_t *data, size_t data_size)
+{
+	uint8_t nonce[12], aad[13];
+	uint8_t *rec;
+	size_t tag_size = DTLS_SEAL_TAILROOM, rec_size;
+	giovec_t auth, iov;
+	unsigned i;
+	int ret;
+
+	if (st->explicit_nonce) {
+		memcpy(nonce, st->iv, 4);
+		memcpy(nonce + 4, seq, 8);
+	} else {
+		memcpy(nonce, st->iv, 12);
+		for (i = 0; i < 8; i++)
+			nonce[4 + i] ^= seq[i];
+	}
+
+	/* epoch and sequence, type, version and length of the plaintext */
+	memcpy(aad, seq, 8);
+	aad[8] = DTLS_CONTENT_APPLICATION_DATA;
+	aad[9] = 254;
+	aad[10] = 253;
+	aad[11] = data_size >> 8;
+	aad[12] = data_size & 0xff;
+
+	auth.iov_base = aad;
+	auth.iov_len = sizeof(aad);
+	iov.iov_base = data;
+	iov.iov_len = data_size;
+
+	ret = gnutls_aead_cipher_encryptv2(st->cipher, nonce, sizeof(nonce),
+					   &auth, 1, &iov, 1,
+					   data + data_size, &tag_size);
+	if (ret < 0)
+		return ret;
+
+	rec = data - DTLS_RECORD_HEADER_SIZE - st->explicit_nonce;
+	rec_size = DTLS_RECORD_HEADER_SIZE + st->explicit_nonce + data_size + tag_size;
+
+	rec[0] = DTLS_CONTENT_APPLICATION_DATA;
+	rec[1] = 254;
+	rec[2] = 253;
+	memcpy(rec + 3, seq, 8);
+	rec[11] = (rec_size - DTLS_RECORD_HEADER_SIZE) >> 8;
+	rec[12] = (rec_size - DTLS_RECORD_HEADER_SIZE) & 0xff;
+	if (st->explicit_nonce)
+		memcpy(rec + DTLS_RECORD_HEADER_SIZE, seq, 8);
+
+	return rec_size;
+}
+
+/* Reverts dtls_seal_record() */
+static int dtls_unseal_record(struct dtls_seal_st *st, const uint8_t seq[8],
+			      uint8_t *data, size_t data_size)
+{
+	uint8_t nonce[12], aad[13];
+	giovec_t auth, iov;
+	unsigned i;
+
+	if (st->explicit_nonce) {
+		memcpy(nonce, st->iv, 4);
+		memcpy(nonce + 4, seq, 8);
+	} else {
+		memcpy(nonce, st->iv, 12);
+		for (i = 0; i < 8; i++)
+			nonce[4 + i] ^= seq[i];
+	}
+
+	memcpy(aad, seq, 8);
+	aad[8] = DTLS_CONTENT_APPLICATION_DATA;
+	aad[9] = 254;
+	aad[10] = 253;
+	aad[11] = data_size >> 8;
+	aad[12] = data_size & 0xff;
+
+	auth.iov_base = aad;
+	auth.iov_len = sizeof(aad);
+	iov.iov_base = data;
+	iov.iov_len = data_size;
+
+	return gnutls_aead_cipher_decryptv2(st->cipher, nonce, sizeof(nonce),
+					    &auth, 1, &iov, 1,
+					    data + data_size, DTLS_SEAL_TAILROOM);
+}
+
+/* Sends the first record of a key with gnutls_record_send(), and checks
+ * whether the record sealed by us from the same data and sequence number
+ * is identical, and that GnuTLS moved to the next sequence number. If
+ * not, the records are no longer sealed by us. Sealing the same data
+ * with the same nonce gives the same ciphertext, so nothing is revealed
+ * by the record we make, which is not sent.
+ */
+static ssize_t dtls_seal_verify(worker_st *ws, struct dtls_seal_st *st,
+				const uint8_t seq[8], const uint8_t *data, size_t data_size)
+{
+	uint8_t next_seq[8], after[8];
+	uint8_t *tmp, *rec;
+	size_t max = DTLS_SEAL_HEADROOM + data_size + DTLS_SEAL_TAILROOM;
+	ssize_t rec_size;
+	int ret;
+
+	tmp = talloc_size(ws, 2 * max);
+	if (tmp == NULL)
+		return dtls_send(ws, data, data_size);
+
+	memcpy(tmp + DTLS_SEAL_HEADROOM, data, data_size);
+	rec_size = dtls_seal_record(st, seq, tmp + DTLS_SEAL_HEADROOM, data_size);
+	rec = tmp + DTLS_SEAL_HEADROOM - DTLS_RECORD_HEADER_SIZE - st->explicit_nonce;
+
+	ws->dtls_tptr.capture = tmp + max;
+	ws->dtls_tptr.capture_max = max;
+	ws->dtls_tptr.capture_size = 0;
+
+	ret = dtls_send(ws, data, data_size);
+
+	ws->dtls_tptr.capture = NULL;
+
+	/* nothing to compare with; e.g., another push function is used */
+	if (ret < 0 || ws->dtls_tptr.capture_size == 0)
+		goto finish;
+
+	uint64_to_seq(seq_to_uint64(seq) + 1, next_seq);
+
+	if (rec_size > 0 && (size_t)rec_size == ws->dtls_tptr.capture_size &&
+	    memcmp(rec, tmp + max, rec_size) == 0 &&
+	    gnutls_record_get_state(ws->dtls_session, 0, NULL, NULL, NULL, after) >= 0 &&
+	    memcmp(after, next_seq, 8) == 0) {
+		st->verified = 1;
+	} else {
+		oclog(ws, LOG_INFO, "DTLS records sealed in place do not match those of GnuTLS %s; not sealing in place",
+		      gnutls_check_version(NULL));
+		dtls_seal_usable = -1;
+	}
+
+ finish:
+	talloc_free(tmp);
+	return ret;
+}
+
+/* Sends data as a single DTLS record, encrypting it in place. Up to
+ * DTLS_SEAL_HEADROOM bytes before data and DTLS_SEAL_TAILROOM bytes
+ * after it are overwritten. Unless GNUTLS_E_LARGE_PACKET is returned,
+ * data no longer holds the plaintext once this returns.
+ *
+ * While the channel is corked the record is only queued, so a record
+ * that exceeds the path MTU is dropped on uncork rather than retried
+ * over CSTP; dtls_uncork() reports it. Until the uncork, records of
+ * that size or larger return GNUTLS_E_LARGE_PACKET here.
+ */
+ssize_t dtls_send_inplace(worker_st *ws, uint8_t *data, size_t data_size)
+{
+	struct dtls_seal_st *st;
+	uint8_t seq[8], next_seq[8];
+	ssize_t rec_size;
+	int ret;
+
+	st = dtls_seal_get(ws, seq);
+	if (st == NULL)
+		return dtls_send(ws, data, data_size);
+
+	if (data_size > gnutls_dtls_get_data_mtu(ws->dtls_session))
+		return GNUTLS_E_LARGE_PACKET;
+
+	if (st->verified == 0)
+		return dtls_seal_verify(ws, st, seq, data, data_size);
+
+	rec_size = dtls_seal_record(st, seq, data, data_size);
+	if (rec_size < 0)
+		return rec_size;
+
+	/* the nonce must never be reused, so the sequence number moves
+	 * forward whether the record makes it out or not */
+	uint64_to_seq(seq_to_uint64(seq) + 1, next_seq);
+	ret = gnutls_record_set_state(ws->dtls_session, 0, next_seq);
+	if (ret < 0)
+		return ret;
+
+	ret = dtls_transport_send(&ws->dtls_tptr,
+				  data - DTLS_RECORD_HEADER_SIZE - st->explicit_nonce,
+				  rec_size);
+	if (ret == GNUTLS_E_LARGE_PACKET) {
+		/* the caller retries over CSTP; give it back the plaintext */
+		if (dtls_unseal_record(st, seq, data, data_size) < 0)
+			return GNUTLS_E_PUSH_ERROR;
+		return ret;
+	}
+	if (ret < 0)
+		return ret;
+
+	return data_size;
+}
+#else
+ssize_t dtls_send_inplace(worker_st *ws, uint8_t *data, size_t data_size)
+{
+	return dtls_send(ws, data, data_size);
+}
+#endif
+
 void dtls_close(worker_st *ws)
 {
 	gnutls_bye(ws->dtls_session, GNUTLS_SHUT_WR);
 	gnutls_deinit(ws->dtls_session);
 }
 
+#ifdef HAVE_SENDMMSG
+static int dtls_queue_flush(dtls_transport_ptr *p)
+{
+	dtls_tx_queue_st *q = p->txq;
+	struct mmsghdr msgs[DTLS_TX_QUEUE_MSGS];
+	struct iovec iov[DTLS_TX_QUEUE_MSGS];
+	unsigned i, sent = 0;
+	int ret = 0;
+
+	if (q->msgs == 0)
+		return 0;
+
+	memset(msgs, 0, sizeof(msgs[0])*q->msgs);
+	for (i = 0; i < q->msgs; i++) {
+		iov[i].iov_base = q->data + q->off[i];
+		iov[i].iov_len = q->len[i];
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	while (sent < q->msgs) {
+		ret = sendmmsg(p->fd, &msgs[sent], q->msgs - sent, 0);
+		if (ret == -1) {
+			if (errno == EMSGSIZE) {
+				/* the path MTU dropped; the record is lost
+				 * like any other datagram, but the rest of
+				 * the queue still goes out */
+				if (q->too_large == 0 || q->len[sent] < q->too_large)
+					q->too_large = q->len[sent];
+				q->dropped++;
+				sent++;
+				ret = 0;
+				continue;
+			}
+			if (errno != EAGAIN && errno != EINTR)
+				break;
+			/* do not cause mayhem */
+			ms_sleep(20);
+			continue;
+		}
+		sent += ret;
+	}
+
+	q->msgs = 0;
+	q->size = 0;
+	q->reserved = 0;
+
+	if (ret == -1)
+		return GNUTLS_E_PUSH_ERROR;
+	return 0;
+}
+
+/* Called by the DTLS push function when the channel is corked;
+ * it copies the already encrypted record into the transmit queue.
+ */
+ssize_t dtls_queue_push(dtls_transport_ptr *p, const void *data, size_t data_size)
+{
+	dtls_tx_queue_st *q = p->txq;
+
+	/* it does not fit in the queue; it is sent after the records
+	 * queued before it */
+	if (data_size > sizeof(q->data)) {
+		if (dtls_queue_flush(p) < 0)
+			return -1;
+		return send(p->fd, data, data_size, 0);
+	}
+
+	if (q->msgs >= DTLS_TX_QUEUE_MSGS || q->size + data_size > sizeof(q->data)) {
+		if (dtls_queue_flush(p) < 0)
+			return -1;
+	}
+
+	if (dtls_queue_too_large(q, data_size)) {
+		/* the sender lowers the MTU; the uncork need not report
+		 * it again */
+		q->dropped = 0;
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	memcpy(q->data + q->size, data, data_size);
+	q->off[q->msgs] = q->size;
+	q->len[q->msgs++] = data_size;
+	q->size += data_size;
+	q->reserved = 0;
+
+	return data_size;
+}
+
+/* Returns max_size bytes at the end of the transmit queue, in which a
+ * record can be built in place so that it is queued without a copy
+ * (see dtls_send_inplace()). The queue is flushed if it is full.
+ * Returns NULL when the channel is not corked.
+ */
+uint8_t *dtls_queue_reserve(dtls_transport_ptr *p, size_t max_size)
+{
+	dtls_tx_queue_st *q = p->txq;
+
+	if (q == NULL || q->corked == 0 || max_size > sizeof(q->data))
+		return NULL;
+
+	if (q->msgs >= DTLS_TX_QUEUE_MSGS || q->size + max_size > sizeof(q->data)) {
+		if (dtls_queue_flush(p) < 0)
+			return NULL;
+	}
+
+	q->reserved = max_size;
+	return q->data + q->size;
+}
+
+void dtls_cork(worker_st *ws)
+{
+	if (ws->dtls_tptr.txq == NULL) {
+		ws->dtls_tptr.txq = talloc_zero(ws, dtls_tx_queue_st);
+		if (ws->dtls_tptr.txq == NULL)
+			return;
+	}
+	ws->dtls_tptr.txq->corked = 1;
+}
+
+/* Flushes the transmit queue. Returns GNUTLS_E_LARGE_PACKET if any of
+ * the queued records was dropped because it exceeded the path MTU; the
+ * caller should then lower the MTU.
+ */
+int dtls_uncork(worker_st *ws)
+{
+	dtls_tx_queue_st *q = ws->dtls_tptr.txq;
+	unsigned dropped;
+	int ret;
+
+	if (q == NULL || q->corked == 0)
+		return 0;
+
+	q->corked = 0;
+	ret = dtls_queue_flush(&ws->dtls_tptr);
+
+	dropped = q->dropped;
+	q->dropped = 0;
+	q->too_large = 0;
+
+	if (ret < 0)
+		return ret;
+	if (dropped)
+		return GNUTLS_E_LARGE_PACKET;
+	return 0;
+}
+#else
+ssize_t dtls_queue_push(dtls_transport_ptr *p, const void *data, size_t data_size)
+{
+	return send(p->fd, data, data_size, 0);
+}
+
+uint8_t *dtls_queue_reserve(dtls_transport_ptr *p, size_t max_size)
+{
+	return NULL;
+}
+
+void dtls_cork(worker_st *ws)
+{
+}
+
+int dtls_uncork(worker_st *ws)
+{
+	return 0;
+}
+#endif
+
 static size_t rehash(const void *_e, void *unused)
 {
 	const tls_cache_st *e = _e;
@@ -665,8 +1540,6 @@ struct key_cb_data {
 	unsigned pk;
 	unsigned bits;
 	unsigned idx; /* the index of the key */
-	struct sockaddr_un sa;
-	unsigned sa_len;
 	const char *vhost;
 };
 
@@ -675,27 +1548,21 @@ int key_cb_common_func (gnutls_privkey_t key, void* userdata, const gnutls_datum
 	gnutls_datum_t * output, unsigned sigalgo, unsigned type)
 {
 	struct key_cb_data* cdata = userdata;
-	int sd = -1, ret, e;
+	int sd, ret, e;
 	SecOpMsg msg = SEC_OP_MSG__INIT;
 	SecOpMsg *reply = NULL;
 	PROTOBUF_ALLOCATOR(pa, userdata);
 
 	output->data = NULL;
 
-	sd = socket(AF_UNIX, SOCK_STREAM, 0);
-	if (sd == -1) {
-		e = errno;
-		syslog(LOG_ERR, "error opening socket: %s", strerror(e));
+	/* the keys are only used by the worker, over its connection
+	 * to sec-mod */
+	if (global_ws == NULL)
 		return GNUTLS_E_INTERNAL_ERROR;
-	}
 
-	ret = connect(sd, (struct sockaddr *)&cdata->sa, cdata->sa_len);
-	if (ret == -1) {
-		e = errno;
-		syslog(LOG_ERR, "error connecting to sec-mod socket '%s': %s",
-			cdata->sa.sun_path, strerror(e));
-		goto error;
-	}
+	sd = connect_to_secmod(global_ws);
+	if (sd == -1)
+		return GNUTLS_E_INTERNAL_ERROR;
 
 	msg.has_key_idx = 1;
 	msg.key_idx = cdata->idx;
@@ -708,6 +1575,7 @@ int key_cb_common_func (gnutls_privkey_t key, void* userdata, const gnutls_datum
 			(pack_size_func)sec_op_msg__get_packed_size,
 			(pack_func)sec_op_msg__pack);
 	if (ret < 0) {
+		disconnect_from_secmod(global_ws);
 		goto error;
 	}
 
@@ -718,10 +1586,9 @@ int key_cb_common_func (gnutls_privkey_t key, void* userdata, const gnutls_datum
 		e = errno;
 		syslog(LOG_ERR, "error receiving sec-mod reply: %s",
 				strerror(e));
+		disconnect_from_secmod(global_ws);
 		goto error;
 	}
-	close(sd);
-	sd = -1;
 
 	output->size = reply->data.len;
 	output->data = gnutls_malloc(reply->data.len);
@@ -736,8 +1603,6 @@ int key_cb_common_func (gnutls_privkey_t key, void* userdata, const gnutls_datum
 	return 0;
 
 error:
-	if (sd != -1)
-		close(sd);
 	gnutls_free(output->data);
 	if (reply != NULL)
 		sec_op_msg__free_unpacked(reply, &pa);
@@ -867,12 +1732,6 @@ int load_cert_files(main_server_st *s, struct vhost_cfg_st *vhost)
 		cdata->idx = i;
 		cdata->vhost = vhost->name;
 
-		/* when called here configuration may not be populated, so avoid using it */
-		cdata->sa.sun_family = AF_UNIX;
-		strlcpy(cdata->sa.sun_path, secmod_socket_file_name(&vhost->perm_config), sizeof(cdata->sa.sun_path));
-		cdata->sa_len = SUN_LEN(&cdata->sa);
-
-
 		/* load the private key */
 
 #if GNUTLS_VERSION_NUMBER >= 0x030600
@@ -36,6 +36,27 @@
 #  define ZERO_COPY
 # endif
 
+/* in-place AEAD and gnutls_record_set_state(). The records are sealed
+ * by us only with the GnuTLS versions whose record state handling was
+ * verified, and once a sealed record matched one of GnuTLS; see
+ * dtls_send_inplace(). */
+# if GNUTLS_VERSION_NUMBER >= 0x03060a
+#  define DTLS_SEAL_IN_PLACE
+#  define DTLS_SEAL_MIN_VERSION "3.6.10"
+#  define DTLS_SEAL_UNVERIFIED_VERSION "3.9.0"
+# endif
+
+/* kernel TLS for the CSTP channel */
+#if defined(__linux__) && defined(HAVE_LINUX_TLS_H) && GNUTLS_VERSION_NUMBER >= 0x030600
+# define ENABLE_KTLS
+#endif
+
+#define DTLS_RECORD_HEADER_SIZE 13
+#define DTLS_CONTENT_APPLICATION_DATA 23
+/* the bytes dtls_send_inplace() may overwrite around the data */
+#define DTLS_SEAL_HEADROOM (DTLS_RECORD_HEADER_SIZE + 8)
+#define DTLS_SEAL_TAILROOM 16
+
 #define PSK_KEY_SIZE 32
 #if TLS_MASTER_SIZE < PSK_KEY_SIZE
 # error
@@ -124,6 +145,9 @@ typedef struct
 #define TLS_SESSION_EXPIRATION_TIME(config) ((config)->cookie_timeout)
 #define DEFAULT_MAX_CACHED_TLS_SESSIONS 64
 
+/* the size of the keys given to gnutls_session_ticket_enable_server() */
+#define TLS_TICKET_KEY_SIZE 64
+
 void tls_cache_init(void *pool, tls_sess_db_st* db);
 void tls_cache_deinit(tls_sess_db_st* db);
 void *calc_sha1_hash(void *pool, char* file, unsigned cert);
@@ -142,10 +166,20 @@ ssize_t cstp_send(struct worker_st *ws, const void *data,
 
 void cstp_cork(struct worker_st *ws);
 int cstp_uncork(struct worker_st *ws);
+int cstp_enable_ktls(struct worker_st *ws);
 
 /* DTLS API */
 void dtls_close(struct worker_st *ws);
 ssize_t dtls_send(struct worker_st *ws, const void *data, size_t data_size);
+ssize_t dtls_send_inplace(struct worker_st *ws, uint8_t *data, size_t data_size);
+
+void dtls_cork(struct worker_st *ws);
+int dtls_uncork(struct worker_st *ws);
+
+struct dtls_transport_ptr;
+ssize_t dtls_queue_push(struct dtls_transport_ptr *p, const void *data, size_t data_size);
+ssize_t dtls_push(gnutls_transport_ptr_t ptr, const void *data, size_t size);
+uint8_t *dtls_queue_reserve(struct dtls_transport_ptr *p, size_t max_size);
 
 /* packet API */
 inline static void packet_deinit(void *p)
@@ -0,0 +1,285 @@
+/*
+ * Copyright (C) 2026 Nikos Mavrogiannopoulos
+ *
+ * Author: Nikos Mavrogiannopoulos
+ *
+ * This file is part of ocserv.
+ *
+ * ocserv is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#include <config.h>
+
+#include <stdint.h>
+#include <string.h>
+#include <netinet/in.h>
+
+#include "tun-gso.h"
+
+#ifdef ENABLE_TUN_OFFLOAD
+
+/* When the tun device is opened with IFF_VNET_HDR and TSO is enabled,
+ * the kernel hands us TCP "super-packets" of up to 64 KiB, preceded by
+ * a virtio_net_hdr, and leaves the transport checksum incomplete. The
+ * functions here split them back into packets which fit the tunnel MTU
+ * and fill in the checksums, right before they are framed for the
+ * client. That way the per-packet cost of the kernel's tun path is
+ * paid once per super-packet.
+ */
+
+#define TCP_FLAG_FIN 0x01
+#define TCP_FLAG_PSH 0x08
+#define TCP_FLAG_CWR 0x80
+
+#define IPV4_HDR_MIN 20
+#define IPV6_HDR_SIZE 40
+#define TCP_HDR_MIN 20
+#define UDP_HDR_SIZE 8
+
+static uint32_t csum_partial(const uint8_t *p, size_t len, uint32_t sum)
+{
+	while (len > 1) {
+		sum += (p[0] << 8) | p[1];
+		p += 2;
+		len -= 2;
+	}
+	if (len)
+		sum += p[0] << 8;
+	return sum;
+}
+
+static uint16_t csum_fold(uint32_t sum)
+{
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	return ~sum & 0xffff;
+}
+
+static uint16_t get16(const uint8_t *p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+	return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static void put16(uint8_t *p, uint16_t v)
+{
+	p[0] = v >> 8;
+	p[1] = v & 0xff;
+}
+
+static void put32(uint8_t *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = (v >> 16) & 0xff;
+	p[2] = (v >> 8) & 0xff;
+	p[3] = v & 0xff;
+}
+
+/* The checksum of the pseudo-header used by TCP and UDP; ip points to
+ * the start of an IPv4 or IPv6 header. */
+static uint32_t pseudo_csum(const uint8_t *ip, uint8_t proto, unsigned l4_len)
+{
+	uint32_t sum;
+
+	if ((ip[0] >> 4) == 4)
+		sum = csum_partial(ip + 12, 8, 0);
+	else
+		sum = csum_partial(ip + 8, 32, 0);
+
+	return sum + proto + l4_len;
+}
+
+/* Completes a checksum the kernel left for us (VIRTIO_NET_HDR_F_NEEDS_CSUM).
+ * The field already contains the pseudo-header sum, so summing from
+ * csum_start to the end of the packet gives the final value. */
+static int complete_csum(uint8_t *pkt, size_t pkt_size,
+			 unsigned csum_start, unsigned csum_offset)
+{
+	uint16_t csum;
+
+	if (csum_start >= pkt_size || csum_start + csum_offset + 2 > pkt_size)
+		return -1;
+
+	csum = csum_fold(csum_partial(pkt + csum_start, pkt_size - csum_start, 0));
+	/* a zero UDP checksum means "no checksum"; send it as all ones */
+	if (csum == 0 && csum_offset == 6)
+		csum = 0xffff;
+
+	put16(pkt + csum_start + csum_offset, csum);
+	return 0;
+}
+
+static int segment(const struct virtio_net_hdr *hdr, unsigned gso_type,
+		   uint8_t *pkt, size_t pkt_size,
+		   uint8_t *out, size_t out_size,
+		   tun_segment_func func, void *priv)
+{
+	unsigned version = pkt[0] >> 4;
+	unsigned ip_hlen, l4_hlen, hlen, payload, off, seg, i;
+	uint8_t proto, *l4;
+	uint32_t seq = 0, sum;
+	uint16_t id = 0;
+	uint8_t flags = 0;
+	int ret;
+
+	if (version == 4) {
+		if (pkt_size < IPV4_HDR_MIN)
+			return -1;
+		ip_hlen = (pkt[0] & 0x0f) * 4;
+		proto = pkt[9];
+		id = get16(pkt + 4);
+	} else if (version == 6) {
+		ip_hlen = IPV6_HDR_SIZE;
+		if (pkt_size < IPV6_HDR_SIZE)
+			return -1;
+		/* the kernel only offloads packets without extension headers */
+		proto = pkt[6];
+	} else {
+		return -1;
+	}
+
+	if (ip_hlen < IPV4_HDR_MIN || pkt_size < ip_hlen)
+		return -1;
+	l4 = pkt + ip_hlen;
+
+	switch (gso_type) {
+	case VIRTIO_NET_HDR_GSO_TCPV4:
+	case VIRTIO_NET_HDR_GSO_TCPV6:
+		if (proto != IPPROTO_TCP ||
+		    (version == 4) != (gso_type == VIRTIO_NET_HDR_GSO_TCPV4))
+			return -1;
+		if (pkt_size < ip_hlen + TCP_HDR_MIN)
+			return -1;
+		l4_hlen = (l4[12] >> 4) * 4;
+		if (l4_hlen < TCP_HDR_MIN)
+			return -1;
+		seq = get32(l4 + 4);
+		flags = l4[13];
+		break;
+#ifdef VIRTIO_NET_HDR_GSO_UDP_L4
+	case VIRTIO_NET_HDR_GSO_UDP_L4:
+		if (proto != IPPROTO_UDP)
+			return -1;
+		l4_hlen = UDP_HDR_SIZE;
+		break;
+#endif
+	default:
+		return -1;
+	}
+
+	hlen = ip_hlen + l4_hlen;
+	if (pkt_size < hlen || hdr->gso_size == 0 ||
+	    hlen + hdr->gso_size > out_size)
+		return -1;
+	payload = pkt_size - hlen;
+
+	off = 0;
+	i = 0;
+	do {
+		seg = payload - off;
+		if (seg > hdr->gso_size)
+			seg = hdr->gso_size;
+
+		memcpy(out, pkt, hlen);
+		memcpy(out + hlen, pkt + hlen + off, seg);
+		l4 = out + ip_hlen;
+
+		if (version == 4) {
+			put16(out + 2, hlen + seg);
+			put16(out + 4, id + i);
+			put16(out + 10, 0);
+			put16(out + 10, csum_fold(csum_partial(out, ip_hlen, 0)));
+		} else {
+			put16(out + 4, l4_hlen + seg);
+		}
+
+		if (proto == IPPROTO_TCP) {
+			uint8_t f = flags;
+
+			/* FIN and PSH belong to the last segment only, CWR
+			 * to the first */
+			if (off + seg < payload)
+				f &= ~(TCP_FLAG_FIN | TCP_FLAG_PSH);
+			if (off > 0)
+				f &= ~TCP_FLAG_CWR;
+			put32(l4 + 4, seq + off);
+			l4[13] = f;
+			put16(l4 + 16, 0);
+			sum = pseudo_csum(out, IPPROTO_TCP, l4_hlen + seg);
+			sum = csum_partial(l4, l4_hlen + seg, sum);
+			put16(l4 + 16, csum_fold(sum));
+		} else {
+			uint16_t csum;
+
+			put16(l4 + 4, l4_hlen + seg);
+			put16(l4 + 6, 0);
+			sum = pseudo_csum(out, IPPROTO_UDP, l4_hlen + seg);
+			sum = csum_partial(l4, l4_hlen + seg, sum);
+			csum = csum_fold(sum);
+			put16(l4 + 6, csum ? csum : 0xffff);
+		}
+
+		ret = func(priv, out, hlen + seg);
+		if (ret < 0)
+			return ret;
+
+		off += seg;
+		i++;
+	} while (off < payload);
+
+	return 0;
+}
+
+/* Takes a packet read from a tun device opened with IFF_VNET_HDR
+ * (the virtio_net_hdr followed by the IP packet) and calls func on
+ * each of the packets it contains. A packet that was not coalesced by
+ * the kernel is passed as is, so that no copy is made; segments of a
+ * super-packet are written to out, which must fit a single segment.
+ *
+ * Returns zero on success, a negative value when the packet cannot be
+ * parsed, or the negative value returned by func.
+ */
+int tun_gso_segment(uint8_t *pkt, size_t pkt_size,
+		    uint8_t *out, size_t out_size,
+		    tun_segment_func func, void *priv)
+{
+	struct virtio_net_hdr hdr;
+	unsigned gso_type;
+
+	if (pkt_size <= TUN_VNET_HDR_SIZE)
+		return -1;
+
+	memcpy(&hdr, pkt, sizeof(hdr));
+	pkt += TUN_VNET_HDR_SIZE;
+	pkt_size -= TUN_VNET_HDR_SIZE;
+
+	gso_type = hdr.gso_type & ~VIRTIO_NET_HDR_GSO_ECN;
+	if (gso_type == VIRTIO_NET_HDR_GSO_NONE) {
+		if (hdr.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) {
+			if (complete_csum(pkt, pkt_size, hdr.csum_start,
+					  hdr.csum_offset) < 0)
+				return -1;
+		}
+		return func(priv, pkt, pkt_size);
+	}
+
+	/* segment() recalculates all checksums, so NEEDS_CSUM is implied */
+	return segment(&hdr, gso_type, pkt, pkt_size, out, out_size, func, priv);
+}
+
+#endif
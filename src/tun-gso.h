@@ -0,0 +1,49 @@
+/*
+ * Copyright (C) 2026 Nikos Mavrogiannopoulos
+ *
+ * Author: Nikos Mavrogiannopoulos
+ *
+ * This file is part of ocserv.
+ *
+ * ocserv is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#ifndef TUN_GSO_H
+# define TUN_GSO_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#if defined(__linux__) && defined(HAVE_LINUX_IF_TUN_H)
+# define ENABLE_TUN_OFFLOAD 1
+#endif
+
+#ifdef ENABLE_TUN_OFFLOAD
+# include <linux/virtio_net.h>
+
+# define TUN_VNET_HDR_SIZE sizeof(struct virtio_net_hdr)
+/* The largest packet the kernel hands us with TSO enabled */
+# define TUN_GSO_MAX_SIZE (64*1024)
+
+/* Called for every MTU-sized packet produced by tun_gso_segment().
+ * pkt points either right after the virtio-net header of the input,
+ * or to out; the room the caller left in front of these is where the
+ * CSTP/DTLS framing headers go. */
+typedef int (*tun_segment_func)(void *priv, uint8_t *pkt, size_t pkt_size);
+
+int tun_gso_segment(uint8_t *pkt, size_t pkt_size,
+		    uint8_t *out, size_t out_size,
+		    tun_segment_func func, void *priv);
+#endif
+
+#endif
@@ -46,6 +46,7 @@
 #include <netdb.h>
 #include <vpn.h>
 #include <tun.h>
+#include <tun-gso.h>
 #include <main.h>
 #include <ccan/list/list.h>
 #include "vhost.h"
@@ -652,6 +653,8 @@ static int os_open_tun(main_server_st * s, struct proc_st *proc)
 
 	memset(&ifr, 0, sizeof(ifr));
 	ifr.ifr_flags = IFF_TUN | IFF_NO_PI;
+	if (GETPCONFIG(s)->tun_offload)
+		ifr.ifr_flags |= IFF_VNET_HDR;
 
 	memcpy(ifr.ifr_name, proc->tun_lease.name, IFNAMSIZ);
 
@@ -700,6 +703,25 @@ static int os_open_tun(main_server_st * s, struct proc_st *proc)
 	}
 #endif
 
+	if (GETPCONFIG(s)->tun_offload) {
+		/* Let the kernel pass us unsegmented TCP (and UDP, when
+		 * supported) packets; the worker splits them to the tunnel
+		 * MTU. Failing that we still get the vnet header, so this
+		 * is not fatal. */
+		t = TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6;
+		ret = -1;
+#ifdef TUN_F_USO4
+		ret = ioctl(tunfd, TUNSETOFFLOAD, t | TUN_F_USO4 | TUN_F_USO6);
+#endif
+		if (ret < 0)
+			ret = ioctl(tunfd, TUNSETOFFLOAD, t);
+		if (ret < 0) {
+			e = errno;
+			mslog(s, NULL, LOG_INFO, "%s: TUNSETOFFLOAD: %s\n",
+			      proc->tun_lease.name, strerror(e));
+		}
+	}
+
 	return tunfd;
  fail:
 	close(tunfd);
@@ -896,6 +918,32 @@ ssize_t tun_read(int sockfd, void *buf, size_t len)
 }
 #endif
 
+#ifdef ENABLE_TUN_OFFLOAD
+/* Writes a packet to a tun device opened with IFF_VNET_HDR. The
+ * packets we write are complete, so the header is all zeros. */
+ssize_t tun_write_vnet(int sockfd, const void *buf, size_t len)
+{
+	static const uint8_t hdr[TUN_VNET_HDR_SIZE];
+	struct iovec iov[2];
+	int ret;
+
+	iov[0].iov_base = (void*)hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = (void*)buf;
+	iov[1].iov_len = len;
+
+	do {
+		ret = writev(sockfd, iov, 2);
+		if (ret == -1 && errno == EAGAIN)
+			ms_sleep(50);
+	} while (ret == -1 && (errno == EAGAIN || errno == EINTR));
+
+	if (ret >= (int)sizeof(hdr))
+		ret -= sizeof(hdr);
+	return ret;
+}
+#endif
+
 #ifndef __FreeBSD__
 int tun_claim(int sockfd)
 {
@@ -36,5 +36,6 @@ struct tun_lease_st {
 ssize_t tun_write(int sockfd, const void *buf, size_t len);
 ssize_t tun_read(int sockfd, void *buf, size_t len);
 int tun_claim(int sockfd);
+ssize_t tun_write_vnet(int sockfd, const void *buf, size_t len);
 
 #endif
@@ -115,6 +115,26 @@ inline static const char *proto_to_str(fw_proto_t proto)
 
 #define DEFAULT_DPD_TIME 600
 
+/* The maximum number of packets a worker reads from the tun
+ * device on each wakeup */
+#define DEFAULT_TUN_BATCH_SIZE 16
+#define MAX_TUN_BATCH_SIZE 256
+
+/* pre-forked workers started per second */
+#define DEFAULT_PREFORK_RATE 50
+
+/* seconds between changes of the TLS session ticket key */
+#define DEFAULT_TICKET_KEY_ROTATION 3600
+
+/* threads of sec-mod that run the authentication modules */
+#define DEFAULT_AUTH_THREADS 4
+#define MAX_AUTH_THREADS 64
+
+/* The latencies of the authentication calls are counted in buckets;
+ * bucket i holds those under 2^i milliseconds, and the last one the
+ * rest. */
+#define AUTH_LATENCY_BUCKETS 12
+
 #define AC_PKT_DATA             0	/* Uncompressed data */
 #define AC_PKT_DPD_OUT          3	/* Dead Peer Detection */
 #define AC_PKT_DPD_RESP         4	/* DPD response */
@@ -156,6 +176,8 @@ extern int syslog_open;
 
 #define MAX_CIPHERSUITE_NAME 64
 #define SID_SIZE 32
+/* the maximum size of a cookie; see sealed-cookie.h */
+#define MAX_COOKIE_SIZE 1024
 
 
 struct vpn_st {
@@ -237,6 +259,7 @@ struct cfg_st {
 
 	gnutls_certificate_request_t cert_req;
 	char *priorities;
+	unsigned kernel_tls; /* hand the CSTP session keys to the kernel */
 #ifdef ENABLE_COMPRESSION
 	unsigned enable_compression;
 	unsigned no_compress_limit;	/* under this size (in bytes) of data there will be no compression */
@@ -276,6 +299,13 @@ struct cfg_st {
 	unsigned ban_points_connect;
 	unsigned ban_points_kkdcp;
 
+	char **ban_allow; /* networks never banned */
+	size_t ban_allow_size;
+	char **ban_deny; /* networks always rejected */
+	size_t ban_deny_size;
+	unsigned ban_aggregate_threshold; /* banned addresses after which their network is banned */
+	unsigned ban_filter; /* drop the banned clients with an eBPF filter on the listeners */
+
 	/* when using the new PSK DTLS negotiation make sure that
 	 * the negotiated DTLS cipher/mac matches the TLS cipher/mac. */
 	unsigned match_dtls_and_tls;
@@ -302,6 +332,12 @@ struct cfg_st {
 	                               * and allow auth to complete in different
 	                               * TCP sessions. */
 	unsigned rate_limit_ms; /* if non zero force a connection every rate_limit milliseconds */
+	unsigned prefork_workers; /* idle workers kept ready for new connections */
+	unsigned prefork_rate; /* idle workers started per second */
+	unsigned udp_steering; /* steer DTLS client hellos to the workers' sockets */
+	unsigned tls_session_tickets; /* resume TLS sessions with tickets instead of sec-mod's cache */
+	unsigned ticket_key_rotation; /* seconds between ticket key changes; 0 for never */
+	unsigned auth_threads; /* threads running the auth modules in sec-mod; 0 for none */
 	unsigned ping_leases; /* non zero if we need to ping prior to leasing */
 
 	size_t rx_per_sec;
@@ -311,6 +347,7 @@ struct cfg_st {
 	char *crl;
 
 	unsigned output_buffer;
+	unsigned tun_batch_size; /* packets to drain from the tun device per wakeup */
 	unsigned default_mtu;
 	unsigned predictable_ips; /* boolean */
 
@@ -396,6 +433,10 @@ struct perm_cfg_st {
 	unsigned int port;
 	unsigned int udp_port;
 
+	unsigned tun_offload; /* open tun devices with IFF_VNET_HDR */
+
+	char *cookie_key_file; /* seal the cookies with the key from this file */
+
 	/* attic, where old config allocated values are stored */
 	struct list_head attic;
 };
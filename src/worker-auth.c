@@ -33,6 +33,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <limits.h>
+#include <poll.h>
 #include <ipc.pb-c.h>
 #include <base64-helper.h>
 
@@ -717,11 +718,30 @@ static int recv_cookie_auth_reply(worker_st * ws)
 	return ret;
 }
 
-/* returns the fd */
+/* Returns the fd of the connection to sec-mod. The connection is
+ * opened on first use and is kept for all the requests of the worker;
+ * it should be closed with disconnect_from_secmod() on any error, as
+ * it may be left in the middle of a message.
+ */
 int connect_to_secmod(worker_st * ws)
 {
+	struct pollfd pfd;
 	int sd, ret, e;
 
+	if (ws->secmod_fd != -1) {
+		/* No data are expected while no request is pending; if the
+		 * socket is readable sec-mod has closed the connection. */
+		pfd.fd = ws->secmod_fd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+
+		if (poll(&pfd, 1, 0) == 0)
+			return ws->secmod_fd;
+
+		oclog(ws, LOG_DEBUG, "sec-mod closed the connection; reconnecting");
+		disconnect_from_secmod(ws);
+	}
+
 	sd = socket(AF_UNIX, SOCK_STREAM, 0);
 	if (sd == -1) {
 		e = errno;
@@ -741,9 +761,19 @@ int connect_to_secmod(worker_st * ws)
 		      ws->secmod_addr.sun_path, strerror(e));
 		return -1;
 	}
+
+	ws->secmod_fd = sd;
 	return sd;
 }
 
+void disconnect_from_secmod(worker_st * ws)
+{
+	if (ws->secmod_fd != -1) {
+		close(ws->secmod_fd);
+		ws->secmod_fd = -1;
+	}
+}
+
 static int recv_auth_reply(worker_st * ws, int sd, char **txt, unsigned *pcounter)
 {
 	int ret;
@@ -758,6 +788,7 @@ static int recv_auth_reply(worker_st * ws, int sd, char **txt, unsigned *pcounte
 		       WSCONFIG(ws)->auth_timeout);
 	if (ret < 0) {
 		oclog(ws, LOG_ERR, "error receiving auth reply message");
+		disconnect_from_secmod(ws);
 		return ret;
 	}
 
@@ -800,14 +831,23 @@ static int recv_auth_reply(worker_st * ws, int sd, char **txt, unsigned *pcounte
 		}
 
 		if (msg->has_sid == 0 ||
-		    msg->sid.len != sizeof(ws->cookie) ||
+		    msg->sid.len != SID_SIZE ||
+		    (msg->has_cookie && msg->cookie.len > sizeof(ws->cookie)) ||
 		    msg->dtls_session_id.len != sizeof(ws->session_id)) {
 
 			ret = ERR_AUTH_FAIL;
 			goto cleanup;
 		}
 
-		memcpy(ws->cookie, msg->sid.data, msg->sid.len);
+		/* the sealed cookie, if any, is given to the client instead
+		 * of the session ID */
+		if (msg->has_cookie) {
+			memcpy(ws->cookie, msg->cookie.data, msg->cookie.len);
+			ws->cookie_size = msg->cookie.len;
+		} else {
+			memcpy(ws->cookie, msg->sid.data, msg->sid.len);
+			ws->cookie_size = msg->sid.len;
+		}
 		ws->cookie_set = 1;
 
 		memcpy(ws->session_id, msg->dtls_session_id.data,
@@ -890,7 +930,7 @@ void cookie_authenticate_or_exit(worker_st *ws)
 
 	/* we have authenticated against sec-mod, we need to complete
 	 * our authentication by forwarding our cookie to main. */
-	ret = auth_cookie(ws, ws->cookie, sizeof(ws->cookie));
+	ret = auth_cookie(ws, ws->cookie, ws->cookie_size);
 	if (ret < 0) {
 		oclog(ws, LOG_WARNING, "failed cookie authentication attempt");
 		if (ret == ERR_AUTH_FAIL) {
@@ -989,7 +1029,7 @@ int post_common_handler(worker_st * ws, unsigned http_ver, const char *imsg)
 		success_msg_foot_size = strlen(success_msg_foot);
 	}
 
-	oc_base64_encode((char *)ws->cookie, sizeof(ws->cookie),
+	oc_base64_encode((char *)ws->cookie, ws->cookie_size,
 		      (char *)str_cookie, str_cookie_size);
 
 	/* reply */
@@ -1563,6 +1603,7 @@ int post_auth_handler(worker_st * ws, unsigned http_ver)
 			reason = MSG_INTERNAL_ERROR;
 			oclog(ws, LOG_ERR,
 			      "failed sending auth init message to sec mod");
+			disconnect_from_secmod(ws);
 			goto auth_fail;
 		}
 
@@ -1621,6 +1662,7 @@ int post_auth_handler(worker_st * ws, unsigned http_ver)
 				reason = MSG_INTERNAL_ERROR;
 				oclog(ws, LOG_ERR,
 				      "failed sending auth req message to main");
+				disconnect_from_secmod(ws);
 				goto auth_fail;
 			}
 
@@ -1636,10 +1678,6 @@ int post_auth_handler(worker_st * ws, unsigned http_ver)
 	}
 
 	ret = recv_auth_reply(ws, sd, &msg, &pcounter);
-	if (sd != -1) {
-		close(sd);
-		sd = -1;
-	}
 
 	if (ret == ERR_AUTH_CONTINUE) {
 		
@@ -1682,8 +1720,6 @@ int post_auth_handler(worker_st * ws, unsigned http_ver)
 
  auth_fail:
 
-	if (sd != -1)
-		close(sd);
 	oclog(ws, LOG_HTTP_DEBUG, "HTTP sending: 401 Unauthorized");
 	cstp_printf(ws,
 		   "HTTP/1.%d 401 %s\r\nContent-Length: 0\r\n\r\n",
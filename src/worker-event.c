@@ -0,0 +1,189 @@
+/*
+ * Copyright (C) 2026 Nikos Mavrogiannopoulos
+ *
+ * Author: Nikos Mavrogiannopoulos
+ *
+ * This file is part of ocserv.
+ *
+ * ocserv is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#include <config.h>
+
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#ifdef HAVE_EPOLL_CREATE1
+# include <sys/epoll.h>
+#endif
+
+#include <worker-event.h>
+
+/* Returns zero when epoll is used and -1 when we fall back to poll().
+ * Either way the backend is usable. */
+int worker_ev_init(worker_ev_st *ev)
+{
+	unsigned i;
+
+	for (i = 0; i < WEV_MAX; i++) {
+		ev->fds[i] = -1;
+		ev->stale[i] = 0;
+	}
+	worker_ev_clear(ev);
+
+#ifdef HAVE_EPOLL_CREATE1
+	ev->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (ev->epfd != -1)
+		return 0;
+#else
+	ev->epfd = -1;
+#endif
+	return -1;
+}
+
+/* Tells that the socket in slot idx was replaced. The new one may have
+ * got the number of the old, which the kernel dropped from the epoll set
+ * when it was closed; it is registered on the next wait either way. */
+void worker_ev_replaced(worker_ev_st *ev, unsigned idx)
+{
+	if (idx < WEV_MAX)
+		ev->stale[idx] = 1;
+}
+
+#ifdef HAVE_EPOLL_CREATE1
+/* Brings the registered fds in sync with fds; this is a no-op
+ * unless an fd was added, removed or replaced. */
+static int epoll_update(worker_ev_st *ev, const int fds[WEV_MAX])
+{
+	struct epoll_event event;
+	unsigned i;
+	int ret;
+
+	for (i = 0; i < WEV_MAX; i++) {
+		if (fds[i] == ev->fds[i] && ev->stale[i] == 0)
+			continue;
+		ev->stale[i] = 0;
+
+		/* the old fd may have been closed already, in which
+		 * case the kernel dropped it from the set */
+		if (ev->fds[i] != -1)
+			epoll_ctl(ev->epfd, EPOLL_CTL_DEL, ev->fds[i], NULL);
+		ev->fds[i] = -1;
+
+		if (fds[i] == -1)
+			continue;
+
+		event.events = EPOLLIN;
+		event.data.u32 = i;
+		ret = epoll_ctl(ev->epfd, EPOLL_CTL_ADD, fds[i], &event);
+		if (ret == -1 && errno == EEXIST)
+			ret = epoll_ctl(ev->epfd, EPOLL_CTL_MOD, fds[i], &event);
+		if (ret == -1)
+			return -1;
+		ev->fds[i] = fds[i];
+	}
+
+	return 0;
+}
+
+static int epoll_backend_wait(worker_ev_st *ev, const int fds[WEV_MAX],
+			      int timeout_ms, const sigset_t *sigmask)
+{
+	struct epoll_event events[WEV_MAX];
+	unsigned idx;
+	int ret, i;
+
+	if (epoll_update(ev, fds) < 0)
+		return -1;
+
+	ret = epoll_pwait(ev->epfd, events, WEV_MAX, timeout_ms, sigmask);
+	if (ret <= 0)
+		return ret;
+
+	for (i = 0; i < ret; i++) {
+		idx = events[i].data.u32;
+		if (idx >= WEV_MAX)
+			continue;
+		if (events[i].events & EPOLLIN)
+			ev->revents[idx] |= POLLIN;
+		if (events[i].events & EPOLLHUP)
+			ev->revents[idx] |= POLLHUP;
+		if (events[i].events & EPOLLERR)
+			ev->revents[idx] |= POLLERR;
+	}
+
+	return ret;
+}
+#endif
+
+static int poll_backend_wait(worker_ev_st *ev, const int fds[WEV_MAX],
+			     int timeout_ms, const sigset_t *sigmask)
+{
+	struct pollfd pfd[WEV_MAX];
+	unsigned idx[WEV_MAX];
+	unsigned i, pfd_size = 0;
+	int ret;
+
+	for (i = 0; i < WEV_MAX; i++) {
+		if (fds[i] == -1)
+			continue;
+		pfd[pfd_size].fd = fds[i];
+		pfd[pfd_size].events = POLLIN;
+		pfd[pfd_size].revents = 0;
+		idx[pfd_size] = i;
+		pfd_size++;
+	}
+
+#ifdef HAVE_PPOLL
+	{
+		struct timespec tv;
+
+		tv.tv_sec = timeout_ms / 1000;
+		tv.tv_nsec = (timeout_ms % 1000) * 1000000;
+		ret = ppoll(pfd, pfd_size, &tv, sigmask);
+	}
+#else
+	{
+		sigset_t old;
+
+		sigprocmask(SIG_SETMASK, sigmask, &old);
+		ret = poll(pfd, pfd_size, timeout_ms);
+		sigprocmask(SIG_SETMASK, &old, NULL);
+	}
+#endif
+	if (ret <= 0)
+		return ret;
+
+	for (i = 0; i < pfd_size; i++)
+		ev->revents[idx[i]] = pfd[i].revents & (POLLIN|POLLHUP|POLLERR);
+
+	return ret;
+}
+
+/* Waits for up to timeout_ms for any of fds (-1 for unused slots) to
+ * become readable, with the signal mask temporarily set to sigmask.
+ * The results are in ev->revents. Returns -1 and sets errno on error.
+ */
+int worker_ev_wait(worker_ev_st *ev, const int fds[WEV_MAX],
+		   int timeout_ms, const sigset_t *sigmask)
+{
+	worker_ev_clear(ev);
+
+#ifdef HAVE_EPOLL_CREATE1
+	if (ev->epfd != -1)
+		return epoll_backend_wait(ev, fds, timeout_ms, sigmask);
+#endif
+	return poll_backend_wait(ev, fds, timeout_ms, sigmask);
+}
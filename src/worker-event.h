@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2026 Nikos Mavrogiannopoulos
+ *
+ * Author: Nikos Mavrogiannopoulos
+ *
+ * This file is part of ocserv.
+ *
+ * ocserv is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#ifndef WORKER_EVENT_H
+# define WORKER_EVENT_H
+
+#include <signal.h>
+#include <poll.h>
+
+/* The fds watched by the worker main loop */
+enum {
+	WEV_CONN_FD = 0,
+	WEV_CMD_FD,
+	WEV_TUN_FD,
+	WEV_UDP_FD,
+	WEV_MAX
+};
+
+/* The event backend of the worker main loop. With epoll the fds are
+ * registered once and only re-registered when they change (e.g., when
+ * main sends a new UDP fd); otherwise poll() is used.
+ */
+typedef struct worker_ev_st {
+	int epfd; /* -1 when poll() is used */
+	int fds[WEV_MAX]; /* the fds registered to epfd, or -1 */
+	unsigned stale[WEV_MAX]; /* see worker_ev_replaced() */
+
+	/* set by worker_ev_wait(); a combination of POLLIN, POLLHUP
+	 * and POLLERR for each of the fds */
+	unsigned revents[WEV_MAX];
+} worker_ev_st;
+
+int worker_ev_init(worker_ev_st *ev);
+void worker_ev_replaced(worker_ev_st *ev, unsigned idx);
+int worker_ev_wait(worker_ev_st *ev, const int fds[WEV_MAX],
+		   int timeout_ms, const sigset_t *sigmask);
+
+inline static void worker_ev_clear(worker_ev_st *ev)
+{
+	unsigned i;
+
+	for (i = 0; i < WEV_MAX; i++)
+		ev->revents[i] = 0;
+}
+
+#endif
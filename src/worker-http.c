@@ -602,9 +602,10 @@ void header_value_check(struct worker_st *ws, struct http_req_st *req)
 				}
 
 				/* we allow for BASE64_DECODE_LENGTH reporting few bytes more
-				 * than the expected */
+				 * than the expected; the sealed cookies are larger than
+				 * the session ID */
 				nlen = BASE64_DECODE_LENGTH(tmplen);
-				if (nlen < sizeof(ws->cookie) || nlen > sizeof(ws->cookie)+8)
+				if (nlen < SID_SIZE || nlen > sizeof(ws->cookie)+8)
 					return;
 
 				/* we assume that - should be build time optimized */
@@ -614,13 +615,14 @@ void header_value_check(struct worker_st *ws, struct http_req_st *req)
 				ret =
 				    oc_base64_decode((uint8_t*)p, tmplen,
 						  ws->buffer, &nlen);
-				if (ret == 0 || nlen != sizeof(ws->cookie)) {
+				if (ret == 0 || nlen < SID_SIZE || nlen > sizeof(ws->cookie)) {
 					oclog(ws, LOG_INFO,
 					      "could not decode cookie: %.*s",
 					      tmplen, p);
 					ws->cookie_set = 0;
 				} else {
-					memcpy(ws->cookie, ws->buffer, sizeof(ws->cookie));
+					memcpy(ws->cookie, ws->buffer, nlen);
+					ws->cookie_size = nlen;
 					ws->auth_state = S_AUTH_COOKIE;
 					ws->cookie_set = 1;
 				}
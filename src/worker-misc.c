@@ -53,6 +53,7 @@ static unsigned recv_from_new_fd(struct worker_st *ws, int fd, UdpFdMsg **tmsg)
 {
 	int saved_fd, ret;
 	UdpFdMsg *saved_tmsg;
+	dtls_rx_queue_st *saved_rxq;
 
 	/* don't bother with anything if we are on uninitialized state */
 	if (ws->dtls_session == NULL || ws->udp_state != UP_ACTIVE)
@@ -60,7 +61,11 @@ static unsigned recv_from_new_fd(struct worker_st *ws, int fd, UdpFdMsg **tmsg)
 
 	saved_fd = ws->dtls_tptr.fd;
 	saved_tmsg = ws->dtls_tptr.msg;
+	saved_rxq = ws->dtls_tptr.rxq;
 
+	/* the datagrams queued from the current fd are kept, and none
+	 * are queued from the new one */
+	ws->dtls_tptr.rxq = NULL;
 	ws->dtls_tptr.msg = *tmsg;
 	ws->dtls_tptr.fd = fd;
 
@@ -76,6 +81,7 @@ static unsigned recv_from_new_fd(struct worker_st *ws, int fd, UdpFdMsg **tmsg)
  	*tmsg = ws->dtls_tptr.msg;
  	ws->dtls_tptr.fd = saved_fd;
  	ws->dtls_tptr.msg = saved_tmsg;
+ 	ws->dtls_tptr.rxq = saved_rxq;
  	return ret;
 }
 
@@ -128,6 +134,26 @@ int handle_commands_from_main(struct worker_st *ws)
 			}
 
 			set_non_block(fd);
+
+			if (tmsg && tmsg->steered) {
+				/* not connected yet; see dtls_steered_hello() */
+				udp_fd_msg__free_unpacked(tmsg, NULL);
+				if (ws->udp_state != UP_WAIT_FD) {
+					close(fd);
+					return 0;
+				}
+
+				if (ws->dtls_tptr.fd != -1)
+					close(ws->dtls_tptr.fd);
+				dtls_transport_set_fd(&ws->dtls_tptr, fd);
+
+				if (WSCONFIG(ws)->try_mtu == 0)
+					set_mtu_disc(fd, ws->proto, 0);
+
+				oclog(ws, LOG_DEBUG, "received steered UDP fd");
+				return 0;
+			}
+
 			if (has_hello == 0) {
 				/* check if the first packet received is a valid one -
 				 * if not discard the new fd */
@@ -148,7 +174,7 @@ int handle_commands_from_main(struct worker_st *ws)
 				udp_fd_msg__free_unpacked(ws->dtls_tptr.msg, NULL);
 
 			ws->dtls_tptr.msg = tmsg;
-			ws->dtls_tptr.fd = fd;
+			dtls_transport_set_fd(&ws->dtls_tptr, fd);
 
 			if (WSCONFIG(ws)->try_mtu == 0)
 				set_mtu_disc(fd, ws->proto, 0);
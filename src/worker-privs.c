@@ -96,6 +96,12 @@ int disable_system_calls(struct worker_st *ws)
 #endif
 	ADD_SYSCALL(recvmsg, 0);
 	ADD_SYSCALL(sendmsg, 0);
+#ifdef HAVE_SENDMMSG
+	ADD_SYSCALL(sendmmsg, 0);
+#endif
+#ifdef HAVE_RECVMMSG
+	ADD_SYSCALL(recvmmsg, 0);
+#endif
 
 	ADD_SYSCALL(read, 0);
 
@@ -121,6 +127,11 @@ int disable_system_calls(struct worker_st *ws)
 
 	ADD_SYSCALL(poll, 0);
 	ADD_SYSCALL(ppoll, 0);
+#ifdef HAVE_EPOLL_CREATE1
+	ADD_SYSCALL(epoll_create1, 0);
+	ADD_SYSCALL(epoll_ctl, 0);
+	ADD_SYSCALL(epoll_pwait, 0);
+#endif
 
 	/* allow setting non-blocking sockets */
 	ADD_SYSCALL(fcntl, 0);
@@ -129,9 +140,12 @@ int disable_system_calls(struct worker_st *ws)
 	ADD_SYSCALL(exit_group, 0);
 	ADD_SYSCALL(socket, 0);
 	ADD_SYSCALL(connect, 0);
+	ADD_SYSCALL(shutdown, 0);
 
 	ADD_SYSCALL(getsockopt, 0);
 	ADD_SYSCALL(setsockopt, 0);
+	/* to verify the address of a steered UDP socket */
+	ADD_SYSCALL(getsockname, 0);
 
 #ifdef ANYCONNECT_CLIENT_COMPAT
 	/* we need to open files when we have an xml_config_file setup on any vhost */
@@ -50,6 +50,7 @@ static int recv_resume_fetch_reply(worker_st *ws, int sd, gnutls_datum_t *sdata)
 		(unpack_func)session_resume_reply_msg__unpack, DEFAULT_SOCKET_TIMEOUT);
 	if (ret < 0) {
 		oclog(ws, LOG_ERR, "error receiving resumption reply (fetch)");
+		disconnect_from_secmod(ws);
 		return ret;
 	}
 
@@ -90,6 +91,11 @@ static gnutls_datum_t resume_db_fetch(void *dbf, gnutls_datum_t key)
 		return r;
 	}
 
+	/* clients which support tickets were given one instead of
+	 * a cache entry */
+	if (ws->ticket_key_set && ws->ticket_ext)
+		return r;
+
 	sd = connect_to_secmod(ws);
 	if (sd == -1) {
 		oclog(ws, LOG_DEBUG, "cannot connect to secmod");
@@ -106,13 +112,12 @@ static gnutls_datum_t resume_db_fetch(void *dbf, gnutls_datum_t key)
 		(pack_size_func)session_resume_fetch_msg__get_packed_size,
 		(pack_func)session_resume_fetch_msg__pack);
 	if (ret < 0) {
-		goto cleanup;
+		disconnect_from_secmod(ws);
+		return r;
 	}
 
 	recv_resume_fetch_reply(ws, sd, &r);
 
- cleanup:
- 	close(sd);
 	return r;
 }
 
@@ -154,10 +159,8 @@ resume_db_store (void *dbf, gnutls_datum_t key, gnutls_datum_t data)
 	ret = send_msg_to_secmod(ws, sd, RESUME_STORE_REQ, &msg,
 		(pack_size_func)session_resume_store_req_msg__get_packed_size,
 		(pack_func)session_resume_store_req_msg__pack);
-
-	close(sd);
-
 	if (ret < 0) {
+		disconnect_from_secmod(ws);
 		return GNUTLS_E_DB_ERROR;
 	}
 
@@ -191,14 +194,51 @@ static int resume_db_delete(void *dbf, gnutls_datum_t key)
 	ret = send_msg_to_secmod(ws, sd, RESUME_DELETE_REQ, &msg,
 		(pack_size_func)session_resume_fetch_msg__get_packed_size,
 		(pack_func)session_resume_fetch_msg__pack);
-
-	close(sd);
-	if (ret < 0)
+	if (ret < 0) {
+		disconnect_from_secmod(ws);
 		return GNUTLS_E_DB_ERROR;
+	}
 
 	return 0;
 }
 
+/* Enables the session tickets with the key main gave us. The virtual
+ * hosts each use a key derived from it, so that a ticket cannot resume
+ * a session on another host than the one it was issued by.
+ */
+void set_ticket_key(worker_st *ws, gnutls_session_t session)
+{
+	uint8_t key[TLS_TICKET_KEY_SIZE];
+	hmac_component_st components[2];
+	gnutls_datum_t d;
+	uint8_t i;
+	int ret;
+
+	if (!ws->ticket_key_set)
+		return;
+
+	if (ws->vhost->name == NULL) {
+		memcpy(key, ws->ticket_key, sizeof(key));
+	} else {
+		components[0].data = ws->vhost->name;
+		components[0].length = strlen(ws->vhost->name);
+		components[1].data = &i;
+		components[1].length = sizeof(i);
+
+		for (i = 0; i < sizeof(key) / HMAC_DIGEST_SIZE; i++)
+			generate_hmac(sizeof(ws->ticket_key), ws->ticket_key,
+				      2, components, key + i * HMAC_DIGEST_SIZE);
+	}
+
+	d.data = key;
+	d.size = sizeof(key);
+	ret = gnutls_session_ticket_enable_server(session, &d);
+	if (ret < 0)
+		oclog(ws, LOG_INFO, "could not enable session tickets: %s", gnutls_strerror(ret));
+
+	safe_memset(key, 0, sizeof(key));
+}
+
 void set_resume_db_funcs(gnutls_session_t session)
 {
 	gnutls_db_set_retrieve_function (session, resume_db_fetch);
@@ -45,6 +45,9 @@
 #include <c-strcase.h>
 #include <c-ctype.h>
 #include <worker-bandwidth.h>
+#include <tun-gso.h>
+#include <worker-event.h>
+#include <ip-util.h>
 #include <signal.h>
 #include <poll.h>
 
@@ -137,9 +140,80 @@ inline static ssize_t dtls_pull_buffer_non_empty(gnutls_transport_ptr_t ptr)
 	dtls_transport_ptr *p = ptr;
 	if (p->msg)
 		return 1;
+	if (p->rxq && p->rxq->pos < p->rxq->msgs)
+		return 1;
 	return 0;
 }
 
+#ifdef HAVE_RECVMMSG
+static void dtls_rx_queue_init(worker_st *ws)
+{
+	dtls_rx_queue_st *q;
+
+	q = talloc_zero(ws, dtls_rx_queue_st);
+	if (q == NULL)
+		return;
+
+	/* datagrams larger than the advertised link MTU are dropped */
+	q->slot_size = MAX(ws->adv_link_mtu, DTLS_RX_MIN_SLOT_SIZE);
+	q->data = talloc_size(q, DTLS_RX_QUEUE_MSGS * q->slot_size);
+	if (q->data == NULL) {
+		talloc_free(q);
+		return;
+	}
+
+	ws->dtls_tptr.rxq = q;
+}
+
+/* Reads the available datagrams on the UDP socket, up to
+ * DTLS_RX_QUEUE_MSGS, with a single system call. Truncated datagrams
+ * are dropped; if all were, it fails with EAGAIN.
+ */
+static int dtls_rx_queue_fill(dtls_transport_ptr *p)
+{
+	dtls_rx_queue_st *q = p->rxq;
+	struct mmsghdr msgs[DTLS_RX_QUEUE_MSGS];
+	struct iovec iov[DTLS_RX_QUEUE_MSGS];
+	unsigned i, n;
+	int ret;
+
+	memset(msgs, 0, sizeof(msgs));
+	for (i = 0; i < DTLS_RX_QUEUE_MSGS; i++) {
+		iov[i].iov_base = q->data + i * q->slot_size;
+		iov[i].iov_len = q->slot_size;
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	q->msgs = q->pos = 0;
+
+	ret = recvmmsg(p->fd, msgs, DTLS_RX_QUEUE_MSGS, MSG_DONTWAIT, NULL);
+	if (ret <= 0)
+		return ret;
+
+	for (i = n = 0; i < (unsigned)ret; i++) {
+		if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+			q->truncated++;
+			continue;
+		}
+		if (n != i)
+			memcpy(q->data + n * q->slot_size,
+			       q->data + i * q->slot_size, msgs[i].msg_len);
+		q->len[n++] = msgs[i].msg_len;
+	}
+
+	q->msgs = n;
+	if (n == 0) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	return n;
+}
+#else
+# define dtls_rx_queue_init(ws)
+#endif
+
 static
 ssize_t dtls_pull(gnutls_transport_ptr_t ptr, void *data, size_t size)
 {
@@ -156,6 +230,27 @@ ssize_t dtls_pull(gnutls_transport_ptr_t ptr, void *data, size_t size)
 		p->msg = NULL;
 		return need;
 	}
+
+#ifdef HAVE_RECVMMSG
+	if (p->rxq) {
+		dtls_rx_queue_st *q = p->rxq;
+		ssize_t need;
+		int ret;
+
+		if (q->pos >= q->msgs) {
+			ret = dtls_rx_queue_fill(p);
+			if (ret <= 0)
+				return ret;
+		}
+
+		need = MIN(q->len[q->pos], size);
+		memcpy(data, q->data + q->pos * q->slot_size, need);
+		q->pos++;
+
+		return need;
+	}
+#endif
+
 	return recv(p->fd, data, size, 0);
 }
 
@@ -182,14 +277,6 @@ int dtls_pull_timeout(gnutls_transport_ptr_t ptr, unsigned int ms)
 	return ret;
 }
 
-static
-ssize_t dtls_push(gnutls_transport_ptr_t ptr, const void *data, size_t size)
-{
-	dtls_transport_ptr *p = ptr;
-
-	return send(p->fd, data, size, 0);
-}
-
 int get_psk_key(gnutls_session_t session,
 		const char *username, gnutls_datum_t *key)
 {
@@ -478,9 +565,16 @@ void send_stats_to_secmod(worker_st * ws, time_t now, unsigned discon_reason)
 		ret = send_msg_to_secmod(ws, sd, CMD_SEC_CLI_STATS, &msg,
 				 (pack_size_func)cli_stats_msg__get_packed_size,
 				 (pack_func) cli_stats_msg__pack);
-		if (discon_reason) /* wait for sec-mod to close connection to verify data have been accounted */
-			read(sd, buf, sizeof(buf));
-		close(sd);
+		e = errno;
+		if (ret < 0) {
+			disconnect_from_secmod(ws);
+		} else if (discon_reason) {
+			/* the connection is not used further; wait for sec-mod to close
+			 * it to verify data have been accounted */
+			if (shutdown(sd, SHUT_WR) == 0)
+				read(sd, buf, sizeof(buf));
+			disconnect_from_secmod(ws);
+		}
 
 		if (ret >= 0) {
 			oclog(ws, LOG_INFO,
@@ -488,7 +582,6 @@ void send_stats_to_secmod(worker_st * ws, time_t now, unsigned discon_reason)
 			      (unsigned long)msg.bytes_in,
 			      (unsigned long)msg.bytes_out);
 		} else {
-			e = errno;
 			oclog(ws, LOG_WARNING, "could not send periodic stats to sec-mod: %s\n", strerror(e));
 		}
 	}
@@ -512,6 +605,10 @@ void exit_worker_reason(worker_st * ws, unsigned reason)
 	if (ws->ban_points > 0)
 		ws_add_score_to_ip(ws, 0, 1);
 
+	if (ws->dtls_tptr.rxq && ws->dtls_tptr.rxq->truncated)
+		oclog(ws, LOG_DEBUG, "dropped %lu truncated DTLS datagram(s)",
+		      ws->dtls_tptr.rxq->truncated);
+
 	talloc_free(ws->main_pool);
 	closelog();
 	_exit(1);
@@ -550,9 +647,11 @@ void exit_worker_reason(worker_st * ws, unsigned reason)
 	gnutls_certificate_server_set_request(session, WSCONFIG(ws)->cert_req); \
 	ret = gnutls_priority_set(session, WSCREDS(ws)->cprio); \
 	GNUTLS_FATAL_ERR(ret); \
-	gnutls_db_set_cache_expiration(session, TLS_SESSION_EXPIRATION_TIME(WSCONFIG(ws)))
+	gnutls_db_set_cache_expiration(session, TLS_SESSION_EXPIRATION_TIME(WSCONFIG(ws))); \
+	set_ticket_key(ws, session)
 
-/* Parse the TLS client hello to figure vhost */
+/* Parse the TLS client hello to figure vhost, and whether the client
+ * supports session tickets */
 static int hello_hook_func(gnutls_session_t session, unsigned int htype,
 			   unsigned when, unsigned int incoming,
 			   const gnutls_datum_t *msg)
@@ -591,12 +690,18 @@ static int hello_hook_func(gnutls_session_t session, unsigned int htype,
 
 	while (pos < msg->size) {
 		uint16_t type;
+		size_t next;
 
 		/* read ExtensionType */
 		SKIP16(pos, msg->size);
 		type = (msg->data[pos-2] << 8) | msg->data[pos-1];
 
-		if (type == 0) { /* server name ext */
+		next = pos;
+		SKIP_V16(next, msg->size);
+
+		if (type == 35) { /* session ticket ext */
+			ws->ticket_ext = 1;
+		} else if (type == 0) { /* server name ext */
 			SKIP16(pos, msg->size);
 			SKIP16(pos, msg->size); /* we don't support anything but a single name */
 
@@ -627,11 +732,9 @@ static int hello_hook_func(gnutls_session_t session, unsigned int htype,
 				oclog(ws, LOG_INFO,
 				      "client requested hostname %s does not match known vhost", (char*)ws->buffer);
 			}
-
-			goto finish;
-		} else {
-			SKIP_V16(pos, msg->size);
 		}
+
+		pos = next;
 	}
 
  finish:
@@ -772,8 +875,9 @@ void vpn_server(struct worker_st *ws)
 		GNUTLS_FATAL_ERR(ret);
 		gnutls_session_set_ptr(session, ws);
 
-		/* if we have a single vhost, avoid going through a callback to set credentials. */
-		if (!HAVE_VHOSTS(ws)) {
+		/* if we have a single vhost and no tickets, avoid going through
+		 * a callback to set credentials. */
+		if (!HAVE_VHOSTS(ws) && !ws->ticket_key_set) {
 			SET_VHOST_CREDS;
 		} else {
 #ifdef SIMULATE_CLIENT_HELLO_HOOK
@@ -797,7 +901,12 @@ void vpn_server(struct worker_st *ws)
 		} while (ret < 0 && gnutls_error_is_fatal(ret) == 0);
 		GNUTLS_FATAL_ERR(ret);
 
-		oclog(ws, LOG_DEBUG, "TLS handshake completed");
+		/* the tickets are issued during the handshake */
+		safe_memset(ws->ticket_key, 0, sizeof(ws->ticket_key));
+		ws->ticket_key_set = 0;
+
+		oclog(ws, LOG_DEBUG, "TLS handshake completed%s",
+		      gnutls_session_is_resumed(session) ? " (resumed)" : "");
 	} else {
 		ws->vhost = find_vhost(ws->vconfig, NULL);
 
@@ -1332,6 +1441,73 @@ static void set_net_priority(worker_st * ws, int fd, int priority)
 
 #define SEND_ERR(x) if (x<0) goto send_error
 
+/* the record and handshake headers precede the client hello */
+#define DTLS_HELLO_SESSION_ID_POS (13+12+HANDSHAKE_SESSION_ID_POS)
+
+/* Peeks at the client hello that main's eBPF program steered to the
+ * unconnected socket in dtls_tptr.fd (see udp-steering), and connects
+ * the socket to the client. The hello is left in the socket for the
+ * DTLS handshake.
+ */
+static void dtls_steered_hello(worker_st * ws)
+{
+	struct sockaddr_storage cli_addr, our_addr, conn_addr;
+	socklen_t cli_addr_size, our_addr_size, conn_addr_size;
+	uint8_t hello[DTLS_HELLO_SESSION_ID_POS+1+sizeof(ws->session_id)];
+	int fd = ws->dtls_tptr.fd;
+	ssize_t ret;
+	int e;
+
+	cli_addr_size = sizeof(cli_addr);
+	our_addr_size = sizeof(our_addr);
+	memset(&our_addr, 0, sizeof(our_addr));
+
+	ret = oc_recvfrom_at(fd, hello, sizeof(hello), MSG_PEEK,
+			     (struct sockaddr *)&cli_addr, &cli_addr_size,
+			     (struct sockaddr *)&our_addr, &our_addr_size,
+			     WSPCONFIG(ws)->udp_port);
+	if (ret < 0)
+		return;
+
+	if (ret != sizeof(hello) || hello[0] != 22 || hello[13] != 1 ||
+	    hello[DTLS_HELLO_SESSION_ID_POS] != sizeof(ws->session_id) ||
+	    memcmp(&hello[DTLS_HELLO_SESSION_ID_POS+1], ws->session_id,
+		   sizeof(ws->session_id)) != 0) {
+		oclog(ws, LOG_DEBUG, "discarding unexpected datagram on steered UDP fd");
+		(void)recv(fd, hello, 1, 0);
+		return;
+	}
+
+	if (connect(fd, (struct sockaddr *)&cli_addr, cli_addr_size) < 0) {
+		e = errno;
+		oclog(ws, LOG_INFO, "could not connect steered UDP fd: %s", strerror(e));
+		goto fail;
+	}
+
+	/* On a wildcard address the kernel picked our address on connect;
+	 * replies must come from the one the client sent its hello to. If
+	 * they differ, the retransmitted hello will go through main. */
+	conn_addr_size = sizeof(conn_addr);
+	if (our_addr.ss_family == cli_addr.ss_family &&
+	    getsockname(fd, (struct sockaddr *)&conn_addr, &conn_addr_size) == 0 &&
+	    (conn_addr_size != our_addr_size ||
+	     memcmp(SA_IN_P_GENERIC(&conn_addr, conn_addr_size),
+		    SA_IN_P_GENERIC(&our_addr, our_addr_size),
+		    SA_IN_SIZE(our_addr_size)) != 0)) {
+		oclog(ws, LOG_DEBUG, "steered UDP fd has a different local address");
+		goto fail;
+	}
+
+	oclog(ws, LOG_DEBUG, "connected steered UDP fd to peer");
+	ws->udp_state = UP_SETUP;
+	ws->udp_recv_time = time(0);
+	return;
+
+ fail:
+	close(fd);
+	dtls_transport_set_fd(&ws->dtls_tptr, -1);
+}
+
 static int dtls_mainloop(worker_st * ws, struct timespec *tnow)
 {
 	int ret;
@@ -1519,39 +1695,25 @@ static int tls_mainloop(struct worker_st *ws, struct timespec *tnow)
 	return ret;
 }
 
-static int tun_mainloop(struct worker_st *ws, struct timespec *tnow)
+/* Forwards the packet of l bytes at buf + 8 to the client. The packet
+ * must have TUN_PKT_HEADROOM bytes in front of it and DTLS_SEAL_TAILROOM
+ * bytes after it, so that the CSTP header or the DTLS record can be
+ * built around it without a copy.
+ */
+static int tun_forward_packet(struct worker_st *ws, struct timespec *tnow,
+			      uint8_t *buf, int l)
 {
-	int ret, l, e;
+	int ret;
 	unsigned tls_retry;
 	int dtls_type = AC_PKT_DATA;
 	int cstp_type = AC_PKT_DATA;
 	gnutls_datum_t dtls_to_send;
 	gnutls_datum_t cstp_to_send;
 
-	l = tun_read(ws->tun_fd, ws->buffer + 8, DATA_MTU(ws, ws->link_mtu));
-	if (l < 0) {
-		e = errno;
-
-		if (e != EAGAIN && e != EINTR) {
-			oclog(ws, LOG_ERR,
-			      "received corrupt data from tun (%d): %s",
-			      l, strerror(e));
-			return -1;
-		}
-
-		return 0;
-	}
-
-	if (l == 0) {
-		oclog(ws, LOG_INFO, "TUN device returned zero");
-		return 0;
-	}
-
-
-	dtls_to_send.data = ws->buffer;
+	dtls_to_send.data = buf;
 	dtls_to_send.size = l;
 
-	cstp_to_send.data = ws->buffer;
+	cstp_to_send.data = buf;
 	cstp_to_send.size = l;
 
 	if (WSCONFIG(ws)->switch_to_tcp_timeout &&
@@ -1565,16 +1727,18 @@ static int tun_mainloop(struct worker_st *ws, struct timespec *tnow)
 #ifdef ENABLE_COMPRESSION
 	if (ws->udp_state == UP_ACTIVE && ws->dtls_selected_comp != NULL && l > WSCONFIG(ws)->no_compress_limit) {
 		/* otherwise don't compress */
-		ret = ws->dtls_selected_comp->compress(ws->decomp+8, sizeof(ws->decomp)-8, ws->buffer+8, l);
+		ret = ws->dtls_selected_comp->compress(ws->decomp + TUN_PKT_HEADROOM,
+						       sizeof(ws->decomp) - TUN_PKT_HEADROOM - DTLS_SEAL_TAILROOM,
+						       buf+8, l);
 		oclog(ws, LOG_TRANSFER_DEBUG, "compressed %d to %d\n", (int)l, ret);
 		if (ret > 0 && ret < l) {
-			dtls_to_send.data = ws->decomp;
+			dtls_to_send.data = ws->decomp + TUN_PKT_HEADROOM - 8;
 			dtls_to_send.size = ret;
 			dtls_type = AC_PKT_COMPRESSED;
 
 			if (ws->cstp_selected_comp) {
 				if (ws->cstp_selected_comp->id == ws->dtls_selected_comp->id) {
-					cstp_to_send.data = ws->decomp;
+					cstp_to_send.data = ws->decomp + TUN_PKT_HEADROOM - 8;
 					cstp_to_send.size = ret;
 					cstp_type = AC_PKT_COMPRESSED;
 				}
@@ -1582,10 +1746,12 @@ static int tun_mainloop(struct worker_st *ws, struct timespec *tnow)
 		}
 	} else if (ws->cstp_selected_comp != NULL && l > WSCONFIG(ws)->no_compress_limit) {
 		/* otherwise don't compress */
-		ret = ws->cstp_selected_comp->compress(ws->decomp+8, sizeof(ws->decomp)-8, ws->buffer+8, l);
+		ret = ws->cstp_selected_comp->compress(ws->decomp + TUN_PKT_HEADROOM,
+						       sizeof(ws->decomp) - TUN_PKT_HEADROOM,
+						       buf+8, l);
 		oclog(ws, LOG_TRANSFER_DEBUG, "compressed %d to %d\n", (int)l, ret);
 		if (ret > 0 && ret < l) {
-			cstp_to_send.data = ws->decomp;
+			cstp_to_send.data = ws->decomp + TUN_PKT_HEADROOM - 8;
 			cstp_to_send.size = ret;
 			cstp_type = AC_PKT_COMPRESSED;
 		}
@@ -1604,7 +1770,7 @@ static int tun_mainloop(struct worker_st *ws, struct timespec *tnow)
 			ws->tun_bytes_out += dtls_to_send.size;
 
 			dtls_to_send.data[7] = dtls_type;
-			ret = dtls_send(ws, dtls_to_send.data + 7, dtls_to_send.size + 1);
+			ret = dtls_send_inplace(ws, dtls_to_send.data + 7, dtls_to_send.size + 1);
 			DTLS_FATAL_ERR_CMD(ret, exit_worker_reason(ws, REASON_ERROR));
 
 			if (ret == GNUTLS_E_LARGE_PACKET) {
@@ -1640,6 +1806,135 @@ static int tun_mainloop(struct worker_st *ws, struct timespec *tnow)
 	return 0;
 }
 
+#ifdef ENABLE_TUN_OFFLOAD
+struct tun_segment_st {
+	struct worker_st *ws;
+	struct timespec *tnow;
+};
+
+static int tun_forward_segment(void *priv, uint8_t *pkt, size_t pkt_size)
+{
+	struct tun_segment_st *st = priv;
+
+	return tun_forward_packet(st->ws, st->tnow, pkt - 8, pkt_size);
+}
+#endif
+
+/* Reads a single packet from the tun device and forwards it to the
+ * client. Returns 1 when there is no packet available, 0 on success,
+ * and a negative value on error.
+ */
+static int tun_send_packet(struct worker_st *ws, struct timespec *tnow)
+{
+	int l, e;
+	unsigned max = MIN(DATA_MTU(ws, ws->link_mtu),
+			   sizeof(ws->buffer) - TUN_PKT_HEADROOM - DTLS_SEAL_TAILROOM);
+	uint8_t *buf = NULL;
+
+#ifdef ENABLE_TUN_OFFLOAD
+	if (ws->tun_gso_buf) {
+		l = tun_read(ws->tun_fd, ws->tun_gso_buf + TUN_PKT_HEADROOM - TUN_VNET_HDR_SIZE,
+			     TUN_VNET_HDR_SIZE + TUN_GSO_MAX_SIZE);
+	} else
+#endif
+	{
+		/* While the DTLS channel is corked, the packet is read
+		 * straight into the transmit queue; the record is then
+		 * sealed and queued where it is. */
+		if (ws->udp_state == UP_ACTIVE)
+			buf = dtls_queue_reserve(&ws->dtls_tptr,
+						 TUN_PKT_HEADROOM + max + DTLS_SEAL_TAILROOM);
+		if (buf == NULL)
+			buf = ws->buffer;
+		l = tun_read(ws->tun_fd, buf + TUN_PKT_HEADROOM, max);
+	}
+	if (l < 0) {
+		e = errno;
+
+		if (e != EAGAIN && e != EINTR) {
+			oclog(ws, LOG_ERR,
+			      "received corrupt data from tun (%d): %s",
+			      l, strerror(e));
+			return -1;
+		}
+
+		return 1;
+	}
+
+	if (l == 0) {
+		oclog(ws, LOG_INFO, "TUN device returned zero");
+		return 1;
+	}
+
+#ifdef ENABLE_TUN_OFFLOAD
+	if (ws->tun_gso_buf) {
+		struct tun_segment_st st = { ws, tnow };
+		int ret;
+
+		ret = tun_gso_segment(ws->tun_gso_buf + TUN_PKT_HEADROOM - TUN_VNET_HDR_SIZE, l,
+				      ws->buffer + TUN_PKT_HEADROOM,
+				      sizeof(ws->buffer) - TUN_PKT_HEADROOM - DTLS_SEAL_TAILROOM,
+				      tun_forward_segment, &st);
+		if (ret == -1) {
+			/* not something we can split; drop it */
+			oclog(ws, LOG_DEBUG,
+			      "could not segment packet of %d bytes from tun", l);
+			return 0;
+		}
+		return ret;
+	}
+#endif
+
+	return tun_forward_packet(ws, tnow, buf + TUN_PKT_HEADROOM - 8, l);
+}
+
+/* Drains up to tun-batch-size packets from the tun device on each
+ * wakeup, so that bulk transfers do not pay a poll() round trip per
+ * packet. The records of a batch are corked and flushed once at the
+ * end; on the UDP channel that is a single sendmmsg().
+ */
+static int tun_mainloop(struct worker_st *ws, struct timespec *tnow)
+{
+	int ret = 0;
+	unsigned i, batch = WSCONFIG(ws)->tun_batch_size;
+	unsigned corked = 0, dtls_corked = 0;
+
+	if (batch > 1 && ws->udp_state != UP_ACTIVE) {
+		cstp_cork(ws);
+		corked = 1;
+	} else if (batch > 1) {
+		dtls_cork(ws);
+		dtls_corked = 1;
+	}
+
+	for (i = 0; i < batch; i++) {
+		ret = tun_send_packet(ws, tnow);
+		if (ret != 0)
+			break;
+	}
+
+	if (corked) {
+		int e = cstp_uncork(ws);
+		CSTP_FATAL_ERR_CMD(ws, e, exit_worker_reason(ws, REASON_ERROR));
+	}
+
+	if (dtls_corked) {
+		int e = dtls_uncork(ws);
+		if (e == GNUTLS_E_LARGE_PACKET) {
+			/* some records did not fit the path MTU and were
+			 * dropped; the next ones will be smaller */
+			mtu_not_ok(ws);
+			e = 0;
+		}
+		DTLS_FATAL_ERR_CMD(e, exit_worker_reason(ws, REASON_ERROR));
+	}
+
+	if (ret < 0)
+		return ret;
+
+	return 0;
+}
+
 static
 char *replace_vals(worker_st *ws, const char *txt)
 {
@@ -1805,14 +2100,12 @@ static void calc_mtu_values(worker_st * ws)
 static int connect_handler(worker_st * ws)
 {
 	struct http_req_st *req = &ws->req;
-	struct pollfd pfd[4];
-	unsigned pfd_size;
+	worker_ev_st ev;
+	int fds[WEV_MAX];
+	unsigned udp_fd_gen;
 	int max, ret, t;
 	char *p;
 	unsigned rnd;
-#ifdef HAVE_PPOLL
-	struct timespec tv;
-#endif
 	unsigned tls_pending, dtls_pending = 0, i;
 	struct timespec tnow;
 	unsigned ip6;
@@ -1867,6 +2160,16 @@ static int connect_handler(worker_st * ws)
 		alarm(0);
 	http_req_deinit(ws);
 
+	/* the client sends nothing before it sees our reply, so this is
+	 * the point to hand the TLS keys to the kernel */
+	if (WSCONFIG(ws)->kernel_tls) {
+		ret = cstp_enable_ktls(ws);
+		if (ret < 0) {
+			oclog(ws, LOG_ERR, "could not switch to kernel TLS");
+			exit_worker(ws);
+		}
+	}
+
 	cstp_cork(ws);
 	ret = cstp_puts(ws, "HTTP/1.1 200 CONNECTED\r\n");
 	SEND_ERR(ret);
@@ -2125,8 +2428,10 @@ static int connect_handler(worker_st * ws)
 		SEND_ERR(ret);
 
 		/* if the peer isn't patched for safe renegotiation, always
-		 * require him to open a new tunnel. */
-		if (ws->session != NULL && gnutls_safe_renegotiation_status(ws->session) != 0)
+		 * require him to open a new tunnel. The same applies when
+		 * the kernel handles TLS, as it cannot rehandshake. */
+		if (ws->session != NULL && !ws->cstp_ktls &&
+		    gnutls_safe_renegotiation_status(ws->session) != 0)
 			method = WSCONFIG(ws)->rekey_method;
 		else
 			method = REKEY_METHOD_NEW_TUNNEL;
@@ -2186,6 +2491,16 @@ static int connect_handler(worker_st * ws)
 
 	set_socket_timeout(ws, ws->conn_fd);
 	set_non_block(ws->conn_fd);
+	set_non_block(ws->tun_fd);
+#ifdef ENABLE_TUN_OFFLOAD
+	if (GETPCONFIG(ws)->tun_offload) {
+		ws->tun_gso_buf = talloc_size(ws, TUN_PKT_HEADROOM + TUN_GSO_MAX_SIZE + DTLS_SEAL_TAILROOM);
+		if (ws->tun_gso_buf == NULL) {
+			oclog(ws, LOG_ERR, "memory error");
+			exit_worker(ws);
+		}
+	}
+#endif
 	set_net_priority(ws, ws->conn_fd, ws->user_config->net_priority);
 	set_no_delay(ws, ws->conn_fd);
 
@@ -2318,6 +2633,18 @@ static int connect_handler(worker_st * ws)
 	bandwidth_init(&ws->b_rx, ws->user_config->rx_per_sec);
 	bandwidth_init(&ws->b_tx, ws->user_config->tx_per_sec);
 
+	if (ws->udp_state != UP_DISABLED)
+		dtls_rx_queue_init(ws);
+
+	if (worker_ev_init(&ev) < 0)
+		oclog(ws, LOG_DEBUG, "could not initialize epoll; using poll()");
+
+	fds[WEV_CONN_FD] = ws->conn_fd;
+	fds[WEV_CMD_FD] = ws->cmd_fd;
+	fds[WEV_TUN_FD] = ws->tun_fd;
+	fds[WEV_UDP_FD] = -1;
+	udp_fd_gen = ws->dtls_tptr.fd_gen;
+
 	sigprocmask(SIG_BLOCK, &blockset, NULL);
 
 	/* worker main loop  */
@@ -2339,7 +2666,7 @@ static int connect_handler(worker_st * ws)
 			exit_worker_reason(ws, terminate_reason);
 		}
 
-		if (ws->session != NULL)
+		if (ws->session != NULL && !ws->cstp_ktls_rx)
 			tls_pending = gnutls_record_check_pending(ws->session);
 		else
 			tls_pending = 0;
@@ -2353,38 +2680,20 @@ static int connect_handler(worker_st * ws)
 			dtls_pending = 0;
 		}
 
-		pfd[0].revents = 0;
-		pfd[1].revents = 0;
-		pfd[2].revents = 0;
-		pfd[3].revents = 0;
+		worker_ev_clear(&ev);
 
 		if (tls_pending == 0 && dtls_pending == 0) {
-			pfd[0].fd = ws->conn_fd;
-			pfd[0].events = POLLIN;
-
-			pfd[1].fd = ws->cmd_fd;
-			pfd[1].events = POLLIN;
-
-			pfd[2].fd = ws->tun_fd;
-			pfd[2].events = POLLIN;
-
-			pfd_size = 3;
+			if (ws->udp_state >= UP_WAIT_FD)
+				fds[WEV_UDP_FD] = ws->dtls_tptr.fd;
+			else
+				fds[WEV_UDP_FD] = -1;
 
-			if (ws->udp_state > UP_WAIT_FD) {
-				pfd[3].fd = ws->dtls_tptr.fd;
-				pfd[3].events = POLLIN;
-				pfd_size++;
+			if (udp_fd_gen != ws->dtls_tptr.fd_gen) {
+				udp_fd_gen = ws->dtls_tptr.fd_gen;
+				worker_ev_replaced(&ev, WEV_UDP_FD);
 			}
 
-#ifdef HAVE_PPOLL
-			tv.tv_nsec = 0;
-			tv.tv_sec = 10;
-			ret = ppoll(pfd, pfd_size, &tv, &emptyset);
-#else
-			sigprocmask(SIG_UNBLOCK, &blockset, NULL);
-			ret = poll(pfd, pfd_size, 10*1000);
-			sigprocmask(SIG_BLOCK, &blockset, NULL);
-#endif
+			ret = worker_ev_wait(&ev, fds, 10*1000, &emptyset);
 			if (ret == -1) {
 				if (errno == EINTR || errno == EAGAIN)
 					continue;
@@ -2392,8 +2701,8 @@ static int connect_handler(worker_st * ws)
 				goto exit;
 			}
 
-			if ((pfd[0].revents | pfd[1].revents |
-			     pfd[2].revents | pfd[3].revents) & POLLERR) {
+			if ((ev.revents[WEV_CONN_FD] | ev.revents[WEV_CMD_FD] |
+			     ev.revents[WEV_TUN_FD] | ev.revents[WEV_UDP_FD]) & POLLERR) {
 				terminate_reason = REASON_ERROR;
 				goto exit;
 			}
@@ -2406,7 +2715,7 @@ static int connect_handler(worker_st * ws)
 		}
 
 		/* send pending data from tun device */
-		if (pfd[2].revents & (POLLIN|POLLHUP)) {
+		if (ev.revents[WEV_TUN_FD] & (POLLIN|POLLHUP)) {
 			ret = tun_mainloop(ws, &tnow);
 			if (ret < 0) {
 				terminate_reason = REASON_ERROR;
@@ -2415,7 +2724,7 @@ static int connect_handler(worker_st * ws)
 		}
 
 		/* read pending data from TCP channel */
-		if ((pfd[0].revents & (POLLIN|POLLHUP)) || tls_pending != 0) {
+		if ((ev.revents[WEV_CONN_FD] & (POLLIN|POLLHUP)) || tls_pending != 0) {
 			ret = tls_mainloop(ws, &tnow);
 			if (ret < 0) {
 				terminate_reason = REASON_ERROR;
@@ -2425,7 +2734,7 @@ static int connect_handler(worker_st * ws)
 
 		/* read data from UDP channel */
 		if (ws->udp_state > UP_WAIT_FD &&
-		    ((pfd[3].revents & (POLLIN|POLLHUP)) || dtls_pending != 0)) {
+		    ((ev.revents[WEV_UDP_FD] & (POLLIN|POLLHUP)) || dtls_pending != 0)) {
 
 			ret = dtls_mainloop(ws, &tnow);
 			if (ret < 0) {
@@ -2434,8 +2743,13 @@ static int connect_handler(worker_st * ws)
 			}
 		}
 
+		/* a client hello on a steered UDP fd */
+		if (ws->udp_state == UP_WAIT_FD &&
+		    (ev.revents[WEV_UDP_FD] & (POLLIN|POLLHUP)))
+			dtls_steered_hello(ws);
+
 		/* read commands from command fd */
-		if (pfd[1].revents & (POLLIN|POLLHUP)) {
+		if (ev.revents[WEV_CMD_FD] & (POLLIN|POLLHUP)) {
 			ret = handle_commands_from_main(ws);
 			if (ret == ERR_NO_CMD_FD) {
 				terminate_reason = REASON_ERROR;
@@ -2582,7 +2896,12 @@ static int parse_data(struct worker_st *ws, uint8_t *buf, size_t buf_size,
 	case AC_PKT_DATA:
 		oclog(ws, LOG_TRANSFER_DEBUG, "writing %d byte(s) to TUN",
 		      (int)plain_size);
-		ret = tun_write(ws->tun_fd, plain, plain_size);
+#ifdef ENABLE_TUN_OFFLOAD
+		if (ws->tun_gso_buf)
+			ret = tun_write_vnet(ws->tun_fd, plain, plain_size);
+		else
+#endif
+			ret = tun_write(ws->tun_fd, plain, plain_size);
 		if (ret == -1) {
 			e = errno;
 			oclog(ws, LOG_ERR, "could not write data to tun: %s",
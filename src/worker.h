@@ -157,12 +157,66 @@ struct http_req_st {
 	unsigned authorization_size;
 };
 
+/* Outgoing DTLS records are queued here while the DTLS channel
+ * is corked, and are sent with a single sendmmsg() on uncork. */
+#define DTLS_TX_QUEUE_MSGS 64
+#define DTLS_TX_QUEUE_SIZE (64*1024)
+
+typedef struct dtls_tx_queue_st {
+	unsigned corked;
+	unsigned msgs;
+	size_t size; /* used bytes in data */
+	size_t reserved; /* bytes after size handed out by dtls_queue_reserve() */
+	size_t too_large; /* the smallest record that failed with EMSGSIZE */
+	unsigned dropped; /* records dropped on EMSGSIZE, not yet reported */
+	size_t off[DTLS_TX_QUEUE_MSGS];
+	size_t len[DTLS_TX_QUEUE_MSGS];
+	uint8_t data[DTLS_TX_QUEUE_SIZE];
+} dtls_tx_queue_st;
+
+/* Incoming datagrams are read with a single recvmmsg() into this
+ * queue, and are returned one by one by the DTLS pull function. */
+#define DTLS_RX_QUEUE_MSGS 16
+#define DTLS_RX_MIN_SLOT_SIZE 2048
+
+typedef struct dtls_rx_queue_st {
+	unsigned msgs;
+	unsigned pos; /* the next datagram to return */
+	unsigned slot_size;
+	size_t len[DTLS_RX_QUEUE_MSGS];
+	uint8_t *data; /* DTLS_RX_QUEUE_MSGS slots of slot_size bytes */
+	unsigned long truncated; /* datagrams dropped as larger than a slot */
+} dtls_rx_queue_st;
+
 typedef struct dtls_transport_ptr {
 	int fd;
 	UdpFdMsg *msg; /* holds the data of the first client hello */
 	int consumed;
+	dtls_tx_queue_st *txq; /* allocated on the first dtls_cork() */
+	dtls_rx_queue_st *rxq; /* NULL if datagrams are read one at a time */
+	unsigned fd_gen; /* changes with fd; a new socket may reuse its number */
+	/* when set, dtls_push() also copies the record here; see
+	 * dtls_send_inplace() */
+	uint8_t *capture;
+	size_t capture_max;
+	size_t capture_size;
 } dtls_transport_ptr;
 
+/* Replaces the UDP socket; the datagrams queued from the old one are
+ * dropped, as they are not for the session on the new one */
+inline static void dtls_transport_set_fd(dtls_transport_ptr *p, int fd)
+{
+	p->fd = fd;
+	p->fd_gen++;
+	if (p->rxq)
+		p->rxq->msgs = p->rxq->pos = 0;
+}
+
+/* The room left in front of packets read from the tun device; it fits
+ * the CSTP header, or the DTLS record header, explicit nonce and
+ * packet type when the record is built in place. */
+#define TUN_PKT_HEADROOM 32
+
 /* Given a base MTU, this macro provides the DTLS plaintext data we can send;
  * the output value does not include the DTLS header */
 #define DATA_MTU(ws,mtu) (mtu-ws->dtls_crypto_overhead-ws->dtls_proto_overhead)
@@ -170,6 +224,9 @@ typedef struct dtls_transport_ptr {
 typedef struct worker_st {
 	gnutls_session_t session;
 	gnutls_session_t dtls_session;
+	unsigned cstp_ktls; /* the CSTP records are sent by the kernel */
+	unsigned cstp_ktls_rx; /* ... and received by it */
+	struct dtls_seal_st *dtls_seal; /* see dtls_send_inplace() */
 
 	auth_struct_st *selected_auth;
 	const compression_method_st *dtls_selected_comp;
@@ -199,6 +256,7 @@ typedef struct worker_st {
 
 	struct sockaddr_un secmod_addr;	/* sec-mod unix address */
 	socklen_t secmod_addr_len;
+	int secmod_fd; /* the connection to sec-mod, or -1 */
 
 	struct sockaddr_storage our_addr;	/* our address */
 	socklen_t our_addr_len;
@@ -208,6 +266,11 @@ typedef struct worker_st {
 	char remote_ip_str[MAX_IP_STR];
 	const uint8_t sec_auth_init_hmac[HMAC_DIGEST_SIZE];
 
+	/* the session ticket key main gave us; wiped after the handshake */
+	uint8_t ticket_key[TLS_TICKET_KEY_SIZE];
+	unsigned ticket_key_set;
+	unsigned ticket_ext; /* the client hello had the session ticket extension */
+
 	int proto; /* AF_INET or AF_INET6 */
 
 	time_t session_start_time;
@@ -272,7 +335,8 @@ typedef struct worker_st {
 	unsigned cert_groups_size;
 
 	char hostname[MAX_HOSTNAME_SIZE];
-	uint8_t cookie[SID_SIZE];
+	uint8_t cookie[MAX_COOKIE_SIZE];
+	unsigned cookie_size;
 
 	unsigned int cookie_set;
 
@@ -282,6 +346,10 @@ typedef struct worker_st {
 	uint8_t session_id[GNUTLS_MAX_SESSION_ID];
 	unsigned cert_auth_ok;
 	int tun_fd;
+	/* set when tun-offload is enabled; holds the virtio-net header and
+	 * a super-packet read from tun_fd, leaving TUN_PKT_HEADROOM bytes
+	 * in front of the packet */
+	uint8_t *tun_gso_buf;
 
 	/* ban points to be sent on exit */
 	unsigned ban_points;
@@ -320,6 +388,7 @@ int get_dl_handler(worker_st *ws, unsigned http_ver);
 int get_cert_names(worker_st * ws, const gnutls_datum_t * raw);
 
 void set_resume_db_funcs(gnutls_session_t);
+void set_ticket_key(worker_st *ws, gnutls_session_t session);
 
 
 void __attribute__ ((format(printf, 3, 4)))
@@ -364,6 +433,8 @@ int handle_commands_from_main(struct worker_st *ws);
 int disable_system_calls(struct worker_st *ws);
 void ocsigaltstack(struct worker_st *ws);
 
+extern struct worker_st *global_ws;
+
 void exit_worker(worker_st * ws);
 void exit_worker_reason(worker_st * ws, unsigned reason);
 
@@ -372,6 +443,7 @@ int ws_switch_auth_to_next(struct worker_st *ws);
 void ws_add_score_to_ip(worker_st *ws, unsigned points, unsigned final);
 
 int connect_to_secmod(worker_st * ws);
+void disconnect_from_secmod(worker_st * ws);
 inline static
 int send_msg_to_secmod(worker_st * ws, int sd, uint8_t cmd,
 		       const void *msg, pack_size_func get_size, pack_func pack)
@@ -0,0 +1,253 @@
+/*
+ * Copyright (C) 2026 Nikos Mavrogiannopoulos
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <talloc.h>
+
+#include "../src/sec-mod-auth-pool.c"
+
+/* Unit test for the auth thread pool. It checks whether the calls to a
+ * slow module which is not thread-safe are serialized without delaying
+ * the calls to other modules, whether a paused pool starts no calls, and
+ * the limits and fairness of the queue per client address.
+ */
+
+void set_non_block(int fd)
+{
+	int val;
+
+	val = fcntl(fd, F_GETFL, 0);
+	assert(fcntl(fd, F_SETFL, val | O_NONBLOCK) >= 0);
+}
+
+int set_cloexec_flag(int fd, bool value)
+{
+	return 0;
+}
+
+#ifdef HAVE_PCL_THREADS
+int co_thread_init(void)
+{
+	return 0;
+}
+#endif
+
+static const struct auth_mod_st slow_mod = {
+	.threads = AUTH_THREADS_SERIAL
+};
+
+static const struct auth_mod_st fast_mod = {
+	.threads = AUTH_THREADS_SAFE
+};
+
+struct test_job_st {
+	auth_job_st job;
+	unsigned id;
+};
+
+#define MAX_JOBS 128
+
+static unsigned done_order[MAX_JOBS];
+static unsigned done_size = 0;
+
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t serial_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned serial_running = 0;
+
+static void test_run(auth_job_st *job)
+{
+	if (job->module == &slow_mod) {
+		pthread_mutex_lock(&serial_lock);
+		assert(serial_running == 0);
+		serial_running++;
+		pthread_mutex_unlock(&serial_lock);
+
+		usleep(200 * 1000);
+
+		pthread_mutex_lock(&serial_lock);
+		serial_running--;
+		pthread_mutex_unlock(&serial_lock);
+	} else if (job->source != 0) {
+		usleep(50 * 1000);
+	}
+}
+#else
+static void test_run(auth_job_st *job)
+{
+}
+#endif
+
+static void test_done(sec_mod_st *sec, auth_job_st *job)
+{
+	struct test_job_st *t = (struct test_job_st *)job;
+
+	assert(done_size < MAX_JOBS);
+	done_order[done_size++] = t->id;
+	talloc_free(t);
+}
+
+static int submit_from(sec_mod_st *sec, const struct auth_mod_st *module, unsigned id,
+		       uint32_t source)
+{
+	struct test_job_st *t;
+	int ret;
+
+	t = talloc_zero(sec, struct test_job_st);
+	assert(t != NULL);
+
+	t->id = id;
+	t->job.module = module;
+	t->job.run = test_run;
+	t->job.done = test_done;
+	t->job.source = source;
+	ret = auth_pool_submit(sec, &t->job);
+	if (ret < 0)
+		talloc_free(t);
+	return ret;
+}
+
+static void submit(sec_mod_st *sec, const struct auth_mod_st *module, unsigned id)
+{
+	assert(submit_from(sec, module, id, 0) == 0);
+}
+
+static unsigned hist_total(const uint32_t *hist)
+{
+	unsigned i, total = 0;
+
+	for (i = 0; i < AUTH_LATENCY_BUCKETS; i++)
+		total += hist[i];
+	return total;
+}
+
+/* waits until the given number of jobs is done, or the timeout */
+static void wait_jobs(sec_mod_st *sec, unsigned jobs, int timeout)
+{
+	struct pollfd pfd;
+
+	pfd.fd = auth_pool_get_fd(sec);
+	pfd.events = POLLIN;
+
+	while (done_size < jobs) {
+		pfd.revents = 0;
+		if (poll(&pfd, 1, timeout) <= 0)
+			return;
+		auth_pool_complete(sec);
+	}
+}
+
+int main()
+{
+	sec_mod_st *sec;
+	vhost_cfg_st *vhost;
+	unsigned i;
+
+	sec = talloc_zero(NULL, sec_mod_st);
+	assert(sec != NULL);
+
+	sec->vconfig = talloc_zero(sec, struct list_head);
+	assert(sec->vconfig != NULL);
+	list_head_init(sec->vconfig);
+
+	vhost = talloc_zero(sec, struct vhost_cfg_st);
+	assert(vhost != NULL);
+	vhost->perm_config.config = talloc_zero(vhost, struct cfg_st);
+	assert(vhost->perm_config.config != NULL);
+	list_add(sec->vconfig, &vhost->list);
+
+	/* without threads the jobs complete when submitted */
+	assert(auth_pool_init(sec, 0) == 0);
+	assert(sec->auth_pool == NULL);
+	assert(auth_pool_get_fd(sec) == -1);
+
+	submit(sec, &fast_mod, 1);
+	assert(done_size == 1 && done_order[0] == 1);
+	done_size = 0;
+
+#ifdef HAVE_PTHREAD_H
+	assert(auth_pool_init(sec, 4) == 0);
+	assert(sec->auth_pool != NULL);
+
+	/* jobs without a threaded module still run when submitted */
+	submit(sec, NULL, 1);
+	assert(done_size == 1);
+	done_size = 0;
+
+	/* three calls to the slow module, followed by three fast ones */
+	for (i = 0; i < 3; i++)
+		submit(sec, &slow_mod, i);
+	for (i = 0; i < 3; i++)
+		submit(sec, &fast_mod, 10 + i);
+
+	wait_jobs(sec, 6, 5000);
+	assert(done_size == 6);
+
+	/* the fast calls did not wait for the slow ones */
+	for (i = 0; i < 3; i++)
+		assert(done_order[i] >= 10);
+	/* and the slow ones ran in order */
+	for (i = 3; i < 6; i++)
+		assert(done_order[i] == i - 3);
+	done_size = 0;
+
+	/* the calls are counted, and the slow ones took 128-256 ms */
+	assert(hist_total(sec->auth_run_hist) == 8);
+	assert(hist_total(sec->auth_wait_hist) == 8);
+	assert(sec->auth_run_hist[8] == 3);
+
+	/* no calls are started while paused */
+	assert(auth_pool_pause(sec) == 0);
+	submit(sec, &fast_mod, 1);
+	wait_jobs(sec, 1, 300);
+	assert(done_size == 0);
+
+	auth_pool_resume(sec);
+	wait_jobs(sec, 1, 5000);
+	assert(done_size == 1);
+	done_size = 0;
+
+	/* a single address cannot fill the queue */
+	assert(auth_pool_pause(sec) == 0);
+	for (i = 0; i < MAX_SOURCE_QUEUED; i++)
+		assert(submit_from(sec, &fast_mod, 100 + i, 1) == 0);
+	assert(submit_from(sec, &fast_mod, 0, 1) < 0);
+
+	/* and another address is not queued behind it */
+	assert(submit_from(sec, &fast_mod, 1000, 2) == 0);
+
+	auth_pool_resume(sec);
+	wait_jobs(sec, MAX_SOURCE_QUEUED + 1, 10000);
+	assert(done_size == MAX_SOURCE_QUEUED + 1);
+	for (i = 0; i < 4; i++) {
+		if (done_order[i] == 1000)
+			break;
+	}
+	assert(i < 4);
+
+	/* the pool is not freed; its threads are waiting on it */
+#else
+	talloc_free(sec);
+#endif
+
+	return 0;
+}
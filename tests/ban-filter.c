@@ -0,0 +1,230 @@
+/*
+ * Copyright (C) 2026 Nikos Mavrogiannopoulos
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <talloc.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "../src/main.h"
+#include "../src/main-ban.h"
+#include "../src/main-ban.c"
+#include "../src/main-ban-filter.c"
+
+/* Unit test for the ban filter. It checks whether the datagrams of a
+ * banned address, or of a network of ban-deny, are dropped by the
+ * kernel, and whether they pass again once unbanned or allowed. A TCP
+ * connection accepted before its address is banned keeps working.
+ */
+
+#ifdef ENABLE_BAN_FILTER
+static struct listener_st *new_listener(main_server_st *s, int family, unsigned tcp)
+{
+	struct listener_st *l;
+	struct sockaddr_storage sa;
+	socklen_t sa_len;
+
+	l = talloc_zero(s, struct listener_st);
+	assert(l != NULL);
+	l->sock_type = tcp ? SOCK_TYPE_TCP : SOCK_TYPE_UDP;
+	l->family = family;
+	l->protocol = tcp ? IPPROTO_TCP : IPPROTO_UDP;
+	l->fd = socket(family, tcp ? SOCK_STREAM : SOCK_DGRAM, 0);
+	assert(l->fd >= 0);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.ss_family = family;
+	if (family == AF_INET) {
+		SA_IN_P(&sa)->s_addr = htonl(INADDR_LOOPBACK);
+		sa_len = sizeof(struct sockaddr_in);
+	} else {
+		memcpy(SA_IN6_P(&sa), &in6addr_loopback, sizeof(struct in6_addr));
+		sa_len = sizeof(struct sockaddr_in6);
+	}
+	if (bind(l->fd, (struct sockaddr *)&sa, sa_len) < 0) {
+		fprintf(stderr, "cannot bind to the loopback address\n");
+		exit(77);
+	}
+	assert(getsockname(l->fd, (struct sockaddr *)&l->addr, &sa_len) >= 0);
+	if (tcp)
+		assert(listen(l->fd, 8) >= 0);
+	l->addr_len = sa_len;
+	list_add(&s->listen_list.head, &l->list);
+
+	return l;
+}
+
+/* returns whether a datagram sent from the loopback address arrived */
+static unsigned arrives(struct listener_st *l)
+{
+	struct pollfd pfd;
+	uint8_t buf[16];
+	int cfd, ret;
+
+	cfd = socket(l->family, SOCK_DGRAM, 0);
+	assert(cfd >= 0);
+	memset(buf, 0x17, sizeof(buf));
+	assert(sendto(cfd, buf, sizeof(buf), 0, (struct sockaddr *)&l->addr, l->addr_len) == sizeof(buf));
+	close(cfd);
+
+	pfd.fd = l->fd;
+	pfd.events = POLLIN;
+	ret = poll(&pfd, 1, 500);
+	if (ret == 1)
+		assert(recv(l->fd, buf, sizeof(buf), 0) == sizeof(buf));
+
+	return ret == 1;
+}
+
+/* returns whether data sent over the connection arrived */
+static unsigned stream_arrives(int cfd, int sfd)
+{
+	struct pollfd pfd;
+	uint8_t buf[16];
+	int ret;
+
+	memset(buf, 0x17, sizeof(buf));
+	assert(send(cfd, buf, sizeof(buf), 0) == sizeof(buf));
+
+	pfd.fd = sfd;
+	pfd.events = POLLIN;
+	ret = poll(&pfd, 1, 500);
+	if (ret == 1)
+		assert(recv(sfd, buf, sizeof(buf), 0) == sizeof(buf));
+
+	return ret == 1;
+}
+
+int main()
+{
+	static char *allow[] = { "::1" };
+	static char *deny[] = { "::/64" };
+	main_server_st *s;
+	vhost_cfg_st *vhost;
+	struct listener_st *l4, *l6, *t4;
+	uint8_t ip[4] = {127, 0, 0, 1};
+	int cfd, sfd;
+
+	s = talloc_zero(NULL, struct main_server_st);
+	assert(s != NULL);
+
+	s->vconfig = talloc_zero(s, struct list_head);
+	assert(s->vconfig != NULL);
+	list_head_init(s->vconfig);
+	list_head_init(&s->listen_list.head);
+
+	vhost = talloc_zero(s, struct vhost_cfg_st);
+	assert(vhost != NULL);
+	vhost->perm_config.config = talloc_zero(vhost, struct cfg_st);
+	assert(vhost->perm_config.config != NULL);
+	vhost->perm_config.config->ban_filter = 1;
+	vhost->perm_config.config->max_ban_score = 20;
+	vhost->perm_config.config->min_reauth_time = 30;
+	list_add(s->vconfig, &vhost->list);
+
+	main_ban_db_init(s);
+
+	l4 = new_listener(s, AF_INET, 0);
+	l6 = new_listener(s, AF_INET6, 0);
+	t4 = new_listener(s, AF_INET, 1);
+
+	ban_filter_setup(s);
+	if (!ban_filter_enabled()) {
+		fprintf(stderr, "the eBPF ban filter is not available\n");
+		exit(77);
+	}
+	main_ban_db_load_rules(s);
+
+	assert(arrives(l4));
+	assert(arrives(l6));
+
+	/* points alone don't drop */
+	add_str_ip_to_ban_list(s, "127.0.0.1", 10);
+	assert(arrives(l4));
+
+	add_str_ip_to_ban_list(s, "127.0.0.1", 10);
+	assert(!arrives(l4));
+	assert(arrives(l6));
+
+	assert(remove_ip_from_ban_list(s, ip, 4) != 0);
+	assert(arrives(l4));
+
+	/* a connection accepted as main does is not affected by a later ban */
+	cfd = socket(AF_INET, SOCK_STREAM, 0);
+	assert(cfd >= 0);
+	assert(connect(cfd, (struct sockaddr *)&t4->addr, t4->addr_len) >= 0);
+	sfd = accept(t4->fd, NULL, NULL);
+	assert(sfd >= 0);
+	ban_filter_detach(sfd);
+	assert(stream_arrives(cfd, sfd));
+
+	add_str_ip_to_ban_list(s, "127.0.0.1", 20);
+	assert(!arrives(l4));
+	assert(stream_arrives(cfd, sfd));
+	assert(stream_arrives(sfd, cfd));
+	close(cfd);
+	close(sfd);
+
+	assert(remove_ip_from_ban_list(s, ip, 4) != 0);
+	assert(arrives(l4));
+
+	/* ban-deny, and the longer network of ban-allow */
+	GETCONFIG(s)->ban_deny = deny;
+	GETCONFIG(s)->ban_deny_size = 1;
+	main_ban_db_load_rules(s);
+	assert(!arrives(l6));
+	assert(arrives(l4));
+
+	GETCONFIG(s)->ban_allow = allow;
+	GETCONFIG(s)->ban_allow_size = 1;
+	main_ban_db_load_rules(s);
+	assert(arrives(l6));
+
+	GETCONFIG(s)->ban_allow_size = 0;
+	GETCONFIG(s)->ban_deny_size = 0;
+	main_ban_db_load_rules(s);
+	assert(arrives(l6));
+
+	/* detached when no longer set */
+	add_str_ip_to_ban_list(s, "127.0.0.1", 20);
+	assert(!arrives(l4));
+	GETCONFIG(s)->ban_filter = 0;
+	ban_filter_setup(s);
+	assert(!ban_filter_enabled());
+	assert(arrives(l4));
+
+	close(l4->fd);
+	close(l6->fd);
+	close(t4->fd);
+	main_ban_db_deinit(s);
+	talloc_free(s);
+
+	return 0;
+}
+#else
+int main()
+{
+	exit(77);
+}
+#endif
@@ -29,6 +29,7 @@
 #include "../src/main-ban.h"
 #include "../src/ip-util.h"
 #include "../src/main-ban.c"
+#include "../src/main-ban-filter.c"
 
 /* Test the IP banning functionality */
 static
@@ -138,6 +139,124 @@ int main()
 		exit(1);
 	}
 
+	if (main_ban_db_elems(s) != 4) {
+		fprintf(stderr, "error in %d: have %d entries\n", __LINE__, main_ban_db_elems(s));
+		exit(1);
+	}
+
+	/* check the banning of networks */
+	GETCONFIG(s)->ban_aggregate_threshold = 3;
+
+	add_str_ip_to_ban_list(s, "10.0.0.1", 40);
+	add_str_ip_to_ban_list(s, "10.0.0.2", 40);
+
+	if (check_if_banned_str(s, "10.0.0.3") != 0) {
+		fprintf(stderr, "error in %d\n", __LINE__);
+		exit(1);
+	}
+
+	add_str_ip_to_ban_list(s, "10.0.0.3", 40);
+
+	if (check_if_banned_str(s, "10.0.0.200") == 0) {
+		fprintf(stderr, "error in %d\n", __LINE__);
+		exit(1);
+	}
+
+	if (check_if_banned_str(s, "10.0.1.1") != 0) {
+		fprintf(stderr, "error in %d\n", __LINE__);
+		exit(1);
+	}
+
+	/* three addresses and their network */
+	if (main_ban_db_elems(s) != 8) {
+		fprintf(stderr, "error in %d: have %d entries\n", __LINE__, main_ban_db_elems(s));
+		exit(1);
+	}
+
+	/* unbanning an address of the network unbans the network */
+	{
+		uint8_t ip[4] = {10, 0, 0, 200};
+
+		if (remove_ip_from_ban_list(s, ip, 4) == 0) {
+			fprintf(stderr, "error in %d\n", __LINE__);
+			exit(1);
+		}
+	}
+
+	if (check_if_banned_str(s, "10.0.0.200") != 0) {
+		fprintf(stderr, "error in %d\n", __LINE__);
+		exit(1);
+	}
+
+	if (check_if_banned_str(s, "10.0.0.1") == 0) {
+		fprintf(stderr, "error in %d\n", __LINE__);
+		exit(1);
+	}
+
+	/* check ban-allow and ban-deny */
+	{
+		static char *allow[] = { "192.168.3.0/24", "fdc0:c81f:22ab::/48" };
+		static char *deny[] = { "172.16.0.0/12", "2001:db8::/32", "invalid/99", "192.168.3.128/25" };
+
+		GETCONFIG(s)->ban_allow = allow;
+		GETCONFIG(s)->ban_allow_size = 2;
+		GETCONFIG(s)->ban_deny = deny;
+		GETCONFIG(s)->ban_deny_size = 4;
+		main_ban_db_load_rules(s);
+	}
+
+	if (check_if_banned_str(s, "192.168.3.1") != 0) {
+		fprintf(stderr, "error in %d\n", __LINE__);
+		exit(1);
+	}
+
+	if (check_if_banned_str(s, "fdc0:c81f:22ab:23a2:4479:f107:1855:bf50") != 0) {
+		fprintf(stderr, "error in %d\n", __LINE__);
+		exit(1);
+	}
+
+	if (add_str_ip_to_ban_list(s, "192.168.3.7", 40) != 0 ||
+	    check_if_banned_str(s, "192.168.3.7") != 0) {
+		fprintf(stderr, "error in %d\n", __LINE__);
+		exit(1);
+	}
+
+	/* the longest network applies */
+	if (check_if_banned_str(s, "192.168.3.200") == 0) {
+		fprintf(stderr, "error in %d\n", __LINE__);
+		exit(1);
+	}
+
+	if (check_if_banned_str(s, "172.20.1.1") == 0) {
+		fprintf(stderr, "error in %d\n", __LINE__);
+		exit(1);
+	}
+
+	if (check_if_banned_str(s, "2001:db8:1::1") == 0) {
+		fprintf(stderr, "error in %d\n", __LINE__);
+		exit(1);
+	}
+
+	if (check_if_banned_str(s, "172.32.1.1") != 0) {
+		fprintf(stderr, "error in %d\n", __LINE__);
+		exit(1);
+	}
+
+	/* the rules are replaced on reload */
+	GETCONFIG(s)->ban_allow_size = 0;
+	GETCONFIG(s)->ban_deny_size = 0;
+	main_ban_db_load_rules(s);
+
+	if (check_if_banned_str(s, "192.168.3.1") == 0) {
+		fprintf(stderr, "error in %d\n", __LINE__);
+		exit(1);
+	}
+
+	if (check_if_banned_str(s, "172.20.1.1") != 0) {
+		fprintf(stderr, "error in %d\n", __LINE__);
+		exit(1);
+	}
+
 	/* check expiration of entries */ 
 	sleep(GETCONFIG(s)->min_reauth_time+1);
 
@@ -0,0 +1,285 @@
+/*
+ * Copyright (C) 2026 Nikos Mavrogiannopoulos
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <gnutls/gnutls.h>
+
+/* Unit test for cstp_enable_ktls(). It checks whether CSTP packets
+ * are exchanged with a GnuTLS peer after the keys were handed to the
+ * kernel, also after a TLS 1.3 key update. When kernel TLS is not
+ * available, it checks whether the session is left intact.
+ */
+static unsigned verbose = 0;
+#define UNDER_TEST
+#define force_write write
+
+#include "../src/tlslib.c"
+
+int get_cert_names(worker_st * ws, const gnutls_datum_t * raw)
+{
+	return 0;
+}
+
+#define PACKETS 3
+
+static uint8_t psk[16] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16 };
+
+static int psk_cb(gnutls_session_t session, const char *username, gnutls_datum_t *key)
+{
+	key->data = gnutls_malloc(sizeof(psk));
+	assert(key->data != NULL);
+	memcpy(key->data, psk, sizeof(psk));
+	key->size = sizeof(psk);
+	return 0;
+}
+
+static void handshake(gnutls_session_t session)
+{
+	int ret;
+
+	do {
+		ret = gnutls_handshake(session);
+	} while (ret < 0 && gnutls_error_is_fatal(ret) == 0);
+
+	if (ret < 0) {
+		fprintf(stderr, "handshake: %s\n", gnutls_strerror(ret));
+		exit(1);
+	}
+}
+
+/* builds a CSTP data packet with the given number of payload bytes */
+static unsigned make_packet(uint8_t *buf, unsigned size, unsigned seed)
+{
+	unsigned i;
+
+	buf[0] = 'S';
+	buf[1] = 'T';
+	buf[2] = 'F';
+	buf[3] = 1;
+	buf[4] = size >> 8;
+	buf[5] = size & 0xff;
+	buf[6] = AC_PKT_DATA;
+	buf[7] = 0;
+	for (i = 0; i < size; i++)
+		buf[8 + i] = (i + seed) & 0xff;
+
+	return size + 8;
+}
+
+static int recv_full(gnutls_session_t session, uint8_t *buf, unsigned size)
+{
+	unsigned total = 0;
+	int ret;
+
+	while (total < size) {
+		do {
+			ret = gnutls_record_recv(session, buf + total, size - total);
+		} while (ret == GNUTLS_E_AGAIN || ret == GNUTLS_E_INTERRUPTED);
+
+		if (ret <= 0) {
+			fprintf(stderr, "client: %s\n", gnutls_strerror(ret));
+			exit(1);
+		}
+		total += ret;
+	}
+
+	return total;
+}
+
+/* echoes back the packets it receives, until the server closes */
+static void client(int fd, const char *prio)
+{
+	gnutls_session_t session;
+	gnutls_psk_client_credentials_t cred;
+	gnutls_datum_t key = { psk, sizeof(psk) };
+	uint8_t buf[16 * 1024];
+	unsigned i;
+	int ret;
+
+	assert(gnutls_psk_allocate_client_credentials(&cred) >= 0);
+	assert(gnutls_psk_set_client_credentials(cred, "test", &key, GNUTLS_PSK_KEY_RAW) >= 0);
+	assert(gnutls_init(&session, GNUTLS_CLIENT) >= 0);
+	assert(gnutls_priority_set_direct(session, prio, NULL) >= 0);
+	assert(gnutls_credentials_set(session, GNUTLS_CRD_PSK, cred) >= 0);
+	gnutls_transport_set_int(session, fd);
+
+	handshake(session);
+
+	for (i = 0; i < PACKETS; i++) {
+		/* with kernel TLS the header and the payload are sent
+		 * in separate records */
+		ret = recv_full(session, buf, 8);
+		ret += recv_full(session, buf + 8, (buf[4] << 8) | buf[5]);
+
+		if (ret != make_packet(buf + 8192, ret - 8, i) ||
+		    memcmp(buf, buf + 8192, ret) != 0) {
+			fprintf(stderr, "client: unexpected packet %u\n", i);
+			exit(1);
+		}
+
+#if GNUTLS_VERSION_NUMBER >= 0x030603
+		/* the server must keep receiving after a key update */
+		if (i == 1 && gnutls_protocol_get_version(session) == GNUTLS_TLS1_3)
+			assert(gnutls_session_key_update(session, 0) >= 0);
+#endif
+
+		assert(gnutls_record_send(session, buf, ret) == ret);
+	}
+
+	/* close_notify */
+	ret = gnutls_record_recv(session, buf, sizeof(buf));
+	if (ret != 0) {
+		fprintf(stderr, "client: no close_notify: %s\n", gnutls_strerror(ret));
+		exit(1);
+	}
+
+	gnutls_deinit(session);
+	gnutls_psk_free_client_credentials(cred);
+}
+
+static void server(int fd, const char *prio)
+{
+	gnutls_session_t session;
+	gnutls_psk_server_credentials_t cred;
+	gnutls_datum_t data;
+	void *packet = NULL;
+	uint8_t buf[8192];
+	worker_st *ws;
+	unsigned i, size;
+	int ret;
+
+	ws = talloc_zero(NULL, worker_st);
+	assert(ws != NULL);
+
+	assert(gnutls_psk_allocate_server_credentials(&cred) >= 0);
+	gnutls_psk_set_server_credentials_function(cred, psk_cb);
+	assert(gnutls_init(&session, GNUTLS_SERVER) >= 0);
+	assert(gnutls_priority_set_direct(session, prio, NULL) >= 0);
+	assert(gnutls_credentials_set(session, GNUTLS_CRD_PSK, cred) >= 0);
+	gnutls_transport_set_int(session, fd);
+
+	handshake(session);
+
+	ws->session = session;
+	ws->conn_fd = fd;
+	ws->buffer_size = sizeof(ws->buffer);
+
+	ret = cstp_enable_ktls(ws);
+	assert(ret >= 0);
+	assert(ret == 0 || ws->cstp_ktls == 0);
+	/* TLS 1.3 records are received by GnuTLS */
+	if (gnutls_protocol_get_version(session) != GNUTLS_TLS1_2)
+		assert(ws->cstp_ktls_rx == 0);
+
+	if (verbose)
+		fprintf(stderr, "%s: %s\n", gnutls_session_get_desc(session),
+			ws->cstp_ktls ? "kernel TLS" : "GnuTLS");
+
+	for (i = 0; i < PACKETS; i++) {
+		size = make_packet(buf, 1000 * i + 1, i);
+
+		cstp_cork(ws);
+		assert(cstp_send(ws, buf, 8) == 8);
+		assert(cstp_send(ws, buf + 8, size - 8) == size - 8);
+		assert(cstp_uncork(ws) >= 0);
+
+		do {
+			ret = cstp_recv_packet(ws, &data, &packet);
+		} while (ret == GNUTLS_E_AGAIN || ret == GNUTLS_E_INTERRUPTED);
+		if (ret != size || data.size != size ||
+		    memcmp(data.data, buf, size) != 0) {
+			fprintf(stderr, "server: unexpected packet %u (%d)\n", i, ret);
+			exit(1);
+		}
+		packet_deinit(packet);
+		packet = NULL;
+	}
+
+	cstp_close(ws);
+	talloc_free(ws);
+	gnutls_psk_free_server_credentials(cred);
+}
+
+static void run(const char *prio)
+{
+	struct sockaddr_in sa;
+	socklen_t sa_len = sizeof(sa);
+	int lfd, sfd, cfd;
+	pid_t child;
+	int status = 0;
+
+	lfd = socket(AF_INET, SOCK_STREAM, 0);
+	assert(lfd >= 0);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	assert(bind(lfd, (struct sockaddr *)&sa, sizeof(sa)) >= 0);
+	assert(listen(lfd, 1) >= 0);
+	assert(getsockname(lfd, (struct sockaddr *)&sa, &sa_len) >= 0);
+
+	child = fork();
+	assert(child >= 0);
+
+	if (child) {
+		sfd = accept(lfd, NULL, NULL);
+		assert(sfd >= 0);
+		close(lfd);
+		server(sfd, prio);
+		wait(&status);
+		if (WEXITSTATUS(status) != 0) {
+			fprintf(stderr, "child failed with %s!\n", prio);
+			exit(1);
+		}
+		close(sfd);
+	} else {
+		close(lfd);
+		cfd = socket(AF_INET, SOCK_STREAM, 0);
+		assert(cfd >= 0);
+		assert(connect(cfd, (struct sockaddr *)&sa, sizeof(sa)) >= 0);
+		client(cfd, prio);
+		exit(0);
+	}
+}
+
+#define PRIO "NORMAL:-KX-ALL:+PSK:+DHE-PSK:-CIPHER-ALL:-VERS-ALL:"
+
+int main(int argc, char **argv)
+{
+	if (argc > 1)
+		verbose = 1;
+
+	run(PRIO"+VERS-TLS1.2:+AES-128-GCM");
+	run(PRIO"+VERS-TLS1.2:+AES-256-GCM");
+	/* the PSK binder restricts TLS 1.3 to the SHA256 suites */
+	run(PRIO"+VERS-TLS1.3:+AES-128-GCM");
+	/* not supported; stays with GnuTLS */
+	run(PRIO"+VERS-TLS1.2:+AES-128-CBC:-MAC-ALL:+SHA1");
+
+	return 0;
+}
@@ -0,0 +1,387 @@
+/*
+ * Copyright (C) 2026 Nikos Mavrogiannopoulos
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <errno.h>
+
+#include <gnutls/gnutls.h>
+#include <gnutls/dtls.h>
+
+/* Unit test for dtls_send_inplace(). It checks whether the records
+ * sealed in place are accepted by a GnuTLS peer, in any order with
+ * records sent by gnutls_record_send(), whether the ones built in
+ * the transmit queue are sent on uncork, and whether a record that gets
+ * EMSGSIZE on uncork is dropped without losing the session, while the
+ * later ones of its size are refused. It also checks that the first
+ * record of a key is compared with the one of GnuTLS before records
+ * are sealed in place, and the replay window of the received records.
+ */
+static unsigned verbose = 0;
+#define UNDER_TEST
+#define force_write write
+
+#include "../src/tlslib.c"
+
+int get_cert_names(worker_st * ws, const gnutls_datum_t * raw)
+{
+	return 0;
+}
+
+static const char *msgs[] = {
+	"in-place", "gnutls", "in-queue", "copied-to-queue", "in-place-again"
+};
+#define MSGS (sizeof(msgs)/sizeof(msgs[0]))
+
+static uint8_t psk[16] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16 };
+
+static int psk_cb(gnutls_session_t session, const char *username, gnutls_datum_t *key)
+{
+	key->data = gnutls_malloc(sizeof(psk));
+	assert(key->data != NULL);
+	memcpy(key->data, psk, sizeof(psk));
+	key->size = sizeof(psk);
+	return 0;
+}
+
+static void handshake(gnutls_session_t session)
+{
+	int ret;
+
+	do {
+		ret = gnutls_handshake(session);
+	} while (ret < 0 && gnutls_error_is_fatal(ret) == 0);
+
+	if (ret < 0) {
+		fprintf(stderr, "handshake: %s\n", gnutls_strerror(ret));
+		exit(1);
+	}
+}
+
+static void client(int fd, const char *prio)
+{
+	gnutls_session_t session;
+	gnutls_psk_client_credentials_t cred;
+	gnutls_datum_t key = { psk, sizeof(psk) };
+	char buf[2048];
+	unsigned i;
+	int ret;
+
+	assert(gnutls_psk_allocate_client_credentials(&cred) >= 0);
+	assert(gnutls_psk_set_client_credentials(cred, "test", &key, GNUTLS_PSK_KEY_RAW) >= 0);
+	assert(gnutls_init(&session, GNUTLS_CLIENT|GNUTLS_DATAGRAM) >= 0);
+	assert(gnutls_priority_set_direct(session, prio, NULL) >= 0);
+	assert(gnutls_credentials_set(session, GNUTLS_CRD_PSK, cred) >= 0);
+	gnutls_transport_set_int(session, fd);
+	gnutls_dtls_set_timeouts(session, 1000, 30*1000);
+
+	handshake(session);
+
+	for (i = 0; i < MSGS; i++) {
+		do {
+			ret = gnutls_record_recv(session, buf, sizeof(buf));
+		} while (ret == GNUTLS_E_AGAIN || ret == GNUTLS_E_INTERRUPTED);
+
+		if (ret < 0) {
+			fprintf(stderr, "client: %s\n", gnutls_strerror(ret));
+			exit(1);
+		}
+
+		if (verbose)
+			fprintf(stderr, "received %.*s\n", ret, buf);
+
+		if (ret != strlen(msgs[i]) || memcmp(buf, msgs[i], ret) != 0) {
+			fprintf(stderr, "client: unexpected record %u\n", i);
+			exit(1);
+		}
+	}
+
+	gnutls_deinit(session);
+	gnutls_psk_free_client_credentials(cred);
+}
+
+/* puts msg at data, with the room dtls_send_inplace() needs around it */
+static void send_inplace(worker_st *ws, uint8_t *data, const char *msg)
+{
+	int ret;
+
+	memcpy(data, msg, strlen(msg));
+	ret = dtls_send_inplace(ws, data, strlen(msg));
+	if (ret != strlen(msg)) {
+		fprintf(stderr, "dtls_send_inplace: %d\n", ret);
+		exit(1);
+	}
+}
+
+static void server(int fd, const char *prio, unsigned aead)
+{
+	gnutls_session_t session;
+	gnutls_psk_server_credentials_t cred;
+	worker_st *ws;
+	uint8_t *slot;
+	int ret;
+
+	ws = talloc_zero(NULL, worker_st);
+	assert(ws != NULL);
+
+	assert(gnutls_psk_allocate_server_credentials(&cred) >= 0);
+	gnutls_psk_set_server_credentials_function(cred, psk_cb);
+	assert(gnutls_init(&session, GNUTLS_SERVER|GNUTLS_DATAGRAM) >= 0);
+	assert(gnutls_priority_set_direct(session, prio, NULL) >= 0);
+	assert(gnutls_credentials_set(session, GNUTLS_CRD_PSK, cred) >= 0);
+	gnutls_transport_set_int(session, fd);
+	gnutls_dtls_set_timeouts(session, 1000, 30*1000);
+
+	handshake(session);
+
+	if (verbose)
+		fprintf(stderr, "negotiated %s\n",
+			gnutls_cipher_get_name(gnutls_cipher_get(session)));
+
+	/* as in the worker, the records go through dtls_push() */
+	ws->dtls_session = session;
+	ws->dtls_tptr.fd = fd;
+	gnutls_transport_set_ptr2(session, (gnutls_transport_ptr_t)(long)fd,
+				  &ws->dtls_tptr);
+	gnutls_transport_set_push_function(session, dtls_push);
+
+	/* too large records are rejected and the data are left intact */
+	memset(ws->buffer + TUN_PKT_HEADROOM, 'x', 4096);
+	ret = dtls_send_inplace(ws, ws->buffer + TUN_PKT_HEADROOM,
+				gnutls_dtls_get_data_mtu(session) + 1);
+	assert(ret == GNUTLS_E_LARGE_PACKET);
+	assert(ws->buffer[TUN_PKT_HEADROOM] == 'x' &&
+	       ws->buffer[TUN_PKT_HEADROOM + 4095] == 'x');
+
+	send_inplace(ws, ws->buffer + TUN_PKT_HEADROOM, msgs[0]);
+#ifdef DTLS_SEAL_IN_PLACE
+	/* that one was sent by GnuTLS, and matched ours */
+	if (aead && dtls_seal_supported())
+		assert(ws->dtls_seal != NULL && ws->dtls_seal->verified != 0);
+#endif
+
+	ret = dtls_send(ws, msgs[1], strlen(msgs[1]));
+	assert(ret == strlen(msgs[1]));
+
+	dtls_cork(ws);
+	slot = dtls_queue_reserve(&ws->dtls_tptr, TUN_PKT_HEADROOM + 1024 + DTLS_SEAL_TAILROOM);
+	if (slot == NULL) /* no sendmmsg() */
+		slot = ws->buffer;
+	send_inplace(ws, slot + TUN_PKT_HEADROOM, msgs[2]);
+	send_inplace(ws, ws->buffer + TUN_PKT_HEADROOM, msgs[3]);
+	assert(dtls_uncork(ws) >= 0);
+
+	send_inplace(ws, ws->decomp + TUN_PKT_HEADROOM, msgs[4]);
+
+	talloc_free(ws);
+	gnutls_deinit(session);
+	gnutls_psk_free_server_credentials(cred);
+}
+
+static void run(const char *prio, unsigned aead)
+{
+	int sockets[2];
+	pid_t child;
+	int status = 0;
+
+	assert(socketpair(AF_UNIX, SOCK_DGRAM, 0, sockets) >= 0);
+
+	child = fork();
+	assert(child >= 0);
+
+	if (child) {
+		close(sockets[1]);
+		server(sockets[0], prio, aead);
+		wait(&status);
+		if (WEXITSTATUS(status) != 0) {
+			fprintf(stderr, "child failed with %s!\n", prio);
+			exit(1);
+		}
+		close(sockets[0]);
+	} else {
+		close(sockets[0]);
+		client(sockets[1], prio);
+		exit(0);
+	}
+}
+
+/* A record that does not fit the path MTU while corked is dropped; the
+ * records queued after it are still sent, and the uncork reports
+ * GNUTLS_E_LARGE_PACKET so that the worker lowers its MTU. */
+static void check_emsgsize(void)
+{
+#ifdef HAVE_SENDMMSG
+	int sockets[2];
+	int sndbuf = 4096;
+	static uint8_t data[32*1024];
+	worker_st *ws;
+	int ret;
+
+	assert(socketpair(AF_UNIX, SOCK_DGRAM, 0, sockets) >= 0);
+	/* datagrams larger than the send buffer fail with EMSGSIZE */
+	assert(setsockopt(sockets[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf)) >= 0);
+
+	ws = talloc_zero(NULL, worker_st);
+	assert(ws != NULL);
+	ws->dtls_tptr.fd = sockets[0];
+
+	memset(data, 'x', sizeof(data));
+	data[0] = 1;
+	data[sizeof(data) - 1] = 2;
+
+	dtls_cork(ws);
+	assert(dtls_queue_push(&ws->dtls_tptr, data, 100) == 100);
+	assert(dtls_queue_push(&ws->dtls_tptr, data, sizeof(data)) == sizeof(data));
+	assert(dtls_queue_push(&ws->dtls_tptr, data + sizeof(data) - 100, 100) == 100);
+	assert(dtls_uncork(ws) == GNUTLS_E_LARGE_PACKET);
+
+	/* the datagrams on either side of the dropped one went out */
+	ret = recv(sockets[1], data, sizeof(data), MSG_DONTWAIT);
+	assert(ret == 100 && data[0] == 1);
+	ret = recv(sockets[1], data, sizeof(data), MSG_DONTWAIT);
+	assert(ret == 100 && data[99] == 2);
+	ret = recv(sockets[1], data, sizeof(data), MSG_DONTWAIT);
+	assert(ret == -1 && errno == EAGAIN);
+
+	/* once a record got EMSGSIZE, records as large are refused for
+	 * the rest of the cork, so that they are sent over CSTP */
+	dtls_cork(ws);
+	assert(dtls_queue_push(&ws->dtls_tptr, data, 100) == 100);
+	assert(dtls_queue_push(&ws->dtls_tptr, data, sizeof(data)) == sizeof(data));
+	/* there is no room for it, so the queue is flushed first */
+	errno = 0;
+	ret = dtls_queue_push(&ws->dtls_tptr, data, 2*sizeof(data) - 100);
+	assert(ret == -1 && errno == EMSGSIZE);
+	errno = 0;
+	ret = dtls_queue_push(&ws->dtls_tptr, data, sizeof(data));
+	assert(ret == -1 && errno == EMSGSIZE);
+	assert(dtls_queue_push(&ws->dtls_tptr, data, 100) == 100);
+	/* the refused records were reported to their senders already */
+	assert(dtls_uncork(ws) == 0);
+	assert(recv(sockets[1], data, sizeof(data), MSG_DONTWAIT) == 100);
+	assert(recv(sockets[1], data, sizeof(data), MSG_DONTWAIT) == 100);
+
+	/* the next cork starts afresh */
+	dtls_cork(ws);
+	assert(dtls_queue_push(&ws->dtls_tptr, data, 100) == 100);
+	assert(dtls_uncork(ws) == 0);
+	assert(recv(sockets[1], data, sizeof(data), MSG_DONTWAIT) == 100);
+
+	talloc_free(ws);
+	close(sockets[0]);
+	close(sockets[1]);
+#endif
+}
+
+/* A record too large for the transmit queue is sent after the ones
+ * queued before it */
+static void check_order(void)
+{
+#ifdef HAVE_SENDMMSG
+	int sockets[2];
+	int sndbuf = 256*1024;
+	static uint8_t data[DTLS_TX_QUEUE_SIZE + 1024];
+	worker_st *ws;
+
+	assert(socketpair(AF_UNIX, SOCK_DGRAM, 0, sockets) >= 0);
+	assert(setsockopt(sockets[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf)) >= 0);
+
+	ws = talloc_zero(NULL, worker_st);
+	assert(ws != NULL);
+	ws->dtls_tptr.fd = sockets[0];
+
+	dtls_cork(ws);
+	assert(dtls_queue_push(&ws->dtls_tptr, data, 100) == 100);
+	assert(dtls_queue_push(&ws->dtls_tptr, data, sizeof(data)) == sizeof(data));
+	assert(dtls_uncork(ws) == 0);
+
+	assert(recv(sockets[1], data, sizeof(data), MSG_DONTWAIT) == 100);
+	assert(recv(sockets[1], data, sizeof(data), MSG_DONTWAIT) == sizeof(data));
+
+	talloc_free(ws);
+	close(sockets[0]);
+	close(sockets[1]);
+#endif
+}
+
+#ifdef DTLS_SEAL_IN_PLACE
+static void replay(struct dtls_seal_st *st, uint64_t n, int expected)
+{
+	uint8_t seq[8];
+
+	uint64_to_seq(n, seq);
+	assert(dtls_replay_check(st, seq) == expected);
+}
+#endif
+
+/* Once the sequence number is set by us, the records received are
+ * checked against our own replay window */
+static void check_replay(void)
+{
+#ifdef DTLS_SEAL_IN_PLACE
+	struct dtls_seal_st st;
+	uint64_t epoch1 = (uint64_t)1 << 48, epoch2 = (uint64_t)2 << 48;
+
+	memset(&st, 0, sizeof(st));
+
+	replay(&st, epoch1 + 100, 0);
+	replay(&st, epoch1 + 100, -1);
+	/* the older ones were checked by GnuTLS */
+	replay(&st, epoch1 + 99, -1);
+	replay(&st, epoch1 + 102, 0);
+	/* reordered, but not seen */
+	replay(&st, epoch1 + 101, 0);
+	replay(&st, epoch1 + 101, -1);
+	replay(&st, epoch1 + 102, -1);
+	/* out of the window */
+	replay(&st, epoch1 + 102 + 64, 0);
+	replay(&st, epoch1 + 102, -1);
+	replay(&st, epoch1 + 103, 0);
+	replay(&st, epoch1 + 103, -1);
+	/* a new epoch starts a new window */
+	replay(&st, epoch2 + 1, 0);
+	replay(&st, epoch2 + 1, -1);
+	replay(&st, epoch2 + 2, 0);
+#endif
+}
+
+#define PRIO "NORMAL:-VERS-ALL:+VERS-DTLS1.2:-KX-ALL:+PSK:-CIPHER-ALL:"
+
+int main(int argc, char **argv)
+{
+	if (argc > 1)
+		verbose = 1;
+
+	check_emsgsize();
+	check_order();
+	check_replay();
+
+	run(PRIO"+AES-128-GCM", 1);
+	run(PRIO"+AES-256-GCM", 1);
+	run(PRIO"+CHACHA20-POLY1305", 1);
+	/* not sealed in place; falls back to gnutls_record_send() */
+	run(PRIO"+AES-128-CBC:-MAC-ALL:+SHA1", 0);
+
+	return 0;
+}
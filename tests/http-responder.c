@@ -0,0 +1,154 @@
+/*
+ * Copyright (C) 2026 Nikos Mavrogiannopoulos
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "http-responder.h"
+
+#define MAX_REQUEST 4096
+#define MAX_BODY (64*1024)
+
+static void log_request(const char *dir, const char *path)
+{
+	char file[256];
+	FILE *fp;
+
+	snprintf(file, sizeof(file), "%s/requests", dir);
+	fp = fopen(file, "a");
+	if (fp == NULL)
+		return;
+	fprintf(fp, "%s\n", path);
+	fclose(fp);
+}
+
+static void answer(int fd, const char *dir, const char *cache_control)
+{
+	char req[MAX_REQUEST];
+	char hdr[512];
+	char file[MAX_REQUEST + 256];
+	char *body = NULL, *path, *p;
+	size_t size = 0, body_size = 0;
+	ssize_t ret;
+	FILE *fp = NULL;
+
+	/* the headers of the request; there is no body */
+	while (size < sizeof(req) - 1) {
+		ret = recv(fd, req + size, sizeof(req) - 1 - size, 0);
+		if (ret <= 0)
+			return;
+		size += ret;
+		req[size] = 0;
+		if (strstr(req, "\r\n\r\n") != NULL)
+			break;
+	}
+
+	if (strncmp(req, "GET /", 5) != 0)
+		return;
+	path = req + 5;
+	p = strchr(path, ' ');
+	if (p == NULL)
+		return;
+	*p = 0;
+
+	log_request(dir, path);
+
+	if (path[0] != 0 && strchr(path, '/') == NULL && strstr(path, "..") == NULL) {
+		snprintf(file, sizeof(file), "%s/%s", dir, path);
+		fp = fopen(file, "r");
+	}
+
+	if (fp != NULL) {
+		body = malloc(MAX_BODY);
+		assert(body != NULL);
+		body_size = fread(body, 1, MAX_BODY, fp);
+		fclose(fp);
+
+		snprintf(hdr, sizeof(hdr),
+			 "HTTP/1.1 200 OK\r\n"
+			 "Content-Type: application/json\r\n"
+			 "%s%s%s"
+			 "Content-Length: %u\r\n"
+			 "Connection: close\r\n\r\n",
+			 cache_control ? "Cache-Control: " : "",
+			 cache_control ? cache_control : "",
+			 cache_control ? "\r\n" : "",
+			 (unsigned)body_size);
+	} else {
+		snprintf(hdr, sizeof(hdr),
+			 "HTTP/1.1 404 Not Found\r\n"
+			 "Content-Length: 0\r\n"
+			 "Connection: close\r\n\r\n");
+	}
+
+	if (send(fd, hdr, strlen(hdr), 0) >= 0 && body_size > 0)
+		send(fd, body, body_size, 0);
+	free(body);
+}
+
+static void responder_loop(int fd, const char *dir, const char *cache_control)
+{
+	int conn;
+
+	for (;;) {
+		conn = accept(fd, NULL, NULL);
+		if (conn < 0)
+			continue;
+
+		answer(conn, dir, cache_control);
+		close(conn);
+	}
+}
+
+pid_t http_responder_start(const char *dir, const char *cache_control,
+			   unsigned *port)
+{
+	struct sockaddr_in sa;
+	socklen_t sa_size = sizeof(sa);
+	pid_t pid;
+	int fd;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	assert(fd >= 0);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	assert(bind(fd, (struct sockaddr *)&sa, sizeof(sa)) >= 0);
+	assert(listen(fd, 16) >= 0);
+	assert(getsockname(fd, (struct sockaddr *)&sa, &sa_size) >= 0);
+	*port = ntohs(sa.sin_port);
+
+	pid = fork();
+	assert(pid >= 0);
+
+	if (pid == 0) {
+		responder_loop(fd, dir, cache_control);
+		exit(0);
+	}
+
+	close(fd);
+	return pid;
+}
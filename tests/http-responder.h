@@ -0,0 +1,30 @@
+/*
+ * Copyright (C) 2026 Nikos Mavrogiannopoulos
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef HTTP_RESPONDER_H
+# define HTTP_RESPONDER_H
+
+#include <sys/types.h>
+
+/* A stand-in HTTP server for the tests. It serves the files of dir, which
+ * are read on each request so that they can be replaced while it runs,
+ * with the provided Cache-Control header (if not NULL). The path of each
+ * request is appended to dir/requests. Returns the pid of the responder
+ * process and the port it listens to on localhost. */
+pid_t http_responder_start(const char *dir, const char *cache_control,
+			   unsigned *port);
+
+#endif
@@ -0,0 +1,255 @@
+/*
+ * Copyright (C) 2026 Nikos Mavrogiannopoulos
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <talloc.h>
+#include <arpa/inet.h>
+
+#include "../src/ip-util.c"
+#include "../src/ip-lease.c"
+
+/* Unit test for the address pools. It checks that every address of a
+ * network is leased before the leases fail, that released addresses are
+ * leased again, and that a seed gets its address when it is free. With
+ * ping-leases, it checks that past the seeded candidates only the
+ * addresses found free are leased, and that those which responded are
+ * not leased.
+ */
+
+void icmp_prober_forget_pool(struct ip_pool_st *pool)
+{
+}
+
+void reset_tun(struct proc_st* proc)
+{
+}
+
+#define IPV4_LEASES 253 /* a /24 without the network, broadcast and ours */
+#define IPV6_SUBNETS 255 /* the /120 subnets of a /112, without ours */
+
+static struct proc_st *test_proc(main_server_st *s, vhost_cfg_st *vhost, unsigned seed)
+{
+	struct proc_st *proc;
+
+	proc = talloc_zero(s, struct proc_st);
+	assert(proc != NULL);
+	proc->config = talloc_zero(proc, GroupCfgSt);
+	assert(proc->config != NULL);
+	proc->vhost = vhost;
+	memcpy(proc->ipv4_seed, &seed, sizeof(proc->ipv4_seed));
+
+	return proc;
+}
+
+int main()
+{
+	main_server_st *s;
+	vhost_cfg_st *vhost;
+	struct proc_st *procs[IPV4_LEASES + 1], *proc;
+	struct ip_pool_st *pool, *pool4 = NULL, *pool6 = NULL;
+	struct sockaddr_storage addr;
+	uint64_t used, capacity;
+	struct in_addr seed;
+	uint32_t slot;
+	unsigned i, j;
+	int ret;
+
+	s = talloc_zero(NULL, main_server_st);
+	assert(s != NULL);
+
+	s->vconfig = talloc_zero(s, struct list_head);
+	assert(s->vconfig != NULL);
+	list_head_init(s->vconfig);
+
+	vhost = talloc_zero(s, struct vhost_cfg_st);
+	assert(vhost != NULL);
+	vhost->perm_config.config = talloc_zero(vhost, struct cfg_st);
+	assert(vhost->perm_config.config != NULL);
+	list_add(s->vconfig, &vhost->list);
+
+	vhost->perm_config.config->network.ipv4 = "192.168.5.0";
+	vhost->perm_config.config->network.ipv4_netmask = "255.255.255.0";
+	vhost->perm_config.config->network.ipv6 = "fd00::";
+	vhost->perm_config.config->network.ipv6_prefix = 112;
+	vhost->perm_config.config->network.ipv6_subnet_prefix = 120;
+
+	ip_lease_init(&s->ip_leases);
+
+	/* the whole pool, with colliding seeds */
+	for (i = 0; i < IPV4_LEASES; i++) {
+		procs[i] = test_proc(s, vhost, i % 7);
+		assert(get_ip_leases(s, procs[i]) == 0);
+		assert(procs[i]->ipv4 != NULL && procs[i]->ipv6 != NULL);
+
+		for (j = 0; j < i; j++) {
+			assert(ip_cmp(&procs[i]->ipv4->rip, &procs[j]->ipv4->rip) != 0);
+			assert(ip_cmp(&procs[i]->ipv6->sig, &procs[j]->ipv6->sig) != 0);
+		}
+
+		/* not the network, broadcast, or ours */
+		assert(SA_IN_U8_P(&procs[i]->ipv4->rip)[2] == 5);
+		assert(SA_IN_U8_P(&procs[i]->ipv4->rip)[3] > 1);
+		assert(SA_IN_U8_P(&procs[i]->ipv4->rip)[3] < 255);
+		assert(SA_IN6_U8_P(&procs[i]->ipv6->sig)[14] != 0);
+		assert(SA_IN6_U8_P(&procs[i]->ipv6->sig)[15] == 0);
+	}
+
+	ip_lease_pool_stats(&s->ip_leases, AF_INET, &used, &capacity);
+	assert(used == IPV4_LEASES && capacity == IPV4_LEASES);
+	ip_lease_pool_stats(&s->ip_leases, AF_INET6, &used, &capacity);
+	assert(used == IPV4_LEASES && capacity == IPV6_SUBNETS);
+
+	/* no address is left */
+	procs[i] = test_proc(s, vhost, 0);
+	assert(get_ip_leases(s, procs[i]) == ERR_NO_IP);
+	talloc_free(procs[i]);
+
+	/* a released address is leased again */
+	remove_ip_leases(s, procs[100]);
+	assert(get_ip_leases(s, procs[100]) == 0);
+	assert(procs[100]->ipv4 != NULL && procs[100]->ipv6 != NULL);
+
+	ip_lease_pool_stats(&s->ip_leases, AF_INET, &used, &capacity);
+	assert(used == IPV4_LEASES);
+
+	/* a seed gets the address it is made of when it is free */
+	for (i = 0; i < 10; i++)
+		remove_ip_leases(s, procs[i]);
+
+	inet_pton(AF_INET, "0.0.0.77", &seed);
+	proc = test_proc(s, vhost, 0);
+	memcpy(proc->ipv4_seed, &seed, sizeof(proc->ipv4_seed));
+	for (i = 0; i < IPV4_LEASES; i++) {
+		if (procs[i]->ipv4 && SA_IN_U8_P(&procs[i]->ipv4->rip)[3] == 77) {
+			remove_ip_leases(s, procs[i]);
+			break;
+		}
+	}
+	assert(get_ip_leases(s, proc) == 0);
+	assert(SA_IN_U8_P(&proc->ipv4->rip)[3] == 77);
+
+	/* the pools go away with their last lease */
+	talloc_free(proc);
+	for (i = 0; i < IPV4_LEASES; i++)
+		talloc_free(procs[i]);
+
+	ip_lease_pool_stats(&s->ip_leases, AF_INET, &used, &capacity);
+	assert(used == 0 && capacity == 0);
+	assert(list_empty(&s->ip_leases.pools));
+
+	/* with ping-leases the pools of the configured networks are created
+	 * in advance; only addresses are pinged, not IPv6 subnets */
+	vhost->perm_config.config->ping_leases = 1;
+	ip_lease_pools_reload(s);
+
+	list_for_each(&s->ip_leases.pools, pool, list) {
+		if (pool->family == AF_INET)
+			pool4 = pool;
+		else
+			pool6 = pool;
+	}
+	assert(pool4 != NULL && pool4->probed && pool4->configured);
+	assert(pool6 != NULL && !pool6->probed && pool6->configured);
+	assert(pool4->used == 0 && pool4->warm_size == 0);
+
+	/* the candidates are free and not reserved */
+	for (i = 0; i < 2 * IP_POOL_WARM_SLOTS; i++) {
+		assert(ip_pool_probe_candidate(s, pool4, &addr, &slot) == 0);
+		assert(slot > 1 && slot < 255 && !slot_in_use(pool4, slot));
+		assert(SA_IN_U8_P(&addr)[2] == 5 && SA_IN_U8_P(&addr)[3] == slot);
+	}
+
+	/* nothing was found free yet; a seeded candidate is leased
+	 * without waiting for a ping */
+	inet_pton(AF_INET, "0.0.0.77", &seed);
+	procs[0] = test_proc(s, vhost, 0);
+	memcpy(procs[0]->ipv4_seed, &seed, sizeof(procs[0]->ipv4_seed));
+	assert(get_ip_leases(s, procs[0]) == 0);
+	assert(SA_IN_U8_P(&procs[0]->ipv4->rip)[3] == 77);
+
+	/* past the seeded candidates only the addresses found free are
+	 * leased; there are none */
+	for (i = 1;; i++) {
+		assert(i <= FIXED_IPS);
+		procs[i] = test_proc(s, vhost, 0);
+		memcpy(procs[i]->ipv4_seed, &seed, sizeof(procs[i]->ipv4_seed));
+		ret = get_ip_leases(s, procs[i]);
+		if (ret != 0)
+			break;
+	}
+	assert(ret == ERR_NO_IP);
+	j = i;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.ss_family = AF_INET;
+	inet_pton(AF_INET, "192.168.5.200", SA_IN_P(&addr));
+	ip_pool_warm_add(pool4, &addr, 200, time(0));
+	assert(pool4->warm_size == 1);
+
+	assert(get_ip_leases(s, procs[j]) == 0);
+	assert(SA_IN_U8_P(&procs[j]->ipv4->rip)[3] == 200);
+	assert(pool4->warm_size == 0);
+
+	/* the released address was kept; it is dropped when it is
+	 * leased, or when it was found free too long ago */
+	remove_ip_leases(s, procs[j]);
+	assert(pool4->warm_size == 1 && pool4->warm[0].slot == 200);
+	ip_pool_warm_expire(s, pool4, time(0) + IP_POOL_WARM_TIME);
+	assert(pool4->warm_size == 0);
+
+	inet_pton(AF_INET, "192.168.5.77", SA_IN_P(&addr));
+	ip_pool_warm_add(pool4, &addr, 77, time(0));
+	ip_pool_warm_expire(s, pool4, time(0));
+	assert(pool4->warm_size == 0);
+
+	/* a seeded candidate that responded to ping is not leased */
+	remove_ip_leases(s, procs[0]);
+	assert(pool4->warm_size == 1);
+	ip_pool_busy_add(pool4, &addr, 77, time(0));
+	assert(pool4->warm_size == 0 && pool4->busy_size == 1);
+
+	inet_pton(AF_INET, "192.168.5.200", SA_IN_P(&addr));
+	ip_pool_warm_add(pool4, &addr, 200, time(0));
+	assert(get_ip_leases(s, procs[0]) == 0);
+	assert(SA_IN_U8_P(&procs[0]->ipv4->rip)[3] == 200);
+
+	/* the warm set is kept larger when many leases are taken from it */
+	pool4->warm_taken = pool4->warm_missed = pool4->warm_rate = 0;
+	assert(ip_pool_warm_target(pool4, 1, 2) == IP_POOL_WARM_MIN);
+	pool4->warm_taken = 100;
+	assert(ip_pool_warm_target(pool4, 1, 2) > IP_POOL_WARM_MIN);
+	pool4->warm_taken = 1000;
+	assert(ip_pool_warm_target(pool4, 1, 2) == IP_POOL_WARM_SLOTS);
+	for (i = 0; i < 16; i++)
+		ip_pool_warm_target(pool4, 1, 2);
+	assert(ip_pool_warm_target(pool4, 1, 2) == IP_POOL_WARM_MIN);
+
+	/* the configured pools are kept when empty */
+	for (i = 0; i <= j; i++)
+		talloc_free(procs[i]);
+	ip_lease_pool_stats(&s->ip_leases, AF_INET, &used, &capacity);
+	assert(used == 0 && capacity == IPV4_LEASES);
+
+	ip_lease_deinit(&s->ip_leases);
+	talloc_free(s);
+
+	return 0;
+}
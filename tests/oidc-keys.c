@@ -0,0 +1,291 @@
+/*
+ * Copyright (C) 2026 Nikos Mavrogiannopoulos
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <talloc.h>
+
+#include "../src/auth/openidconnect.c"
+#include "http-responder.h"
+
+/* Unit test for the key cache of the OpenID Connect module, against the
+ * stand-in HTTP server. It checks the lifetime taken from Cache-Control,
+ * that an unknown kid results to a single refresh which authentication
+ * does not wait for, and that the keys are kept when a refresh fails.
+ */
+
+#if defined(HAVE_PTHREAD_H) && defined(SUPPORT_OIDC_AUTH)
+
+#ifndef HAVE_STRLCPY
+size_t oc_strlcpy(char *dst, char const *src, size_t siz)
+{
+	size_t len = strlen(src);
+
+	if (siz != 0) {
+		if (len >= siz) {
+			memcpy(dst, src, siz - 1);
+			dst[siz - 1] = 0;
+		} else {
+			memcpy(dst, src, len + 1);
+		}
+	}
+	return len;
+}
+#endif
+
+#define TEST_DIR "./oidc-keys.tmp"
+#define MIN_REFRESH 2
+
+static void write_file(const char *name, const char *data)
+{
+	char file[256], tmp[sizeof(file) + 4];
+	FILE *fp;
+
+	snprintf(file, sizeof(file), "%s/%s", TEST_DIR, name);
+	snprintf(tmp, sizeof(tmp), "%s.new", file);
+
+	fp = fopen(tmp, "w");
+	assert(fp != NULL);
+	fputs(data, fp);
+	fclose(fp);
+
+	assert(rename(tmp, file) == 0);
+}
+
+static cjose_jwk_t *create_key(const char *kid)
+{
+	cjose_err err;
+	cjose_jwk_t *key;
+
+	key = cjose_jwk_create_EC_random(CJOSE_JWK_EC_P_256, &err);
+	assert(key != NULL);
+	assert(cjose_jwk_set_kid(key, kid, strlen(kid), &err));
+	return key;
+}
+
+static void write_jwks(cjose_jwk_t *key)
+{
+	char data[4096];
+	const char *key_str;
+	cjose_err err;
+
+	key_str = cjose_jwk_to_json(key, false, &err);
+	assert(key_str != NULL);
+	snprintf(data, sizeof(data), "{\"keys\":[%s]}", key_str);
+	write_file("jwks", data);
+}
+
+/* a token signed with key, which names kid as its key */
+static cjose_jws_t *create_token(cjose_jwk_t *key, const char *kid)
+{
+	static const char claims[] = "{\"sub\":\"test\"}";
+	cjose_jws_t *jws, *token;
+	const char *token_str;
+	json_t *header;
+	cjose_err err;
+
+	header = json_object();
+	json_object_set_new(header, "typ", json_string("JWT"));
+	json_object_set_new(header, "alg", json_string("ES256"));
+	json_object_set_new(header, "kid", json_string(kid));
+
+	jws = cjose_jws_sign(key, header, (const uint8_t *)claims,
+			     sizeof(claims) - 1, &err);
+	assert(jws != NULL);
+	assert(cjose_jws_export(jws, &token_str, &err));
+
+	token = cjose_jws_import(token_str, strlen(token_str), &err);
+	assert(token != NULL);
+
+	cjose_jws_release(jws);
+	json_decref(header);
+	return token;
+}
+
+/* the number of fetches of the JWKS */
+static unsigned jwks_requests(void)
+{
+	char line[256];
+	unsigned count = 0;
+	FILE *fp;
+
+	fp = fopen(TEST_DIR "/requests", "r");
+	if (fp == NULL)
+		return 0;
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (strcmp(line, "jwks\n") == 0)
+			count++;
+	}
+	fclose(fp);
+	return count;
+}
+
+static unsigned has_key(oidc_vctx_st *vctx, const char *kid)
+{
+	oidc_keys_st *keys;
+	unsigned found;
+
+	keys = oidc_keys_get(vctx);
+	assert(keys != NULL);
+	found = htable_get(&keys->keys, hash_any(kid, strlen(kid), 0),
+			   oidc_key_cmp, (void *)kid) != NULL;
+	oidc_keys_put(vctx, keys);
+
+	return found;
+}
+
+/* waits for a refresh to complete */
+static void wait_refresh(oidc_vctx_st *vctx)
+{
+	unsigned i, done;
+
+	for (i = 0; i < 500; i++) {
+		oidc_lock(vctx);
+		done = (vctx->refresh_requested == 0);
+		oidc_unlock(vctx);
+		if (done)
+			return;
+		usleep(10000);
+	}
+	assert(0);
+}
+
+static unsigned header_max_age(const char *line)
+{
+	oidc_json_parser_context context;
+
+	memset(&context, 0, sizeof(context));
+	context.max_age = -1;
+	assert(oidc_json_parser_header_callback((char *)line, 1, strlen(line),
+						&context) == strlen(line));
+	return context.max_age;
+}
+
+int main()
+{
+	char data[1024];
+	cjose_jwk_t *key_a, *key_b;
+	cjose_jws_t *token_a, *token_b, *token_wrong;
+	oidc_vctx_st *vctx;
+	void *pool, *_vctx = NULL;
+	unsigned port, i;
+	time_t start;
+	pid_t pid;
+
+	/* the lifetime of the keys */
+	assert(header_max_age("Cache-Control: public, max-age=300\r\n") == 300);
+	assert(header_max_age("cache-control: MAX-AGE=20, must-revalidate\r\n") == 20);
+	assert(header_max_age("Cache-Control: no-cache\r\n") == 0);
+	assert(header_max_age("Cache-Control: no-store, max-age=300\r\n") == 0);
+	assert(header_max_age("Content-Type: application/json\r\n") == (unsigned)-1);
+
+	pool = talloc_new(NULL);
+	assert(pool != NULL);
+
+	assert(mkdir(TEST_DIR, 0700) == 0 || errno == EEXIST);
+	unlink(TEST_DIR "/requests");
+
+	pid = http_responder_start(TEST_DIR, "public, max-age=7200", &port);
+
+	key_a = create_key("key-a");
+	key_b = create_key("key-b");
+	write_jwks(key_a);
+
+	snprintf(data, sizeof(data), "{\"jwks_uri\":\"http://127.0.0.1:%u/jwks\"}", port);
+	write_file("openid-configuration", data);
+
+	snprintf(data, sizeof(data),
+		 "{\"openid_configuration_url\":\"http://127.0.0.1:%u/openid-configuration\","
+		 "\"user_name_claim\":\"sub\",\"required_claims\":{\"aud\":\"test\"},"
+		 "\"minimum_jwk_refresh_time\":%u}", port, MIN_REFRESH);
+	write_file("oidc.json", data);
+
+	/* the keys are loaded when the module is initialized */
+	oidc_auth_funcs.vhost_init(&_vctx, pool, TEST_DIR "/oidc.json");
+	vctx = _vctx;
+	assert(vctx->keys != NULL && vctx->keys->size == 1);
+	assert(vctx->next_refresh - vctx->last_jwks_load_time == 7200);
+	assert(jwks_requests() == 1);
+
+	token_a = create_token(key_a, "key-a");
+	token_b = create_token(key_b, "key-b");
+	token_wrong = create_token(key_b, "key-a");
+
+	assert(oidc_verify_singature(vctx, token_a));
+	assert(!oidc_verify_singature(vctx, token_wrong));
+	assert(jwks_requests() == 1);
+
+	/* the keys are rotated; the first tokens with the new kid fail,
+	 * and ask for a single refresh */
+	write_jwks(key_b);
+	sleep(MIN_REFRESH + 1);
+
+	for (i = 0; i < 16; i++)
+		assert(!oidc_verify_singature(vctx, token_b));
+	wait_refresh(vctx);
+
+	assert(has_key(vctx, "key-b"));
+	assert(!has_key(vctx, "key-a"));
+	assert(oidc_verify_singature(vctx, token_b));
+	assert(!oidc_verify_singature(vctx, token_a));
+	assert(jwks_requests() == 2);
+
+	/* the server is gone; authentication does not wait for the refresh,
+	 * which fails, and the current keys are kept */
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+	sleep(MIN_REFRESH + 1);
+
+	start = time(0);
+	assert(!oidc_verify_singature(vctx, token_a));
+	assert(time(0) - start <= 1);
+	wait_refresh(vctx);
+
+	assert(vctx->next_refresh - vctx->last_jwks_load_time == KEYS_RETRY_INTERVAL);
+	assert(oidc_verify_singature(vctx, token_b));
+
+	oidc_auth_funcs.vhost_deinit(vctx);
+	assert(vctx->keys == NULL);
+
+	cjose_jws_release(token_a);
+	cjose_jws_release(token_b);
+	cjose_jws_release(token_wrong);
+	cjose_jwk_release(key_a);
+	cjose_jwk_release(key_b);
+
+	unlink(TEST_DIR "/requests");
+	unlink(TEST_DIR "/jwks");
+	unlink(TEST_DIR "/openid-configuration");
+	unlink(TEST_DIR "/oidc.json");
+	rmdir(TEST_DIR);
+	talloc_free(pool);
+
+	return 0;
+}
+#else
+int main()
+{
+	exit(77);
+}
+#endif
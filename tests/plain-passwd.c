@@ -0,0 +1,158 @@
+/*
+ * Copyright (C) 2026 Nikos Mavrogiannopoulos
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <talloc.h>
+
+#include "../src/auth/plain.c"
+
+/* Unit test for the password snapshot of the plain auth module. It checks
+ * the lookups, whether a file replaced as ocpasswd does is reloaded, and
+ * that the remembered password checks do not outlive a password change.
+ */
+
+const char *pass_msg_failed = "failed";
+const char *pass_msg_otp = "otp";
+
+#ifndef HAVE_STRLCPY
+size_t oc_strlcpy(char *dst, char const *src, size_t siz)
+{
+	size_t len = strlen(src);
+
+	if (siz != 0) {
+		if (len >= siz) {
+			memcpy(dst, src, siz - 1);
+			dst[siz - 1] = 0;
+		} else {
+			memcpy(dst, src, len + 1);
+		}
+	}
+	return len;
+}
+#endif
+
+#define PASSWD_FILE "./plain-passwd.tmp"
+
+/* the password of each user equals the username, unless pass is set */
+static void write_passwd(const char *users[], unsigned users_size, const char *pass)
+{
+	FILE *fp;
+	unsigned i;
+	char *hash;
+
+	fp = fopen(PASSWD_FILE ".new", "w");
+	assert(fp != NULL);
+
+	for (i = 0; i < users_size; i++) {
+		hash = crypt(pass ? pass : users[i], "$5$ocservsalt$");
+		assert(hash != NULL);
+		fprintf(fp, "%s:group1,%s-group:%s\n", users[i], users[i], hash);
+	}
+	fclose(fp);
+
+	assert(rename(PASSWD_FILE ".new", PASSWD_FILE) == 0);
+}
+
+static int login(void *vctx, const char *user, const char *pass, char *group)
+{
+	common_auth_init_st info;
+	void *ctx = NULL;
+	int ret;
+
+	memset(&info, 0, sizeof(info));
+	info.username = user;
+
+	ret = plain_auth_funcs.auth_init(&ctx, NULL, vctx, &info);
+	if (ret != ERR_AUTH_CONTINUE)
+		return ret;
+
+	ret = plain_auth_funcs.auth_pass(ctx, pass, strlen(pass));
+	if (ret == 0 && group != NULL)
+		assert(plain_auth_funcs.auth_group(ctx, NULL, group, MAX_GROUPNAME_SIZE) == 0);
+
+	plain_auth_funcs.auth_deinit(ctx);
+	return ret;
+}
+
+int main()
+{
+	const char *users[] = { "alice", "bob", "carol" };
+	char group[MAX_GROUPNAME_SIZE];
+	struct plain_cfg_st config;
+	struct plain_vhost_ctx_st *vctx;
+	struct plain_db_st *db;
+	void *pool, *_vctx = NULL;
+
+	pool = talloc_new(NULL);
+	assert(pool != NULL);
+
+	write_passwd(users, 2, NULL);
+
+	memset(&config, 0, sizeof(config));
+	config.passwd = PASSWD_FILE;
+
+	/* the file is loaded when the module is initialized */
+	plain_auth_funcs.vhost_init(&_vctx, pool, &config);
+	vctx = _vctx;
+	assert(vctx->db != NULL && vctx->db->size == 2);
+	db = vctx->db;
+
+	assert(login(vctx, "alice", "alice", group) == 0);
+	assert(strcmp(group, "group1") == 0);
+	assert(login(vctx, "bob", "bob", NULL) == 0);
+	assert(login(vctx, "bob", "alice", NULL) == ERR_AUTH_CONTINUE);
+	assert(login(vctx, "carol", "carol", NULL) == ERR_AUTH_CONTINUE);
+
+	/* no change; the same snapshot is used */
+	assert(vctx->db == db);
+
+	/* the successful checks are remembered, and used */
+	assert(vctx->hits_size == 2);
+	assert(login(vctx, "alice", "alice", NULL) == 0);
+	assert(login(vctx, "alice", "bob", NULL) == ERR_AUTH_CONTINUE);
+	assert(vctx->hits_size == 2);
+
+	/* a new user is seen without reloading the server */
+	write_passwd(users, 3, NULL);
+	assert(login(vctx, "carol", "carol", group) == 0);
+	assert(strcmp(group, "group1") == 0);
+	assert(vctx->db != db && vctx->db->size == 3);
+
+	/* a removed file fails the logins */
+	assert(unlink(PASSWD_FILE) == 0);
+	assert(login(vctx, "alice", "alice", NULL) == ERR_AUTH_FAIL);
+	assert(vctx->db == NULL);
+
+	write_passwd(users, 1, NULL);
+	assert(login(vctx, "alice", "alice", NULL) == 0);
+	assert(login(vctx, "bob", "bob", NULL) == ERR_AUTH_CONTINUE);
+
+	/* a changed password; the old one is no longer accepted */
+	write_passwd(users, 1, "secret");
+	assert(login(vctx, "alice", "alice", NULL) == ERR_AUTH_CONTINUE);
+	assert(login(vctx, "alice", "secret", NULL) == 0);
+
+	plain_auth_funcs.vhost_deinit(vctx);
+	unlink(PASSWD_FILE);
+	talloc_free(pool);
+
+	return 0;
+}
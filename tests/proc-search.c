@@ -0,0 +1,219 @@
+/*
+ * Copyright (C) 2026 Nikos Mavrogiannopoulos
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include <talloc.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "../src/main.h"
+#include "../src/proc-search.c"
+
+/* Unit test and benchmark for the proc_st lookups and for the walk of
+ * the proc list in kill_children_auth_timeout(). It checks whether each
+ * proc is found by its SID, DTLS session ID and address. When run with
+ * an argument, it prints the time of each pass over many procs, with
+ * the cache flushed before each pass.
+ */
+
+#define PROCS 20000
+#define BENCH_PASSES 5
+#define FLUSH_SIZE (32*1024*1024)
+
+static void make_proc(main_server_st *s, struct proc_st *proc, unsigned i,
+		      time_t now)
+{
+	struct sockaddr_in *sa = (struct sockaddr_in *)&proc->remote_addr;
+
+	proc->fd = i + 3;
+	proc->pid = i + 100;
+	proc->tun_lease.fd = -1;
+	/* a quarter is past the auth timeout without having completed
+	 * the authentication */
+	proc->status = (i % 2) ? PS_AUTH_COMPLETED : PS_AUTH_INIT;
+	proc->conn_time = (i % 4 == 0) ? now - 3600 : now;
+
+	memset(proc->sid, 0, sizeof(proc->sid));
+	memcpy(proc->sid, &i, sizeof(i));
+	proc->active_sid = 1;
+
+	memset(proc->dtls_session_id, 0xaa, sizeof(proc->dtls_session_id));
+	memcpy(proc->dtls_session_id, &i, sizeof(i));
+	proc->dtls_session_id_size = sizeof(proc->dtls_session_id);
+
+	sa->sin_family = AF_INET;
+	sa->sin_addr.s_addr = htonl(0x0a000000 + i);
+	sa->sin_port = htons(443);
+	proc->remote_addr_len = sizeof(*sa);
+
+	assert(proc_table_add(s, proc) == 0);
+	list_add_tail(&s->proc_list.head, &proc->list);
+	s->proc_list.total++;
+}
+
+/* allocates the procs as new_proc() does, interleaved with the
+ * allocations a running server makes between two connections */
+static struct proc_st **add_procs(main_server_st *s, unsigned count, time_t now)
+{
+	struct proc_st **procs;
+	unsigned i;
+
+	procs = talloc_array(s, struct proc_st *, count);
+	assert(procs != NULL);
+
+	for (i = 0; i < count; i++) {
+		procs[i] = talloc_zero(s, struct proc_st);
+		assert(procs[i] != NULL);
+		procs[i]->info = talloc_zero(procs[i], struct proc_info_st);
+		assert(procs[i]->info != NULL);
+		assert(talloc_size(procs[i], 64 + (i % 8) * 32) != NULL);
+
+		make_proc(s, procs[i], i, now);
+	}
+
+	return procs;
+}
+
+/* the walk of kill_children_auth_timeout() */
+static unsigned count_auth_timeout(main_server_st *s, time_t oldest)
+{
+	struct proc_st *ctmp;
+	unsigned count = 0;
+
+	list_for_each(&s->proc_list.head, ctmp, list) {
+		if ((ctmp->status < PS_AUTH_COMPLETED) &&
+		    (ctmp->conn_time < oldest) &&
+		    (ctmp->pid != -1))
+			count++;
+	}
+
+	return count;
+}
+
+/* looks up each proc by its SID and reads the fields a command to the
+ * worker needs */
+static unsigned lookup_all(main_server_st *s, unsigned count)
+{
+	struct proc_st *proc;
+	uint8_t sid[SID_SIZE];
+	unsigned i, sum = 0;
+
+	memset(sid, 0, sizeof(sid));
+	for (i = 0; i < count; i++) {
+		memcpy(sid, &i, sizeof(i));
+		proc = proc_search_sid(s, sid);
+		assert(proc != NULL);
+		sum += proc->fd + proc->pid + proc->active_sid;
+	}
+
+	return sum;
+}
+
+static void check_lookups(main_server_st *s, struct proc_st **procs,
+			  unsigned count)
+{
+	struct sockaddr_storage addr;
+	uint8_t id[GNUTLS_MAX_SESSION_ID];
+	unsigned i;
+
+	for (i = 0; i < count; i++) {
+		assert(proc_search_sid(s, procs[i]->sid) == procs[i]);
+
+		memcpy(id, procs[i]->dtls_session_id, sizeof(id));
+		assert(proc_search_dtls_id(s, id, sizeof(id)) == procs[i]);
+
+		memcpy(&addr, &procs[i]->remote_addr, procs[i]->remote_addr_len);
+		assert(proc_search_single_ip(s, &addr, procs[i]->remote_addr_len) == procs[i]);
+	}
+
+	/* unknown ones */
+	memset(id, 0xbb, sizeof(id));
+	assert(proc_search_sid(s, id) == NULL);
+	assert(proc_search_dtls_id(s, id, sizeof(id)) == NULL);
+}
+
+static double ms_since(const struct timespec *start)
+{
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start->tv_sec) * 1000.0 +
+	       (end.tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+static void bench(main_server_st *s, time_t oldest)
+{
+	struct timespec start;
+	volatile unsigned sink;
+	uint8_t *flush;
+	unsigned i;
+
+	flush = malloc(FLUSH_SIZE);
+	assert(flush != NULL);
+
+	printf("proc_st: %u bytes\n", (unsigned)sizeof(struct proc_st));
+
+	for (i = 0; i < BENCH_PASSES; i++) {
+		memset(flush, i, FLUSH_SIZE);
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		sink = count_auth_timeout(s, oldest);
+		printf("auth timeout walk of %u procs: %.3f ms\n", PROCS,
+		       ms_since(&start));
+
+		memset(flush, i, FLUSH_SIZE);
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		sink = lookup_all(s, PROCS);
+		printf("%u SID lookups: %.3f ms\n", PROCS,
+		       ms_since(&start));
+	}
+	(void)sink;
+
+	free(flush);
+}
+
+int main(int argc, char **argv)
+{
+	main_server_st *s;
+	struct proc_st **procs;
+	time_t now = time(NULL);
+	unsigned count = PROCS;
+
+	s = talloc_zero(NULL, struct main_server_st);
+	assert(s != NULL);
+	list_head_init(&s->proc_list.head);
+	proc_table_init(s);
+
+	procs = add_procs(s, count, now);
+	assert(s->proc_table.total == count);
+
+	check_lookups(s, procs, count);
+	assert(count_auth_timeout(s, now - 60) == count / 4);
+	assert(lookup_all(s, count) != 0);
+
+	if (argc > 1)
+		bench(s, now - 60);
+
+	proc_table_deinit(s);
+	talloc_free(s);
+
+	return 0;
+}
@@ -0,0 +1,309 @@
+/*
+ * Copyright (C) 2026 Nikos Mavrogiannopoulos
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#include "../src/radius-client.c"
+#include "radius-responder.h"
+
+/* Unit test for the RADIUS client, against the stand-in responder. It
+ * checks the packet encoding, the retransmissions, the failover and the
+ * release with requests outstanding, and reports the throughput of many
+ * outstanding requests.
+ */
+
+#ifdef HAVE_PTHREAD_H
+
+#define SECRET "testing123"
+#define BENCH_REQUESTS 4000
+#define BENCH_THREADS 16
+#define BENCH_THREAD_REQUESTS 100
+
+static void set_cfg(struct radius_client_cfg_st *cfg, unsigned timeout, unsigned retries)
+{
+	memset(cfg, 0, sizeof(*cfg));
+	cfg->timeout = timeout;
+	cfg->retries = retries;
+}
+
+static void add_server(struct radius_client_cfg_st *cfg, unsigned port, const char *secret)
+{
+	cfg->servers[cfg->servers_size].name = "127.0.0.1";
+	cfg->servers[cfg->servers_size].port = port;
+	cfg->servers[cfg->servers_size].secret = secret;
+	cfg->servers_size++;
+}
+
+/* a port which never replies */
+static int silent_server(unsigned *port)
+{
+	struct sockaddr_in sa;
+	socklen_t sa_size = sizeof(sa);
+	int fd;
+
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	assert(fd >= 0);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	assert(bind(fd, (struct sockaddr *)&sa, sizeof(sa)) >= 0);
+	assert(getsockname(fd, (struct sockaddr *)&sa, &sa_size) >= 0);
+	*port = ntohs(sa.sin_port);
+
+	return fd;
+}
+
+static int login(struct radius_client_st *c, const char *user, const char *pass,
+		 radius_reply_st *reply)
+{
+	uint8_t attrs[RADIUS_MAX_ATTRS];
+	unsigned attrs_size = 0;
+
+	assert(radius_attr_append(attrs, &attrs_size, 1, user, strlen(user)) == 0);
+	assert(radius_attr_append(attrs, &attrs_size, RADIUS_ATTR_USER_PASSWORD,
+				  pass, strlen(pass)) == 0);
+	assert(radius_attr_append_vsa(attrs, &attrs_size, 311, 28, "\x7f\x00\x00\x01", 4) == 0);
+
+	return radius_client_send(c, RADIUS_ACCESS_REQUEST, attrs, attrs_size, reply);
+}
+
+static void check_login(struct radius_client_st *c, const char *user, const char *pass,
+			uint8_t code)
+{
+	radius_reply_st reply;
+
+	assert(login(c, user, pass, &reply) == RADIUS_OK);
+	assert(reply.code == code);
+	if (code == RADIUS_ACCESS_ACCEPT) {
+		assert(reply.attrs_size >= 9);
+		assert(memcmp(reply.attrs, "\x12\x09welcome", 9) == 0);
+	}
+	radius_reply_deinit(&reply);
+}
+
+static void *login_thread(void *arg)
+{
+	struct radius_client_st *c = arg;
+	unsigned i;
+
+	for (i = 0; i < BENCH_THREAD_REQUESTS; i++)
+		check_login(c, "test", "test", RADIUS_ACCESS_ACCEPT);
+
+	return NULL;
+}
+
+static pthread_mutex_t bench_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t bench_cond = PTHREAD_COND_INITIALIZER;
+static unsigned bench_done = 0;
+static unsigned bench_ok = 0;
+
+static void acct_done(int status, const radius_reply_st *reply, void *priv)
+{
+	pthread_mutex_lock(&bench_lock);
+	bench_done++;
+	if (status == RADIUS_OK && reply->code == RADIUS_ACCOUNTING_RESPONSE)
+		bench_ok++;
+	pthread_cond_signal(&bench_cond);
+	pthread_mutex_unlock(&bench_lock);
+}
+
+/* a thread waiting for its reply while the client is released */
+static int waiter_status = 1;
+
+static void *waiter_thread(void *arg)
+{
+	radius_reply_st reply;
+
+	waiter_status = login(arg, "test", "test", &reply);
+	return NULL;
+}
+
+int main()
+{
+	struct radius_client_cfg_st cfg;
+	struct radius_client_st *c;
+	radius_reply_st reply;
+	pthread_t threads[BENCH_THREADS];
+	uint8_t attrs[64];
+	static uint8_t big[RADIUS_MAX_ATTRS], filler[253];
+	unsigned attrs_size, big_size, i, port, silent_port;
+	pid_t pid, pid2;
+	uint64_t start;
+	int silent_fd;
+
+	pid = radius_responder_start(SECRET, 0, &port);
+	silent_fd = silent_server(&silent_port);
+
+	/* accept and reject, with passwords over one block */
+	set_cfg(&cfg, 5, 3);
+	add_server(&cfg, port, SECRET);
+	c = radius_client_new(&cfg);
+	assert(c != NULL);
+
+	check_login(c, "test", "test", RADIUS_ACCESS_ACCEPT);
+	check_login(c, "a-user-with-a-longer-name", "a-user-with-a-longer-name",
+		    RADIUS_ACCESS_ACCEPT);
+	check_login(c, "test", "wrong", RADIUS_ACCESS_REJECT);
+	assert(c->servers[0].srtt != 0);
+
+	attrs_size = 0;
+	assert(radius_attr_append(attrs, &attrs_size, 40, "\x00\x00\x00\x03", 4) == 0);
+	assert(radius_client_send(c, RADIUS_ACCOUNTING_REQUEST, attrs, attrs_size,
+				  &reply) == RADIUS_OK);
+	assert(reply.code == RADIUS_ACCOUNTING_RESPONSE);
+	radius_reply_deinit(&reply);
+
+	/* the password padding and the message authenticator would take
+	 * the request past the largest packet */
+	big_size = 0;
+	assert(radius_attr_append(big, &big_size, RADIUS_ATTR_USER_PASSWORD, "x", 1) == 0);
+	while (big_size + 3 <= RADIUS_MAX_ATTRS) {
+		i = RADIUS_MAX_ATTRS - big_size - 2;
+		if (i > sizeof(filler))
+			i = sizeof(filler);
+		assert(radius_attr_append(big, &big_size, 1, filler, i) == 0);
+	}
+	assert(radius_client_send(c, RADIUS_ACCESS_REQUEST, big, big_size,
+				  &reply) == RADIUS_ERROR);
+
+	/* many outstanding requests; more than the identifiers */
+	start = now_ms();
+	for (i = 0; i < BENCH_REQUESTS; i++)
+		assert(radius_client_send_async(c, RADIUS_ACCOUNTING_REQUEST, attrs,
+						attrs_size, acct_done, NULL) == 0);
+
+	pthread_mutex_lock(&bench_lock);
+	while (bench_done < BENCH_REQUESTS)
+		pthread_cond_wait(&bench_cond, &bench_lock);
+	pthread_mutex_unlock(&bench_lock);
+	assert(bench_ok == BENCH_REQUESTS);
+	printf("%u accounting requests in %u ms\n", BENCH_REQUESTS,
+	       (unsigned)(now_ms() - start));
+
+	/* threads waiting for their replies at once */
+	start = now_ms();
+	for (i = 0; i < BENCH_THREADS; i++)
+		assert(pthread_create(&threads[i], NULL, login_thread, c) == 0);
+	for (i = 0; i < BENCH_THREADS; i++)
+		pthread_join(threads[i], NULL);
+	printf("%u access requests from %u threads in %u ms\n",
+	       BENCH_THREADS * BENCH_THREAD_REQUESTS, BENCH_THREADS,
+	       (unsigned)(now_ms() - start));
+
+	radius_client_deinit(c);
+
+	/* the requests outstanding on release are still sent */
+	c = radius_client_new(&cfg);
+	assert(c != NULL);
+	bench_done = bench_ok = 0;
+	for (i = 0; i < 100; i++)
+		assert(radius_client_send_async(c, RADIUS_ACCOUNTING_REQUEST, attrs,
+						attrs_size, acct_done, NULL) == 0);
+	radius_client_deinit(c);
+	assert(bench_done == 100 && bench_ok == 100);
+
+	/* a wrong secret; the replies are not accepted */
+	set_cfg(&cfg, 1, 1);
+	add_server(&cfg, port, "wrong");
+	c = radius_client_new(&cfg);
+	assert(c != NULL);
+	assert(login(c, "test", "test", &reply) == RADIUS_TIMEOUT);
+	radius_client_deinit(c);
+
+	/* the first request is lost and retransmitted */
+	pid2 = radius_responder_start(SECRET, 1, &port);
+	set_cfg(&cfg, 5, 3);
+	add_server(&cfg, port, SECRET);
+	c = radius_client_new(&cfg);
+	assert(c != NULL);
+	start = now_ms();
+	check_login(c, "test", "test", RADIUS_ACCESS_ACCEPT);
+	assert(now_ms() - start >= MIN_RTO_MS);
+	/* an ambiguous sample is not used */
+	assert(c->servers[0].srtt == 0);
+	radius_client_deinit(c);
+
+	/* failover from a silent server */
+	set_cfg(&cfg, 1, 2);
+	add_server(&cfg, silent_port, SECRET);
+	add_server(&cfg, port, SECRET);
+	c = radius_client_new(&cfg);
+	assert(c != NULL);
+
+	start = now_ms();
+	check_login(c, "test", "test", RADIUS_ACCESS_ACCEPT);
+	assert(now_ms() - start >= 2 * 1000);
+
+	/* the silent server is avoided */
+	start = now_ms();
+	check_login(c, "test", "test", RADIUS_ACCESS_ACCEPT);
+	assert(now_ms() - start < 500);
+	radius_client_deinit(c);
+
+	/* no server replies */
+	set_cfg(&cfg, 1, 1);
+	add_server(&cfg, silent_port, SECRET);
+	c = radius_client_new(&cfg);
+	assert(c != NULL);
+	assert(login(c, "test", "test", &reply) == RADIUS_TIMEOUT);
+	radius_client_deinit(c);
+
+	/* on release, the requests which got no reply fail, and the
+	 * waiting threads return first */
+	set_cfg(&cfg, 10, 1);
+	add_server(&cfg, silent_port, SECRET);
+	c = radius_client_new(&cfg);
+	assert(c != NULL);
+	bench_done = bench_ok = 0;
+	assert(radius_client_send_async(c, RADIUS_ACCOUNTING_REQUEST, attrs,
+					attrs_size, acct_done, NULL) == 0);
+	assert(pthread_create(&threads[0], NULL, waiter_thread, c) == 0);
+	pthread_mutex_lock(&c->lock);
+	while (c->waiters == 0) {
+		pthread_mutex_unlock(&c->lock);
+		usleep(10 * 1000);
+		pthread_mutex_lock(&c->lock);
+	}
+	pthread_mutex_unlock(&c->lock);
+	start = now_ms();
+	radius_client_deinit(c);
+	assert(now_ms() - start <= MAX_DRAIN_MS + 500);
+	assert(bench_done == 1 && bench_ok == 0);
+	pthread_join(threads[0], NULL);
+	assert(waiter_status == RADIUS_ERROR);
+
+	kill(pid, SIGTERM);
+	kill(pid2, SIGTERM);
+	waitpid(pid, NULL, 0);
+	waitpid(pid2, NULL, 0);
+	close(silent_fd);
+
+	return 0;
+}
+#else
+int main()
+{
+	exit(77);
+}
+#endif
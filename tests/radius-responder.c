@@ -0,0 +1,196 @@
+/*
+ * Copyright (C) 2026 Nikos Mavrogiannopoulos
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <assert.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <gnutls/gnutls.h>
+#include <gnutls/crypto.h>
+
+#include "radius-responder.h"
+
+#define HDR_SIZE 20
+#define MAX_PACKET 4096
+
+static void md5(const void *d1, unsigned d1_size, const void *d2, unsigned d2_size,
+		uint8_t out[16])
+{
+	gnutls_hash_hd_t h;
+
+	assert(gnutls_hash_init(&h, GNUTLS_DIG_MD5) >= 0);
+	gnutls_hash(h, d1, d1_size);
+	gnutls_hash(h, d2, d2_size);
+	gnutls_hash_deinit(h, out);
+}
+
+static int find_attr(const uint8_t *p, unsigned len, uint8_t type,
+		     const uint8_t **value, unsigned *value_size)
+{
+	unsigned i;
+
+	for (i = HDR_SIZE; i + 2 <= len && p[i + 1] >= 2; i += p[i + 1]) {
+		if (p[i] == type) {
+			*value = p + i + 2;
+			*value_size = p[i + 1] - 2;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+static void unhide_password(const char *secret, const uint8_t *auth,
+			    const uint8_t *in, unsigned size, char *out)
+{
+	uint8_t b[16];
+	unsigned i, j;
+
+	assert(size % 16 == 0 && size <= 128);
+	for (i = 0; i < size; i += 16) {
+		md5(secret, strlen(secret), i == 0 ? auth : in + i - 16, 16, b);
+		for (j = 0; j < 16; j++)
+			out[i + j] = in[i + j] ^ b[j];
+	}
+	out[size] = 0;
+}
+
+/* Returns the size of the reply, or zero if the request is invalid */
+static unsigned answer(const char *secret, uint8_t *req, unsigned len, uint8_t *rep)
+{
+	const uint8_t *user, *pass, *ma;
+	unsigned user_size, pass_size, ma_size, pos = HDR_SIZE;
+	uint8_t digest[16], mac[16];
+	char password[129];
+
+	if (len < HDR_SIZE || len != (((unsigned)req[2] << 8) | req[3]))
+		return 0;
+
+	rep[1] = req[1];
+
+	if (req[0] == 1) {
+		if (find_attr(req, len, 1, &user, &user_size) < 0 ||
+		    find_attr(req, len, 2, &pass, &pass_size) < 0 ||
+		    find_attr(req, len, 80, &ma, &ma_size) < 0 || ma_size != 16)
+			return 0;
+
+		memcpy(mac, ma, 16);
+		memset((uint8_t *)ma, 0, 16);
+		gnutls_hmac_fast(GNUTLS_MAC_MD5, secret, strlen(secret), req, len, digest);
+		if (memcmp(mac, digest, 16) != 0)
+			return 0;
+
+		unhide_password(secret, req + 4, pass, pass_size, password);
+
+		if (strlen(password) == user_size && memcmp(password, user, user_size) == 0) {
+			rep[0] = 2;
+			memcpy(rep + pos, "\x12\x09welcome", 9);
+			pos += 9;
+		} else {
+			rep[0] = 3;
+		}
+
+		/* Message-Authenticator */
+		rep[pos] = 80;
+		rep[pos + 1] = 18;
+		memset(rep + pos + 2, 0, 16);
+		pos += 18;
+		rep[2] = pos >> 8;
+		rep[3] = pos & 0xff;
+		memcpy(rep + 4, req + 4, 16);
+		gnutls_hmac_fast(GNUTLS_MAC_MD5, secret, strlen(secret), rep, pos,
+				 rep + pos - 16);
+	} else if (req[0] == 4) {
+		memcpy(mac, req + 4, 16);
+		memset(req + 4, 0, 16);
+		md5(req, len, secret, strlen(secret), digest);
+		if (memcmp(mac, digest, 16) != 0)
+			return 0;
+		memcpy(req + 4, mac, 16);
+
+		rep[0] = 5;
+		rep[2] = pos >> 8;
+		rep[3] = pos & 0xff;
+		memcpy(rep + 4, req + 4, 16);
+	} else {
+		return 0;
+	}
+
+	md5(rep, pos, secret, strlen(secret), digest);
+	memcpy(rep + 4, digest, 16);
+
+	return pos;
+}
+
+static void responder_loop(int fd, const char *secret, unsigned drop_first)
+{
+	uint8_t req[MAX_PACKET], rep[MAX_PACKET];
+	struct sockaddr_storage from;
+	socklen_t from_size;
+	unsigned received = 0, size;
+	int ret;
+
+	for (;;) {
+		from_size = sizeof(from);
+		ret = recvfrom(fd, req, sizeof(req), 0, (struct sockaddr *)&from, &from_size);
+		if (ret < 0)
+			continue;
+
+		if (received++ < drop_first)
+			continue;
+
+		size = answer(secret, req, ret, rep);
+		if (size > 0)
+			sendto(fd, rep, size, 0, (struct sockaddr *)&from, from_size);
+	}
+}
+
+pid_t radius_responder_start(const char *secret, unsigned drop_first,
+			     unsigned *port)
+{
+	struct sockaddr_in sa;
+	socklen_t sa_size = sizeof(sa);
+	pid_t pid;
+	int fd;
+
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	assert(fd >= 0);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	assert(bind(fd, (struct sockaddr *)&sa, sizeof(sa)) >= 0);
+	assert(getsockname(fd, (struct sockaddr *)&sa, &sa_size) >= 0);
+	*port = ntohs(sa.sin_port);
+
+	pid = fork();
+	assert(pid >= 0);
+
+	if (pid == 0) {
+		responder_loop(fd, secret, drop_first);
+		exit(0);
+	}
+
+	close(fd);
+	return pid;
+}
@@ -0,0 +1,30 @@
+/*
+ * Copyright (C) 2026 Nikos Mavrogiannopoulos
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef RADIUS_RESPONDER_H
+# define RADIUS_RESPONDER_H
+
+#include <sys/types.h>
+
+/* A stand-in RADIUS server for the tests and the benchmarks. It accepts
+ * the users whose password equals their name, and acknowledges all
+ * accounting requests. The first drop_first requests are ignored, to
+ * cause retransmissions. Returns the pid of the responder process and
+ * the port it listens to on localhost. */
+pid_t radius_responder_start(const char *secret, unsigned drop_first,
+			     unsigned *port);
+
+#endif
@@ -0,0 +1,131 @@
+/*
+ * Copyright (C) 2026 Nikos Mavrogiannopoulos
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <talloc.h>
+
+#include "../src/sealed-cookie.c"
+
+/* Unit test for the sealed cookies. It checks that a sealed cookie
+ * opens to the sealed session, and that modified cookies, or cookies
+ * sealed with another key, are rejected.
+ */
+
+#ifdef SUPPORT_SEALED_COOKIES
+
+#define KEY_FILE "./sealed-cookie.tmp"
+
+static void write_key(const char *data, size_t size)
+{
+	FILE *fp;
+
+	fp = fopen(KEY_FILE, "w");
+	assert(fp != NULL);
+	assert(fwrite(data, 1, size, fp) == size);
+	fclose(fp);
+}
+
+int main()
+{
+	SealedCookieMsg msg = SEALED_COOKIE_MSG__INIT;
+	SealedCookieMsg *omsg;
+	uint8_t key[SEALED_COOKIE_KEY_SIZE];
+	uint8_t key2[SEALED_COOKIE_KEY_SIZE];
+	uint8_t sid[SID_SIZE];
+	uint8_t *cookie, *cookie2;
+	size_t cookie_size, cookie2_size, i;
+	void *pool;
+
+	pool = talloc_new(NULL);
+	assert(pool != NULL);
+
+	/* too short keys are refused */
+	write_key("short", 5);
+	assert(sealed_cookie_load_key(KEY_FILE, key) < 0);
+	assert(sealed_cookie_load_key(KEY_FILE ".missing", key) < 0);
+
+	write_key("0123456789abcdef0123456789abcdef", 32);
+	assert(sealed_cookie_load_key(KEY_FILE, key) == 0);
+	write_key("fedcba9876543210fedcba9876543210", 32);
+	assert(sealed_cookie_load_key(KEY_FILE, key2) == 0);
+	assert(memcmp(key, key2, sizeof(key)) != 0);
+	unlink(KEY_FILE);
+
+	memset(sid, 0x5a, sizeof(sid));
+	msg.sid.data = sid;
+	msg.sid.len = sizeof(sid);
+	msg.username = "test";
+	msg.groupname = "group1";
+	msg.auth_type = 1;
+	msg.ipv4_seed = 0x01020304;
+	msg.created = 1000;
+	msg.expires = 2000;
+	msg.remote_ip = "192.168.1.1";
+	msg.tls_auth_ok = 1;
+
+	assert(sealed_cookie_seal(pool, key, &msg, &cookie, &cookie_size) == 0);
+	assert(IS_SEALED_COOKIE(cookie_size));
+	assert(cookie_size <= MAX_COOKIE_SIZE);
+
+	/* the same session seals to a different cookie each time */
+	assert(sealed_cookie_seal(pool, key, &msg, &cookie2, &cookie2_size) == 0);
+	assert(cookie_size == cookie2_size);
+	assert(memcmp(cookie, cookie2, cookie_size) != 0);
+
+	omsg = sealed_cookie_open(pool, key, cookie, cookie_size);
+	assert(omsg != NULL);
+	assert(omsg->sid.len == sizeof(sid) && memcmp(omsg->sid.data, sid, sizeof(sid)) == 0);
+	assert(strcmp(omsg->username, "test") == 0);
+	assert(strcmp(omsg->groupname, "group1") == 0);
+	assert(omsg->vhost == NULL);
+	assert(omsg->auth_type == 1);
+	assert(omsg->ipv4_seed == 0x01020304);
+	assert(omsg->created == 1000 && omsg->expires == 2000);
+	assert(strcmp(omsg->remote_ip, "192.168.1.1") == 0);
+	assert(omsg->tls_auth_ok == 1);
+
+	/* another key */
+	assert(sealed_cookie_open(pool, key2, cookie, cookie_size) == NULL);
+
+	/* any modified byte, including the version */
+	for (i = 0; i < cookie_size; i++) {
+		cookie[i] ^= 0x01;
+		assert(sealed_cookie_open(pool, key, cookie, cookie_size) == NULL);
+		cookie[i] ^= 0x01;
+	}
+
+	/* truncated cookies, and plain session IDs */
+	assert(sealed_cookie_open(pool, key, cookie, cookie_size - 1) == NULL);
+	assert(sealed_cookie_open(pool, key, cookie, SID_SIZE) == NULL);
+	assert(sealed_cookie_open(pool, key, cookie, 1) == NULL);
+
+	assert(sealed_cookie_open(pool, key, cookie, cookie_size) != NULL);
+
+	talloc_free(pool);
+
+	return 0;
+}
+#else
+int main()
+{
+	exit(77);
+}
+#endif
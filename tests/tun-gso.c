@@ -0,0 +1,249 @@
+/*
+ * Copyright (C) 2026 Nikos Mavrogiannopoulos
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Unit test for tun_gso_segment(). It checks whether TCP
+ * super-packets are split to the expected segments with valid
+ * checksums.
+ */
+#include "../src/tun-gso.c"
+
+#ifdef ENABLE_TUN_OFFLOAD
+
+#define PAYLOAD_SIZE 3000
+#define MSS 1000
+
+static unsigned seen;
+static unsigned seen_bytes;
+static uint8_t seen_flags[8];
+static uint32_t seen_seq[8];
+
+static int l4_csum_ok(const uint8_t *pkt, size_t size)
+{
+	unsigned ip_hlen = ((pkt[0] >> 4) == 4) ? (pkt[0] & 0x0f) * 4 : IPV6_HDR_SIZE;
+	uint32_t sum;
+
+	sum = pseudo_csum(pkt, IPPROTO_TCP, size - ip_hlen);
+	sum = csum_partial(pkt + ip_hlen, size - ip_hlen, sum);
+	return csum_fold(sum) == 0;
+}
+
+static int check_segment(void *priv, uint8_t *pkt, size_t pkt_size)
+{
+	unsigned version = pkt[0] >> 4;
+	unsigned ip_hlen = (version == 4) ? 20 : 40;
+
+	if (seen >= sizeof(seen_seq)/sizeof(seen_seq[0])) {
+		fprintf(stderr, "error in %d: too many segments\n", __LINE__);
+		exit(1);
+	}
+
+	if (version == 4) {
+		if (get16(pkt + 2) != pkt_size) {
+			fprintf(stderr, "error in %d: wrong IPv4 length\n", __LINE__);
+			exit(1);
+		}
+		if (get16(pkt + 4) != 0x1234 + seen) {
+			fprintf(stderr, "error in %d: wrong IPv4 id\n", __LINE__);
+			exit(1);
+		}
+		if (csum_fold(csum_partial(pkt, ip_hlen, 0)) != 0) {
+			fprintf(stderr, "error in %d: wrong IPv4 checksum\n", __LINE__);
+			exit(1);
+		}
+	} else {
+		if (get16(pkt + 4) != pkt_size - ip_hlen) {
+			fprintf(stderr, "error in %d: wrong IPv6 length\n", __LINE__);
+			exit(1);
+		}
+	}
+
+	if (pkt_size - ip_hlen - 20 > MSS) {
+		fprintf(stderr, "error in %d: segment too large\n", __LINE__);
+		exit(1);
+	}
+
+	if (!l4_csum_ok(pkt, pkt_size)) {
+		fprintf(stderr, "error in %d: wrong TCP checksum\n", __LINE__);
+		exit(1);
+	}
+
+	seen_seq[seen] = get32(pkt + ip_hlen + 4);
+	seen_flags[seen] = pkt[ip_hlen + 13];
+	seen_bytes += pkt_size - ip_hlen - 20;
+	seen++;
+	return 0;
+}
+
+static unsigned make_packet(uint8_t *buf, unsigned version, unsigned gso)
+{
+	struct virtio_net_hdr hdr;
+	uint8_t *ip = buf + TUN_VNET_HDR_SIZE, *tcp;
+	unsigned ip_hlen = (version == 4) ? 20 : 40, i;
+
+	memset(buf, 0, TUN_VNET_HDR_SIZE + ip_hlen + 20 + PAYLOAD_SIZE);
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+	hdr.csum_start = ip_hlen;
+	hdr.csum_offset = 16;
+	if (gso) {
+		hdr.gso_type = (version == 4) ? VIRTIO_NET_HDR_GSO_TCPV4 : VIRTIO_NET_HDR_GSO_TCPV6;
+		hdr.gso_size = MSS;
+		hdr.hdr_len = ip_hlen + 20;
+	}
+	memcpy(buf, &hdr, sizeof(hdr));
+
+	if (version == 4) {
+		ip[0] = 0x45;
+		put16(ip + 2, ip_hlen + 20 + PAYLOAD_SIZE);
+		put16(ip + 4, 0x1234);
+		ip[8] = 64;
+		ip[9] = IPPROTO_TCP;
+		put32(ip + 12, 0xc0a80101);
+		put32(ip + 16, 0xc0a80102);
+	} else {
+		ip[0] = 0x60;
+		put16(ip + 4, 20 + PAYLOAD_SIZE);
+		ip[6] = IPPROTO_TCP;
+		ip[7] = 64;
+		ip[8] = 0xfd;
+		ip[23] = 1;
+		ip[24] = 0xfd;
+		ip[39] = 2;
+	}
+
+	tcp = ip + ip_hlen;
+	put16(tcp, 443);
+	put16(tcp + 2, 50000);
+	put32(tcp + 4, 0xfffffc00); /* wraps during the test */
+	tcp[12] = 5 << 4;
+	tcp[13] = TCP_FLAG_FIN | TCP_FLAG_PSH | TCP_FLAG_CWR | 0x10;
+
+	for (i = 0; i < PAYLOAD_SIZE; i++)
+		tcp[20 + i] = i & 0xff;
+
+	/* the kernel leaves the pseudo-header sum in the checksum field */
+	put16(tcp + 16, ~csum_fold(pseudo_csum(ip, IPPROTO_TCP, 20 + PAYLOAD_SIZE)) & 0xffff);
+
+	return TUN_VNET_HDR_SIZE + ip_hlen + 20 + PAYLOAD_SIZE;
+}
+
+static void check_split(unsigned version)
+{
+	static uint8_t in[8192];
+	static uint8_t out[2048];
+	unsigned size, i;
+
+	seen = 0;
+	seen_bytes = 0;
+	size = make_packet(in, version, 1);
+
+	if (tun_gso_segment(in, size, out + 8, sizeof(out) - 8, check_segment, NULL) != 0) {
+		fprintf(stderr, "error in %d\n", __LINE__);
+		exit(1);
+	}
+
+	if (seen != PAYLOAD_SIZE / MSS || seen_bytes != PAYLOAD_SIZE) {
+		fprintf(stderr, "error in %d: %u segments, %u bytes\n", __LINE__, seen, seen_bytes);
+		exit(1);
+	}
+
+	for (i = 0; i < seen; i++) {
+		if (seen_seq[i] != (uint32_t)(0xfffffc00 + i * MSS)) {
+			fprintf(stderr, "error in %d: wrong seq %u\n", __LINE__, i);
+			exit(1);
+		}
+		if ((i < seen - 1) && (seen_flags[i] & (TCP_FLAG_FIN | TCP_FLAG_PSH))) {
+			fprintf(stderr, "error in %d: FIN/PSH on segment %u\n", __LINE__, i);
+			exit(1);
+		}
+		if (i > 0 && (seen_flags[i] & TCP_FLAG_CWR)) {
+			fprintf(stderr, "error in %d: CWR on segment %u\n", __LINE__, i);
+			exit(1);
+		}
+	}
+
+	if ((seen_flags[seen - 1] & (TCP_FLAG_FIN | TCP_FLAG_PSH)) != (TCP_FLAG_FIN | TCP_FLAG_PSH) ||
+	    !(seen_flags[0] & TCP_FLAG_CWR)) {
+		fprintf(stderr, "error in %d: flags were lost\n", __LINE__);
+		exit(1);
+	}
+}
+
+static int check_whole(void *priv, uint8_t *pkt, size_t pkt_size)
+{
+	if (pkt != priv) {
+		fprintf(stderr, "error in %d: packet was copied\n", __LINE__);
+		exit(1);
+	}
+	if (!l4_csum_ok(pkt, pkt_size)) {
+		fprintf(stderr, "error in %d: wrong TCP checksum\n", __LINE__);
+		exit(1);
+	}
+	seen++;
+	return 0;
+}
+
+int main(void)
+{
+	static uint8_t in[8192];
+	static uint8_t out[2048];
+	unsigned size;
+
+	check_split(4);
+	check_split(6);
+
+	/* a packet which is not coalesced only gets its checksum */
+	seen = 0;
+	size = make_packet(in, 4, 0);
+	if (tun_gso_segment(in, size, out, sizeof(out), check_whole, in + TUN_VNET_HDR_SIZE) != 0 ||
+	    seen != 1) {
+		fprintf(stderr, "error in %d\n", __LINE__);
+		exit(1);
+	}
+
+	/* segments which do not fit the output are rejected */
+	size = make_packet(in, 4, 1);
+	if (tun_gso_segment(in, size, out, MSS, check_segment, NULL) != -1) {
+		fprintf(stderr, "error in %d\n", __LINE__);
+		exit(1);
+	}
+
+	/* truncated packets */
+	if (tun_gso_segment(in, TUN_VNET_HDR_SIZE + 10, out, sizeof(out), check_segment, NULL) != -1) {
+		fprintf(stderr, "error in %d\n", __LINE__);
+		exit(1);
+	}
+	if (tun_gso_segment(in, TUN_VNET_HDR_SIZE, out, sizeof(out), check_segment, NULL) != -1) {
+		fprintf(stderr, "error in %d\n", __LINE__);
+		exit(1);
+	}
+
+	return 0;
+}
+
+#else
+int main(void)
+{
+	exit(77);
+}
+#endif
@@ -0,0 +1,207 @@
+/*
+ * Copyright (C) 2026 Nikos Mavrogiannopoulos
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <talloc.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "../src/main.h"
+#include "../src/main-udp-steer.c"
+
+/* Unit test for the UDP steering program. It checks whether a client
+ * hello with a registered session ID reaches the worker's socket once,
+ * and whether everything else reaches the listener.
+ */
+
+#ifdef ENABLE_UDP_STEERING
+static int worker_fd = -1;
+
+int send_socket_msg(void *pool, int fd, uint8_t cmd, int socketfd,
+		    const void *msg, pack_size_func get_size, pack_func pack)
+{
+	assert(cmd == CMD_UDP_FD);
+	assert(((UdpFdMsg *)msg)->steered != 0);
+	worker_fd = dup(socketfd);
+	assert(worker_fd >= 0);
+	return 0;
+}
+
+size_t udp_fd_msg__get_packed_size(const UdpFdMsg *message)
+{
+	return 0;
+}
+
+size_t udp_fd_msg__pack(const UdpFdMsg *message, uint8_t *out)
+{
+	return 0;
+}
+
+void set_worker_udp_opts(main_server_st *s, int fd, int family)
+{
+}
+
+void set_udp_socket_options(struct perm_cfg_st *config, int fd, int family)
+{
+	int y = 1;
+
+	assert(setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &y, sizeof(y)) >= 0);
+}
+
+static void make_hello(uint8_t *buf, unsigned size, uint8_t id)
+{
+	memset(buf, 0, size);
+	buf[0] = 22; /* handshake */
+	buf[1] = 0xfe;
+	buf[2] = 0xfd;
+	buf[13] = 1; /* client hello */
+	buf[STEER_SESSION_ID_LEN_POS] = STEER_SESSION_ID_SIZE;
+	memset(buf + STEER_SESSION_ID_LEN_POS + 1, id, STEER_SESSION_ID_SIZE);
+}
+
+/* returns the socket the datagram was received on */
+static int send_and_recv(int cfd, struct sockaddr_in *sa, const uint8_t *buf,
+			 unsigned size, int lfd)
+{
+	struct pollfd pfd[2];
+	uint8_t rbuf[256];
+	int ret;
+
+	assert(sendto(cfd, buf, size, 0, (struct sockaddr *)sa, sizeof(*sa)) == size);
+
+	pfd[0].fd = lfd;
+	pfd[1].fd = worker_fd;
+	pfd[0].events = pfd[1].events = POLLIN;
+
+	ret = poll(pfd, 2, 2000);
+	assert(ret == 1);
+
+	ret = recv(pfd[0].revents ? lfd : worker_fd, rbuf, sizeof(rbuf), 0);
+	assert(ret == size && memcmp(rbuf, buf, size) == 0);
+
+	return pfd[0].revents ? lfd : worker_fd;
+}
+
+int main()
+{
+	main_server_st *s;
+	vhost_cfg_st *vhost;
+	struct listener_st *l;
+	struct proc_st *proc;
+	struct sockaddr_in sa;
+	socklen_t sa_len = sizeof(sa);
+	uint8_t buf[128];
+	int cfd;
+
+	s = talloc_zero(NULL, struct main_server_st);
+	assert(s != NULL);
+
+	s->vconfig = talloc_zero(s, struct list_head);
+	assert(s->vconfig != NULL);
+	list_head_init(s->vconfig);
+	list_head_init(&s->listen_list.head);
+
+	vhost = talloc_zero(s, struct vhost_cfg_st);
+	assert(vhost != NULL);
+	vhost->perm_config.config = talloc_zero(vhost, struct cfg_st);
+	assert(vhost->perm_config.config != NULL);
+	vhost->perm_config.config->udp_steering = 1;
+	vhost->perm_config.config->max_clients = 4;
+	list_add(s->vconfig, &vhost->list);
+
+	l = talloc_zero(s, struct listener_st);
+	assert(l != NULL);
+	l->sock_type = SOCK_TYPE_UDP;
+	l->family = AF_INET;
+	l->protocol = IPPROTO_UDP;
+	l->fd = socket(AF_INET, SOCK_DGRAM, 0);
+	assert(l->fd >= 0);
+	set_udp_socket_options(NULL, l->fd, AF_INET);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	assert(bind(l->fd, (struct sockaddr *)&sa, sizeof(sa)) >= 0);
+	assert(getsockname(l->fd, (struct sockaddr *)&sa, &sa_len) >= 0);
+	memcpy(&l->addr, &sa, sizeof(sa));
+	l->addr_len = sizeof(sa);
+	list_add(&s->listen_list.head, &l->list);
+
+	udp_steer_attach(s, l);
+	if (l->steer == NULL) {
+		fprintf(stderr, "eBPF steering is not available\n");
+		exit(77);
+	}
+
+	proc = talloc_zero(s, struct proc_st);
+	assert(proc != NULL);
+	memcpy(&proc->our_addr, &sa, sizeof(sa));
+	proc->our_addr_len = sizeof(sa);
+	proc->dtls_session_id_size = STEER_SESSION_ID_SIZE;
+	memset(proc->dtls_session_id, 0xaa, STEER_SESSION_ID_SIZE);
+
+	udp_steer_add(s, proc);
+	assert(proc->udp_steer == l && worker_fd != -1);
+	assert(l->steer->free_slots_size == 3);
+
+	cfd = socket(AF_INET, SOCK_DGRAM, 0);
+	assert(cfd >= 0);
+
+	/* not a hello */
+	memset(buf, 0x17, sizeof(buf));
+	assert(send_and_recv(cfd, &sa, buf, sizeof(buf), l->fd) == l->fd);
+
+	/* too short to be a hello */
+	make_hello(buf, sizeof(buf), 0xaa);
+	assert(send_and_recv(cfd, &sa, buf, STEER_HELLO_SIZE - 1, l->fd) == l->fd);
+
+	/* an unknown session */
+	make_hello(buf, sizeof(buf), 0xbb);
+	assert(send_and_recv(cfd, &sa, buf, sizeof(buf), l->fd) == l->fd);
+
+	/* the worker's session; steered only once */
+	make_hello(buf, sizeof(buf), 0xaa);
+	assert(send_and_recv(cfd, &sa, buf, sizeof(buf), l->fd) == worker_fd);
+	assert(send_and_recv(cfd, &sa, buf, sizeof(buf), l->fd) == l->fd);
+
+	udp_steer_del(s, proc);
+	assert(proc->udp_steer == NULL);
+	assert(l->steer->free_slots_size == 4);
+
+	udp_steer_close(l);
+	assert(l->steer == NULL);
+
+	close(cfd);
+	close(worker_fd);
+	close(l->fd);
+	talloc_free(s);
+
+	return 0;
+}
+#else
+int main()
+{
+	exit(77);
+}
+#endif